@@ -24,7 +24,7 @@ namespace Juicer
         virtual WFSTLattice* getLattice() = 0;
         virtual void init() = 0;
         virtual void processFrame(
-            float** inputVec, int currFrame_, int nFrames
+            real** inputVec, int currFrame_, int nFrames
         ) = 0;
         virtual DecHyp *finish() = 0;
     };
@@ -79,6 +79,9 @@ Juicer::DecoderBatchTest::~DecoderBatchTest()
     }
 
     delete [] latticeDir ;
+
+    free( workerDecoders ) ;
+    free( workerFrontends ) ;
 }
 
 
@@ -141,6 +144,14 @@ void Juicer::DecoderBatchTest::init(
     doLatticeGeneration = false ;
     latticeDir = NULL ;
 
+    nWorkers = 1 ;
+    workerDecoders = (IDecoder **)malloc( sizeof(IDecoder *) ) ;
+    workerDecoders[0] = wfstDecoder ;
+    workerFrontends = (FrontEnd **)malloc( sizeof(FrontEnd *) ) ;
+    workerFrontends[0] = frontend ;
+    testDone = NULL ;
+    testWorker = NULL ;
+
     configureTests() ;
 }
 
@@ -213,6 +224,21 @@ void Juicer::DecoderBatchTest::activateLatticeGeneration( const char *latticeDir
 }
 
 
+void Juicer::DecoderBatchTest::addWorker( IDecoder *wfstDecoder_ , FrontEnd *frontend_ )
+{
+    if ( (wfstDecoder_ == NULL) || (frontend_ == NULL) )
+        error("DBT::addWorker - wfstDecoder_ or frontend_ is NULL") ;
+    if ( wfstDecoder_->modelLevelOutput() != wfstDecoder->modelLevelOutput() )
+        error("DBT::addWorker - decoder output level differs from the first decoder") ;
+
+    workerDecoders = (IDecoder **)realloc( workerDecoders , (nWorkers+1)*sizeof(IDecoder *) ) ;
+    workerFrontends = (FrontEnd **)realloc( workerFrontends , (nWorkers+1)*sizeof(FrontEnd *) ) ;
+    workerDecoders[nWorkers] = wfstDecoder_ ;
+    workerFrontends[nWorkers] = frontend_ ;
+    nWorkers++ ;
+}
+
+
 void Juicer::DecoderBatchTest::openOutputFile()
 {
     // Setup the output file descriptor
@@ -653,7 +679,7 @@ void Juicer::DecoderBatchTest::outputResultPhones( DecoderSingleTest *test )
 }
 
 
-void Juicer::DecoderBatchTest::outputWFSTLattice( DecoderSingleTest *test )
+void Juicer::DecoderBatchTest::outputWFSTLattice( DecoderSingleTest *test , IDecoder *decoder )
 {
 #ifdef DEBUG
     if ( (mode != DBT_MODE_WFSTDECODE_WORDS) && (mode != DBT_MODE_WFSTDECODE_PHONES) )
@@ -662,8 +688,22 @@ void Juicer::DecoderBatchTest::outputWFSTLattice( DecoderSingleTest *test )
         error("DBT::outputWFSTLattice - doLatticeGeneration == false OR latticeDir == NULL") ;
 #endif
 
+    char str2[10000] ;
+    getLatticeFName( test , str2 ) ;
+
+    LogFile::printf("\nLattice FSM: %s" , str2 ) ;
+
+    WFSTLattice *lattice = decoder->getLattice() ;
+    lattice->writeLatticeFSM( str2 ) ;
+
+    LogFile::printf(" ... done\n\n") ;
+}
+
+
+void Juicer::DecoderBatchTest::getLatticeFName( DecoderSingleTest *test , char *fName )
+{
     const char *ptr , *str ;
-    char *ptr2 , str2[10000] ;
+    char *ptr2 ;
 
     // replace original testFName path with latticeDir
     str = test->getTestFName() ;
@@ -671,19 +711,12 @@ void Juicer::DecoderBatchTest::outputWFSTLattice( DecoderSingleTest *test )
         ptr++ ;
     else
         ptr = str ;
-    sprintf( str2 , "%s/%s" , latticeDir , ptr ) ;
+    sprintf( fName , "%s/%s" , latticeDir , ptr ) ;
 
     // Replace existing extension with fsm
-    if ( (ptr2=strrchr( str2 , '.' )) != NULL )
+    if ( (ptr2=strrchr( fName , '.' )) != NULL )
         *ptr2 = '\0' ;
-    strcat( str2 , ".fsm" ) ;
-
-    LogFile::printf("\nLattice FSM: %s" , str2 ) ;
-
-    WFSTLattice *lattice = wfstDecoder->getLattice() ;
-    lattice->writeLatticeFSM( str2 ) ;
-
-    LogFile::printf(" ... done\n\n") ;
+    strcat( fName , ".fsm" ) ;
 }
 
 
@@ -719,7 +752,7 @@ void Juicer::DecoderBatchTest::run()
             if ( doLatticeGeneration &&
                  ((mode == DBT_MODE_WFSTDECODE_WORDS) ||
                   (mode == DBT_MODE_WFSTDECODE_PHONES)) )
-                outputWFSTLattice( tests[0] ) ;
+                outputWFSTLattice( tests[0] , wfstDecoder ) ;
 
             real uttTime = (real)(tests[0]->getNumFrames()) /
                 (real)framesPerSec ;
@@ -735,31 +768,161 @@ void Juicer::DecoderBatchTest::run()
     }
 
 
+    if ( nWorkers > 1 )
+        runParallel() ;
+    else
+    {
+        for ( int i=0 ; i<nTests ; i++ )
+        {
+            LogFile::printf( "File: %s\n" , tests[i]->getTestFName() ) ;
+
+            // run the test
+            if ( (mode == DBT_MODE_WFSTDECODE_WORDS) || (mode == DBT_MODE_WFSTDECODE_PHONES) )
+                tests[i]->run( wfstDecoder , frontend, vocab ) ;
+            else
+                error("DecoderBatchTest::run - mode invalid") ;
+
+            // output the result
+            if ( mode != DBT_MODE_WFSTDECODE_PHONES )
+            {
+                outputResult( tests[i] ) ;
+            }
+            else
+            {
+                outputResultPhones( tests[i] ) ;
+            }
+
+            if ( doLatticeGeneration &&
+                 ((mode == DBT_MODE_WFSTDECODE_WORDS) || (mode == DBT_MODE_WFSTDECODE_PHONES)) )
+            {
+                outputWFSTLattice( tests[i] , wfstDecoder ) ;
+            }
+
+            real uttTime = (real)(tests[i]->getNumFrames()) / (real)framesPerSec ;
+            real decTime = tests[i]->getDecodeTime() ;
+            decodeTime += decTime ;
+            speechTime += uttTime ;
+
+            LogFile::printf( "CPU time %.3f  speech time %.3f  RT factor %.3f\n" ,
+                             decTime , uttTime , decTime / uttTime ) ;
+        }
+    }
+
+    LogFile::printf(
+        "\n\n"
+        "Total CPU time %.3f  Total speech time %.3f  Avg. RT factor %.3f\n" ,
+        decodeTime , speechTime , decodeTime / speechTime
+    ) ;
+
+    // output any format-specific footer information and close the output file
+    closeOutputFile() ;
+}
+
+
+struct DBTWorkerArg
+{
+    Juicer::DecoderBatchTest   *tester ;
+    int                        worker ;
+};
+
+
+void *Juicer::DecoderBatchTest::workerThread( void *arg )
+{
+    DBTWorkerArg *workerArg = (DBTWorkerArg *)arg ;
+    workerArg->tester->runWorker( workerArg->worker ) ;
+    return NULL ;
+}
+
+
+void Juicer::DecoderBatchTest::runWorker( int worker )
+{
+    IDecoder *decoder = workerDecoders[worker] ;
+    while ( true )
+    {
+        pthread_mutex_lock( &workMutex ) ;
+        int i = nextTest++ ;
+        if ( i < nTests )
+            testWorker[i] = worker ;
+        pthread_mutex_unlock( &workMutex ) ;
+        if ( i >= nTests )
+            break ;
+
+        tests[i]->run( decoder , workerFrontends[worker] , vocab ) ;
+
+        pthread_mutex_lock( &workMutex ) ;
+        testDone[i] = true ;
+        pthread_cond_broadcast( &testDoneCond ) ;
+
+        // The lattice belongs to the decoder and goes with its next test,
+        // so hold on to it until it has been written with the result
+        if ( doLatticeGeneration )
+        {
+            while ( nextOutput <= i )
+                pthread_cond_wait( &testDoneCond , &workMutex ) ;
+        }
+        pthread_mutex_unlock( &workMutex ) ;
+    }
+}
+
+
+/**
+ * Workers take the tests in input order, and the results are output in the
+ * same order as they become available.  With lattices, a worker waits for
+ * the output of its test, lattice included, before taking the next one.  Decoding times are the CPU times
+ * of the workers, so the totals and RT factor are comparable to a serial
+ * run; the wall clock time shows the speed up.
+ */
+void Juicer::DecoderBatchTest::runParallel()
+{
+    if ( (mode != DBT_MODE_WFSTDECODE_WORDS) && (mode != DBT_MODE_WFSTDECODE_PHONES) )
+        error("DecoderBatchTest::runParallel - mode invalid") ;
+
+    LogFile::printf( "Decoding %d files with %d threads\n" , nTests , nWorkers ) ;
+    DecoderSingleTest::setThreadCPUTime( true ) ;
+    struct timespec startTime , endTime ;
+    clock_gettime( CLOCK_MONOTONIC , &startTime ) ;
+
+    nextTest = 0 ;
+    nextOutput = 0 ;
+    testDone = new bool[nTests] ;
+    testWorker = new int[nTests] ;
     for ( int i=0 ; i<nTests ; i++ )
+        testDone[i] = false ;
+    pthread_mutex_init( &workMutex , NULL ) ;
+    pthread_cond_init( &testDoneCond , NULL ) ;
+
+    pthread_t *threads = new pthread_t[nWorkers] ;
+    DBTWorkerArg *args = new DBTWorkerArg[nWorkers] ;
+    for ( int w=0 ; w<nWorkers ; w++ )
     {
-        LogFile::printf( "File: %s\n" , tests[i]->getTestFName() ) ;
+        args[w].tester = this ;
+        args[w].worker = w ;
+        if ( pthread_create( &threads[w] , NULL , workerThread , &args[w] ) != 0 )
+            error("DecoderBatchTest::runParallel - pthread_create failed") ;
+    }
 
-        // run the test
-        if ( (mode == DBT_MODE_WFSTDECODE_WORDS) || (mode == DBT_MODE_WFSTDECODE_PHONES) )
-            tests[i]->run( wfstDecoder , frontend, vocab ) ;
-        else
-            error("DecoderBatchTest::run - mode invalid") ;
+    for ( int i=0 ; i<nTests ; i++ )
+    {
+        pthread_mutex_lock( &workMutex ) ;
+        while ( ! testDone[i] )
+            pthread_cond_wait( &testDoneCond , &workMutex ) ;
+        pthread_mutex_unlock( &workMutex ) ;
+
+        LogFile::printf( "File: %s\n" , tests[i]->getTestFName() ) ;
 
         // output the result
         if ( mode != DBT_MODE_WFSTDECODE_PHONES )
-        {
             outputResult( tests[i] ) ;
-        }
         else
-        {
             outputResultPhones( tests[i] ) ;
-        }
 
-        if ( doLatticeGeneration &&
-             ((mode == DBT_MODE_WFSTDECODE_WORDS) || (mode == DBT_MODE_WFSTDECODE_PHONES)) )
-        {
-            outputWFSTLattice( tests[i] ) ;
-        }
+        if ( doLatticeGeneration )
+            outputWFSTLattice( tests[i] , workerDecoders[testWorker[i]] ) ;
+
+        pthread_mutex_lock( &workMutex ) ;
+        nextOutput = i + 1 ;
+        pthread_cond_broadcast( &testDoneCond ) ;
+        pthread_mutex_unlock( &workMutex ) ;
 
         real uttTime = (real)(tests[i]->getNumFrames()) / (real)framesPerSec ;
         real decTime = tests[i]->getDecodeTime() ;
@@ -770,14 +933,23 @@ void Juicer::DecoderBatchTest::run()
                          decTime , uttTime , decTime / uttTime ) ;
     }
 
-    LogFile::printf(
-        "\n\n"
-        "Total CPU time %.3f  Total speech time %.3f  Avg. RT factor %.3f\n" ,
-        decodeTime , speechTime , decodeTime / speechTime
-    ) ;
-
-    // output any format-specific footer information and close the output file
-    closeOutputFile() ;
+    for ( int w=0 ; w<nWorkers ; w++ )
+        pthread_join( threads[w] , NULL ) ;
+    delete [] threads ;
+    delete [] args ;
+    pthread_mutex_destroy( &workMutex ) ;
+    pthread_cond_destroy( &testDoneCond ) ;
+    delete [] testDone ;
+    testDone = NULL ;
+    delete [] testWorker ;
+    testWorker = NULL ;
+
+    clock_gettime( CLOCK_MONOTONIC , &endTime ) ;
+    DecoderSingleTest::setThreadCPUTime( false ) ;
+    real wallTime = (real)(endTime.tv_sec - startTime.tv_sec) +
+        (real)(endTime.tv_nsec - startTime.tv_nsec) * 1e-9 ;
+    LogFile::printf( "\nWall clock time %.3f with %d threads  RT factor %.3f\n" ,
+                     wallTime , nWorkers , wallTime / speechTime ) ;
 }
 
 
@@ -8,6 +8,8 @@
 #ifndef DECODERBATCHTEST_INC
 #define DECODERBATCHTEST_INC
 
+#include <pthread.h>
+
 #include "general.h"
 
 #include "FrontEnd.h"
@@ -67,6 +69,15 @@ public:
 
 	// Public methods
    void activateLatticeGeneration( const char *latticeDir_ ) ;
+
+   /**
+    * Decode the tests in parallel, one per worker thread, each worker with
+    * its own decoder and front end in addition to those of the
+    * constructor.  The decoders are expected to share the network and
+    * read-only model parameters.  Results are still output in input
+    * order, and with the same statistics.
+    */
+   void addWorker( IDecoder *wfstDecoder_ , FrontEnd *frontend_ ) ;
 	void run() ;
 	void outputText() ;
 
@@ -97,6 +108,18 @@ private:
    bool                    doLatticeGeneration ;
    char                    *latticeDir ;
 
+   // Parallel decoding, see addWorker().  Worker 0 is the constructor's
+   // decoder and front end.
+   int                     nWorkers ;
+   IDecoder                **workerDecoders ;
+   FrontEnd                **workerFrontends ;
+   pthread_mutex_t         workMutex ;
+   pthread_cond_t          testDoneCond ;
+   int                     nextTest ;
+   bool                    *testDone ;
+   int                     *testWorker ;   // the worker that ran each test
+   int                     nextOutput ;    // the first test not yet output
+
 	// Private methods
 	void init( const char *inputFName_ , DSTDataFileFormat inputFormat_ , int inputVecSize_ , 
               const char *outputFName_ , DBTOutputFormat outputFormat_ , 
@@ -104,7 +127,11 @@ private:
 	void openOutputFile() ;
 	void outputResult( DecoderSingleTest *test ) ;
 	void outputResultPhones( DecoderSingleTest *test ) ;
-   void outputWFSTLattice( DecoderSingleTest *test ) ;
+   void outputWFSTLattice( DecoderSingleTest *test , IDecoder *decoder ) ;
+   void getLatticeFName( DecoderSingleTest *test , char *fName ) ;
+   void runParallel() ;
+   static void *workerThread( void *arg ) ;
+   void runWorker( int worker ) ;
 	void closeOutputFile() ;
 	void configureTests() ; 
 	void printStatistics( int i_cost , int d_cost , int s_cost ) ;
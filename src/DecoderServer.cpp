@@ -0,0 +1,424 @@
+/*
+ * Copyright 2009 by Idiap Research Institute
+ *                   http://www.idiap.ch
+ *
+ * See the file COPYING for the licence associated with this software.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string>
+
+#include "DecoderServer.h"
+#include "WFSTDecoderLite.h"
+#include "LogFile.h"
+
+using namespace Torch ;
+
+namespace Juicer {
+
+
+struct DSSessionArg
+{
+   DecoderServer  *server ;
+   int            session ;
+   int            fd ;
+   int            decoder ;
+};
+
+
+// Mean and maximum of a latency, in ms
+struct DSLatency
+{
+   double   sum ;
+   double   max ;
+   int      n ;
+
+   DSLatency() : sum(0.0) , max(0.0) , n(0) {} ;
+   void add( double ms )
+   {
+      sum += ms ;
+      if ( ms > max )
+         max = ms ;
+      n++ ;
+   }
+   void add( const DSLatency &other )
+   {
+      sum += other.sum ;
+      if ( other.max > max )
+         max = other.max ;
+      n += other.n ;
+   }
+   double mean() const { return (n > 0) ? sum / n : 0.0 ; } ;
+};
+
+
+static double wallTimeMs()
+{
+   struct timespec t ;
+   clock_gettime( CLOCK_MONOTONIC , &t ) ;
+   return (double)t.tv_sec * 1000.0 + (double)t.tv_nsec / 1.0e6 ;
+}
+
+
+static bool readFully( int fd , void *buf , size_t len )
+{
+   char *p = (char *)buf ;
+   while ( len > 0 )
+   {
+      ssize_t n = read( fd , p , len ) ;
+      if ( n < 0 && errno == EINTR )
+         continue ;
+      if ( n <= 0 )
+         return false ;
+      p += n ;
+      len -= n ;
+   }
+   return true ;
+}
+
+
+static bool writeFully( int fd , const string &s )
+{
+   const char *p = s.c_str() ;
+   size_t len = s.size() ;
+   while ( len > 0 )
+   {
+      ssize_t n = write( fd , p , len ) ;
+      if ( n < 0 && errno == EINTR )
+         continue ;
+      if ( n <= 0 )
+         return false ;
+      p += n ;
+      len -= n ;
+   }
+   return true ;
+}
+
+
+DecoderServer::DecoderServer(
+      DecVocabulary *vocab_ , IDecoder *decoder_ , int inputVecSize_ ,
+      int lookahead_ , int partialInterval_ , bool removeSentMarks_ ,
+      int framesPerSec_ )
+{
+   if ( (vocab = vocab_) == NULL )
+      error("DecoderServer::DecoderServer - vocab_ is NULL") ;
+   if ( decoder_->modelLevelOutput() )
+      error("DecoderServer::DecoderServer - model level output not supported") ;
+
+   inputVecSize = inputVecSize_ ;
+   lookahead = (lookahead_ < 1) ? 1 : lookahead_ ;
+   partialInterval = partialInterval_ ;
+   removeSentMarks = removeSentMarks_ ;
+   framesPerSec = (framesPerSec_ > 0) ? framesPerSec_ : 100 ;
+   nSessions = 0 ;
+   pthread_mutex_init( &mutex , NULL ) ;
+   pthread_cond_init( &decoderFree , NULL ) ;
+
+   addDecoder( decoder_ ) ;
+}
+
+
+DecoderServer::~DecoderServer()
+{
+   pthread_cond_destroy( &decoderFree ) ;
+   pthread_mutex_destroy( &mutex ) ;
+}
+
+
+void DecoderServer::addDecoder( IDecoder *decoder_ )
+{
+   if ( decoder_ == NULL )
+      error("DecoderServer::addDecoder - decoder_ is NULL") ;
+   setupDecoder( decoder_ ) ;
+   decoders.push_back( decoder_ ) ;
+   decoderBusy.push_back( false ) ;
+}
+
+
+void DecoderServer::setupDecoder( IDecoder *decoder )
+{
+#ifdef PARTIAL_DECODING
+   WFSTDecoderLite *lite = dynamic_cast<WFSTDecoderLite*>( decoder ) ;
+   if ( lite != NULL )
+      lite->setPartialDecodeOptions( partialInterval ) ;
+#endif
+}
+
+
+// Blocks until one of the decoders is free
+int DecoderServer::acquireDecoder()
+{
+   pthread_mutex_lock( &mutex ) ;
+   int index = -1 ;
+   while ( index < 0 )
+   {
+      for ( int i=0 ; i<(int)decoders.size() ; i++ )
+      {
+         if ( !decoderBusy[i] )
+         {
+            index = i ;
+            break ;
+         }
+      }
+      if ( index < 0 )
+         pthread_cond_wait( &decoderFree , &mutex ) ;
+   }
+   decoderBusy[index] = true ;
+   pthread_mutex_unlock( &mutex ) ;
+   return index ;
+}
+
+
+void DecoderServer::releaseDecoder( int index )
+{
+   pthread_mutex_lock( &mutex ) ;
+   decoderBusy[index] = false ;
+   pthread_cond_signal( &decoderFree ) ;
+   pthread_mutex_unlock( &mutex ) ;
+}
+
+
+void DecoderServer::run( const char *socketName )
+{
+   // a client going away shows as a failed write, not a signal
+   signal( SIGPIPE , SIG_IGN ) ;
+
+   if ( strcmp( socketName , "-" ) == 0 )
+   {
+      LogFile::printf( "DecoderServer: serving one session on stdin\n" ) ;
+      serveSession( 0 , 0 , 1 , decoders[0] ) ;
+      return ;
+   }
+
+   struct sockaddr_un addr ;
+   if ( strlen( socketName ) >= sizeof(addr.sun_path) )
+      error("DecoderServer::run - socket name %s too long" , socketName ) ;
+   memset( &addr , 0 , sizeof(addr) ) ;
+   addr.sun_family = AF_UNIX ;
+   strcpy( addr.sun_path , socketName ) ;
+
+   int listenFD = socket( AF_UNIX , SOCK_STREAM , 0 ) ;
+   if ( listenFD < 0 )
+      error("DecoderServer::run - socket failed") ;
+   unlink( socketName ) ;
+   if ( bind( listenFD , (struct sockaddr *)&addr , sizeof(addr) ) < 0 )
+      error("DecoderServer::run - can not bind %s" , socketName ) ;
+   if ( listen( listenFD , 16 ) < 0 )
+      error("DecoderServer::run - listen failed") ;
+   LogFile::printf( "DecoderServer: listening on %s for %d concurrent sessions\n" ,
+                    socketName , (int)decoders.size() ) ;
+
+   // Connections wait in the listen queue while all decoders are busy
+   while ( true )
+   {
+      int index = acquireDecoder() ;
+      int fd = accept( listenFD , NULL , NULL ) ;
+      if ( fd < 0 )
+      {
+         releaseDecoder( index ) ;
+         if ( errno == EINTR || errno == ECONNABORTED )
+            continue ;
+         error("DecoderServer::run - accept failed") ;
+      }
+
+      DSSessionArg *arg = new DSSessionArg ;
+      arg->server = this ;
+      arg->session = ++nSessions ;
+      arg->fd = fd ;
+      arg->decoder = index ;
+      pthread_t thread ;
+      if ( pthread_create( &thread , NULL , sessionThread , arg ) != 0 )
+         error("DecoderServer::run - pthread_create failed") ;
+      pthread_detach( thread ) ;
+   }
+}
+
+
+void *DecoderServer::sessionThread( void *arg )
+{
+   DSSessionArg *a = (DSSessionArg *)arg ;
+   DecoderServer *server = a->server ;
+   server->serveSession( a->session , a->fd , a->fd , server->decoders[a->decoder] ) ;
+   close( a->fd ) ;
+   server->releaseDecoder( a->decoder ) ;
+   delete a ;
+   return NULL ;
+}
+
+
+/**
+ * A frame is decoded as soon as the lookahead frames after it have
+ * arrived, and the partial traceback is checked after each frame.  The
+ * latencies are from the arrival of a frame to its decoding, from the
+ * arrival of the last frame of a word to its P line, and from the end of
+ * the utterance to its F line.
+ */
+void DecoderServer::serveSession( int session , int inFD , int outFD , IDecoder *decoder )
+{
+#ifdef PARTIAL_DECODING
+   WFSTDecoderLite *lite = dynamic_cast<WFSTDecoderLite*>( decoder ) ;
+#endif
+   vector<real*> frames ;
+   vector<double> arrival ;
+   vector<float> wire( inputVecSize ) ;   // a frame as it is sent
+   real *frame ;
+   int nDone = 0 ;
+   int nPartial = 0 ;
+   bool started = false ;
+   double decodeMs = 0.0 ;
+   DSLatency frameLatency , partialLatency , finalLatency ;
+   DSLatency sessionFrameLatency , sessionPartialLatency , sessionFinalLatency ;
+   int nUtterances = 0 ;
+   int nSessionFrames = 0 ;
+   char line[1000] ;
+   bool ok = true ;
+
+   LogFile::printf( "DecoderServer: session %d started\n" , session ) ;
+   while ( ok )
+   {
+      int n ;
+      if ( !readFully( inFD , &n , sizeof(n) ) )
+         break ;
+      double readMs = wallTimeMs() ;
+
+      if ( n != 0 )
+      {
+         if ( n != inputVecSize )
+         {
+            sprintf( line , "E frame of %d values, expected %d\n" , n , inputVecSize ) ;
+            writeFully( outFD , line ) ;
+            break ;
+         }
+         if ( !readFully( inFD , &wire[0] , n*sizeof(float) ) )
+            break ;
+         // The decoder takes reals, which are doubles with USE_DOUBLE
+         frame = new real[n] ;
+         for ( int i=0 ; i<n ; i++ )
+            frame[i] = wire[i] ;
+         if ( !started )
+         {
+            decoder->init() ;
+            started = true ;
+         }
+         frames.push_back( frame ) ;
+         arrival.push_back( readMs ) ;
+      }
+      else if ( !started )
+      {
+         decoder->init() ;
+         started = true ;
+      }
+
+      // Decode what the lookahead allows, and everything at the end
+      int nFrames = frames.size() ;
+      int nReady = (n == 0) ? nFrames : nFrames - lookahead + 1 ;
+      while ( nDone < nReady )
+      {
+         double t = wallTimeMs() ;
+         decoder->processFrame( &frames[nDone] , nDone , nFrames - nDone ) ;
+         double now = wallTimeMs() ;
+         decodeMs += now - t ;
+         frameLatency.add( now - arrival[nDone] ) ;
+         delete [] frames[nDone] ;
+         frames[nDone++] = NULL ;
+      }
+
+      DecHyp *hyp = NULL ;
+      if ( n == 0 )
+         hyp = decoder->finish() ;
+
+      // Words newly agreed on, including those the end of the utterance
+      // settled
+#ifdef PARTIAL_DECODING
+      if ( lite != NULL )
+      {
+         string out ;
+         int nPaths = lite->getNumPartialPaths() ;
+         for ( ; nPartial < nPaths ; nPartial++ )
+         {
+            const Path *path = lite->getPartialPath( nPartial ) ;
+            int word = path->label - 1 ;   // 0th label is epsilon
+            if ( removeSentMarks &&
+                 ((word == vocab->sentStartIndex) || (word == vocab->sentEndIndex)) )
+               continue ;
+            out += "P " ;
+            sprintf( line , "%d " , path->frame ) ;
+            out += line ;
+            out += vocab->words[word] ;
+            out += "\n" ;
+            if ( (path->frame >= 0) && (path->frame < (int)arrival.size()) )
+               partialLatency.add( wallTimeMs() - arrival[path->frame] ) ;
+         }
+         if ( !out.empty() )
+            ok = writeFully( outFD , out ) ;
+      }
+#endif
+
+      if ( n != 0 )
+         continue ;
+
+      // End of the utterance
+      vector<int> words ;
+      for ( DecHypHist *hist = (hyp != NULL) ? hyp->hist : NULL ; hist != NULL ; hist = hist->prev )
+      {
+         int word = hist->state - 1 ;
+         if ( removeSentMarks &&
+              ((word == vocab->sentStartIndex) || (word == vocab->sentEndIndex)) )
+            continue ;
+         words.push_back( word ) ;
+      }
+      string out = "F" ;
+      for ( int i=(int)words.size()-1 ; i>=0 ; i-- )
+      {
+         out += " " ;
+         out += vocab->words[words[i]] ;
+      }
+      out += "\n" ;
+      finalLatency.add( wallTimeMs() - readMs ) ;
+
+      real speechTime = (real)nFrames / framesPerSec ;
+      sprintf( line , "S frames=%d frameLatency=%.1f/%.1fms partialLatency=%.1f/%.1fms "
+               "finalLatency=%.1fms rt=%.3f\n" ,
+               nFrames , frameLatency.mean() , frameLatency.max ,
+               partialLatency.mean() , partialLatency.max , finalLatency.sum ,
+               (nFrames > 0) ? decodeMs / 1000.0 / speechTime : 0.0 ) ;
+      out += line ;
+      ok = writeFully( outFD , out ) ;
+
+      nUtterances++ ;
+      nSessionFrames += nFrames ;
+      sessionFrameLatency.add( frameLatency ) ;
+      sessionPartialLatency.add( partialLatency ) ;
+      sessionFinalLatency.add( finalLatency ) ;
+      frameLatency = DSLatency() ;
+      partialLatency = DSLatency() ;
+      finalLatency = DSLatency() ;
+      frames.clear() ;
+      arrival.clear() ;
+      nDone = 0 ;
+      nPartial = 0 ;
+      decodeMs = 0.0 ;
+      started = false ;
+   }
+
+   // A client leaving in the middle of an utterance gets nothing more
+   if ( started )
+      decoder->finish() ;
+   for ( int i=nDone ; i<(int)frames.size() ; i++ )
+      delete [] frames[i] ;
+
+   LogFile::printf( "DecoderServer: session %d ended, %d utterances, %d frames, latency "
+                    "frame %.1f/%.1fms partial %.1f/%.1fms final %.1f/%.1fms (mean/max)\n" ,
+                    session , nUtterances , nSessionFrames ,
+                    sessionFrameLatency.mean() , sessionFrameLatency.max ,
+                    sessionPartialLatency.mean() , sessionPartialLatency.max ,
+                    sessionFinalLatency.mean() , sessionFinalLatency.max ) ;
+}
+
+
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright 2009 by Idiap Research Institute
+ *                   http://www.idiap.ch
+ *
+ * See the file COPYING for the licence associated with this software.
+ */
+
+#ifndef DECODERSERVER_INC
+#define DECODERSERVER_INC
+
+#include <pthread.h>
+#include <vector>
+
+#include "general.h"
+#include "DecVocabulary.h"
+#include "Decoder.h"
+
+using namespace std ;
+
+namespace Juicer {
+
+
+/**
+ * Decodes live frame streams with the models and network kept resident.
+ * Clients connect to a Unix socket, or a single session runs on stdin and
+ * stdout, and send utterances as frames of inputVecSize 32 bit floats,
+ * whatever real is: each frame as an int32 count followed by the floats,
+ * and a count of 0 to end the utterance, all in host byte order.  Features
+ * go as they are, LNA input as the log probabilities of its source.  A session may send several
+ * utterances and ends when the client closes its side.
+ *
+ * The server answers in lines of text:
+ *   P <endFrame> <word>     a word all hypotheses now agree on
+ *   F <word> <word> ...     the best hypothesis at the end of an utterance
+ *   S <counters>            latency and speed of the utterance
+ *   E <message>             an error, after which the session is closed
+ * P lines come from the partial traceback of WFSTDecoderLite, other
+ * decoders only give the F line.
+ */
+class DecoderServer
+{
+public:
+   /// lookahead is the number of frames the models score in a block
+   /// (-blockSize), partialInterval how often (in frames) the hypotheses
+   /// are traced back for P lines
+   DecoderServer(
+         DecVocabulary *vocab_ , IDecoder *decoder_ , int inputVecSize_ ,
+         int lookahead_ , int partialInterval_ , bool removeSentMarks_ ,
+         int framesPerSec_ ) ;
+   virtual ~DecoderServer() ;
+
+   /// One more decoder, for as many concurrent sessions as there are
+   /// decoders.  As for DecoderBatchTest::addWorker(), they share the
+   /// network but not the models.
+   void addDecoder( IDecoder *decoder_ ) ;
+
+   /// Serves sessions on the Unix socket socketName until killed, or one
+   /// session on stdin and stdout for "-"
+   void run( const char *socketName ) ;
+
+private:
+   DecVocabulary        *vocab ;
+   vector<IDecoder*>    decoders ;
+   vector<bool>         decoderBusy ;
+   int                  inputVecSize ;
+   int                  lookahead ;
+   int                  partialInterval ;
+   bool                 removeSentMarks ;
+   int                  framesPerSec ;
+
+   pthread_mutex_t      mutex ;
+   pthread_cond_t       decoderFree ;
+   int                  nSessions ;
+
+   void setupDecoder( IDecoder *decoder ) ;
+   int acquireDecoder() ;
+   void releaseDecoder( int index ) ;
+   static void *sessionThread( void *arg ) ;
+   void serveSession( int session , int inFD , int outFD , IDecoder *decoder ) ;
+};
+
+
+}
+
+#endif
@@ -33,6 +33,20 @@ namespace Juicer {
 #endif
 
 int DecoderSingleTest::framesPerSec = 0 ;
+bool DecoderSingleTest::threadCPUTime = false ;
+
+
+// CPU seconds used by the process, or by the calling thread only
+static double cpuTime( bool threadOnly )
+{
+   if ( threadOnly )
+   {
+      struct timespec ts ;
+      clock_gettime( CLOCK_THREAD_CPUTIME_ID , &ts ) ;
+      return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9 ;
+   }
+   return (double)clock() / CLOCKS_PER_SEC ;
+}
 
 
 DecoderSingleTest::DecoderSingleTest()
@@ -246,7 +260,7 @@ void DecoderSingleTest::decodeUtterance(
     IDecoder *decoder , FrontEnd *frontend , DecVocabulary *vocab
 )
 {
-    clock_t startTime , endTime ;
+    double startTime , endTime ;
 
 
 #ifdef DEBUG
@@ -256,7 +270,7 @@ void DecoderSingleTest::decodeUtterance(
 #endif
 
     // Timer for the decoding
-    startTime = clock() ;
+    startTime = cpuTime( threadCPUTime ) ;
 
     // Run the decoder over the whole available input
     decoder->init() ;
@@ -295,16 +309,12 @@ void DecoderSingleTest::decodeUtterance(
     }
 
 
+    // The process CPU time is summed over all its threads, so with
+    // -threading it includes the GMM threads, however many there are.
+    // -nThreads decoders time their own thread only, they have no helpers.
     DecHyp* hyp = decoder->finish() ;
-    endTime = clock() ;
-    decodeTime = (real)(endTime-startTime) / CLOCKS_PER_SEC ;
-
-
-    if (dynamic_cast<WFSTDecoderLiteThreading*>(decoder)) {
-        // the decoder in question is WFSTDecoderLiteThreading
-        // we are using two threads in decoding
-        decodeTime /= 2;
-    }
+    endTime = cpuTime( threadCPUTime ) ;
+    decodeTime = (real)(endTime-startTime) ;
 
     // Time stamp and speaker ID
     // time stamp must be after the first frame of decode
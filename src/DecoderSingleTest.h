@@ -124,10 +124,14 @@ public:
   real getTotalAcousticScore() { return totalAcousticScore ; } ;
   
   static void setFramesPerSec( int framesPerSec_ ) { framesPerSec = framesPerSec_ ; } ;
+  // Time the decoding with the CPU time of the calling thread rather than
+  // of the process, when several tests are decoded at once
+  static void setThreadCPUTime( bool threadCPUTime_ ) { threadCPUTime = threadCPUTime_ ; } ;
    
 private:
   // Private member variables
   static int           framesPerSec ;
+  static bool          threadCPUTime ;
   bool                 inputsAreFeatures ;
   int			expVecSize ;
   int			vecSize ;
@@ -0,0 +1,860 @@
+/*
+ * Copyright 2009 by Idiap Research Institute
+ *                   http://www.idiap.ch
+ *
+ * See the file COPYING for the licence associated with this software.
+ *
+ * GaussianKernels.cpp  -  diagonal Gaussian distance kernels for the flat
+ * GMM parameter layout of HTKFlatModels.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <pthread.h>
+
+#include "GaussianKernels.h"
+#include "log_add.h"
+
+#ifdef HAVE_GAUSS_SIMD
+#include <immintrin.h>
+# if defined(__clang__) || __GNUC__ >= 7
+#  define HAVE_GAUSS_AVX512
+# endif
+#endif
+
+using namespace Torch;
+
+namespace Juicer {
+
+// The reference kernel, the same arithmetic as the original loop in
+// HTKFlatModels::calcGMMOutput().  Padded dimensions add exact zeros.
+static void gaussKernelScalar(
+    const real *x, const real *means, const real *ivars,
+    const real *dets, int nComps, int vecSize4, real *out
+)
+{
+    for (int i = 0; i < nComps; ++i) {
+        const real* m = means;
+        const real* v = ivars;
+        const real* xx = x;
+        real sumxmu = 0.0;
+        for (int j = 0; j < vecSize4; ++j) {
+            real xmu = *(xx++) - *(m++);
+            sumxmu += xmu*xmu* *v++;
+        }
+        means += vecSize4;
+        ivars += vecSize4;
+        out[i] = -0.5*sumxmu + dets[i];
+    }
+}
+
+static void gaussGemmScalar(
+    const real *W, int nRows, const real *X, int nCols, int dim4, real *out
+)
+{
+    for (int r = 0; r < nRows; ++r, W += dim4) {
+        const real* xx = X;
+        for (int c = 0; c < nCols; ++c) {
+            const real* w = W;
+            real sum = 0.0;
+            for (int j = 0; j < dim4; ++j)
+                sum += *(w++) * *(xx++);
+            *out++ = sum;
+        }
+    }
+}
+
+// half to float by table, built on first use, once for all the decoders
+// of a parallel batch.  Readers always go through pthread_once(), which
+// orders them after the table is written
+static float *halfTable = NULL;
+static pthread_once_t halfTableOnce = PTHREAD_ONCE_INIT;
+
+static void initHalfTable()
+{
+    float *table = new float[65536];
+    for (int h = 0; h < 65536; ++h) {
+        int sign = h >> 15;
+        int exp = (h >> 10) & 0x1f;
+        int mant = h & 0x3ff;
+        float f;
+        if (exp == 0)
+            f = ldexp((float)mant, -24);
+        else if (exp == 31)
+            f = HUGE_VAL;       // never produced by floatToHalf()
+        else
+            f = ldexp((float)(mant | 0x400), exp - 25);
+        table[h] = sign ? -f : f;
+    }
+    halfTable = table;
+}
+
+float halfToFloat( unsigned short h )
+{
+    pthread_once(&halfTableOnce, initHalfTable);
+    return halfTable[h];
+}
+
+// round to nearest, values beyond the half range saturate
+unsigned short floatToHalf( float f )
+{
+    unsigned short sign = (f < 0) ? 0x8000 : 0;
+    f = fabs(f);
+    if (f >= 65504.0f)
+        return sign | 0x7bff;
+    if (f < ldexp(1.0f, -24))
+        return sign;
+    int e;
+    frexp(f, &e);               // f = m * 2^e, 0.5 <= m < 1
+    int exp = e + 14;           // biased half exponent
+    int mant;
+    if (exp <= 0) {
+        // subnormal, units of 2^-24
+        mant = (int)floor(ldexp(f, 24) + 0.5f);
+        return sign | mant;
+    }
+    mant = (int)floor(ldexp(f, 11 - e) + 0.5f);  // 11 significant bits
+    if (mant == 0x800) {
+        mant >>= 1;
+        ++exp;
+        if (exp >= 31)
+            return sign | 0x7bff;
+    }
+    return sign | (exp << 10) | (mant & 0x3ff);
+}
+
+template <class T>
+static void quantKernelScalar(
+    const int *xq, const void *means, const unsigned short *ivars,
+    real ivarScale, const real *dets, int nComps, int vecSize8, real *out
+)
+{
+    pthread_once(&halfTableOnce, initHalfTable);
+    const T* m = (const T*)means;
+    for (int i = 0; i < nComps; ++i) {
+        real sum = 0.0;
+        for (int j = 0; j < vecSize8; ++j) {
+            real d = (real)(xq[j] - m[j]);
+            sum += d*d*halfTable[ivars[j]];
+        }
+        m += vecSize8;
+        ivars += vecSize8;
+        out[i] = dets[i] - 0.5*ivarScale*sum;
+    }
+}
+
+// Log-sum-exp.  Both variants take the maximum first and sum exp(x-max),
+// so there is one log per call instead of one per component.  exp(r) for
+// r <= 0 is computed as 2^n * p(r-n*ln2); the exact polynomial is the
+// Cephes expf one (relative error ~2e-7), the approximate one a cubic
+// (~6e-4, which is also the bound on the log-sum error).  Terms below
+// EXP_MIN underflow to zero.
+#define EXP_MIN -87.0
+#define EXP_LOG2E 1.44269504088896341
+#define EXP_C1 0.693359375
+#define EXP_C2 -2.12194440e-4
+
+static inline real expCubic(real x)
+{
+    if (x < EXP_MIN)
+        return 0.0;
+    real fn = floor(x*EXP_LOG2E + 0.5);
+    real r = x - fn*EXP_C1 - fn*EXP_C2;
+    real p = 1.0 + r*(1.0 + r*(0.5 + r*(1.0/6.0)));
+    return ldexp(p, (int)fn);
+}
+
+static real logSumScalar(const real *x, int n)
+{
+    real m = LOG_ZERO;
+    for (int i = 0; i < n; ++i)
+        if (x[i] > m)
+            m = x[i];
+    if (m <= LOG_ZERO)
+        return LOG_ZERO;
+    real sum = 0.0;
+    for (int i = 0; i < n; ++i)
+        sum += exp(x[i] - m);
+    return m + log(sum);
+}
+
+static real logSumApproxScalar(const real *x, int n)
+{
+    real m = LOG_ZERO;
+    for (int i = 0; i < n; ++i)
+        if (x[i] > m)
+            m = x[i];
+    if (m <= LOG_ZERO)
+        return LOG_ZERO;
+    real sum = 0.0;
+    for (int i = 0; i < n; ++i)
+        sum += expCubic(x[i] - m);
+    return m + log(sum);
+}
+
+#ifdef HAVE_GAUSS_SIMD
+
+// sum the 4 lanes of each of a0..a3 into the 4 lanes of the result
+__attribute__((target("sse2")))
+static inline __m128 hsum4x4(__m128 a0, __m128 a1, __m128 a2, __m128 a3)
+{
+    _MM_TRANSPOSE4_PS(a0, a1, a2, a3);
+    return _mm_add_ps(_mm_add_ps(a0, a1), _mm_add_ps(a2, a3));
+}
+
+__attribute__((target("sse2")))
+static inline void storeScores(
+    __m128 sums, const real *dets, real *out
+)
+{
+    __m128 r = _mm_sub_ps(_mm_loadu_ps(dets),
+                          _mm_mul_ps(_mm_set1_ps(0.5f), sums));
+    _mm_storeu_ps(out, r);
+}
+
+// SSE2: 4 dimensions a step, 4 components a pass
+__attribute__((target("sse2")))
+static void gaussKernelSSE2(
+    const real *x, const real *means, const real *ivars,
+    const real *dets, int nComps, int vecSize4, real *out
+)
+{
+    int i = 0;
+    for (; i+4 <= nComps; i += 4) {
+        const real* m = means + i*vecSize4;
+        const real* v = ivars + i*vecSize4;
+        __m128 acc0 = _mm_setzero_ps();
+        __m128 acc1 = _mm_setzero_ps();
+        __m128 acc2 = _mm_setzero_ps();
+        __m128 acc3 = _mm_setzero_ps();
+        for (int j = 0; j < vecSize4; j += 4) {
+            __m128 xv = _mm_loadu_ps(x+j);
+            __m128 d0 = _mm_sub_ps(xv, _mm_loadu_ps(m+j));
+            __m128 d1 = _mm_sub_ps(xv, _mm_loadu_ps(m+vecSize4+j));
+            __m128 d2 = _mm_sub_ps(xv, _mm_loadu_ps(m+2*vecSize4+j));
+            __m128 d3 = _mm_sub_ps(xv, _mm_loadu_ps(m+3*vecSize4+j));
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_mul_ps(d0, d0), _mm_loadu_ps(v+j)));
+            acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_mul_ps(d1, d1), _mm_loadu_ps(v+vecSize4+j)));
+            acc2 = _mm_add_ps(acc2, _mm_mul_ps(_mm_mul_ps(d2, d2), _mm_loadu_ps(v+2*vecSize4+j)));
+            acc3 = _mm_add_ps(acc3, _mm_mul_ps(_mm_mul_ps(d3, d3), _mm_loadu_ps(v+3*vecSize4+j)));
+        }
+        storeScores(hsum4x4(acc0, acc1, acc2, acc3), dets+i, out+i);
+    }
+    // remaining components one at a time
+    for (; i < nComps; ++i) {
+        const real* m = means + i*vecSize4;
+        const real* v = ivars + i*vecSize4;
+        __m128 acc = _mm_setzero_ps();
+        for (int j = 0; j < vecSize4; j += 4) {
+            __m128 d = _mm_sub_ps(_mm_loadu_ps(x+j), _mm_loadu_ps(m+j));
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_mul_ps(d, d), _mm_loadu_ps(v+j)));
+        }
+        real s[4];
+        _mm_storeu_ps(s, acc);
+        out[i] = dets[i] - 0.5f*((s[0]+s[1])+(s[2]+s[3]));
+    }
+}
+
+__attribute__((target("sse2")))
+static inline real dotSSE2(const real *w, const real *x, int dim4)
+{
+    __m128 acc = _mm_setzero_ps();
+    for (int j = 0; j < dim4; j += 4)
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(w+j), _mm_loadu_ps(x+j)));
+    real s[4];
+    _mm_storeu_ps(s, acc);
+    return (s[0]+s[1])+(s[2]+s[3]);
+}
+
+// SSE2 GEMM: 4 rows of W against one row of X a pass
+__attribute__((target("sse2")))
+static void gaussGemmSSE2(
+    const real *W, int nRows, const real *X, int nCols, int dim4, real *out
+)
+{
+    int r = 0;
+    for (; r+4 <= nRows; r += 4) {
+        const real* w0 = W + r*dim4;
+        const real* w1 = w0 + dim4;
+        const real* w2 = w1 + dim4;
+        const real* w3 = w2 + dim4;
+        for (int c = 0; c < nCols; ++c) {
+            const real* xx = X + c*dim4;
+            __m128 acc0 = _mm_setzero_ps();
+            __m128 acc1 = _mm_setzero_ps();
+            __m128 acc2 = _mm_setzero_ps();
+            __m128 acc3 = _mm_setzero_ps();
+            for (int j = 0; j < dim4; j += 4) {
+                __m128 xv = _mm_loadu_ps(xx+j);
+                acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(w0+j), xv));
+                acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(w1+j), xv));
+                acc2 = _mm_add_ps(acc2, _mm_mul_ps(_mm_loadu_ps(w2+j), xv));
+                acc3 = _mm_add_ps(acc3, _mm_mul_ps(_mm_loadu_ps(w3+j), xv));
+            }
+            real s[4];
+            _mm_storeu_ps(s, hsum4x4(acc0, acc1, acc2, acc3));
+            out[r*nCols+c] = s[0];
+            out[(r+1)*nCols+c] = s[1];
+            out[(r+2)*nCols+c] = s[2];
+            out[(r+3)*nCols+c] = s[3];
+        }
+    }
+    for (; r < nRows; ++r)
+        for (int c = 0; c < nCols; ++c)
+            out[r*nCols+c] = dotSSE2(W+r*dim4, X+c*dim4, dim4);
+}
+
+// AVX2+FMA: 8 dimensions a step (plus one 4 dimension step when vecSize4
+// is not a multiple of 8), 4 components a pass
+__attribute__((target("avx2,fma")))
+static inline __m128 fold256(__m256 a)
+{
+    return _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+}
+
+__attribute__((target("avx2,fma")))
+static void gaussKernelAVX2(
+    const real *x, const real *means, const real *ivars,
+    const real *dets, int nComps, int vecSize4, real *out
+)
+{
+    int vecSize8 = vecSize4 & ~7;
+    int i = 0;
+    for (; i+4 <= nComps; i += 4) {
+        const real* m0 = means + i*vecSize4;
+        const real* m1 = m0 + vecSize4;
+        const real* m2 = m1 + vecSize4;
+        const real* m3 = m2 + vecSize4;
+        const real* v0 = ivars + i*vecSize4;
+        const real* v1 = v0 + vecSize4;
+        const real* v2 = v1 + vecSize4;
+        const real* v3 = v2 + vecSize4;
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        __m256 acc2 = _mm256_setzero_ps();
+        __m256 acc3 = _mm256_setzero_ps();
+        int j = 0;
+        for (; j < vecSize8; j += 8) {
+            __m256 xv = _mm256_loadu_ps(x+j);
+            __m256 d0 = _mm256_sub_ps(xv, _mm256_loadu_ps(m0+j));
+            __m256 d1 = _mm256_sub_ps(xv, _mm256_loadu_ps(m1+j));
+            __m256 d2 = _mm256_sub_ps(xv, _mm256_loadu_ps(m2+j));
+            __m256 d3 = _mm256_sub_ps(xv, _mm256_loadu_ps(m3+j));
+            acc0 = _mm256_fmadd_ps(_mm256_mul_ps(d0, d0), _mm256_loadu_ps(v0+j), acc0);
+            acc1 = _mm256_fmadd_ps(_mm256_mul_ps(d1, d1), _mm256_loadu_ps(v1+j), acc1);
+            acc2 = _mm256_fmadd_ps(_mm256_mul_ps(d2, d2), _mm256_loadu_ps(v2+j), acc2);
+            acc3 = _mm256_fmadd_ps(_mm256_mul_ps(d3, d3), _mm256_loadu_ps(v3+j), acc3);
+        }
+        __m128 s0 = fold256(acc0);
+        __m128 s1 = fold256(acc1);
+        __m128 s2 = fold256(acc2);
+        __m128 s3 = fold256(acc3);
+        if (j < vecSize4) {
+            __m128 xv = _mm_loadu_ps(x+j);
+            __m128 d0 = _mm_sub_ps(xv, _mm_loadu_ps(m0+j));
+            __m128 d1 = _mm_sub_ps(xv, _mm_loadu_ps(m1+j));
+            __m128 d2 = _mm_sub_ps(xv, _mm_loadu_ps(m2+j));
+            __m128 d3 = _mm_sub_ps(xv, _mm_loadu_ps(m3+j));
+            s0 = _mm_fmadd_ps(_mm_mul_ps(d0, d0), _mm_loadu_ps(v0+j), s0);
+            s1 = _mm_fmadd_ps(_mm_mul_ps(d1, d1), _mm_loadu_ps(v1+j), s1);
+            s2 = _mm_fmadd_ps(_mm_mul_ps(d2, d2), _mm_loadu_ps(v2+j), s2);
+            s3 = _mm_fmadd_ps(_mm_mul_ps(d3, d3), _mm_loadu_ps(v3+j), s3);
+        }
+        storeScores(hsum4x4(s0, s1, s2, s3), dets+i, out+i);
+    }
+    if (i < nComps)
+        gaussKernelSSE2(x, means+i*vecSize4, ivars+i*vecSize4, dets+i,
+                        nComps-i, vecSize4, out+i);
+}
+
+// AVX2+FMA GEMM: a 4x2 tile of W rows and X rows a pass, so each loaded
+// chunk is used twice.  Odd columns and remaining rows go through SSE2.
+__attribute__((target("avx2,fma")))
+static void gaussGemmAVX2(
+    const real *W, int nRows, const real *X, int nCols, int dim4, real *out
+)
+{
+    int dim8 = dim4 & ~7;
+    int nRows4 = nRows & ~3;
+    int nCols2 = nCols & ~1;
+    for (int r = 0; r < nRows4; r += 4) {
+        const real* w0 = W + r*dim4;
+        const real* w1 = w0 + dim4;
+        const real* w2 = w1 + dim4;
+        const real* w3 = w2 + dim4;
+        for (int c = 0; c < nCols2; c += 2) {
+            const real* x0 = X + c*dim4;
+            const real* x1 = x0 + dim4;
+            __m256 a00 = _mm256_setzero_ps(), a01 = _mm256_setzero_ps();
+            __m256 a10 = _mm256_setzero_ps(), a11 = _mm256_setzero_ps();
+            __m256 a20 = _mm256_setzero_ps(), a21 = _mm256_setzero_ps();
+            __m256 a30 = _mm256_setzero_ps(), a31 = _mm256_setzero_ps();
+            int j = 0;
+            for (; j < dim8; j += 8) {
+                __m256 xv0 = _mm256_loadu_ps(x0+j);
+                __m256 xv1 = _mm256_loadu_ps(x1+j);
+                __m256 wv = _mm256_loadu_ps(w0+j);
+                a00 = _mm256_fmadd_ps(wv, xv0, a00);
+                a01 = _mm256_fmadd_ps(wv, xv1, a01);
+                wv = _mm256_loadu_ps(w1+j);
+                a10 = _mm256_fmadd_ps(wv, xv0, a10);
+                a11 = _mm256_fmadd_ps(wv, xv1, a11);
+                wv = _mm256_loadu_ps(w2+j);
+                a20 = _mm256_fmadd_ps(wv, xv0, a20);
+                a21 = _mm256_fmadd_ps(wv, xv1, a21);
+                wv = _mm256_loadu_ps(w3+j);
+                a30 = _mm256_fmadd_ps(wv, xv0, a30);
+                a31 = _mm256_fmadd_ps(wv, xv1, a31);
+            }
+            __m128 s00 = fold256(a00), s01 = fold256(a01);
+            __m128 s10 = fold256(a10), s11 = fold256(a11);
+            __m128 s20 = fold256(a20), s21 = fold256(a21);
+            __m128 s30 = fold256(a30), s31 = fold256(a31);
+            if (j < dim4) {
+                __m128 xv0 = _mm_loadu_ps(x0+j);
+                __m128 xv1 = _mm_loadu_ps(x1+j);
+                __m128 wv = _mm_loadu_ps(w0+j);
+                s00 = _mm_fmadd_ps(wv, xv0, s00);
+                s01 = _mm_fmadd_ps(wv, xv1, s01);
+                wv = _mm_loadu_ps(w1+j);
+                s10 = _mm_fmadd_ps(wv, xv0, s10);
+                s11 = _mm_fmadd_ps(wv, xv1, s11);
+                wv = _mm_loadu_ps(w2+j);
+                s20 = _mm_fmadd_ps(wv, xv0, s20);
+                s21 = _mm_fmadd_ps(wv, xv1, s21);
+                wv = _mm_loadu_ps(w3+j);
+                s30 = _mm_fmadd_ps(wv, xv0, s30);
+                s31 = _mm_fmadd_ps(wv, xv1, s31);
+            }
+            real s[8];
+            _mm_storeu_ps(s, hsum4x4(s00, s10, s20, s30));
+            _mm_storeu_ps(s+4, hsum4x4(s01, s11, s21, s31));
+            for (int k = 0; k < 4; ++k) {
+                out[(r+k)*nCols+c] = s[k];
+                out[(r+k)*nCols+c+1] = s[4+k];
+            }
+        }
+    }
+    if (nCols2 < nCols)
+        for (int r = 0; r < nRows4; ++r)
+            out[r*nCols+nCols2] = dotSSE2(W+r*dim4, X+nCols2*dim4, dim4);
+    if (nRows4 < nRows)
+        gaussGemmSSE2(W+nRows4*dim4, nRows-nRows4, X, nCols, dim4,
+                      out+nRows4*nCols);
+}
+
+// Quantized AVX2 kernels, 8 dimensions a step: the means are widened to
+// int32 and subtracted in integers, the difference squared in float and
+// weighted by the fp16 inverse variances expanded with F16C.  They are
+// selected with the AVX2 kernel when the CPU also reports F16C.
+__attribute__((target("avx2,fma,f16c")))
+static void quantKernel16AVX2(
+    const int *xq, const void *means, const unsigned short *ivars,
+    real ivarScale, const real *dets, int nComps, int vecSize8, real *out
+)
+{
+    const short* m = (const short*)means;
+    for (int i = 0; i < nComps; ++i) {
+        __m256 acc = _mm256_setzero_ps();
+        for (int j = 0; j < vecSize8; j += 8) {
+            __m256i mv = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(m+j)));
+            __m256i d = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(xq+j)), mv);
+            __m256 df = _mm256_cvtepi32_ps(d);
+            __m256 w = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(ivars+j)));
+            acc = _mm256_fmadd_ps(_mm256_mul_ps(df, df), w, acc);
+        }
+        __m128 s = fold256(acc);
+        s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+        s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+        out[i] = dets[i] - 0.5f*ivarScale*_mm_cvtss_f32(s);
+        m += vecSize8;
+        ivars += vecSize8;
+    }
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static void quantKernel8AVX2(
+    const int *xq, const void *means, const unsigned short *ivars,
+    real ivarScale, const real *dets, int nComps, int vecSize8, real *out
+)
+{
+    const signed char* m = (const signed char*)means;
+    for (int i = 0; i < nComps; ++i) {
+        __m256 acc = _mm256_setzero_ps();
+        for (int j = 0; j < vecSize8; j += 8) {
+            __m256i mv = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(m+j)));
+            __m256i d = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(xq+j)), mv);
+            __m256 df = _mm256_cvtepi32_ps(d);
+            __m256 w = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(ivars+j)));
+            acc = _mm256_fmadd_ps(_mm256_mul_ps(df, df), w, acc);
+        }
+        __m128 s = fold256(acc);
+        s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+        s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+        out[i] = dets[i] - 0.5f*ivarScale*_mm_cvtss_f32(s);
+        m += vecSize8;
+        ivars += vecSize8;
+    }
+}
+
+// 4 and 8 lane exp(x) for x <= 0, see logSumScalar()
+template <bool EXACT>
+__attribute__((target("sse2")))
+static inline __m128 exp128(__m128 x)
+{
+    x = _mm_max_ps(x, _mm_set1_ps(EXP_MIN));
+    __m128 fn = _mm_cvtepi32_ps(_mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(EXP_LOG2E))));
+    __m128 r = _mm_sub_ps(x, _mm_mul_ps(fn, _mm_set1_ps(EXP_C1)));
+    r = _mm_sub_ps(r, _mm_mul_ps(fn, _mm_set1_ps(EXP_C2)));
+    __m128 p;
+    if (EXACT) {
+        p = _mm_set1_ps(1.9875691500e-4f);
+        p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.3981999507e-3f));
+        p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(8.3334519073e-3f));
+        p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(4.1665795894e-2f));
+        p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.6666665459e-1f));
+        p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(5.0000001201e-1f));
+        p = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(p, r), r), _mm_add_ps(r, _mm_set1_ps(1.0f)));
+    } else {
+        p = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(1.0f/6.0f), r), _mm_set1_ps(0.5f));
+        p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.0f));
+        p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.0f));
+    }
+    __m128i e = _mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(fn), _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(p, _mm_castsi128_ps(e));
+}
+
+template <bool EXACT>
+__attribute__((target("avx2,fma")))
+static inline __m256 exp256(__m256 x)
+{
+    x = _mm256_max_ps(x, _mm256_set1_ps(EXP_MIN));
+    __m256 fn = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(EXP_LOG2E)),
+                                _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fnmadd_ps(fn, _mm256_set1_ps(EXP_C1), x);
+    r = _mm256_fnmadd_ps(fn, _mm256_set1_ps(EXP_C2), r);
+    __m256 p;
+    if (EXACT) {
+        p = _mm256_set1_ps(1.9875691500e-4f);
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+        p = _mm256_fmadd_ps(_mm256_mul_ps(p, r), r, _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+    } else {
+        p = _mm256_fmadd_ps(_mm256_set1_ps(1.0f/6.0f), r, _mm256_set1_ps(0.5f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.0f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.0f));
+    }
+    __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(fn), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+}
+
+// SSE2 log-sum-exp, the tail padded with EXP_MIN below the maximum
+template <bool EXACT>
+__attribute__((target("sse2")))
+static real logSumSSE2(const real *x, int n)
+{
+    int n4 = n & ~3;
+    __m128 mv = _mm_set1_ps(LOG_ZERO);
+    for (int i = 0; i < n4; i += 4)
+        mv = _mm_max_ps(mv, _mm_loadu_ps(x+i));
+    mv = _mm_max_ps(mv, _mm_movehl_ps(mv, mv));
+    mv = _mm_max_ss(mv, _mm_shuffle_ps(mv, mv, 1));
+    real m = _mm_cvtss_f32(mv);
+    for (int i = n4; i < n; ++i)
+        if (x[i] > m)
+            m = x[i];
+    if (m <= LOG_ZERO)
+        return LOG_ZERO;
+
+    __m128 mm = _mm_set1_ps(m);
+    __m128 sum = _mm_setzero_ps();
+    for (int i = 0; i < n4; i += 4)
+        sum = _mm_add_ps(sum, exp128<EXACT>(_mm_sub_ps(_mm_loadu_ps(x+i), mm)));
+    if (n4 < n) {
+        real tail[4] = {EXP_MIN, EXP_MIN, EXP_MIN, EXP_MIN};
+        for (int i = n4; i < n; ++i)
+            tail[i-n4] = x[i] - m;
+        __m128 t = exp128<EXACT>(_mm_loadu_ps(tail));
+        sum = _mm_add_ps(sum, t);
+    }
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return m + log(_mm_cvtss_f32(sum));
+}
+
+template <bool EXACT>
+__attribute__((target("avx2,fma")))
+static real logSumAVX2(const real *x, int n)
+{
+    int n8 = n & ~7;
+    __m256 mv = _mm256_set1_ps(LOG_ZERO);
+    for (int i = 0; i < n8; i += 8)
+        mv = _mm256_max_ps(mv, _mm256_loadu_ps(x+i));
+    __m128 m4 = _mm_max_ps(_mm256_castps256_ps128(mv), _mm256_extractf128_ps(mv, 1));
+    m4 = _mm_max_ps(m4, _mm_movehl_ps(m4, m4));
+    m4 = _mm_max_ss(m4, _mm_shuffle_ps(m4, m4, 1));
+    real m = _mm_cvtss_f32(m4);
+    for (int i = n8; i < n; ++i)
+        if (x[i] > m)
+            m = x[i];
+    if (m <= LOG_ZERO)
+        return LOG_ZERO;
+
+    __m256 mm = _mm256_set1_ps(m);
+    __m256 sum = _mm256_setzero_ps();
+    for (int i = 0; i < n8; i += 8)
+        sum = _mm256_add_ps(sum, exp256<EXACT>(_mm256_sub_ps(_mm256_loadu_ps(x+i), mm)));
+    if (n8 < n) {
+        real tail[8] = {EXP_MIN, EXP_MIN, EXP_MIN, EXP_MIN,
+                        EXP_MIN, EXP_MIN, EXP_MIN, EXP_MIN};
+        for (int i = n8; i < n; ++i)
+            tail[i-n8] = x[i] - m;
+        sum = _mm256_add_ps(sum, exp256<EXACT>(_mm256_loadu_ps(tail)));
+    }
+    __m128 s = fold256(sum);
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return m + log(_mm_cvtss_f32(s));
+}
+
+#ifdef HAVE_GAUSS_AVX512
+// AVX-512F: 16 dimensions a step, the tail done with a masked load so
+// nothing is read past vecSize4, 4 components a pass
+__attribute__((target("avx512f")))
+static void gaussKernelAVX512(
+    const real *x, const real *means, const real *ivars,
+    const real *dets, int nComps, int vecSize4, real *out
+)
+{
+    int vecSize16 = vecSize4 & ~15;
+    __mmask16 tail = (__mmask16)((1 << (vecSize4 - vecSize16)) - 1);
+    int i = 0;
+    for (; i+4 <= nComps; i += 4) {
+        const real* m0 = means + i*vecSize4;
+        const real* m1 = m0 + vecSize4;
+        const real* m2 = m1 + vecSize4;
+        const real* m3 = m2 + vecSize4;
+        const real* v0 = ivars + i*vecSize4;
+        const real* v1 = v0 + vecSize4;
+        const real* v2 = v1 + vecSize4;
+        const real* v3 = v2 + vecSize4;
+        __m512 acc0 = _mm512_setzero_ps();
+        __m512 acc1 = _mm512_setzero_ps();
+        __m512 acc2 = _mm512_setzero_ps();
+        __m512 acc3 = _mm512_setzero_ps();
+        int j = 0;
+        for (; j < vecSize16; j += 16) {
+            __m512 xv = _mm512_loadu_ps(x+j);
+            __m512 d0 = _mm512_sub_ps(xv, _mm512_loadu_ps(m0+j));
+            __m512 d1 = _mm512_sub_ps(xv, _mm512_loadu_ps(m1+j));
+            __m512 d2 = _mm512_sub_ps(xv, _mm512_loadu_ps(m2+j));
+            __m512 d3 = _mm512_sub_ps(xv, _mm512_loadu_ps(m3+j));
+            acc0 = _mm512_fmadd_ps(_mm512_mul_ps(d0, d0), _mm512_loadu_ps(v0+j), acc0);
+            acc1 = _mm512_fmadd_ps(_mm512_mul_ps(d1, d1), _mm512_loadu_ps(v1+j), acc1);
+            acc2 = _mm512_fmadd_ps(_mm512_mul_ps(d2, d2), _mm512_loadu_ps(v2+j), acc2);
+            acc3 = _mm512_fmadd_ps(_mm512_mul_ps(d3, d3), _mm512_loadu_ps(v3+j), acc3);
+        }
+        if (tail) {
+            __m512 xv = _mm512_maskz_loadu_ps(tail, x+j);
+            __m512 d0 = _mm512_sub_ps(xv, _mm512_maskz_loadu_ps(tail, m0+j));
+            __m512 d1 = _mm512_sub_ps(xv, _mm512_maskz_loadu_ps(tail, m1+j));
+            __m512 d2 = _mm512_sub_ps(xv, _mm512_maskz_loadu_ps(tail, m2+j));
+            __m512 d3 = _mm512_sub_ps(xv, _mm512_maskz_loadu_ps(tail, m3+j));
+            acc0 = _mm512_fmadd_ps(_mm512_mul_ps(d0, d0), _mm512_maskz_loadu_ps(tail, v0+j), acc0);
+            acc1 = _mm512_fmadd_ps(_mm512_mul_ps(d1, d1), _mm512_maskz_loadu_ps(tail, v1+j), acc1);
+            acc2 = _mm512_fmadd_ps(_mm512_mul_ps(d2, d2), _mm512_maskz_loadu_ps(tail, v2+j), acc2);
+            acc3 = _mm512_fmadd_ps(_mm512_mul_ps(d3, d3), _mm512_maskz_loadu_ps(tail, v3+j), acc3);
+        }
+        out[i]   = dets[i]   - 0.5f*_mm512_reduce_add_ps(acc0);
+        out[i+1] = dets[i+1] - 0.5f*_mm512_reduce_add_ps(acc1);
+        out[i+2] = dets[i+2] - 0.5f*_mm512_reduce_add_ps(acc2);
+        out[i+3] = dets[i+3] - 0.5f*_mm512_reduce_add_ps(acc3);
+    }
+    if (i < nComps)
+        gaussKernelSSE2(x, means+i*vecSize4, ivars+i*vecSize4, dets+i,
+                        nComps-i, vecSize4, out+i);
+}
+#endif /* HAVE_GAUSS_AVX512 */
+
+#endif /* HAVE_GAUSS_SIMD */
+
+
+bool gaussKernelSupported( GaussKernelType type )
+{
+#ifdef HAVE_GAUSS_SIMD
+    __builtin_cpu_init();
+#endif
+    switch (type) {
+    case GAUSS_KERNEL_AUTO:
+    case GAUSS_KERNEL_SCALAR:
+        return true;
+#ifdef HAVE_GAUSS_SIMD
+    case GAUSS_KERNEL_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case GAUSS_KERNEL_AVX2:
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+# ifdef HAVE_GAUSS_AVX512
+    case GAUSS_KERNEL_AVX512:
+        return __builtin_cpu_supports("avx512f");
+# endif
+#endif
+    default:
+        return false;
+    }
+}
+
+// Returns |type| if the CPU supports it, otherwise the best supported
+// kernel below it.  GAUSS_KERNEL_AUTO asks for the best one overall.
+GaussKernelType selectGaussKernel( GaussKernelType type )
+{
+    int t = (type == GAUSS_KERNEL_AUTO) ? (int)GAUSS_KERNEL_AVX512 : (int)type;
+    while (t > GAUSS_KERNEL_SCALAR && !gaussKernelSupported((GaussKernelType)t))
+        --t;
+    return (GaussKernelType)t;
+}
+
+GaussKernel getGaussKernel( GaussKernelType type )
+{
+    switch (selectGaussKernel(type)) {
+#ifdef HAVE_GAUSS_SIMD
+    case GAUSS_KERNEL_SSE2:
+        return gaussKernelSSE2;
+    case GAUSS_KERNEL_AVX2:
+        return gaussKernelAVX2;
+# ifdef HAVE_GAUSS_AVX512
+    case GAUSS_KERNEL_AVX512:
+        return gaussKernelAVX512;
+# endif
+#endif
+    default:
+        return gaussKernelScalar;
+    }
+}
+
+// There is no AVX-512 GEMM; the AVX2 one is used on those CPUs
+GaussGemm getGaussGemm( GaussKernelType type )
+{
+    switch (selectGaussKernel(type)) {
+#ifdef HAVE_GAUSS_SIMD
+    case GAUSS_KERNEL_SSE2:
+        return gaussGemmSSE2;
+    case GAUSS_KERNEL_AVX2:
+    case GAUSS_KERNEL_AVX512:
+        return gaussGemmAVX2;
+#endif
+    default:
+        return gaussGemmScalar;
+    }
+}
+
+// The quantized kernels only have scalar and AVX2 versions.  The AVX2 ones
+// also need F16C, which a virtual CPU may hide while showing AVX2
+QuantKernel getQuantKernel( GaussKernelType type , int meanBits )
+{
+#ifdef HAVE_GAUSS_SIMD
+    if ((selectGaussKernel(type) >= GAUSS_KERNEL_AVX2) &&
+        __builtin_cpu_supports("f16c"))
+        return (meanBits == 8) ? quantKernel8AVX2 : quantKernel16AVX2;
+#endif
+    if (meanBits == 8)
+        return quantKernelScalar<signed char>;
+    return quantKernelScalar<short>;
+}
+
+// The SIMD log-sum-exp has SSE2 and AVX2 versions, AVX-512 CPUs use the
+// latter.  The exact scalar one calls exp() from libm.
+LogSumKernel getLogSumKernel( GaussKernelType type , LogSumType logSum )
+{
+    bool exact = (logSum == LOGSUM_EXACT);
+    switch (selectGaussKernel(type)) {
+#ifdef HAVE_GAUSS_SIMD
+    case GAUSS_KERNEL_SSE2:
+        return exact ? logSumSSE2<true> : logSumSSE2<false>;
+    case GAUSS_KERNEL_AVX2:
+    case GAUSS_KERNEL_AVX512:
+        return exact ? logSumAVX2<true> : logSumAVX2<false>;
+#endif
+    default:
+        return exact ? logSumScalar : logSumApproxScalar;
+    }
+}
+
+const char *logSumName( LogSumType type )
+{
+    return (type == LOGSUM_APPROX) ? "approx" : "exact";
+}
+
+// Returns the log-sum-exp variant called |name|, or -1 if there is none
+LogSumType logSumFromName( const char *name )
+{
+    if ( (name == NULL) || (name[0] == '\0') || (strcmp( name , "exact" ) == 0) )
+        return LOGSUM_EXACT;
+    if ( strcmp( name , "approx" ) == 0 )
+        return LOGSUM_APPROX;
+    return (LogSumType)-1;
+}
+
+// Largest difference between kernel and the libm log-sum-exp over the n
+// vectors of length len in x
+real checkLogSumKernel( LogSumKernel kernel , const real *x , int n , int len )
+{
+    real maxDiff = 0.0;
+    for (int i = 0; i < n; ++i, x += len) {
+        real diff = fabs(kernel(x, len) - logSumScalar(x, len));
+        if (diff > maxDiff)
+            maxDiff = diff;
+    }
+    return maxDiff;
+}
+
+const char *gaussKernelName( GaussKernelType type )
+{
+    switch (type) {
+    case GAUSS_KERNEL_AUTO:   return "auto";
+    case GAUSS_KERNEL_SCALAR: return "scalar";
+    case GAUSS_KERNEL_SSE2:   return "sse2";
+    case GAUSS_KERNEL_AVX2:   return "avx2";
+    case GAUSS_KERNEL_AVX512: return "avx512";
+    }
+    return "unknown";
+}
+
+// Returns the kernel type for |name|, or -1 if there is no such kernel
+GaussKernelType gaussKernelFromName( const char *name )
+{
+    if ( (name == NULL) || (name[0] == '\0') )
+        return GAUSS_KERNEL_AUTO;
+    for (int t = GAUSS_KERNEL_AUTO; t <= GAUSS_KERNEL_AVX512; ++t)
+        if ( strcmp( name , gaussKernelName((GaussKernelType)t) ) == 0 )
+            return (GaussKernelType)t;
+    return (GaussKernelType)-1;
+}
+
+real checkGaussKernel(
+    GaussKernel kernel , const real *x , const real *means ,
+    const real *ivars , const real *dets , int nComps , int vecSize4
+)
+{
+    real *ref = new real[2*nComps];
+    real *res = ref + nComps;
+    gaussKernelScalar(x, means, ivars, dets, nComps, vecSize4, ref);
+    kernel(x, means, ivars, dets, nComps, vecSize4, res);
+
+    real maxDiff = 0.0;
+    for (int i = 0; i < nComps; ++i) {
+        // compare the distance terms, dets[i] is the same on both sides
+        real dist = fabs(ref[i] - dets[i]);
+        real diff = fabs(res[i] - ref[i]) / (dist > 1.0 ? dist : 1.0);
+        if (diff > maxDiff)
+            maxDiff = diff;
+    }
+    delete[] ref;
+    return maxDiff;
+}
+
+}; // namespace juicer
@@ -0,0 +1,144 @@
+/*
+ * Copyright 2009 by Idiap Research Institute
+ *                   http://www.idiap.ch
+ *
+ * See the file COPYING for the licence associated with this software.
+ */
+
+/*
+ * vi:ts=4:tw=78:shiftwidth=4:expandtab
+ * vim600:fdm=marker
+ *
+ * GaussianKernels.h  -  diagonal Gaussian distance kernels for the flat
+ * GMM parameter layout of HTKFlatModels, with SSE2/AVX2/AVX-512 versions
+ * selected at run time.
+ *
+ */
+
+#ifndef _GAUSSIANKERNELS_H
+#define _GAUSSIANKERNELS_H
+
+#include "general.h"
+
+// The SIMD kernels are compiled with per-function target attributes, so
+// the rest of the library does not need to be built with -mavx2 and the
+// same binary runs on any x86 CPU.  Define OPT_NO_SIMD to disable them.
+#if !defined(OPT_NO_SIMD) && !defined(USE_DOUBLE) && \
+    (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+# define HAVE_GAUSS_SIMD
+#endif
+
+// SIMD kernels sum the dimensions in a different order from the scalar
+// loop (and use fused multiply-add where available), so their output
+// differs from it by rounding only.  The difference in the distance term
+// is bounded by GAUSS_KERNEL_TOLERANCE relative to its magnitude; it is
+// checked against the loaded models when a kernel is selected.
+#define GAUSS_KERNEL_TOLERANCE 1e-4
+
+// The GEMM form expands (x-m)^2/v into x^2/v - 2xm/v + m^2/v and folds the
+// m^2/v sum into a per-component constant.  The terms cancel, so the
+// rounding error grows with the distance of the means from the origin;
+// HTKFlatModels checks it against this bound before it uses batching.
+#define GAUSS_GEMM_TOLERANCE 1e-3
+
+// Largest log-sum-exp error accepted from the approximate exp; the cubic
+// used is within 6e-4
+#define LOGSUM_APPROX_TOLERANCE 1e-3
+
+namespace Juicer
+{
+    typedef enum {
+        GAUSS_KERNEL_AUTO = 0,  // best kernel supported by the CPU
+        GAUSS_KERNEL_SCALAR,
+        GAUSS_KERNEL_SSE2,
+        GAUSS_KERNEL_AVX2,      // AVX2 + FMA
+        GAUSS_KERNEL_AVX512     // AVX-512F
+    } GaussKernelType;
+
+    /**
+     * Diagonal Gaussian kernel.  For each of the nComps components stored
+     * every vecSize4 reals in means and ivars (inverse variances) it
+     * writes
+     *
+     *   out[i] = dets[i] - 0.5 * sum_j (x[j]-means[j])^2 * ivars[j]
+     *
+     * vecSize4 must be a multiple of 4, and x, means and ivars must be
+     * padded with zeros up to vecSize4.  Several components are scored
+     * per pass so that each chunk of x is loaded only once.
+     */
+    typedef void (*GaussKernel)(
+        const real *x, const real *means, const real *ivars,
+        const real *dets, int nComps, int vecSize4, real *out
+    );
+
+    /**
+     * Dot products of nRows rows of W with nCols rows of X, all dim4 reals
+     * long (a multiple of 4):
+     *
+     *   out[r*nCols+c] = sum_j W[r*dim4+j] * X[c*dim4+j]
+     *
+     * With W = [-0.5/v, m/v, const] and X = [x^2, x, 1] this is the
+     * Gaussian distance of several components and frames at once.
+     */
+    typedef void (*GaussGemm)(
+        const real *W, int nRows, const real *X, int nCols, int dim4,
+        real *out
+    );
+
+    /**
+     * Quantized diagonal Gaussian kernel.  Means are int8 or int16 and
+     * inverse variances fp16, all stored every vecSize8 values (a
+     * multiple of 8).  The frame xq is quantized on the same per
+     * dimension grid as the means, with the grid step squared folded into
+     * ivars, so
+     *
+     *   out[i] = dets[i] - 0.5 * ivarScale * sum_j (xq[j]-mq[j])^2 * ivars[j]
+     *
+     * The differences are taken in integers; ivars are expanded to float.
+     */
+    typedef void (*QuantKernel)(
+        const int *xq, const void *means, const unsigned short *ivars,
+        real ivarScale, const real *dets, int nComps, int vecSize8,
+        real *out
+    );
+
+    typedef enum {
+        LOGSUM_EXACT = 0,       // exp to float precision
+        LOGSUM_APPROX           // cubic exp, see LOGSUM_APPROX_TOLERANCE
+    } LogSumType;
+
+    /**
+     * log(sum_i exp(x[i])) over n values, LOG_ZERO if there are none.
+     * Used to combine the weighted component scores of a mixture.
+     */
+    typedef real (*LogSumKernel)( const real *x , int n );
+
+    bool gaussKernelSupported( GaussKernelType type ) ;
+    GaussKernelType selectGaussKernel( GaussKernelType type ) ;
+    GaussKernel getGaussKernel( GaussKernelType type ) ;
+    GaussGemm getGaussGemm( GaussKernelType type ) ;
+    QuantKernel getQuantKernel( GaussKernelType type , int meanBits ) ;
+    LogSumKernel getLogSumKernel( GaussKernelType type , LogSumType logSum ) ;
+    const char *logSumName( LogSumType type ) ;
+    LogSumType logSumFromName( const char *name ) ;
+    real checkLogSumKernel( LogSumKernel kernel , const real *x , int n , int len ) ;
+
+    // IEEE half precision conversion for the quantized parameter store
+    unsigned short floatToHalf( float f ) ;
+    float halfToFloat( unsigned short h ) ;
+    const char *gaussKernelName( GaussKernelType type ) ;
+    GaussKernelType gaussKernelFromName( const char *name ) ;
+
+    /**
+     * Returns the largest difference between kernel and the scalar kernel
+     * on the given components, relative to the magnitude of the distance
+     * term.
+     */
+    real checkGaussKernel(
+        GaussKernel kernel , const real *x , const real *means ,
+        const real *ivars , const real *dets , int nComps , int vecSize4
+    ) ;
+}
+
+#endif /* ifndef _GAUSSIANKERNELS_H */
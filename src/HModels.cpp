@@ -57,6 +57,8 @@ HModels::HModels()
 	noAlias = FALSE;
 	isHModelsinitialised = false;
 	useHAdapt = false;
+	logSumKernel = getLogSumKernel( GAUSS_KERNEL_AUTO , LOGSUM_EXACT );
+	logSumBuffer = NULL;
 }
 
 /**
@@ -77,6 +79,8 @@ HModels::HModels( const char * mlist )
 	noAlias = FALSE;
 	isHModelsinitialised = false;
 	useHAdapt = false;
+	logSumKernel = getLogSumKernel( GAUSS_KERNEL_AUTO , LOGSUM_EXACT );
+	logSumBuffer = NULL;
 	SetHTKModelsList(mlist);
 }
 
@@ -88,6 +92,7 @@ HModels::~HModels()
     delete[] HTKMList;
     if (isHModelsinitialised) {
         delete[] stateProbCache;
+        delete[] logSumBuffer;
         for( int i=0;i<hSet.numTransP;i++ )
         {
              SEIndex* se = transMats[i].seIndexes;
@@ -284,6 +289,7 @@ void HModels::InitialiseHModels( bool removeInitialToFinalTransitions )
 	{
 		stateProbCache[i].isEmpty = true;
 	}
+	logSumBuffer = new real[ maxMixes ];
 }
 
 
@@ -358,6 +364,15 @@ real HModels::calcOutput( int hmmInd , int stateInd )
 }
 
 
+/**
+ * Select the exact or approximate log-sum-exp used to combine the
+ * components of adapted mixtures; HTK's SOutP does the others
+ */
+void HModels::setLogSum( LogSumType type )
+{
+    logSumKernel = getLogSumKernel( GAUSS_KERNEL_AUTO , type );
+}
+
 /**
  * Implementing the Juicer Models API function
  * Calculate the output probability given an index to a GMM
@@ -390,7 +405,7 @@ real HModels::calcOutput( int gmmInd )
                                                         me->mpdf );
                 stateProbCache[gmmInd].logProb += det;
             } else {
-                stateProbCache[gmmInd].logProb = LZERO;
+                int n = 0;
                 for (int m=1; m<=se->nMix; m++,me++) {
                     wt = MixLogWeight(hset, me->weight);
                     if (wt>LMINMIX) {   
@@ -398,9 +413,10 @@ real HModels::calcOutput( int gmmInd )
                                                      xfInfo->inXForm , &det , currentFrameIndex ) ,
                                     me->mpdf );
                         px += det;
-                        stateProbCache[gmmInd].logProb=LAdd(stateProbCache[gmmInd].logProb,wt+px);
+                        logSumBuffer[n++] = wt+px;
                     }
                 }
+                stateProbCache[gmmInd].logProb = (n > 0) ? logSumKernel( logSumBuffer , n ) : LZERO;
             }
         } else {
             stateProbCache[gmmInd].logProb = SOutP( hset , 1 , &currentFrameData , GMMlookupTable[gmmInd] );
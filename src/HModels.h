@@ -37,6 +37,7 @@
 #define HMODELS_INC
 
 #include "Models.h"
+#include "GaussianKernels.h"
 #include "log_add.h" // for LOG_ZERO returned by getTeeLogProb()
 
 namespace Juicer
@@ -112,6 +113,7 @@ namespace Juicer
         void setBlockSize(int bs);
         real calcOutput( int hmmInd , int stateInd ) ;
         real calcOutput( int gmmInd ) ;
+        void setLogSum( LogSumType type ) ;
 
         int getNumHMMs() ;
         int getCurrFrame() ;
@@ -189,6 +191,12 @@ namespace Juicer
     	 * Cache area for HMM state probability calculations
     	 */
     	HModelCacheElement *stateProbCache;
+    	/*
+    	 * Log-sum-exp of the weighted component outputs when adapting,
+    	 * and its buffer of maxMixes
+    	 */
+    	LogSumKernel logSumKernel;
+    	real *logSumBuffer;
     	/*
     	 * Returns pointer to corresponding TransMatrix of the specified HMM.
     	 * Will copy the transition matrix into transMats if it has not
@@ -14,6 +14,12 @@
 
 #include <cassert>
 #include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "log_add.h"
 
 
@@ -29,36 +35,22 @@
 #include "HTKFlatModels.h"
 #include "LogFile.h"
 
-#ifdef OPT_FAST_EXP
-// from "A Fast, Compact Approximation of the Exponential Function" by Nicol N. Schraudolph, 1999
-// at http:// citeseerx.ist.psu.edu/viewdoc/summary?doi=10.1.1.57.1569
-static union {
-    double d;
-    struct {
-//  WORDS_BIGENDIAN should be defined automatically fQueue config.h during configure
-#ifdef WORDS_BIGENDIAN
-        int i,j;
-#else
-        int j,i;
-#endif
-    }n;
-} _eco;
+// largest mean log likelihood error accepted from the quantized store
+#define QUANT_LL_TOLERANCE 0.25
 
-#define EXP_A ((1<<20)/M_LN2)
-#define EXP_C 60801
-#define fastexp(y) (_eco.n.i = EXP_A*(y) + ((1023<<20) - EXP_C), _eco.d)
-#endif
+// dense mode is left when activity drops below this fraction of the threshold
+#define DENSE_HYSTERESIS 0.8
 
-#ifdef OPT_FAST_LOG
-// Borchardt's Algorithmfor fast log computation
-#define fastlog(x) (6 * (x - 1) / (x + 1 + 4 * sqrt(x)))
-#endif
+// a GMM is rejected only when its bound is this much below the minimum,
+// to allow for the rounding of the full and partial kernels
+#define BOUND_MARGIN 0.01
 
-#ifdef USE_DOUBLE
-#define MINUS_LOG_THRESHOLD -39.14
-#else
-#define MINUS_LOG_THRESHOLD -18.42
-#endif
+// most component rows stacked into one matrix product by calcOutputs()
+#define GEMM_MAX_ROWS 256
+
+// flat models file, see outputFlat()
+#define FLAT_VERSION 1
+#define FLAT_ALIGN 64
 
 // end macro definitions
 
@@ -68,17 +60,100 @@ namespace Juicer {
 
 HTKFlatModels::HTKFlatModels() {
     fBuffer = NULL;
+    fParams = NULL;
+    fCacheBuffer = NULL;
+    fMap = NULL;
+    fMapLen = 0;
+    fMapIndex = NULL;
     fCacheT = NULL;
     fCache = NULL;
     fnBlock = -1;
+    fInput = NULL;
+    fCompOutputs = NULL;
+    fKernelType = GAUSS_KERNEL_AUTO;
+    fCPUKernelType = GAUSS_KERNEL_SCALAR;
+    fKernel = NULL;
+    fBatch = false;
+    fGemmDim = 0;
+    fGemm = NULL;
+    fGemmInput = NULL;
+    fGemmOutputs = NULL;
+    fGemmPending = NULL;
+    fGemmBuffer = NULL;
+    fGemmKernel = NULL;
+    fQuantBits = 0;
+    fvecSize8 = 0;
+    fMeansQ = NULL;
+    fVarsQ = NULL;
+    fQuantOffset = NULL;
+    fQuantStep = NULL;
+    fQuantVarScale = 1.0;
+    fInputQ = NULL;
+    fQuantBuffer = NULL;
+    fQuantKernel = NULL;
+    fShareComps = true;
+    fnShared = 0;
+    fShareInd = NULL;
+    fGMMWeights = NULL;
+    fCompCache = NULL;
+    fCompCacheT = NULL;
+    fCompCacheN = NULL;
+    fShareBuffer = NULL;
+    fDenseThreshold = 0.0;
+    fDense = false;
+    fDenseT = -1000;
+    fReqT = NULL;
+    fnReq = 0;
+    fnReqSum = 0;
+    fnReqFrames = 0;
+    fnFrames = 0;
+    fnDenseFrames = 0;
+    fnDenseSwitches = 0;
+    fnBoundDims = 0;
+    fBoundDim4 = 0;
+    fBoundDims = NULL;
+    fBoundMeans = NULL;
+    fBoundVars = NULL;
+    fBoundInput = NULL;
+    fBoundBuffer = NULL;
+    fnBoundChecks = 0;
+    fnBoundRejects = 0;
 }
 
 HTKFlatModels::~HTKFlatModels() {
+    if (fDenseThreshold > 0.0 && fnFrames > 0)
+        LogFile::printf("HTKFlatModels: dense scoring in %ld of %ld frames, %ld switches\n",
+                        fnDenseFrames, fnFrames, fnDenseSwitches);
+    if (fnBoundChecks > 0)
+        LogFile::printf("HTKFlatModels: %ld of %ld GMMs rejected by their %d dimension bound\n",
+                        fnBoundRejects, fnBoundChecks, fnBoundDims);
+    delete[] fReqT;
 #ifdef HAVE_INTEL_IPP
     ippFree(fBuffer);
+    ippFree(fParams);
+    ippFree(fCacheBuffer);
 #else
     free(fBuffer);
+    free(fParams);
+    free(fCacheBuffer);
 #endif
+    free(fGemmBuffer);
+    free(fQuantBuffer);
+    free(fShareBuffer);
+    free(fBoundBuffer);
+
+    // the tables built by readFlat() point into the map, so they are
+    // released here rather than by HTKModels
+    if (fMap) {
+        delete[] gMMs;
+        delete[] hMMs;
+        delete[] transMats;
+        delete[] fMapIndex;
+        gMMs = NULL;
+        hMMs = NULL;
+        transMats = NULL;
+        munmap(fMap, fMapLen);
+    }
 }
 
 void HTKFlatModels::readBinary( const char *fName ) {
@@ -102,8 +177,75 @@ void HTKFlatModels::init()
     LogFile::printf("CPU runs at %d Mhz\n", cpuMhz);
 #endif
 
-    // now create our own GMM parameter structure from loaded structures from
-    // HTKModels
+    // the parameters are already in place when mapped from a flat file
+    if (!fMap)
+        initParams();
+
+    // block cache and input, private to this process
+    int cache_len = sizeof(int)*nGMMs + sizeof(real)*nGMMs*fnBlock;
+    cache_len += sizeof(real)*(fnBlock*fvecSize4 + fMaxCompNum);
+    LogFile::printf("HTKFlatModels allocated %.2f MB for the block cache, blockSize=%d\n", cache_len/(1024.*1024), fnBlock);
+#ifdef HAVE_INTEL_IPP
+    fCacheBuffer = ippMalloc(cache_len);
+#else
+    fCacheBuffer = malloc(cache_len);
+#endif
+    if (!fCacheBuffer)
+        error("fail to allocate memory for HTKFlatModels");
+    fCacheT = (int*)fCacheBuffer;
+    fCache = (real*)(fCacheT+nGMMs);
+    fInput = fCache+nGMMs*fnBlock;
+    fCompOutputs = fInput+fnBlock*fvecSize4;
+
+    // the SIMD kernels run over all fvecSize4 dimensions, so the padding
+    // of the input has to be zero
+    memset(fInput, 0, sizeof(real)*fnBlock*fvecSize4);
+
+    initSharing();
+    if (fDenseThreshold > 0.0) {
+        fReqT = new int[nGMMs];
+        for (int i = 0; i < nGMMs; ++i)
+            fReqT[i] = -1000;
+    }
+    initGaussKernel();
+    if (fQuantBits && !initQuant())
+        fQuantBits = 0;
+    // the bound is on the float scores, the quantized ones can be above it
+    if (fnBoundDims > 0 && fQuantBits) {
+        LogFile::printf("HTKFlatModels: GMM output bound needs float parameters, disabled\n");
+        fnBoundDims = 0;
+    }
+    if (fnBoundDims > 0)
+        initBound();
+    if (fBatch) {
+        if (fQuantBits) {
+            LogFile::printf("HTKFlatModels: batched GMM scoring needs float parameters, disabled\n");
+            fBatch = false;
+        } else if (fnShared) {
+            LogFile::printf("HTKFlatModels: batched GMM scoring needs unshared mixtures, disabled\n");
+            fBatch = false;
+        } else {
+            initGemm();
+        }
+    }
+
+    // the float parameters are no longer used once quantized, mapped ones
+    // are left to the page cache
+    if (fQuantBits) {
+#ifdef HAVE_INTEL_IPP
+        ippFree(fParams);
+#else
+        free(fParams);
+#endif
+        fParams = NULL;
+        fMeans = fVars = NULL;
+    }
+}
+
+// create our own GMM parameter structure from loaded structures from
+// HTKModels
+void HTKFlatModels::initParams()
+{
     int nMaxGmmComp = 0;
     for (int i = 0; i < nMixtures; ++i) {
         if (mixtures[i].nComps > nMaxGmmComp)
@@ -111,34 +253,34 @@ void HTKFlatModels::init()
     }
 
     fnGaussians = nMaxGmmComp*nMixtures;
-#ifdef OPT_ALIGN4
-    fvecSize4=(vecSize+3)&(~3);
-    fnMixtures4 = (nMixtures+3)&(~3);
-    fnGaussians4 = (fnGaussians+3)&(~3);
-#else
-    fvecSize4 = vecSize;
-    fnMixtures4 = nMixtures;
-    fnGaussians4 = fnGaussians;
-#endif
+    fMaxCompNum = nMaxGmmComp;
+    fvecSize4 = flatVecSize(vecSize);
+    fnMixtures4 = flatVecSize(nMixtures);
+    fnGaussians4 = flatVecSize(fnGaussians);
 
-
-    int model_len=sizeof(FMixture)*fnMixtures4+sizeof(real)*(fnGaussians4+ 
-            fnGaussians*fvecSize4+fnGaussians*fvecSize4);
-    model_len += sizeof(real)*nGMMs*fnBlock + sizeof(int)*nGMMs;
-    LogFile::printf("\nHTKFlatModels allocated %.2f MB for flat parameters, blockSize=%d\n", model_len/(1024.*1024), fnBlock);
+    // means and variances are allocated on their own so that they can be
+    // released when the quantized store is used
+    int model_len = sizeof(FMixture)*fnMixtures4+sizeof(real)*fnGaussians4;
+    int param_len = sizeof(real)*(fnGaussians*fvecSize4+fnGaussians*fvecSize4);
+    LogFile::printf("\nHTKFlatModels allocated %.2f MB for flat parameters\n", (model_len+param_len)/(1024.*1024));
 #ifdef HAVE_INTEL_IPP
     fBuffer = ippMalloc(model_len);
+    fParams = ippMalloc(param_len);
 #else
     fBuffer = malloc(model_len);
+    fParams = malloc(param_len);
 #endif
-    if (!fBuffer)
+    if (!fBuffer || !fParams)
         error("fail to allocate memory for HTKFlatModels");
     fMixtures     = (FMixture*)fBuffer;
     fDets    = (real*)(fMixtures+fnMixtures4);
-    fMeans      = fDets+fnGaussians4;
+    fMeans      = (real*)fParams;
     fVars       = fMeans+fnGaussians*fvecSize4;
-    fCacheT = (int*)(fVars+fnGaussians*fvecSize4);
-    fCache = (real*)(fCacheT+nGMMs);
+
+    // the SIMD kernels run over all fvecSize4 dimensions, so the padding
+    // of the means and variances has to be zero
+    memset(fBuffer, 0, model_len);
+    memset(fMeans, 0, sizeof(real)*fnGaussians*fvecSize4*2);
 
     for (int i = 0; i < nMixtures; ++i) {
         fMixtures[i].compNum = mixtures[i].nComps;
@@ -163,19 +305,690 @@ void HTKFlatModels::init()
             fDet(i)[j] = varVecs[mix->varVecInds[j]].sumLogVarPlusNObsLog2Pi;
         }
     }
+}
+
+// padded size of the flat arrays
+int HTKFlatModels::flatVecSize( int n )
+{
+#if defined(OPT_ALIGN4) || defined(HAVE_GAUSS_SIMD)
+    return (n+3)&(~3);
+#else
+    return n;
+#endif
+}
+
+// Flat models file.  The header is followed by the sections below, each
+// starting on a FLAT_ALIGN boundary, so that once mapped the parameters
+// are used in place with the alignment init() would give them.  All
+// sizes follow from the counts in the header.
+enum {
+    FLAT_MIXTURES = 0,  // FMixture, nMixtures4
+    FLAT_DETS,          // real, nGaussians4, log weights added if unshared
+    FLAT_MEANS,         // real, nGaussians*vecSize4
+    FLAT_VARS,          // real, nGaussians*vecSize4, inverse variances
+    FLAT_GMMS,          // int, nGMMs, mixture of each GMM
+    FLAT_WEIGHTS,       // real, nGMMs*maxCompNum, log weights of each GMM
+    FLAT_HMMS,          // FlatHMM, nHMMs
+    FLAT_GMMINDS,       // int, nGMMInds, GMM of each HMM state
+    FLAT_TRANSMATS,     // FlatTransMat, nTransMats
+    FLAT_NSUCS,         // int, nStates, successors of each state
+    FLAT_SUCS,          // int, nSucs
+    FLAT_LOGPROBS,      // real, nSucs
+    FLAT_TRP,           // real, nTrP, full log transition matrices
+    FLAT_SEINDEXES,     // SEIndex, nStates
+    FLAT_NAMES,         // char, namesLen, the HMM names
+    FLAT_NSECTIONS
+};
+
+typedef struct {
+    char id[4];         // "JFMF"
+    int version;
+    int realSize;
+    int align;
+    int vecSize;
+    int vecSize4;       // padded sizes of this build, see flatVecSize()
+    int nMixtures;
+    int nMixtures4;
+    int nGaussians;
+    int nGaussians4;
+    int maxCompNum;
+    int nGMMs;
+    int nHMMs;
+    int nGMMInds;
+    int nTransMats;
+    int nStates;
+    int nSucs;
+    int nTrP;
+    int namesLen;
+    int sections[FLAT_NSECTIONS]; // offsets in units of align
+    int nBlocks;                  // file size in units of align
+} FlatHeader;
+
+typedef struct {
+    int nStates;
+    int gmmInd;         // first entry in FLAT_GMMINDS
+    int transMatrixInd;
+    int nameInd;        // offset in FLAT_NAMES
+    real teeWeight;
+} FlatHMM;
+
+typedef struct {
+    int nStates;
+    int stateInd;       // first entry in FLAT_NSUCS and FLAT_SEINDEXES
+    int sucInd;         // first entry in FLAT_SUCS and FLAT_LOGPROBS
+    int trPInd;         // first entry in FLAT_TRP
+} FlatTransMat;
+
+// section offsets and file size from the counts of the header
+static void flatLayout( FlatHeader *h )
+{
+    long len[FLAT_NSECTIONS];
+    len[FLAT_MIXTURES] = sizeof(FMixture)*h->nMixtures4;
+    len[FLAT_DETS] = sizeof(real)*h->nGaussians4;
+    len[FLAT_MEANS] = sizeof(real)*(long)h->nGaussians*h->vecSize4;
+    len[FLAT_VARS] = len[FLAT_MEANS];
+    len[FLAT_GMMS] = sizeof(int)*h->nGMMs;
+    len[FLAT_WEIGHTS] = sizeof(real)*(long)h->nGMMs*h->maxCompNum;
+    len[FLAT_HMMS] = sizeof(FlatHMM)*h->nHMMs;
+    len[FLAT_GMMINDS] = sizeof(int)*h->nGMMInds;
+    len[FLAT_TRANSMATS] = sizeof(FlatTransMat)*h->nTransMats;
+    len[FLAT_NSUCS] = sizeof(int)*h->nStates;
+    len[FLAT_SUCS] = sizeof(int)*h->nSucs;
+    len[FLAT_LOGPROBS] = sizeof(real)*h->nSucs;
+    len[FLAT_TRP] = sizeof(real)*h->nTrP;
+    len[FLAT_SEINDEXES] = sizeof(SEIndex)*h->nStates;
+    len[FLAT_NAMES] = h->namesLen;
+
+    long pos = sizeof(FlatHeader);
+    for (int s = 0; s < FLAT_NSECTIONS; ++s) {
+        h->sections[s] = (pos+FLAT_ALIGN-1)/FLAT_ALIGN;
+        pos = (long)h->sections[s]*FLAT_ALIGN + len[s];
+    }
+    h->nBlocks = (pos+FLAT_ALIGN-1)/FLAT_ALIGN;
+}
+
+// zero padding up to |offset| blocks, then |len| bytes of |data|
+static void writeFlatSection( FILE *fd , int offset , const void *data , long len )
+{
+    static const char zeros[FLAT_ALIGN] = {0};
+    long pos = ftell(fd);
+    while (pos < (long)offset*FLAT_ALIGN) {
+        long n = (long)offset*FLAT_ALIGN - pos;
+        if (n > FLAT_ALIGN)
+            n = FLAT_ALIGN;
+        fwrite(zeros, 1, n, fd);
+        pos += n;
+    }
+    if (len > 0 && (long)fwrite(data, 1, len, fd) != len)
+        error("HTKFlatModels::outputFlat - error writing file");
+}
 
-    // since the GMM parameters here are not shared, add log weights to dets
-    // as part of the pre-computation
+void HTKFlatModels::outputFlat( const char *fName )
+{
+    if (!fMeans)
+        error("HTKFlatModels::outputFlat - float parameters released by quantization");
+    if (hybridMode)
+        error("HTKFlatModels::outputFlat - hybrid models have no GMMs");
+
+    FlatHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.id, "JFMF", 4);
+    h.version = FLAT_VERSION;
+    h.realSize = sizeof(real);
+    h.align = FLAT_ALIGN;
+    h.vecSize = vecSize;
+    h.vecSize4 = fvecSize4;
+    h.nMixtures = nMixtures;
+    h.nMixtures4 = fnMixtures4;
+    h.nGaussians = fnGaussians;
+    h.nGaussians4 = fnGaussians4;
+    h.maxCompNum = fMaxCompNum;
+    h.nGMMs = nGMMs;
+    h.nHMMs = nHMMs;
+    h.nTransMats = nTransMats;
+
+    std::vector<int> gmms(nGMMs);
+    std::vector<real> weights(nGMMs*fMaxCompNum, 0.0);
     for (int i = 0; i < nGMMs; ++i) {
+        gmms[i] = gMMs[i].mixtureInd;
+        for (int j = 0; j < fMixtures[gmms[i]].compNum; ++j)
+            weights[i*fMaxCompNum+j] = gMMs[i].logCompWeights[j];
+    }
+
+    std::vector<FlatHMM> hmms(nHMMs);
+    std::vector<int> gmmInds;
+    std::vector<char> names;
+    for (int i = 0; i < nHMMs; ++i) {
+        HMM* hmm = hMMs + i;
+        hmms[i].nStates = hmm->nStates;
+        hmms[i].gmmInd = gmmInds.size();
+        hmms[i].transMatrixInd = hmm->transMatrixInd;
+        hmms[i].nameInd = names.size();
+        hmms[i].teeWeight = hmm->teeWeight;
+        gmmInds.insert(gmmInds.end(), hmm->gmmInds, hmm->gmmInds+hmm->nStates);
+        names.insert(names.end(), hmm->name, hmm->name+strlen(hmm->name)+1);
+    }
+
+    std::vector<FlatTransMat> tms(nTransMats);
+    std::vector<int> nSucs, sucs;
+    std::vector<real> logProbs, trP;
+    std::vector<SEIndex> seIndexes;
+    for (int i = 0; i < nTransMats; ++i) {
+        TransMatrix* tm = transMats + i;
+        int n = tm->nStates;
+        tms[i].nStates = n;
+        tms[i].stateInd = nSucs.size();
+        tms[i].sucInd = sucs.size();
+        tms[i].trPInd = trP.size();
+        SEIndex noSE = {0, 0};
+        for (int j = 0; j < n; ++j) {
+            nSucs.push_back(tm->nSucs[j]);
+            sucs.insert(sucs.end(), tm->sucs[j], tm->sucs[j]+tm->nSucs[j]);
+            logProbs.insert(logProbs.end(), tm->logProbs[j], tm->logProbs[j]+tm->nSucs[j]);
+            trP.insert(trP.end(), tm->trP[j], tm->trP[j]+n);
+            // state 0 has no SEIndex
+            seIndexes.push_back(j > 0 ? tm->seIndexes[j] : noSE);
+        }
+    }
+    h.nGMMInds = gmmInds.size();
+    h.nStates = nSucs.size();
+    h.nSucs = sucs.size();
+    h.nTrP = trP.size();
+    h.namesLen = names.size();
+    flatLayout(&h);
+
+    FILE *fd;
+    if ( (fd = fopen( fName , "wb" )) == NULL )
+        error("HTKFlatModels::outputFlat - error opening %s" , fName ) ;
+    writeFlatSection(fd, 0, &h, sizeof(h));
+    writeFlatSection(fd, h.sections[FLAT_MIXTURES], fMixtures, sizeof(FMixture)*nMixtures);
+    writeFlatSection(fd, h.sections[FLAT_DETS], fDets, sizeof(real)*fnGaussians);
+    writeFlatSection(fd, h.sections[FLAT_MEANS], fMeans, sizeof(real)*(long)fnGaussians*fvecSize4);
+    writeFlatSection(fd, h.sections[FLAT_VARS], fVars, sizeof(real)*(long)fnGaussians*fvecSize4);
+    writeFlatSection(fd, h.sections[FLAT_GMMS], &gmms[0], sizeof(int)*gmms.size());
+    writeFlatSection(fd, h.sections[FLAT_WEIGHTS], &weights[0], sizeof(real)*weights.size());
+    writeFlatSection(fd, h.sections[FLAT_HMMS], &hmms[0], sizeof(FlatHMM)*hmms.size());
+    writeFlatSection(fd, h.sections[FLAT_GMMINDS], &gmmInds[0], sizeof(int)*gmmInds.size());
+    writeFlatSection(fd, h.sections[FLAT_TRANSMATS], &tms[0], sizeof(FlatTransMat)*tms.size());
+    writeFlatSection(fd, h.sections[FLAT_NSUCS], &nSucs[0], sizeof(int)*nSucs.size());
+    writeFlatSection(fd, h.sections[FLAT_SUCS], &sucs[0], sizeof(int)*sucs.size());
+    writeFlatSection(fd, h.sections[FLAT_LOGPROBS], &logProbs[0], sizeof(real)*logProbs.size());
+    writeFlatSection(fd, h.sections[FLAT_TRP], &trP[0], sizeof(real)*trP.size());
+    writeFlatSection(fd, h.sections[FLAT_SEINDEXES], &seIndexes[0], sizeof(SEIndex)*seIndexes.size());
+    writeFlatSection(fd, h.sections[FLAT_NAMES], &names[0], names.size());
+    writeFlatSection(fd, h.nBlocks, NULL, 0);
+    fclose(fd);
+}
+
+// Map a file written by outputFlat() read-only and shared, and point the
+// flat parameters into it.  Only the small tables of pointers the
+// HTKModels interface hands out (HMMs, GMMs, transition matrix rows) are
+// built privately, the block cache and everything else follows in init()
+// as for loaded models.
+void HTKFlatModels::readFlat( const char *fName )
+{
+    if (fMap || nMixtures)
+        error("HTKFlatModels::readFlat - models already loaded");
+
+    int fd;
+    struct stat st;
+    if ( (fd = open( fName , O_RDONLY )) < 0 )
+        error("HTKFlatModels::readFlat - error opening %s" , fName ) ;
+    if ( fstat( fd , &st ) != 0 || st.st_size < (off_t)sizeof(FlatHeader) )
+        error("HTKFlatModels::readFlat - error reading header") ;
+    void *map = mmap( NULL , st.st_size , PROT_READ , MAP_SHARED , fd , 0 ) ;
+    close( fd ) ;
+    if ( map == MAP_FAILED )
+        error("HTKFlatModels::readFlat - error mapping %s" , fName ) ;
+
+    const FlatHeader* h = (const FlatHeader*)map;
+    char id[5] ;
+    memcpy( id , h->id , 4 ) ;
+    id[4] = '\0' ;
+    if ( strcmp( id , "JFMF" ) != 0 )
+        error("HTKFlatModels::readFlat - invalid ID = %s" , id ) ;
+    if ( h->version != FLAT_VERSION )
+        error("HTKFlatModels::readFlat - unsupported version %d" , h->version ) ;
+    if ( h->realSize != (int)sizeof(real) )
+        error("HTKFlatModels::readFlat - file written with a different real size") ;
+    if ( h->vecSize4 != flatVecSize(h->vecSize) || h->nMixtures4 != flatVecSize(h->nMixtures) ||
+         h->nGaussians4 != flatVecSize(h->nGaussians) || h->align != FLAT_ALIGN )
+        error("HTKFlatModels::readFlat - file written with a different padding") ;
+    FlatHeader layout = *h;
+    flatLayout(&layout);
+    if ( memcmp( &layout , h , sizeof(FlatHeader) ) != 0 ||
+         st.st_size < (off_t)h->nBlocks*FLAT_ALIGN )
+        error("HTKFlatModels::readFlat - inconsistent or truncated file") ;
+
+    char* base = (char*)map;
+    vecSize = h->vecSize;
+    fvecSize4 = h->vecSize4;
+    nMixtures = h->nMixtures;
+    fnMixtures4 = h->nMixtures4;
+    fnGaussians = h->nGaussians;
+    fnGaussians4 = h->nGaussians4;
+    fMaxCompNum = h->maxCompNum;
+    fMixtures = (FMixture*)(base + (long)h->sections[FLAT_MIXTURES]*FLAT_ALIGN);
+    fDets = (real*)(base + (long)h->sections[FLAT_DETS]*FLAT_ALIGN);
+    fMeans = (real*)(base + (long)h->sections[FLAT_MEANS]*FLAT_ALIGN);
+    fVars = (real*)(base + (long)h->sections[FLAT_VARS]*FLAT_ALIGN);
+    fGMMWeights = (real*)(base + (long)h->sections[FLAT_WEIGHTS]*FLAT_ALIGN);
+
+    const int* gmms = (const int*)(base + (long)h->sections[FLAT_GMMS]*FLAT_ALIGN);
+    nGMMs = h->nGMMs;
+    gMMs = new GMM[nGMMs];
+    for (int i = 0; i < nGMMs; ++i) {
+        gMMs[i].name = NULL;
+        gMMs[i].mixtureInd = gmms[i];
+        gMMs[i].compWeights = NULL;
+        gMMs[i].logCompWeights = fGMMWeights + i*fMaxCompNum;
+    }
+
+    const FlatHMM* hmms = (const FlatHMM*)(base + (long)h->sections[FLAT_HMMS]*FLAT_ALIGN);
+    int* gmmInds = (int*)(base + (long)h->sections[FLAT_GMMINDS]*FLAT_ALIGN);
+    char* names = base + (long)h->sections[FLAT_NAMES]*FLAT_ALIGN;
+    nHMMs = h->nHMMs;
+    hMMs = new HMM[nHMMs];
+    for (int i = 0; i < nHMMs; ++i) {
+        hMMs[i].name = names + hmms[i].nameInd;
+        hMMs[i].nStates = hmms[i].nStates;
+        hMMs[i].gmmInds = gmmInds + hmms[i].gmmInd;
+        hMMs[i].transMatrixInd = hmms[i].transMatrixInd;
+        hMMs[i].teeWeight = hmms[i].teeWeight;
+    }
+
+    // one row pointer for each of sucs, logProbs and trP of every state
+    const FlatTransMat* tms = (const FlatTransMat*)(base + (long)h->sections[FLAT_TRANSMATS]*FLAT_ALIGN);
+    int* nSucs = (int*)(base + (long)h->sections[FLAT_NSUCS]*FLAT_ALIGN);
+    int* sucs = (int*)(base + (long)h->sections[FLAT_SUCS]*FLAT_ALIGN);
+    real* logProbs = (real*)(base + (long)h->sections[FLAT_LOGPROBS]*FLAT_ALIGN);
+    real* trP = (real*)(base + (long)h->sections[FLAT_TRP]*FLAT_ALIGN);
+    SEIndex* seIndexes = (SEIndex*)(base + (long)h->sections[FLAT_SEINDEXES]*FLAT_ALIGN);
+    nTransMats = h->nTransMats;
+    transMats = new TransMatrix[nTransMats];
+    fMapIndex = new char[sizeof(int*)*h->nStates + 2*sizeof(real*)*h->nStates];
+    int** sucRows = (int**)fMapIndex;
+    real** probRows = (real**)(sucRows + h->nStates);
+    real** trPRows = probRows + h->nStates;
+    for (int i = 0; i < nTransMats; ++i) {
+        TransMatrix* tm = transMats + i;
+        int n = tms[i].nStates;
+        int s = tms[i].stateInd;
+        tm->name = NULL;
+        tm->nStates = n;
+        tm->nSucs = nSucs + s;
+        tm->sucs = sucRows + s;
+        tm->probs = NULL;
+        tm->logProbs = probRows + s;
+        tm->trP = trPRows + s;
+        tm->seIndexes = seIndexes + s;
+        for (int j = 0, k = tms[i].sucInd; j < n; k += nSucs[s+j], ++j) {
+            tm->sucs[j] = sucs + k;
+            tm->logProbs[j] = logProbs + k;
+            tm->trP[j] = trP + tms[i].trPInd + j*n;
+        }
+    }
+
+    hybridMode = false;
+    currGMMOutputs = NULL;
+    transBuffer = NULL;
+    fMap = map;
+    fMapLen = st.st_size;
+    LogFile::printf("\nHTKFlatModels mapped %.2f MB of flat parameters from %s\n",
+                    fMapLen/(1024.*1024), fName);
+    init();
+}
+
+// Where a mixture belongs to a single GMM, as in most systems, the log
+// weights of the GMM are added to the dets as part of the pre-computation.
+// The GMMs of a mixture shared by several of them keep their own weights,
+// and the component scores of the mixture are cached for the block so
+// that each GMM only adds its weights to them.
+void HTKFlatModels::initSharing()
+{
+    int* nUses = new int[nMixtures];
+    for (int i = 0; i < nMixtures; ++i)
+        nUses[i] = 0;
+    for (int i = 0; i < nGMMs; ++i)
+        ++nUses[gMMs[i].mixtureInd];
+    fnShared = 0;
+    for (int i = 0; i < nMixtures; ++i) {
+        if (nUses[i] > 1)
+            ++fnShared;
+    }
+
+    if (fnShared) {
+        // the GMM weights of a flat file are mapped with the parameters
+        int weights_len = fMap ? 0 : nGMMs*fMaxCompNum;
+        int cache_len = fShareComps ? fnShared*fnBlock*fMaxCompNum : 0;
+        int share_len = sizeof(int)*nMixtures + sizeof(real)*weights_len;
+        share_len += sizeof(real)*cache_len + sizeof(int)*2*fnShared;
+        free(fShareBuffer);
+        fShareBuffer = malloc(share_len);
+        if (!fShareBuffer)
+            error("fail to allocate memory for HTKFlatModels shared mixtures");
+        real* weights = (real*)fShareBuffer;
+        if (!fMap)
+            fGMMWeights = weights;
+        fCompCache = fShareComps ? weights+weights_len : NULL;
+        fShareInd = (int*)(weights+weights_len+cache_len);
+        fCompCacheT = fShareInd+nMixtures;
+        fCompCacheN = fCompCacheT+fnShared;
+        for (int i = 0, s = 0; i < nMixtures; ++i)
+            fShareInd[i] = (nUses[i] > 1) ? s++ : -1;
+        for (int i = 0; i < fnShared; ++i) {
+            fCompCacheT[i] = -1000;
+            fCompCacheN[i] = 0;
+        }
+        LogFile::printf("HTKFlatModels: %d of %d mixtures shared by several GMMs, %.2f MB of weights and component cache\n",
+                        fnShared, nMixtures, share_len/(1024.*1024));
+    }
+
+    // a flat file holds the dets and GMM weights as set up here
+    for (int i = 0; i < nGMMs && !fMap; ++i) {
         real* logCompWeights = gMMs[i].logCompWeights;
-        Mixture* mix = mixtures + gMMs[i].mixtureInd;
-        // printf("add log weights of GMM %d Mixture %d\n", i, gMMs[i].mixtureInd);
-        for (int j = 0; j < mix->nComps; ++j) {
-            fDet(i)[j] += logCompWeights[j];
+        int mixInd = gMMs[i].mixtureInd;
+        for (int j = 0; j < fMixtures[mixInd].compNum; ++j) {
+            if (nUses[mixInd] > 1)
+                fGMMWeights[i*fMaxCompNum+j] = logCompWeights[j];
+            else
+                fDet(mixInd)[j] += logCompWeights[j];
+        }
+    }
+    delete[] nUses;
+}
+
+// select the Gaussian kernel and check it against the scalar one on the
+// loaded parameters, taking a mean of the next mixture as the observation
+void HTKFlatModels::initGaussKernel()
+{
+    GaussKernelType type = selectGaussKernel(fKernelType);
+    if (type != fKernelType && fKernelType != GAUSS_KERNEL_AUTO)
+        LogFile::printf("HTKFlatModels: %s Gaussian kernel not supported by this CPU\n",
+                        gaussKernelName(fKernelType));
+    fCPUKernelType = type;
+    fKernel = getGaussKernel(type);
+    if (fQuantBits)
+        fQuantKernel = getQuantKernel(type, fQuantBits);
+
+    // the check needs the float parameters, which are gone when quantized
+    if (type != GAUSS_KERNEL_SCALAR && fMeans) {
+        real maxDiff = 0.0;
+        for (int i = 0; i < nMixtures && i < 16; ++i) {
+            real diff = checkGaussKernel(fKernel, fMean((i+1)%nMixtures),
+                                         fMean(i), fVar(i), fDet(i),
+                                         fMixtures[i].compNum, fvecSize4);
+            if (diff > maxDiff)
+                maxDiff = diff;
+        }
+        if (maxDiff > GAUSS_KERNEL_TOLERANCE) {
+            LogFile::printf("HTKFlatModels: %s Gaussian kernel differs from scalar by %g, using scalar\n",
+                            gaussKernelName(type), maxDiff);
+            type = GAUSS_KERNEL_SCALAR;
+            fKernel = getGaussKernel(type);
+        }
+    }
+
+    // the approximate log-sum-exp is checked on the components of a few
+    // mixtures, scored at the mean of their first component
+    logSumKernel = getLogSumKernel(type, logSumType);
+    if (logSumType == LOGSUM_APPROX && fMeans) {
+        real maxDiff = 0.0;
+        for (int i = 0; i < nMixtures && i < 16; ++i) {
+            int nMix = fMixtures[i].compNum;
+            fKernel(fMean(i), fMean(i), fVar(i), fDet(i), nMix, fvecSize4, fCompOutputs);
+            real diff = checkLogSumKernel(logSumKernel, fCompOutputs, 1, nMix);
+            if (diff > maxDiff)
+                maxDiff = diff;
+        }
+        if (maxDiff > LOGSUM_APPROX_TOLERANCE) {
+            LogFile::printf("HTKFlatModels: approximate log-sum-exp differs by %g, using exact\n", maxDiff);
+            logSumType = LOGSUM_EXACT;
+            logSumKernel = getLogSumKernel(type, logSumType);
+        }
+    }
+#ifdef HAVE_INTEL_IPP
+    LogFile::printf("HTKFlatModels using IPP for Gaussian calculation\n");
+#else
+    LogFile::printf("HTKFlatModels using %s Gaussian kernel\n", gaussKernelName(type));
+#endif
+}
+
+void HTKFlatModels::setGaussKernel(GaussKernelType type)
+{
+    fKernelType = type;
+    if (fKernel)
+        initGaussKernel();
+    if (fBatch && fGemmBuffer)
+        initGemm();
+}
+
+// Batched scoring writes the Gaussian distance as a dot product,
+//
+//   det - 0.5*sum (x-m)^2/v
+//     = sum x^2*(-0.5/v) + sum x*(m/v) + (det - 0.5*sum m^2/v)
+//
+// so the scores of all components of a GMM over all frames of the block
+// are one matrix product of its rows of fGemm with the [x^2, x, 1] rows
+// of fGemmInput.  The expansion is checked against the direct kernel and
+// batching is turned off if it loses too much precision.
+void HTKFlatModels::initGemm()
+{
+    fGemmDim = 2*fvecSize4 + 4;
+    if (!fGemmBuffer) {
+        int maxRows = max(fMaxCompNum, GEMM_MAX_ROWS);
+        int gemm_len = sizeof(real)*(fnGaussians*fGemmDim + fnBlock*fGemmDim +
+                                     maxRows*fnBlock) + sizeof(int)*nGMMs;
+        LogFile::printf("HTKFlatModels allocated %.2f MB for batched scoring\n", gemm_len/(1024.*1024));
+        fGemmBuffer = malloc(gemm_len);
+        if (!fGemmBuffer)
+            error("fail to allocate memory for HTKFlatModels batched scoring");
+        fGemm = (real*)fGemmBuffer;
+        fGemmInput = fGemm+fnGaussians*fGemmDim;
+        fGemmOutputs = fGemmInput+fnBlock*fGemmDim;
+        fGemmPending = (int*)(fGemmOutputs+maxRows*fnBlock);
+        memset(fGemm, 0, sizeof(real)*(fnGaussians+fnBlock)*fGemmDim);
+
+        for (int i = 0; i < nMixtures; ++i) {
+            for (int j = 0; j < fMixtures[i].compNum; ++j) {
+                real* w = fGemm+fGemmDim*(fMixtures[i].compInd+j);
+                real* m = fMean(i)+j*fvecSize4;
+                real* iv = fVar(i)+j*fvecSize4;
+                double c = fDet(i)[j];
+                for (int k = 0; k < vecSize; ++k) {
+                    w[k] = -0.5*iv[k];
+                    w[fvecSize4+k] = m[k]*iv[k];
+                    c -= 0.5*(double)m[k]*m[k]*iv[k];
+                }
+                w[2*fvecSize4] = c;
+            }
         }
+        for (int k = 0; k < fnBlock; ++k)
+            fGemmInput[k*fGemmDim+2*fvecSize4] = 1.0;
+    }
+    fGemmKernel = getGaussGemm(fCPUKernelType);
+
+    // same check as for the kernels, against the direct kernel
+    real* x = new real[fGemmDim];
+    real maxDiff = 0.0;
+    for (int i = 0; i < nMixtures && i < 16; ++i) {
+        real* mean = fMean((i+1)%nMixtures);
+        memset(x, 0, sizeof(real)*fGemmDim);
+        for (int k = 0; k < vecSize; ++k) {
+            x[k] = mean[k]*mean[k];
+            x[fvecSize4+k] = mean[k];
+        }
+        x[2*fvecSize4] = 1.0;
+        int nMix = fMixtures[i].compNum;
+        fKernel(mean, fMean(i), fVar(i), fDet(i), nMix, fvecSize4, fCompOutputs);
+        fGemmKernel(fGemm+fGemmDim*fMixtures[i].compInd, nMix, x, 1, fGemmDim, fGemmOutputs);
+        for (int j = 0; j < nMix; ++j) {
+            real dist = fabs(fCompOutputs[j] - fDet(i)[j]);
+            real diff = fabs(fGemmOutputs[j] - fCompOutputs[j]) / (dist > 1.0 ? dist : 1.0);
+            if (diff > maxDiff)
+                maxDiff = diff;
+        }
+    }
+    delete[] x;
+
+    if (maxDiff > GAUSS_GEMM_TOLERANCE) {
+        LogFile::printf("HTKFlatModels: batched scoring differs from direct by %g, disabled\n", maxDiff);
+        fBatch = false;
+    } else {
+        LogFile::printf("HTKFlatModels using batched GMM scoring\n");
     }
 }
 
+void HTKFlatModels::setQuantization(int bits)
+{
+    if (bits != 0 && bits != 8 && bits != 16)
+        error("HTKFlatModels::setQuantization - bits should be 0, 8 or 16");
+    fQuantBits = bits;
+}
+
+// Quantized parameter store.  The means of each dimension are put on a
+// grid of 2^bits-1 steps spanning their range, and stored as int8 or
+// int16.  Frames go on the same grid (without clipping, they are kept as
+// int32), so the distance is sum (xq-mq)^2 * step^2/var; step^2/var is
+// stored as fp16, divided by a power of 2 that keeps it in range.
+//
+// The store is calibrated against the float parameters on points one
+// standard deviation away from a component mean of sampled mixtures.  If
+// the mean log likelihood error is above QUANT_LL_TOLERANCE, 8 bits
+// falls back to 16 bits and 16 bits to float.  Returns false for float.
+bool HTKFlatModels::initQuant()
+{
+    int meanSize = fQuantBits/8;
+    int qMax = (fQuantBits == 8) ? 127 : 32767;
+    fvecSize8 = (vecSize+7)&(~7);
+
+    int quant_len = sizeof(int)*fnBlock*fvecSize8 + sizeof(real)*2*vecSize +
+        (sizeof(unsigned short)+meanSize)*fnGaussians*fvecSize8;
+    free(fQuantBuffer);
+    fQuantBuffer = malloc(quant_len);
+    if (!fQuantBuffer)
+        error("fail to allocate memory for HTKFlatModels quantized parameters");
+    memset(fQuantBuffer, 0, quant_len);
+    fInputQ = (int*)fQuantBuffer;
+    fQuantOffset = (real*)(fInputQ+fnBlock*fvecSize8);
+    fQuantStep = fQuantOffset+vecSize;
+    fVarsQ = (unsigned short*)(fQuantStep+vecSize);
+    fMeansQ = (void*)(fVarsQ+fnGaussians*fvecSize8);
+
+    // the grid of each dimension
+    for (int d = 0; d < vecSize; ++d) {
+        real lo = fMean(0)[d];
+        real hi = lo;
+        for (int i = 0; i < nMixtures; ++i)
+            for (int j = 0; j < fMixtures[i].compNum; ++j) {
+                real m = fMean(i)[j*fvecSize4+d];
+                if (m < lo) lo = m;
+                if (m > hi) hi = m;
+            }
+        fQuantOffset[d] = 0.5*(lo+hi);
+        fQuantStep[d] = (hi > lo) ? 0.5*(hi-lo)/qMax : 1.0;
+    }
+
+    real maxVar = 0.0;
+    for (int i = 0; i < nMixtures; ++i)
+        for (int j = 0; j < fMixtures[i].compNum; ++j)
+            for (int d = 0; d < vecSize; ++d) {
+                real w = fVar(i)[j*fvecSize4+d]*fQuantStep[d]*fQuantStep[d];
+                if (w > maxVar)
+                    maxVar = w;
+            }
+    int e;
+    frexp(maxVar, &e);
+    fQuantVarScale = ldexp(1.0, e-14);
+
+    for (int i = 0; i < nMixtures; ++i) {
+        for (int j = 0; j < fMixtures[i].compNum; ++j) {
+            real* m = fMean(i)+j*fvecSize4;
+            real* iv = fVar(i)+j*fvecSize4;
+            unsigned short* vq = fVarQ(i)+j*fvecSize8;
+            for (int d = 0; d < vecSize; ++d) {
+                int q = (int)floor((m[d]-fQuantOffset[d])/fQuantStep[d] + 0.5);
+                q = (q > qMax) ? qMax : ((q < -qMax) ? -qMax : q);
+                if (fQuantBits == 8)
+                    ((signed char*)fMeanQ(i))[j*fvecSize8+d] = q;
+                else
+                    ((short*)fMeanQ(i))[j*fvecSize8+d] = q;
+                vq[d] = floatToHalf(iv[d]*fQuantStep[d]*fQuantStep[d]/fQuantVarScale);
+            }
+        }
+    }
+    fQuantKernel = getQuantKernel(fCPUKernelType, fQuantBits);
+
+    // calibration on up to 256 mixtures spread over the models
+    real* x = new real[fvecSize4];
+    int* xq = new int[fvecSize8];
+    real* ref = new real[fMaxCompNum];
+    double sumErr = 0.0;
+    real maxErr = 0.0;
+    int nCheck = 0;
+    int stride = (nMixtures+255)/256;
+    for (int i = 0; i < nMixtures; i += stride) {
+        int nMix = fMixtures[i].compNum;
+        real* m = fMean(i);
+        real* iv = fVar(i);
+        memset(x, 0, sizeof(real)*fvecSize4);
+        memset(xq, 0, sizeof(int)*fvecSize8);
+        for (int d = 0; d < vecSize; ++d)
+            x[d] = m[d] + ((d & 1) ? 1 : -1)/sqrt(iv[d]);
+        quantizeFrame(x, xq);
+
+        fKernel(x, m, iv, fDet(i), nMix, fvecSize4, ref);
+        fQuantKernel(xq, fMeanQ(i), fVarQ(i), fQuantVarScale, fDet(i), nMix, fvecSize8, fCompOutputs);
+        real refProb = logSumKernel(ref, nMix);
+        real quantProb = logSumKernel(fCompOutputs, nMix);
+        real err = fabs(quantProb - refProb);
+        sumErr += err;
+        if (err > maxErr)
+            maxErr = err;
+        ++nCheck;
+    }
+    delete[] ref;
+    delete[] xq;
+    delete[] x;
+
+    real meanErr = sumErr/nCheck;
+    LogFile::printf("HTKFlatModels: %d bit means and fp16 variances use %.2f MB instead of %.2f MB, "
+                    "log likelihood error %.4f mean, %.4f max\n", fQuantBits,
+                    (double)(sizeof(unsigned short)+meanSize)*fnGaussians*fvecSize8/(1024.*1024),
+                    (double)sizeof(real)*2*fnGaussians*fvecSize4/(1024.*1024), meanErr, maxErr);
+    if (meanErr > QUANT_LL_TOLERANCE) {
+        if (fQuantBits == 8) {
+            LogFile::printf("HTKFlatModels: 8 bit error too large, trying 16 bits\n");
+            fQuantBits = 16;
+            return initQuant();
+        }
+        LogFile::printf("HTKFlatModels: 16 bit error too large, using float parameters\n");
+        free(fQuantBuffer);
+        fQuantBuffer = NULL;
+        return false;
+    }
+    return true;
+}
+
+// put a padded frame on the grid of the quantized means
+void HTKFlatModels::quantizeFrame( const real* x, int* xq )
+{
+    for (int d = 0; d < vecSize; ++d) {
+        real q = floor((x[d]-fQuantOffset[d])/fQuantStep[d] + 0.5);
+        // keep the int32 differences and their float squares exact enough
+        if (q > 1e6) q = 1e6;
+        if (q < -1e6) q = -1e6;
+        xq[d] = (int)q;
+    }
+}
+
+void HTKFlatModels::setBatchOutput(bool batch)
+{
+    fBatch = batch;
+    if (fBatch && fKernel)
+        initGemm();
+}
+
 real HTKFlatModels::calcOutput( int hmmInd , int stateInd )
 {
 #ifdef DEBUG
@@ -225,71 +1038,173 @@ real HTKFlatModels::calcOutput( int gmmInd ) { // new version of GMM obversion c
 
 real HTKFlatModels::calcGMMOutput( int gmmInd )
 {
+    if (fReqT && fReqT[gmmInd] != currFrame) {
+        fReqT[gmmInd] = currFrame;
+        ++fnReq;
+    }
     int n = currFrame - fCacheT[gmmInd];
     if (n < fnBlock) {
         return fCache[gmmInd*fnBlock+n];
     } else {
-        // compute GMM outp for the next few frames
-        real *dets=fDet(gmmInd);
-        int nMix = fMixtures[gmmInd].compNum;
-        int m = min(currInputLen, fnBlock);
-        for (int k = 0; k < m; ++k) {
-            real *means=fMean(gmmInd);
-            real *vars=fVar(gmmInd);
-            real logProb = LOG_ZERO;
-#ifdef HAVE_INTEL_IPP
-            ippsLogGaussMixture_32f_D2(currInputData[k],means,vars,nMix,fvecSize4, vecSize, dets, &logProb);
-#else
-            for (int i = 0; i < nMix; ++i) {
-                real* m = means;
-                real* v = vars;
-                const real* x=currInputData[k];
-                real sumxmu = 0.0;
-                for (int j = 0; j < vecSize; ++j) {
-                    real xmu = *(x++) - *(m++); 
-                    sumxmu += xmu*xmu* *v++;
-                }
-                means += fvecSize4;
-                vars += fvecSize4;
-                logProb = HTKFlatModels::logAdd(logProb , -0.5*sumxmu +dets[i]) ;
-            }
-#endif
-            fCache[gmmInd*fnBlock+k] = logProb;
-        }
-        fCacheT[gmmInd] = currFrame;
+        calcGMMBlockOutput(gmmInd);
         return fCache[gmmInd*fnBlock];
     }
 }
 
-// a version of Torch3's logAdd, included here to take advantage of Intel's C++ compiler 
-// without the need of re-compiling Torch lib
-real HTKFlatModels::logAdd(real x, real y) {
-    if (x < y) {
-        real t = x;
-        x = y;
-        y = t;
+// compute GMM output for the next few frames
+void HTKFlatModels::calcGMMBlockOutput( int gmmInd )
+{
+    int m = min(currInputLen, fnBlock);
+    real* cache = fCache+gmmInd*fnBlock;
+    if (fBatch) {
+        int mixInd = gMMs[gmmInd].mixtureInd;
+        fGemmKernel(fGemm+fGemmDim*fMixtures[mixInd].compInd,
+                    fMixtures[mixInd].compNum, fGemmInput, m, fGemmDim,
+                    fGemmOutputs);
+        sumGemmOutputs(gmmInd, fGemmOutputs, m, cache, fCompOutputs);
+    } else {
+        for (int k = 0; k < m; ++k)
+            cache[k] = calcGMMFrameOutput(gmmInd, k, fCompOutputs);
     }
+    fCacheT[gmmInd] = currFrame;
+}
 
-    real diff = y - x;
+// block |cache| of a GMM from its component x frame rows of a matrix
+// product, |compOutputs| is scratch space
+void HTKFlatModels::sumGemmOutputs( int gmmInd, const real* outputs, int m,
+                                    real* cache, real* compOutputs )
+{
+    int nMix = fMixtures[gMMs[gmmInd].mixtureInd].compNum;
+    for (int k = 0; k < m; ++k) {
+        for (int i = 0; i < nMix; ++i)
+            compOutputs[i] = outputs[i*m+k];
+        cache[k] = logSumKernel(compOutputs, nMix);
+    }
+}
 
-    if (diff < MINUS_LOG_THRESHOLD) {
-        return  x;
-    } else {
-        // return x+log(1.0+exp(diff));
-#ifdef OPT_FAST_LOG
-    #ifdef OPT_FAST_EXP
-        return x + fastlog(1.0 + fastexp(diff));
-    #else
-        return x + fastlog(1.0 + exp(diff));
-    #endif
+// Score the GMMs requested for this frame that are not cached yet.  They
+// are taken in index order so the parameter rows stream through memory
+// once, while the [x^2, x, 1] block stays in cache for all of them.  The
+// rows of consecutive GMMs follow on in fGemm, so each run of them, up to
+// GEMM_MAX_ROWS rows, is one matrix product.
+void HTKFlatModels::calcOutputs( int nGMMInds , const int *gmmInds )
+{
+    if (!batchOutput())
+        return;
+
+    int nPending = 0;
+    for (int i = 0; i < nGMMInds; ++i) {
+        int gmmInd = gmmInds[i];
+        if (currFrame - fCacheT[gmmInd] >= fnBlock) {
+            fCacheT[gmmInd] = currFrame; // so repeated indices are skipped
+            fGemmPending[nPending++] = gmmInd;
+        }
+    }
+    std::sort(fGemmPending, fGemmPending+nPending);
+
+    int m = min(currInputLen, fnBlock);
+    for (int i = 0; i < nPending; ) {
+        int first = fMixtures[gMMs[fGemmPending[i]].mixtureInd].compInd;
+        int nRows = 0;
+        int j = i;
+        for (; j < nPending; ++j) {
+            const FMixture& mix = fMixtures[gMMs[fGemmPending[j]].mixtureInd];
+            if (mix.compInd != first+nRows ||
+                (nRows > 0 && nRows+mix.compNum > GEMM_MAX_ROWS))
+                break;
+            nRows += mix.compNum;
+        }
+        fGemmKernel(fGemm+fGemmDim*first, nRows, fGemmInput, m, fGemmDim,
+                    fGemmOutputs);
+        for (; i < j; ++i) {
+            int gmmInd = fGemmPending[i];
+            int compInd = fMixtures[gMMs[gmmInd].mixtureInd].compInd;
+            sumGemmOutputs(gmmInd, fGemmOutputs+(compInd-first)*m, m,
+                           fCache+gmmInd*fnBlock, fCompOutputs);
+        }
+    }
+}
+
+// GMM output of frame |k| of the block, |compOutputs| is scratch space for
+// the component scores
+real HTKFlatModels::calcGMMFrameOutput( int gmmInd, int k, real* compOutputs )
+{
+    int mixInd = gMMs[gmmInd].mixtureInd;
+    if (fCompCache && fShareInd[mixInd] >= 0) {
+        int nMix = fMixtures[mixInd].compNum;
+        const real* comps = calcMixtureFrameOutput(mixInd, k);
+        const real* logWeights = fGMMWeights+gmmInd*fMaxCompNum;
+        for (int i = 0; i < nMix; ++i)
+            compOutputs[i] = comps[i]+logWeights[i];
+        return logSumKernel(compOutputs, nMix);
+    }
+    return calcGMMFrameOutput(gmmInd, fInput+k*fvecSize4,
+                              fQuantBits ? fInputQ+k*fvecSize8 : NULL,
+                              compOutputs);
+}
+
+// GMM output of the padded frame |x|, or |xq| quantized, without the
+// component cache, so for any input block
+real HTKFlatModels::calcGMMFrameOutput( int gmmInd, const real* x, const int* xq,
+                                        real* compOutputs )
+{
+    int mixInd = gMMs[gmmInd].mixtureInd;
+    real *dets=fDet(mixInd);
+    int nMix = fMixtures[mixInd].compNum;
+    if (fnShared && fShareInd[mixInd] >= 0) {
+        calcMixtureComps(mixInd, x, xq, compOutputs);
+        const real* logWeights = fGMMWeights+gmmInd*fMaxCompNum;
+        for (int i = 0; i < nMix; ++i)
+            compOutputs[i] += logWeights[i];
+        return logSumKernel(compOutputs, nMix);
+    }
+    if (fQuantBits) {
+        fQuantKernel(xq, fMeanQ(mixInd), fVarQ(mixInd),
+                     fQuantVarScale, dets, nMix, fvecSize8, compOutputs);
+        return logSumKernel(compOutputs, nMix);
+    }
+
+#ifdef HAVE_INTEL_IPP
+    real logProb = LOG_ZERO;
+    ippsLogGaussMixture_32f_D2(x,fMean(mixInd),fVar(mixInd),nMix,fvecSize4, vecSize, dets, &logProb);
+    return logProb;
 #else
-    #ifdef OPT_FAST_EXP
-            return x + log(1.0 + fastexp(diff));
-    #else
-            return x + log(1.0 + exp(diff));
-    #endif
+    fKernel(x, fMean(mixInd), fVar(mixInd), dets, nMix, fvecSize4, compOutputs);
+    return logSumKernel(compOutputs, nMix);
 #endif
+}
+
+// Component scores of shared mixture |mixInd| for frame |k| of the block,
+// without weights, from the component cache.  They are computed for the
+// whole block the first time one of the GMMs asks.
+const real* HTKFlatModels::calcMixtureFrameOutput( int mixInd, int k )
+{
+    int s = fShareInd[mixInd];
+    real* cache = fCompCache+s*fnBlock*fMaxCompNum;
+    int n = currFrame + k - fCompCacheT[s];
+    if (n < 0 || n >= fCompCacheN[s]) {
+        int m = min(currInputLen, fnBlock);
+        for (int j = 0; j < m; ++j)
+            calcMixtureComps(mixInd, fInput+j*fvecSize4,
+                             fQuantBits ? fInputQ+j*fvecSize8 : NULL,
+                             cache+j*fMaxCompNum);
+        fCompCacheT[s] = currFrame;
+        fCompCacheN[s] = m;
+        n = k;
     }
+    return cache+n*fMaxCompNum;
+}
+
+void HTKFlatModels::calcMixtureComps( int mixInd, const real* x, const int* xq,
+                                      real* compOutputs )
+{
+    int nMix = fMixtures[mixInd].compNum;
+    if (fQuantBits)
+        fQuantKernel(xq, fMeanQ(mixInd), fVarQ(mixInd),
+                     fQuantVarScale, fDet(mixInd), nMix, fvecSize8, compOutputs);
+    else
+        fKernel(x, fMean(mixInd), fVar(mixInd), fDet(mixInd),
+                nMix, fvecSize4, compOutputs);
 }
 
 void HTKFlatModels::newFrame( int frame , real **input, int nData) {
@@ -298,11 +1213,200 @@ void HTKFlatModels::newFrame( int frame , real **input, int nData) {
    currFrame = frame ;
    currInputData = input ;
    currInputLen = nData;
+   int m = min(nData, fnBlock);
+   for (int k = 0; k < m; ++k)
+       memcpy(fInput+k*fvecSize4, input[k], sizeof(real)*vecSize);
+   if (fQuantBits) {
+       for (int k = 0; k < m; ++k)
+           quantizeFrame(input[k], fInputQ+k*fvecSize8);
+   }
+   if (fBoundDims && m > 0) {
+       for (int k = 0; k < fnBoundDims; ++k)
+           fBoundInput[k] = input[0][fBoundDims[k]];
+   }
+   if (fBatch) {
+       for (int k = 0; k < m; ++k) {
+           real* x = fGemmInput+k*fGemmDim;
+           for (int j = 0; j < vecSize; ++j) {
+               x[j] = input[k][j]*input[k][j];
+               x[fvecSize4+j] = input[k][j];
+           }
+       }
+   }
    if (frame == 0) {
        // reset cache status for new utterance
        for (int i = 0; i < nGMMs; ++i)
            fCacheT[i] = -1000;
+       for (int i = 0; i < fnShared; ++i) {
+           fCompCacheT[i] = -1000;
+           fCompCacheN[i] = 0;
+       }
    }
+   if (fReqT && !hybridMode)
+       updateDense(frame);
+}
+
+void HTKFlatModels::setDenseOutput(real threshold)
+{
+    if (threshold < 0.0 || threshold > 1.0)
+        error("HTKFlatModels::setDenseOutput - threshold should be in [0, 1]");
+    fDenseThreshold = threshold;
+}
+
+// Once a block, decide from the fraction of GMMs the decoder asked for
+// whether to keep scoring on demand or to score every GMM, switching back
+// only when activity drops well below the threshold.  A dense pass walks
+// the GMMs in parameter order and computes the whole block of each, so
+// the parameters stream through memory once and afterwards every request
+// of the block is a cache hit.
+void HTKFlatModels::updateDense( int frame )
+{
+    if (frame == 0) {
+        fDense = false;
+        fDenseT = -1000;
+        fnReqSum = 0;
+        fnReqFrames = 0;
+        for (int i = 0; i < nGMMs; ++i)
+            fReqT[i] = -1000;
+    } else {
+        fnReqSum += fnReq;
+        ++fnReqFrames;
+    }
+    fnReq = 0;
+
+    if (fnReqFrames >= fnBlock) {
+        real activity = (real)fnReqSum / ((real)fnReqFrames*nGMMs);
+        if (!fDense && activity >= fDenseThreshold) {
+            fDense = true;
+            ++fnDenseSwitches;
+        } else if (fDense && activity < fDenseThreshold*DENSE_HYSTERESIS) {
+            fDense = false;
+            ++fnDenseSwitches;
+        }
+        fnReqSum = 0;
+        fnReqFrames = 0;
+    }
+
+    if (fDense && frame - fDenseT >= fnBlock) {
+        for (int i = 0; i < nGMMs; ++i) {
+            if (fCacheT[i] != frame)
+                calcGMMBlockOutput(i);
+        }
+        fDenseT = frame;
+    }
+    ++fnFrames;
+    if (fDense)
+        ++fnDenseFrames;
+}
+
+void HTKFlatModels::setOutputBound(int nDims)
+{
+    if (nDims < 0)
+        error("HTKFlatModels::setOutputBound - nDims should be >= 0");
+    fnBoundDims = nDims;
+}
+
+// The bound of a GMM is its score on a subset of the dimensions: every
+// component distance only loses non-negative terms, so the log-sum over
+// the components can only go up.  The dimensions kept are those where
+// the means are spread furthest apart relative to the variances, which
+// make up most of the distance of a frame to the components it is not
+// close to.  Their means and inverse variances are copied to their own
+// padded arrays so that the Gaussian kernel scores them as it is.
+void HTKFlatModels::initBound()
+{
+    if (fnBoundDims > vecSize)
+        fnBoundDims = vecSize;
+    fBoundDim4 = flatVecSize(fnBoundDims);
+
+    int bound_len = sizeof(int)*fnBoundDims + sizeof(real)*(2*fnGaussians+1)*fBoundDim4;
+    free(fBoundBuffer);
+    fBoundBuffer = malloc(bound_len);
+    if (!fBoundBuffer)
+        error("fail to allocate memory for HTKFlatModels output bound");
+    memset(fBoundBuffer, 0, bound_len);
+    fBoundMeans = (real*)fBoundBuffer;
+    fBoundVars = fBoundMeans+fnGaussians*fBoundDim4;
+    fBoundInput = fBoundVars+fnGaussians*fBoundDim4;
+    fBoundDims = (int*)(fBoundInput+fBoundDim4);
+
+    // spread of the means of each dimension, in units of the variances
+    std::vector<double> mean(vecSize, 0.0);
+    std::vector<std::pair<double, int> > spread(vecSize);
+    int nComps = 0;
+    for (int i = 0; i < nMixtures; ++i) {
+        for (int j = 0; j < fMixtures[i].compNum; ++j) {
+            for (int d = 0; d < vecSize; ++d)
+                mean[d] += fMean(i)[j*fvecSize4+d];
+            ++nComps;
+        }
+    }
+    for (int d = 0; d < vecSize; ++d) {
+        mean[d] /= nComps;
+        spread[d] = std::make_pair(0.0, d);
+    }
+    for (int i = 0; i < nMixtures; ++i) {
+        for (int j = 0; j < fMixtures[i].compNum; ++j) {
+            for (int d = 0; d < vecSize; ++d) {
+                double m = fMean(i)[j*fvecSize4+d] - mean[d];
+                spread[d].first -= m*m*fVar(i)[j*fvecSize4+d];
+            }
+        }
+    }
+    std::sort(spread.begin(), spread.end());
+    for (int k = 0; k < fnBoundDims; ++k)
+        fBoundDims[k] = spread[k].second;
+    std::sort(fBoundDims, fBoundDims+fnBoundDims);
+
+    for (int i = 0; i < nMixtures; ++i) {
+        for (int j = 0; j < fMixtures[i].compNum; ++j) {
+            int g = fMixtures[i].compInd+j;
+            for (int k = 0; k < fnBoundDims; ++k) {
+                fBoundMeans[g*fBoundDim4+k] = fMeans[g*fvecSize4+fBoundDims[k]];
+                fBoundVars[g*fBoundDim4+k] = fVars[g*fvecSize4+fBoundDims[k]];
+            }
+        }
+    }
+    LogFile::printf("HTKFlatModels: GMM output bound on %d of %d dimensions, %.2f MB\n",
+                    fnBoundDims, vecSize, bound_len/(1024.*1024));
+}
+
+// upper bound of the output of GMM |gmmInd| for the current frame
+real HTKFlatModels::calcGMMBound( int gmmInd )
+{
+    int mixInd = gMMs[gmmInd].mixtureInd;
+    int nMix = fMixtures[mixInd].compNum;
+    int compInd = fMixtures[mixInd].compInd;
+    fKernel(fBoundInput, fBoundMeans+compInd*fBoundDim4, fBoundVars+compInd*fBoundDim4,
+            fDet(mixInd), nMix, fBoundDim4, fCompOutputs);
+    if (fnShared && fShareInd[mixInd] >= 0) {
+        const real* logWeights = fGMMWeights+gmmInd*fMaxCompNum;
+        for (int i = 0; i < nMix; ++i)
+            fCompOutputs[i] += logWeights[i];
+    }
+    return logSumKernel(fCompOutputs, nMix);
+}
+
+real HTKFlatModels::calcBoundedOutput( int hmmInd , int stateInd , real minOutput )
+{
+    if ( hybridMode )
+        return calcOutput( hmmInd , stateInd ) ;
+    return calcBoundedOutput( hMMs[hmmInd].gmmInds[stateInd] , minOutput ) ;
+}
+
+// Cached outputs are returned as they are.  Rejected GMMs are not
+// counted as requests for dense mode, they cost next to nothing.
+real HTKFlatModels::calcBoundedOutput( int gmmInd , real minOutput )
+{
+    if (!fBoundDims || hybridMode || minOutput <= LOG_ZERO ||
+        currFrame - fCacheT[gmmInd] < fnBlock)
+        return calcOutput(gmmInd);
+    ++fnBoundChecks;
+    if (calcGMMBound(gmmInd) + BOUND_MARGIN < minOutput) {
+        ++fnBoundRejects;
+        return LOG_ZERO;
+    }
+    return calcGMMOutput(gmmInd);
 }
 
 void HTKFlatModels::setBlockSize(int bs) {
@@ -17,6 +17,7 @@
 #define _HTKFLATMODELS_H
 
 #include "HTKModels.h"
+#include "GaussianKernels.h"
 
 namespace Juicer
 {
@@ -33,37 +34,155 @@ namespace Juicer
         virtual ~HTKFlatModels();
         virtual void init(); // initialise private data from loaded HTKModels
         void readBinary( const char *fName );
+
+        /**
+         * Flat models file: the parameters as laid out by init(), with
+         * the GMM, HMM and transition tables, to be mapped read-only by
+         * readFlat() and shared by all decoders on a host.  Written from
+         * loaded models before quantization.
+         */
+        void outputFlat( const char *fName );
+        void readFlat( const char *fName );
         void Load( const char *htkModelsFName ,
                    bool removeInitialToFinalTransitions_=false ) ;
         real calcOutput( int gmmInd ) ; // new version of GMM obversion calculation
         real calcOutput( int hmmInd , int stateInd ); // new version of GMM obversion calculation
+        real calcBoundedOutput( int hmmInd , int stateInd , real minOutput );
+        real calcBoundedOutput( int gmmInd , real minOutput );
         void newFrame( int frame , real **input, int nFrame);
         void setBlockSize(int bs);
+        void setGaussKernel(GaussKernelType type);
+        void setBatchOutput(bool batch);
+        bool batchOutput() { return fBatch && !hybridMode; }
+        void calcOutputs( int nGMMInds , const int *gmmInds );
+        void setQuantization(int bits); // 0 (float), 8 or 16 bit means, before Load
+
+        /**
+         * Score all GMMs for the block in one pass, in parameter order,
+         * while at least this fraction of them is requested per frame.
+         * 0 keeps scoring on demand only.
+         */
+        void setDenseOutput(real threshold);
+        bool denseOutput() { return fDense; }
+
+        /**
+         * Upper bound for calcBoundedOutput(): the GMM scored on only the
+         * nDims dimensions that contribute most to the distances, which
+         * can not be below its full score.  0 disables the bound.
+         */
+        void setOutputBound(int nDims);
 
     protected:
         int fvecSize4;
         int fnMixtures4;
         int fnGaussians;
         int fnGaussians4;
+        int fMaxCompNum;         // max number of components in a GMM
         FMixture *fMixtures;         // mixture structures with the same order as in HTKModels::mixtures
         // real *fWeights;          // Gaussian weights, no longer needed, // added to dets
         real *fDets;             // Gaussian determinants (gconst + log weight)
         real *fMeans;            // Gaussian means
         real *fVars;             // Gaussian variances
         void* fBuffer;            // data buffer
+        void* fParams;           // fMeans and fVars, released when quantized
+        void* fCacheBuffer;      // block cache and input
+
+        // mapped flat models file, see readFlat()
+        void* fMap;
+        size_t fMapLen;
+        char* fMapIndex;         // row pointers of the transition matrices
 
         int fnBlock;
         real* fCache;            // block cache
         int* fCacheT;            // time of last calculation
         real** currInputData;
         int currInputLen;
+        real* fInput;            // zero padded copy of the input block, fnBlock*fvecSize4
+        real* fCompOutputs;      // per-component scores of the GMM being computed
+
+        GaussKernelType fKernelType;
+        GaussKernelType fCPUKernelType; // fKernelType resolved for this CPU
+        GaussKernel fKernel;     // selected by CPUID in init()
+
+        // batched scoring in GEMM form, see initGemm()
+        bool fBatch;
+        int fGemmDim;            // 2*fvecSize4+4
+        real* fGemm;             // [-0.5/var, mean/var, const] for each Gaussian
+        real* fGemmInput;        // [x^2, x, 1] for each frame of the block
+        real* fGemmOutputs;      // component x frame scores of the GMMs of one product
+        int* fGemmPending;       // GMMs of a calcOutputs() call still to score
+        void* fGemmBuffer;
+        GaussGemm fGemmKernel;
+
+        // quantized parameter store, see initQuant()
+        int fQuantBits;          // 0 (float), 8 or 16
+        int fvecSize8;
+        void* fMeansQ;           // int8 or int16 means, fvecSize8 each
+        unsigned short* fVarsQ;  // fp16 inverse variances times grid step^2
+        real* fQuantOffset;      // grid of each dimension
+        real* fQuantStep;
+        real fQuantVarScale;     // power of 2 keeping fVarsQ in fp16 range
+        int* fInputQ;            // quantized input block
+        void* fQuantBuffer;
+        QuantKernel fQuantKernel;
+
+        // mixtures shared by several GMMs, see initSharing()
+        bool fShareComps;        // cache their component scores for the block
+        int fnShared;
+        int* fShareInd;          // slot of each mixture in fCompCache, -1 if not shared
+        real* fGMMWeights;       // log weights of the GMMs of shared mixtures
+        real* fCompCache;        // component scores, fnBlock*fMaxCompNum per slot
+        int* fCompCacheT;        // first frame and number of frames in fCompCache
+        int* fCompCacheN;
+        void* fShareBuffer;
+
+        // dense mode, see updateDense()
+        real fDenseThreshold;
+        bool fDense;
+        int fDenseT;             // first frame of the last dense block
+        int* fReqT;              // last frame each GMM was requested
+        int fnReq;               // GMMs requested in the current frame
+        long fnReqSum;           // ... summed since the last decision
+        int fnReqFrames;
+        long fnFrames;
+        long fnDenseFrames;
+        long fnDenseSwitches;
+
+        // early rejection, see initBound()
+        int fnBoundDims;
+        int fBoundDim4;          // padded size of the bound parameters
+        int* fBoundDims;         // dimensions used by the bound
+        real* fBoundMeans;       // means and inverse variances on those
+        real* fBoundVars;
+        real* fBoundInput;       // current frame on those
+        void* fBoundBuffer;
+        long fnBoundChecks;
+        long fnBoundRejects;
 
         real *fMean(int gmmId)   {return fMeans+fvecSize4*fMixtures[gmmId].compInd;}
         real *fVar(int gmmId)    {return fVars+fvecSize4*fMixtures[gmmId].compInd;}
         real *fDet(int gmmId)    {return fDets+fMixtures[gmmId].compInd;}
         // real *fWeight(int gmmId) {return fWeights+fMixtures[gmmId].compInd;}
         real calcGMMOutput( int gmmInd );
-        real logAdd(real x, real y);
+        void* fMeanQ(int gmmId)  {return (char*)fMeansQ+fQuantBits/8*fvecSize8*fMixtures[gmmId].compInd;}
+        unsigned short *fVarQ(int gmmId) {return fVarsQ+fvecSize8*fMixtures[gmmId].compInd;}
+        real calcGMMFrameOutput( int gmmInd, int k, real* compOutputs );
+        real calcGMMFrameOutput( int gmmInd, const real* x, const int* xq, real* compOutputs );
+        void initParams();
+        static int flatVecSize( int n );
+        void initGaussKernel();
+        void initGemm();
+        bool initQuant();
+        void initSharing();
+        const real* calcMixtureFrameOutput( int mixInd, int k );
+        void calcMixtureComps( int mixInd, const real* x, const int* xq, real* compOutputs );
+        void updateDense( int frame );
+        void initBound();
+        real calcGMMBound( int gmmInd );
+        void quantizeFrame( const real* x, int* xq );
+        virtual void calcGMMBlockOutput( int gmmInd );
+        void sumGemmOutputs( int gmmInd, const real* outputs, int m,
+                             real* cache, real* compOutputs );
     };
 
 }; // namespace juicer
@@ -0,0 +1,381 @@
+/*
+ * Copyright 2009 by Idiap Research Institute
+ *                   http://www.idiap.ch
+ *
+ * See the file COPYING for the licence associated with this software.
+ *
+ * HTKFlatModelsStreams.cpp  -  based on HTKFlatModels, one copy of the
+ * parameters scoring several decoders in lockstep
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include "HTKFlatModelsStreams.h"
+#include "LogFile.h"
+
+using namespace Torch;
+
+namespace Juicer {
+
+HTKFlatModelsStream::HTKFlatModelsStream(HTKFlatModelsStreams* models_, int stream_)
+{
+    models = models_;
+    stream = stream_;
+}
+
+void HTKFlatModelsStream::Load(const char*, const char*, int)
+{
+    error("HTKFlatModelsStream::Load - load the shared HTKFlatModelsStreams");
+}
+
+void HTKFlatModelsStream::Load(const char*, bool)
+{
+    error("HTKFlatModelsStream::Load - load the shared HTKFlatModelsStreams");
+}
+
+void HTKFlatModelsStream::readBinary(const char*)
+{
+    error("HTKFlatModelsStream::readBinary - load the shared HTKFlatModelsStreams");
+}
+
+void HTKFlatModelsStream::output(const char*, bool)
+{
+    error("HTKFlatModelsStream::output - output the shared HTKFlatModelsStreams");
+}
+
+void HTKFlatModelsStream::setBlockSize(int bs)
+{
+    error("HTKFlatModelsStream::setBlockSize - set it on the shared HTKFlatModelsStreams");
+}
+
+void HTKFlatModelsStream::newFrame(int frame, real **input, int nFrame)
+{
+    models->newStreamFrame(stream, frame, input, nFrame);
+}
+
+real HTKFlatModelsStream::calcOutput(int hmmInd, int stateInd)
+{
+    return models->calcStreamOutput(stream, models->getGMMIndex(hmmInd, stateInd));
+}
+
+real HTKFlatModelsStream::calcOutput(int gmmInd)
+{
+    return models->calcStreamOutput(stream, gmmInd);
+}
+
+void HTKFlatModelsStream::calcOutputs(int nGMMInds, const int *gmmInds)
+{
+    models->calcStreamOutputs(stream, nGMMInds, gmmInds);
+}
+
+int HTKFlatModelsStream::getGMMIndex(int hmmInd, int stateInd)
+{
+    return models->getGMMIndex(hmmInd, stateInd);
+}
+
+int HTKFlatModelsStream::getNumHMMs() { return models->getNumHMMs(); }
+int HTKFlatModelsStream::getCurrFrame() { return models->getStreamFrame(stream); }
+const char* HTKFlatModelsStream::getHMMName(int hmmInd) { return models->getHMMName(hmmInd); }
+int HTKFlatModelsStream::getInputVecSize() { return models->getInputVecSize(); }
+int HTKFlatModelsStream::getNumStates(int hmmInd) { return models->getNumStates(hmmInd); }
+
+int HTKFlatModelsStream::getNumSuccessors(int hmmInd, int stateInd)
+{
+    return models->getNumSuccessors(hmmInd, stateInd);
+}
+
+int HTKFlatModelsStream::getSuccessor(int hmmInd, int stateInd, int sucInd)
+{
+    return models->getSuccessor(hmmInd, stateInd, sucInd);
+}
+
+real HTKFlatModelsStream::getSuccessorLogProb(int hmmInd, int stateInd, int sucInd)
+{
+    return models->getSuccessorLogProb(hmmInd, stateInd, sucInd);
+}
+
+real HTKFlatModelsStream::getTeeLogProb(int hmmInd) { return models->getTeeLogProb(hmmInd); }
+real** HTKFlatModelsStream::getTransMat(int hmmInd) { return models->getTransMat(hmmInd); }
+SEIndex* HTKFlatModelsStream::getSEIndex(int hmmInd) { return models->getSEIndex(hmmInd); }
+
+
+HTKFlatModelsStreams::HTKFlatModelsStreams(int nStreams) {
+    if (nStreams < 1)
+        error("HTKFlatModelsStreams - nStreams should be >= 1");
+    // the component cache would have to be per stream as well
+    fShareComps = false;
+    fnStreams = nStreams;
+    fStreams = new Stream[fnStreams];
+    fViews = new HTKFlatModelsStream*[fnStreams];
+    for (int s = 0; s < fnStreams; ++s) {
+        memset(&fStreams[s], 0, sizeof(Stream));
+        fViews[s] = new HTKFlatModelsStream(this, s);
+    }
+    fSelected = -1;
+    fnRanges = 0;
+    fNextRange = 0;
+    fnRangesDone = 0;
+    fScoring = false;
+    fnActive = 0;
+    fnWaiting = 0;
+    fRound = 0;
+    fnRounds = 0;
+    fnRoundStreams = 0;
+    fnBlocks = 0;
+    fnLoads = 0;
+    pthread_mutex_init(&fMutex, NULL);
+    pthread_cond_init(&fRoundChange, NULL);
+}
+
+HTKFlatModelsStreams::~HTKFlatModelsStreams() {
+    if (fnRounds > 0)
+        LogFile::printf("HTKFlatModelsStreams: %ld frames of %.2f streams on average, "
+                        "%ld GMM blocks from %ld parameter loads (%.2f blocks per load)\n",
+                        fnRounds, (double)fnRoundStreams/fnRounds, fnBlocks, fnLoads,
+                        fnLoads ? (double)fnBlocks/fnLoads : 0.0);
+    pthread_cond_destroy(&fRoundChange);
+    pthread_mutex_destroy(&fMutex);
+    for (int s = 0; s < fnStreams; ++s) {
+        free(fStreams[s].buffer);
+        delete fViews[s];
+    }
+    delete[] fViews;
+    delete[] fStreams;
+}
+
+// Every stream has the block cache and input of HTKFlatModels::init(),
+// which are swapped into the HTKFlatModels members by select(), and the
+// scratch space its thread scores GMMs with.
+void HTKFlatModelsStreams::init()
+{
+    // dense mode and the bound both decide from the requests of one
+    // decoder
+    if (fDenseThreshold > 0.0) {
+        LogFile::printf("HTKFlatModelsStreams: dense GMM scoring not supported, disabled\n");
+        fDenseThreshold = 0.0;
+    }
+    if (fnBoundDims > 0) {
+        LogFile::printf("HTKFlatModelsStreams: GMM output bound not supported, disabled\n");
+        fnBoundDims = 0;
+    }
+    HTKFlatModels::init();
+
+    int input_len = fnBlock*fvecSize4;
+    int gemm_len = fBatch ? fnBlock*fGemmDim : 0;
+    int quant_len = fQuantBits ? fnBlock*fvecSize8 : 0;
+    int scratch_len = fMaxCompNum + (fBatch ? fMaxCompNum*fnBlock : 0);
+    int stream_len = sizeof(int)*(nGMMs + quant_len) +
+        sizeof(real)*(nGMMs*fnBlock + input_len + gemm_len + scratch_len);
+    for (int s = 0; s < fnStreams; ++s) {
+        Stream& st = fStreams[s];
+        free(st.buffer);
+        st.buffer = malloc(stream_len);
+        if (!st.buffer)
+            error("fail to allocate memory for HTKFlatModelsStreams");
+        st.cacheT = (int*)st.buffer;
+        st.inputQ = st.cacheT+nGMMs;
+        st.cache = (real*)(st.inputQ+quant_len);
+        st.input = st.cache+nGMMs*fnBlock;
+        st.gemmInput = st.input+input_len;
+        st.compOutputs = st.gemmInput+gemm_len;
+        st.gemmOutputs = st.compOutputs+fMaxCompNum;
+        memset(st.inputQ, 0, sizeof(int)*quant_len);
+        memset(st.input, 0, sizeof(real)*(input_len + gemm_len));
+        for (int i = 0; i < nGMMs; ++i)
+            st.cacheT[i] = -1000;
+        for (int k = 0; k < fnBlock && fBatch; ++k)
+            st.gemmInput[k*fGemmDim+2*fvecSize4] = 1.0;
+        st.currFrame = -1;
+    }
+    fSelected = -1;
+    LogFile::printf("HTKFlatModelsStreams allocated %.2f MB for %d streams\n",
+                    (double)stream_len*fnStreams/(1024.*1024), fnStreams);
+}
+
+// make |stream| the one HTKFlatModels computes for, fMutex held
+void HTKFlatModelsStreams::select(int stream)
+{
+    if (fSelected == stream)
+        return;
+    if (fSelected >= 0) {
+        Stream& prev = fStreams[fSelected];
+        prev.currFrame = currFrame;
+        prev.currInputData = currInputData;
+        prev.currInputLen = currInputLen;
+    }
+    Stream& st = fStreams[stream];
+    currFrame = st.currFrame;
+    currInputData = st.currInputData;
+    currInputLen = st.currInputLen;
+    fCache = st.cache;
+    fCacheT = st.cacheT;
+    fInput = st.input;
+    if (fBatch)
+        fGemmInput = st.gemmInput;
+    if (fQuantBits)
+        fInputQ = st.inputQ;
+    fSelected = stream;
+}
+
+// The first frame of an utterance joins the stream to the lockstep.
+void HTKFlatModelsStreams::newStreamFrame(int stream, int frame, real **input, int nData)
+{
+    pthread_mutex_lock(&fMutex);
+    Stream& st = fStreams[stream];
+    if (frame == 0 && !st.active) {
+        st.active = true;
+        ++fnActive;
+    }
+    select(stream);
+    HTKFlatModels::newFrame(frame, input, nData);
+    st.currFrame = currFrame;
+    st.currInputData = currInputData;
+    st.currInputLen = currInputLen;
+    pthread_mutex_unlock(&fMutex);
+}
+
+// HTKFlatModels::calcGMMBlockOutput() on the block of |st|, with the
+// scratch space of the stream |scratch| whose thread does it.  There is no
+// component cache, so calcGMMFrameOutput() only reads the frame it is given.
+void HTKFlatModelsStreams::calcStreamBlockOutput(Stream& st, int gmmInd, Stream& scratch)
+{
+    int m = min(st.currInputLen, fnBlock);
+    real* cache = st.cache+gmmInd*fnBlock;
+    if (fBatch) {
+        int mixInd = gMMs[gmmInd].mixtureInd;
+        fGemmKernel(fGemm+fGemmDim*fMixtures[mixInd].compInd,
+                    fMixtures[mixInd].compNum, st.gemmInput, m, fGemmDim,
+                    scratch.gemmOutputs);
+        sumGemmOutputs(gmmInd, scratch.gemmOutputs, m, cache, scratch.compOutputs);
+    } else {
+        for (int k = 0; k < m; ++k)
+            cache[k] = calcGMMFrameOutput(gmmInd, st.input+k*fvecSize4,
+                                          fQuantBits ? st.inputQ+k*fvecSize8 : NULL,
+                                          scratch.compOutputs);
+    }
+    st.cacheT[gmmInd] = st.currFrame;
+}
+
+// Outside a round only the stream itself writes its block cache, and
+// the parameters are read only, so it needs no lock.
+real HTKFlatModelsStreams::calcStreamOutput(int stream, int gmmInd)
+{
+    Stream& st = fStreams[stream];
+    int n = st.currFrame - st.cacheT[gmmInd];
+    if (n < fnBlock)
+        return st.cache[gmmInd*fnBlock+n];
+    calcStreamBlockOutput(st, gmmInd, st);
+    return st.cache[gmmInd*fnBlock];
+}
+
+// Queue the GMMs the stream has no scores for, and help score the round
+// once all streams have.
+void HTKFlatModelsStreams::calcStreamOutputs(int stream, int nGMMInds, const int *gmmInds)
+{
+    pthread_mutex_lock(&fMutex);
+    Stream& st = fStreams[stream];
+    if (!st.active)
+        error("HTKFlatModelsStreams::calcStreamOutputs - stream %d not in an utterance", stream);
+    // a stream that just joined waits for the round being scored
+    while (fScoring)
+        pthread_cond_wait(&fRoundChange, &fMutex);
+    for (int i = 0; i < nGMMInds; ++i) {
+        int gmmInd = gmmInds[i];
+        if (st.currFrame - st.cacheT[gmmInd] >= fnBlock) {
+            st.cacheT[gmmInd] = st.currFrame; // so repeated indices are skipped
+            fPending.push_back(gmmInd*fnStreams+stream);
+        }
+    }
+    st.waiting = true;
+    ++fnWaiting;
+    long round = fRound;
+    if (fnWaiting == fnActive)
+        startRound();
+    while (round == fRound) {
+        if (fScoring && fNextRange < fnRanges)
+            scoreRanges(st);
+        else
+            pthread_cond_wait(&fRoundChange, &fMutex);
+    }
+    pthread_mutex_unlock(&fMutex);
+}
+
+// Sort the queued GMMs and cut them into a range for each waiting stream,
+// moving the cuts forward so that all the streams asking for a GMM are in
+// one range and its parameters are still read once.  fMutex held.
+void HTKFlatModelsStreams::startRound()
+{
+    std::sort(fPending.begin(), fPending.end());
+    size_t n = fPending.size();
+    fnRanges = fnWaiting;
+    fRanges.resize(fnRanges+1);
+    fRanges[0] = 0;
+    for (int r = 1; r < fnRanges; ++r) {
+        size_t i = std::max(n*r/fnRanges, fRanges[r-1]);
+        while (i > 0 && i < n && fPending[i]/fnStreams == fPending[i-1]/fnStreams)
+            ++i;
+        fRanges[r] = i;
+    }
+    fRanges[fnRanges] = n;
+
+    int prevGMM = -1;
+    for (size_t i = 0; i < n; ++i) {
+        if (fPending[i]/fnStreams != prevGMM) {
+            ++fnLoads;
+            prevGMM = fPending[i]/fnStreams;
+        }
+    }
+    fnBlocks += n;
+
+    fNextRange = 0;
+    fnRangesDone = 0;
+    fScoring = true;
+    pthread_cond_broadcast(&fRoundChange);
+}
+
+// Take ranges of the round and score them without the lock, in the
+// scratch space of |st|, until none is left.  fMutex held.
+void HTKFlatModelsStreams::scoreRanges(Stream& st)
+{
+    while (fNextRange < fnRanges) {
+        int r = fNextRange++;
+        pthread_mutex_unlock(&fMutex);
+        for (size_t i = fRanges[r]; i < fRanges[r+1]; ++i)
+            calcStreamBlockOutput(fStreams[fPending[i] % fnStreams],
+                                  fPending[i] / fnStreams, st);
+        pthread_mutex_lock(&fMutex);
+        if (++fnRangesDone == fnRanges)
+            endRound();
+    }
+}
+
+// The streams on the last frame of their utterance leave.  fMutex held.
+void HTKFlatModelsStreams::endRound()
+{
+    fPending.clear();
+    fScoring = false;
+
+    ++fnRounds;
+    fnRoundStreams += fnWaiting;
+    for (int s = 0; s < fnStreams; ++s) {
+        Stream& st = fStreams[s];
+        if (!st.waiting)
+            continue;
+        st.waiting = false;
+        if (st.currInputLen <= 1) {
+            st.active = false;
+            --fnActive;
+        }
+    }
+    fnWaiting = 0;
+    ++fRound;
+    pthread_cond_broadcast(&fRoundChange);
+}
+
+}; // namespace Juicer
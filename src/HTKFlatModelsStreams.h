@@ -0,0 +1,144 @@
+/*
+ * Copyright 2009 by Idiap Research Institute
+ *                   http://www.idiap.ch
+ *
+ * See the file COPYING for the licence associated with this software.
+ */
+
+/*
+ * vi:ts=4:tw=78:shiftwidth=4:expandtab
+ * vim600:fdm=marker
+ *
+ * HTKFlatModelsStreams.h  -  based on HTKFlatModels, one copy of the
+ * parameters scoring several decoders in lockstep
+ *
+ */
+
+#ifndef _HTKFLATMODELSSTREAMS_H
+#define _HTKFLATMODELSSTREAMS_H
+
+#include <pthread.h>
+#include <vector>
+#include "HTKFlatModels.h"
+
+namespace Juicer {
+
+    class HTKFlatModelsStreams;
+
+    /**
+     * The models as seen by the decoder of one stream: the structure is
+     * that of the shared models, the frame, input block and block cache
+     * its own.
+     */
+    class HTKFlatModelsStream : public IModels {
+        public:
+            HTKFlatModelsStream(HTKFlatModelsStreams* models_, int stream_);
+            virtual ~HTKFlatModelsStream() {}
+
+            void Load(const char*, const char*, int);
+            void Load(const char*, bool removeInitialToFinalTransitions_=false);
+            void readBinary(const char*);
+            void output(const char*, bool);
+            void setBlockSize(int bs);
+
+            void newFrame(int frame, real **input, int nFrame);
+            real calcOutput(int hmmInd, int stateInd);
+            real calcOutput(int gmmInd);
+            bool batchOutput() { return true; }
+            void calcOutputs(int nGMMInds, const int *gmmInds);
+            int getGMMIndex(int hmmInd, int stateInd);
+
+            int getNumHMMs();
+            int getCurrFrame();
+            const char* getHMMName(int hmmInd);
+            int getInputVecSize();
+            int getNumStates(int hmmInd);
+            int getNumSuccessors(int hmmInd, int stateInd);
+            int getSuccessor(int hmmInd, int stateInd, int sucInd);
+            real getSuccessorLogProb(int hmmInd, int stateInd, int sucInd);
+            real getTeeLogProb(int hmmInd);
+            real** getTransMat(int hmmInd);
+            SEIndex* getSEIndex(int hmmInd);
+
+        private:
+            HTKFlatModelsStreams* models;
+            int stream;
+    };
+
+    /**
+     * Models shared by the decoders of nStreams utterances running in
+     * their own threads.  Each decoder gets the view of getStream(), and
+     * must call calcOutputs() once in every frame, as WFSTDecoderLite and
+     * WFSTDecoder do.  The decoders then meet frame by frame: the GMMs all
+     * of them ask for are split by index into one range per stream, and
+     * each stream's thread scores a range, GMM by GMM, so the parameters of
+     * a GMM are read once for every stream that needs it rather than once
+     * per stream.  A stream joins on its first frame and leaves after its
+     * last.
+     */
+    class HTKFlatModelsStreams : public HTKFlatModels {
+        public:
+            HTKFlatModelsStreams(int nStreams);
+            virtual ~HTKFlatModelsStreams();
+            void init();
+
+            int getNumStreams() { return fnStreams; }
+            HTKFlatModelsStream* getStream(int stream) { return fViews[stream]; }
+
+            // for HTKFlatModelsStream
+            void newStreamFrame(int stream, int frame, real **input, int nData);
+            real calcStreamOutput(int stream, int gmmInd);
+            void calcStreamOutputs(int stream, int nGMMInds, const int *gmmInds);
+            int getStreamFrame(int stream) { return fStreams[stream].currFrame; }
+
+        private:
+            // what HTKFlatModels holds for the one decoder, for each stream
+            typedef struct {
+                int currFrame;
+                real** currInputData;
+                int currInputLen;
+                real* cache;
+                int* cacheT;
+                real* input;
+                real* gemmInput;
+                int* inputQ;
+                real* compOutputs;   // scratch space of the stream's thread
+                real* gemmOutputs;
+                void* buffer;
+                bool active;
+                bool waiting;
+            } Stream;
+
+            int fnStreams;
+            Stream* fStreams;
+            HTKFlatModelsStream** fViews;
+            int fSelected;           // stream in the HTKFlatModels members
+
+            // GMMs of the waiting streams still to score, gmmInd*fnStreams+stream
+            std::vector<int> fPending;
+            // ... split into fnRanges ranges of fPending, no GMM in two
+            std::vector<size_t> fRanges;
+            int fnRanges;
+            int fNextRange;          // first range not taken by a thread
+            int fnRangesDone;
+            bool fScoring;           // fPending is being scored
+            int fnActive;
+            int fnWaiting;
+            long fRound;
+            pthread_mutex_t fMutex;
+            pthread_cond_t fRoundChange; // scoring starts or the round ends
+
+            long fnRounds;
+            long fnRoundStreams;
+            long fnBlocks;           // GMM blocks scored in rounds
+            long fnLoads;            // ... distinct GMMs per round among them
+
+            void select(int stream);
+            void calcStreamBlockOutput(Stream& st, int gmmInd, Stream& scratch);
+            void startRound();
+            void scoreRanges(Stream& st);
+            void endRound();
+    };
+
+}; // namespace juicer
+#endif /* ifndef _HTKFLATMODELSSTREAMS_H */
@@ -3,7 +3,9 @@
  *
  * See the file COPYING for the licence associated with this software.
  *
- * HTKFlatModelsThreading.cpp  -  based on HTKFlatModels, with added functions for 2-thread decoding
+ * HTKFlatModelsThreading.cpp  -  based on HTKFlatModels, with a pool of
+ * worker threads doing the GMM calculation while the decoder propagates
+ * tokens
  */
 
 #ifdef HAVE_CONFIG_H
@@ -12,122 +14,214 @@
 
 #include <cassert>
 #include <cstdlib>
+#include <unistd.h>
+#include <sched.h>
 #include "log_add.h"
 
 #include "HTKFlatModelsThreading.h"
 #include "LogFile.h"
 
-#ifdef HAVE_INTEL_IPP
-#include <ippcore.h>
-#include <ipps.h>
-#include <ippsr.h>
-#endif
-
 using namespace Torch;
 
 namespace Juicer {
 
+// polls of an empty queue before a worker goes to sleep
+static const int WORKER_SPIN = 4000;
+
+static inline void cpuRelax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#endif
+}
+
+typedef struct WorkerParam_ {
+    HTKFlatModelsThreading* models;
+    int worker;
+} WorkerParam;
+
 HTKFlatModelsThreading::HTKFlatModelsThreading() {
-    fQueue = NULL;
-    fCounter = -1;
-    fStart = fEnd = 0;
-    fRunning = true;
+    // workers may score GMMs of the same mixture at once, so the
+    // component scores of shared mixtures are not cached
+    fShareComps = false;
+    fRing = NULL;
+    fHead = fTail = 0;
+    fnWorkers = 0;
+    fWorkers = NULL;
+    fWorkerCompOutputs = NULL;
+    fRunning = 0;
+    fnParked = 0;
+    pthread_mutex_init(&fMutex, NULL);
+    pthread_cond_init(&fWakeUp, NULL);
 }
 
 HTKFlatModelsThreading::~HTKFlatModelsThreading() {
-    delete[] fQueue;
+    stop();
+    pthread_cond_destroy(&fWakeUp);
+    pthread_mutex_destroy(&fMutex);
+    delete[] fRing;
+    delete[] fWorkerCompOutputs;
 }
 
 void HTKFlatModelsThreading::init()
 {
+    // the GMM threads and the decoder share the block cache, so the
+    // decoder can not score a batch of GMMs itself
+    if (fBatch) {
+        LogFile::printf("HTKFlatModelsThreading: batched GMM scoring not supported, disabled\n");
+        fBatch = false;
+    }
+    // the decoder does not score GMMs itself, the workers do
+    if (fDenseThreshold > 0.0) {
+        LogFile::printf("HTKFlatModelsThreading: dense GMM scoring not supported, disabled\n");
+        fDenseThreshold = 0.0;
+    }
+    // nor does it reject GMMs, their outputs are all queued
+    if (fnBoundDims > 0) {
+        LogFile::printf("HTKFlatModelsThreading: GMM output bound not supported, disabled\n");
+        fnBoundDims = 0;
+    }
     HTKFlatModels::init();
 
-    fQueue = new FProbQueue[nGMMs];
-    for(int i = 0; i < nGMMs; i++){
-        fQueue[i].next=-1;
-        fQueue[i].t=-1;
-    }
+    fRing = new int[nGMMs];
+    fHead = fTail = 0;
 }
 
-bool HTKFlatModelsThreading::cachedOutput(int gmmInd, real* outp) {
-    int n = currFrame - fCacheT[gmmInd];
-    if (n < fnBlock) {
-        *outp = fCache[gmmInd*fnBlock+n];
-        return true;
-    } else {
-        return false;
+void HTKFlatModelsThreading::start(int nWorkers)
+{
+    assert(fWorkers == NULL && fRing != NULL);
+    if (nWorkers <= 0) {
+        nWorkers = (int)sysconf(_SC_NPROCESSORS_ONLN) - 1;
+        if (nWorkers < 1)
+            nWorkers = 1;
+    }
+    fnWorkers = nWorkers;
+    fWorkerCompOutputs = new real[(fnWorkers+1)*fMaxCompNum];
+    fWorkers = new pthread_t[fnWorkers];
+    fRunning = 1;
+
+    WorkerParam* param = new WorkerParam[fnWorkers];
+    for (int i = 0; i < fnWorkers; ++i) {
+        param[i].models = this;
+        param[i].worker = i+1;
+        if (pthread_create(&fWorkers[i], NULL, workerThread, &param[i]))
+            error("HTKFlatModelsThreading::start - failed to create GMM thread %d", i);
     }
+    // each worker copies its parameters before it first parks
+    while (__atomic_load_n(&fnParked, __ATOMIC_SEQ_CST) < fnWorkers)
+        sched_yield();
+    delete[] param;
+    LogFile::printf("HTKFlatModelsThreading: %d GMM threads\n", fnWorkers);
 }
 
-real HTKFlatModelsThreading::readOutput(int gmmInd) {
-    int n = currFrame - fCacheT[gmmInd];
-    if (n < fnBlock) {
-        return fCache[gmmInd*fnBlock+n];
-    } else {
-        // the output of gmmInd is supposed to be calculated in thread2, but not due to
-        // a very rare sync problem (get skipped in fQueue for whatever
-        // reason), and a simple fix is to re-calculate it
-         return this->calcSingleFrameGMMOutput(gmmInd);
-    }
+void HTKFlatModelsThreading::stop()
+{
+    if (!fWorkers)
+        return;
+    pthread_mutex_lock(&fMutex);
+    __atomic_store_n(&fRunning, 0, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&fWakeUp);
+    pthread_mutex_unlock(&fMutex);
+    for (int i = 0; i < fnWorkers; ++i)
+        pthread_join(fWorkers[i], NULL);
+    delete[] fWorkers;
+    fWorkers = NULL;
 }
 
-// GMM calculation (the same as real HTKFlatModels::calcGMMOutput( int gmmInd ))
-// without updating the cache to avoid possible sync problem in thread 2. As
-// thread 2 is dedicated to GMM calculation and can update cache at any time.
-real HTKFlatModelsThreading::calcSingleFrameGMMOutput(int gmmInd )
+void* HTKFlatModelsThreading::workerThread(void* arg)
 {
-    // compute GMM outp for current frame only
-    real *dets=fDet(gmmInd);
-    int nMix = fMixtures[gmmInd].compNum;
-    real *means=fMean(gmmInd);
-    real *vars=fVar(gmmInd);
-    real logProb = LOG_ZERO;
-#ifdef HAVE_INTEL_IPP
-    ippsLogGaussMixture_32f_D2(currInputData[0],means,vars,nMix,fvecSize4, vecSize, dets, &logProb);
-#else
-    for (int i = 0; i < nMix; ++i) {
-        real* m = means;
-        real* v = vars;
-        const real* x=currInputData[0];
-        real sumxmu = 0.0;
-        for (int j = 0; j < vecSize; ++j) {
-            real xmu = *(x++) - *(m++); 
-            sumxmu += xmu*xmu* *v++;
+    WorkerParam* p = (WorkerParam*)arg;
+    p->models->workerLoop(p->worker);
+    return NULL;
+}
+
+// Take GMMs off the queue while there are any, then spin for a while and
+// finally sleep until addQueue() or stop() wakes the worker up.  fnParked
+// is raised before the queue is checked and addQueue() reads it after
+// publishing fTail, so a GMM can not be queued unnoticed.
+void HTKFlatModelsThreading::workerLoop(int worker)
+{
+    real* compOutputs = fWorkerCompOutputs+worker*fMaxCompNum;
+    int idle = WORKER_SPIN;
+    while (__atomic_load_n(&fRunning, __ATOMIC_ACQUIRE)) {
+        if (calcQueued(compOutputs)) {
+            idle = 0;
+        } else if (idle < WORKER_SPIN) {
+            ++idle;
+            cpuRelax();
+        } else {
+            pthread_mutex_lock(&fMutex);
+            __atomic_add_fetch(&fnParked, 1, __ATOMIC_SEQ_CST);
+            while (__atomic_load_n(&fRunning, __ATOMIC_SEQ_CST) &&
+                   __atomic_load_n(&fHead, __ATOMIC_SEQ_CST) >=
+                   __atomic_load_n(&fTail, __ATOMIC_SEQ_CST))
+                pthread_cond_wait(&fWakeUp, &fMutex);
+            __atomic_sub_fetch(&fnParked, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&fMutex);
+            idle = 0;
         }
-        means += fvecSize4;
-        vars += fvecSize4;
-        logProb = HTKFlatModels::logAdd(logProb , -0.5*sumxmu +dets[i]) ;
     }
-#endif
+}
 
-    return logProb;
+// Claim the next queued GMM, if any, and compute it
+bool HTKFlatModelsThreading::calcQueued(real* compOutputs)
+{
+    unsigned long head = __atomic_load_n(&fHead, __ATOMIC_RELAXED);
+    do {
+        if (head >= __atomic_load_n(&fTail, __ATOMIC_ACQUIRE))
+            return false;
+    } while (!__atomic_compare_exchange_n(&fHead, &head, head+1, false,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    calcQueuedBlockOutput(fRing[head % nGMMs], compOutputs);
+    return true;
 }
 
-void HTKFlatModelsThreading::addQueue(int gmmInd) {
+// HTKFlatModels::calcGMMBlockOutput() with the caller's component buffer.
+// The cache time is written last, with release semantics, as it is what
+// tells the decoder the outputs are there.
+void HTKFlatModelsThreading::calcQueuedBlockOutput(int gmmInd, real* compOutputs)
+{
+    int m = min(currInputLen, fnBlock);
+    real* cache = fCache+gmmInd*fnBlock;
+    for (int k = 0; k < m; ++k)
+        cache[k] = calcGMMFrameOutput(gmmInd, k, compOutputs);
+    __atomic_store_n(&fCacheT[gmmInd], currFrame, __ATOMIC_RELEASE);
+}
 
-    assert(fQueue[fEnd].next == -1);
-    fQueue[fEnd].next = gmmInd;
-    fEnd = gmmInd;
-    fQueue[gmmInd].t = currFrame;
+bool HTKFlatModelsThreading::cachedOutput(int gmmInd, real* outp) {
+    if (hybridMode) {
+        *outp = calcOutput(gmmInd);
+        return true;
+    }
+    int n = currFrame - __atomic_load_n(&fCacheT[gmmInd], __ATOMIC_ACQUIRE);
+    if (n < fnBlock) {
+        *outp = fCache[gmmInd*fnBlock+n];
+        return true;
+    } else {
+        return false;
+    }
 }
 
-void HTKFlatModelsThreading::calcStates(){
-   while(fRunning){
-      if(fQueue[fStart].t>=0){
-         this->calcOutput(fStart);
-         fQueue[fStart].t=-1;
-         fCounter++;
-      }
-
-      if(fStart!=fEnd){
-         int n=fStart;
-         fStart=fQueue[n].next;
-         fQueue[n].next=-1;
-      } else {
-          // break;
-      }
-   }
-   return;
+// Output of a queued GMM.  Rather than spin, the decoder helps with the
+// queue until the GMM is done.
+real HTKFlatModelsThreading::waitOutput(int gmmInd) {
+    real outp;
+    while (!cachedOutput(gmmInd, &outp)) {
+        if (!calcQueued(fWorkerCompOutputs))
+            cpuRelax();
+    }
+    return outp;
+}
+
+void HTKFlatModelsThreading::addQueue(int gmmInd) {
+    assert(fTail - __atomic_load_n(&fHead, __ATOMIC_RELAXED) < (unsigned long)nGMMs);
+    fRing[fTail % nGMMs] = gmmInd;
+    __atomic_store_n(&fTail, fTail+1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&fnParked, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&fMutex);
+        pthread_cond_signal(&fWakeUp);
+        pthread_mutex_unlock(&fMutex);
+    }
 }
 
 }; // namespace juicer
@@ -8,20 +8,19 @@
  * vi:ts=4:tw=78:shiftwidth=4:expandtab
  * vim600:fdm=marker
  *
- * HTKFlatModelsThreading.h  -  based on HTKFlatModels, with added functions for 2-thread decoding
+ * HTKFlatModelsThreading.h  -  based on HTKFlatModels, with a pool of
+ * worker threads doing the GMM calculation while the decoder propagates
+ * tokens
  *
  */
 
 #ifndef _HTKFLATMODELSTHREADING_H
 #define _HTKFLATMODELSTHREADING_H
 
+#include <pthread.h>
 #include "HTKFlatModels.h"
 
 namespace Juicer {
-    typedef struct FProbQueue_{
-        int   t;
-        int   next;
-    } FProbQueue;
 
     class HTKFlatModelsThreading : public HTKFlatModels {
         public:
@@ -29,24 +28,41 @@ namespace Juicer {
             virtual ~HTKFlatModelsThreading();
             void init();
 
+            /**
+             * Start nWorkers GMM threads (0 for one per core, less the
+             * decoder's) after init().  stop() joins them.
+             */
+            void start(int nWorkers);
+            void stop();
+
             bool cachedOutput(int gmmInd, real* outp);
-            real readOutput(int gmmInd);
+            real waitOutput(int gmmInd);
             void addQueue(int gmmInd);
-            int nReadyStates() { assert(fCounter >= -1); return fCounter; }
-            void sync() { fCounter = -1; }
             int gmmInd(int hmmInd, int stateInd) { return hMMs[hmmInd].gmmInds[stateInd]; }
-            void calcStates();
-            void stop() { fRunning = false; }
 
         private:
-            real calcSingleFrameGMMOutput(int gmmInd );
-            FProbQueue* fQueue;
-            int  fStart;
-            int  fEnd;
-            int  fCounter;
-            bool fRunning;
+            // The queue is a ring of nGMMs entries indexed by two ever
+            // increasing tickets: the decoder is the only writer of fTail,
+            // workers claim entries by compare-and-swap on fHead.  The
+            // decoder waits for all GMMs queued in a frame before the next
+            // one, so no more than nGMMs entries are ever outstanding.
+            int* fRing;
+            unsigned long fHead;
+            unsigned long fTail;
+
+            int fnWorkers;
+            pthread_t* fWorkers;
+            real* fWorkerCompOutputs; // fMaxCompNum per worker, the decoder's first
+            int fRunning;
+            int fnParked;            // workers asleep on fWakeUp
+            pthread_mutex_t fMutex;
+            pthread_cond_t fWakeUp;
+
+            static void* workerThread(void* arg);
+            void workerLoop(int worker);
+            bool calcQueued(real* compOutputs);
+            void calcQueuedBlockOutput(int gmmInd, real* compOutputs);
     };
 
 }; // namespace juicer
 #endif /* ifndef _HTKFLATMODELSTHREADING_H */
-
@@ -0,0 +1,478 @@
+/*
+ * Copyright 2009 by Idiap Research Institute
+ *                   http://www.idiap.ch
+ *
+ * See the file COPYING for the licence associated with this software.
+ *
+ * HTKGSModels.cpp  -  HTKFlatModels with Gaussian selection.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include "log_add.h"
+
+#include "HTKGSModels.h"
+#include "LogFile.h"
+
+// every GS_CHECK_INTERVAL-th GMM frame is also scored in full to measure
+// the error of the selection
+#define GS_CHECK_INTERVAL 64
+
+// binary index format version
+#define GS_VERSION 1
+
+using namespace Torch;
+
+namespace Juicer {
+
+HTKGSModels::HTKGSModels() {
+    fGSFName = NULL;
+    fnCodewords = 0;
+    fGSThreshold = 0.0;
+    fGSMinComps = 0;
+    fCWMeans = NULL;
+    fCWVars = NULL;
+    fCWDets = NULL;
+    fCWScores = NULL;
+    fGSOffsets = NULL;
+    fGSComps = NULL;
+    fCodeword = NULL;
+    fGSMeans = NULL;
+    fGSVars = NULL;
+    fGSDets = NULL;
+    fGSGathered = -1;
+
+    fnGMMFrames = 0;
+    fnCompsScored = 0;
+    fnCompsFull = 0;
+    fnChecked = 0;
+    fSumAbsErr = 0.0;
+    fMaxAbsErr = 0.0;
+}
+
+HTKGSModels::~HTKGSModels() {
+    if (fnGMMFrames > 0) {
+        LogFile::printf("HTKGSModels summary:\nscored %.1f%% of Gaussians (%.2f of %.2f per GMM frame), "
+                        "log likelihood error %.4f mean, %.4f max over %ld checked GMM frames\n",
+                        100.0*fnCompsScored/fnCompsFull,
+                        (double)fnCompsScored/fnGMMFrames, (double)fnCompsFull/fnGMMFrames,
+                        fnChecked > 0 ? fSumAbsErr/fnChecked : 0.0, fMaxAbsErr, fnChecked);
+    }
+    freeIndex();
+    delete[] fCodeword;
+    delete[] fGSMeans;
+    delete[] fGSFName;
+}
+
+void HTKGSModels::setIndexFName( const char *fName ) {
+    delete[] fGSFName;
+    fGSFName = NULL;
+    if ( (fName != NULL) && (fName[0] != '\0') ) {
+        fGSFName = new char[strlen(fName)+1];
+        strcpy(fGSFName, fName);
+    }
+}
+
+void HTKGSModels::init()
+{
+    // batched scoring works on whole GMMs, there is nothing to select
+    if (fBatch) {
+        LogFile::printf("HTKGSModels: batched GMM scoring not supported, disabled\n");
+        fBatch = false;
+    }
+    // the shortlists index the float parameters
+    if (fQuantBits) {
+        LogFile::printf("HTKGSModels: quantized parameters not supported, using float\n");
+        fQuantBits = 0;
+    }
+    HTKFlatModels::init();
+
+    delete[] fCodeword;
+    fCodeword = new int[fnBlock];
+    delete[] fGSMeans;
+    fGSMeans = new real[(2*fvecSize4 + 1)*fMaxCompNum];
+    fGSVars = fGSMeans + fMaxCompNum*fvecSize4;
+    fGSDets = fGSVars + fMaxCompNum*fvecSize4;
+    fGSGathered = -1;
+    if (fGSFName)
+        readIndex(fGSFName);
+}
+
+void HTKGSModels::freeIndex()
+{
+    delete[] fCWMeans;
+    delete[] fGSOffsets;
+    delete[] fGSComps;
+    fCWMeans = fCWVars = fCWDets = fCWScores = NULL;
+    fGSOffsets = NULL;
+    fGSComps = NULL;
+    fnCodewords = 0;
+    fGSGathered = -1;
+}
+
+// codeword means, inverse variances, dets and scores in one zeroed block
+void HTKGSModels::allocCodewords( int nCodewords )
+{
+    fnCodewords = nCodewords;
+    int len = 2*nCodewords*fvecSize4 + 2*nCodewords;
+    fCWMeans = new real[len];
+    memset(fCWMeans, 0, sizeof(real)*len);
+    fCWVars = fCWMeans + nCodewords*fvecSize4;
+    fCWDets = fCWVars + nCodewords*fvecSize4;
+    fCWScores = fCWDets + nCodewords;
+}
+
+// Re-estimate each codeword from the Gaussians assigned to it: the mean
+// of their means, and a variance covering both their variances and the
+// spread of their means.  Empty codewords keep their old parameters.
+void HTKGSModels::updateCodewords(
+    int nCodewords , int nGauss , const int *gauss , const int *assign
+)
+{
+    std::vector<double> sum(nCodewords*vecSize, 0.0);
+    std::vector<double> sumSq(nCodewords*vecSize, 0.0);
+    std::vector<int> count(nCodewords, 0);
+    for (int g = 0; g < nGauss; ++g) {
+        int c = assign[g];
+        real* m = fMeans+gauss[g]*fvecSize4;
+        real* iv = fVars+gauss[g]*fvecSize4;
+        double* s = &sum[c*vecSize];
+        double* s2 = &sumSq[c*vecSize];
+        for (int d = 0; d < vecSize; ++d) {
+            s[d] += m[d];
+            s2[d] += (double)m[d]*m[d] + 1.0/iv[d];
+        }
+        ++count[c];
+    }
+    for (int c = 0; c < nCodewords; ++c) {
+        if (count[c] == 0)
+            continue;
+        real* m = fCWMeans+c*fvecSize4;
+        real* iv = fCWVars+c*fvecSize4;
+        double det = 0.0;
+        for (int d = 0; d < vecSize; ++d) {
+            double mean = sum[c*vecSize+d]/count[c];
+            double var = sumSq[c*vecSize+d]/count[c] - mean*mean;
+            if (var < 1e-4)
+                var = 1e-4;
+            m[d] = mean;
+            iv[d] = 1.0/var;
+            det += log(var);
+        }
+        fCWDets[c] = -0.5*det;
+    }
+}
+
+void HTKGSModels::buildIndex( int nCodewords , real threshold , int minComps )
+{
+    if ( (nCodewords < 1) || ((nCodewords & (nCodewords-1)) != 0) )
+        error("HTKGSModels::buildIndex - nCodewords must be a power of 2");
+    if (minComps < 1)
+        error("HTKGSModels::buildIndex - minComps must be at least 1");
+    if (fMaxCompNum > 65535)
+        error("HTKGSModels::buildIndex - too many components per mixture");
+    freeIndex();
+    allocCodewords(nCodewords);
+    fGSThreshold = threshold;
+    fGSMinComps = minComps;
+
+    // all Gaussians, as indexes into fMeans/fVars
+    int nGauss = 0;
+    for (int i = 0; i < nMixtures; ++i)
+        nGauss += fMixtures[i].compNum;
+    int* gauss = new int[nGauss];
+    int* assign = new int[nGauss];
+    for (int i = 0, g = 0; i < nMixtures; ++i)
+        for (int j = 0; j < fMixtures[i].compNum; ++j, ++g) {
+            gauss[g] = fMixtures[i].compInd+j;
+            assign[g] = 0;
+        }
+    real* scores = new real[nCodewords];
+
+    // grow the VQ tree by splitting every codeword along its standard
+    // deviation; a Gaussian only moves between the children of its parent
+    updateCodewords(1, nGauss, gauss, assign);
+    for (int k = 1; k < nCodewords; k *= 2) {
+        for (int c = k-1; c >= 0; --c) {
+            real* m = fCWMeans+c*fvecSize4;
+            real* iv = fCWVars+c*fvecSize4;
+            real det = fCWDets[c];
+            for (int s = 1; s >= 0; --s) {
+                real* cm = fCWMeans+(2*c+s)*fvecSize4;
+                real* civ = fCWVars+(2*c+s)*fvecSize4;
+                for (int d = 0; d < vecSize; ++d) {
+                    real sd = sqrt(1.0/iv[d]);
+                    civ[d] = iv[d];
+                    cm[d] = m[d] + (s ? 0.2 : -0.2)*sd;
+                }
+                fCWDets[2*c+s] = det;
+            }
+        }
+        for (int g = 0; g < nGauss; ++g)
+            assign[g] *= 2;
+
+        for (int iter = 0; iter < 4; ++iter) {
+            for (int g = 0; g < nGauss; ++g) {
+                int c = assign[g] & ~1;
+                fKernel(fMeans+gauss[g]*fvecSize4, fCWMeans+c*fvecSize4,
+                        fCWVars+c*fvecSize4, fCWDets+c, 2, fvecSize4, scores);
+                assign[g] = c + (scores[1] > scores[0] ? 1 : 0);
+            }
+            updateCodewords(2*k, nGauss, gauss, assign);
+        }
+    }
+
+    // then a few passes over all codewords to undo bad early splits
+    for (int iter = 0; iter < 2; ++iter) {
+        for (int g = 0; g < nGauss; ++g) {
+            fKernel(fMeans+gauss[g]*fvecSize4, fCWMeans, fCWVars, fCWDets,
+                    nCodewords, fvecSize4, scores);
+            assign[g] = std::max_element(scores, scores+nCodewords) - scores;
+        }
+        updateCodewords(nCodewords, nGauss, gauss, assign);
+    }
+    delete[] scores;
+    delete[] assign;
+    delete[] gauss;
+
+    // Shortlists: the components whose mean is within |threshold| of the
+    // codeword, in squared distance per dimension normalised by the
+    // component variance, and at least the |minComps| closest ones.
+    std::vector<int> offsets;
+    std::vector<unsigned short> comps;
+    real* zeros = new real[fMaxCompNum];
+    real* dist = new real[fMaxCompNum];
+    std::vector< std::pair<real,int> > order;
+    memset(zeros, 0, sizeof(real)*fMaxCompNum);
+    for (int c = 0; c < nCodewords; ++c) {
+        for (int i = 0; i < nMixtures; ++i) {
+            int n = fMixtures[i].compNum;
+            offsets.push_back(comps.size());
+            fKernel(fCWMeans+c*fvecSize4, fMean(i), fVar(i), zeros, n, fvecSize4, dist);
+            order.clear();
+            for (int j = 0; j < n; ++j)
+                order.push_back(std::make_pair(-2*dist[j]/vecSize, j));
+            std::sort(order.begin(), order.end());
+            int j = 0;
+            while ( (j < n) && ((j < minComps) || (order[j].first <= threshold)) )
+                ++j;
+            std::vector<unsigned short> sel;
+            for (int k = 0; k < j; ++k)
+                sel.push_back(order[k].second);
+            std::sort(sel.begin(), sel.end());
+            comps.insert(comps.end(), sel.begin(), sel.end());
+        }
+    }
+    offsets.push_back(comps.size());
+    delete[] dist;
+    delete[] zeros;
+
+    fGSOffsets = new int[offsets.size()];
+    std::copy(offsets.begin(), offsets.end(), fGSOffsets);
+    fGSComps = new unsigned short[comps.size()];
+    std::copy(comps.begin(), comps.end(), fGSComps);
+
+    LogFile::printf("HTKGSModels built %d codewords, shortlists of %.2f of %.2f components per mixture\n",
+                    fnCodewords, (double)comps.size()/((double)nCodewords*nMixtures),
+                    (double)nGauss/nMixtures);
+}
+
+void HTKGSModels::writeIndex( const char *fName )
+{
+    if (fGSOffsets == NULL)
+        error("HTKGSModels::writeIndex - no index");
+
+    FILE *fd;
+    if ( (fd = fopen( fName , "wb" )) == NULL )
+        error("HTKGSModels::writeIndex - error opening %s" , fName ) ;
+
+    char id[5] ;
+    strcpy( id , "JGSI" ) ;
+    fwrite( id , sizeof(int) , 1 , fd ) ;
+
+    int version = GS_VERSION ;
+    int realSize = sizeof(real) ;
+    fwrite( &version , sizeof(int) , 1 , fd ) ;
+    fwrite( &realSize , sizeof(int) , 1 , fd ) ;
+    fwrite( &vecSize , sizeof(int) , 1 , fd ) ;
+    fwrite( &nMixtures , sizeof(int) , 1 , fd ) ;
+    fwrite( &fnCodewords , sizeof(int) , 1 , fd ) ;
+    fwrite( &fGSThreshold , sizeof(real) , 1 , fd ) ;
+    fwrite( &fGSMinComps , sizeof(int) , 1 , fd ) ;
+
+    // codeword means and variances, without padding
+    for ( int c=0 ; c<fnCodewords ; c++ )
+        fwrite( fCWMeans+c*fvecSize4 , sizeof(real) , vecSize , fd ) ;
+    real *var = new real[vecSize] ;
+    for ( int c=0 ; c<fnCodewords ; c++ )
+    {
+        for ( int d=0 ; d<vecSize ; d++ )
+            var[d] = 1.0 / fCWVars[c*fvecSize4+d] ;
+        fwrite( var , sizeof(real) , vecSize , fd ) ;
+    }
+    delete [] var ;
+
+    int nOffsets = fnCodewords*nMixtures + 1 ;
+    fwrite( fGSOffsets , sizeof(int) , nOffsets , fd ) ;
+    fwrite( fGSComps , sizeof(unsigned short) , fGSOffsets[nOffsets-1] , fd ) ;
+
+    fclose( fd ) ;
+}
+
+void HTKGSModels::readIndex( const char *fName )
+{
+    FILE *fd;
+    if ( (fd = fopen( fName , "rb" )) == NULL )
+        error("HTKGSModels::readIndex - error opening %s" , fName ) ;
+
+    char id[5] ;
+    if ( fread( id , sizeof(int) , 1 , fd ) != 1 )
+        error("HTKGSModels::readIndex - error reading ID") ;
+    id[4] = '\0' ;
+    if ( strcmp( id , "JGSI" ) != 0 )
+        error("HTKGSModels::readIndex - invalid ID = %s" , id ) ;
+
+    int version, realSize, vs, nMix, nCodewords ;
+    if ( (fread( &version , sizeof(int) , 1 , fd ) != 1) || (version != GS_VERSION) )
+        error("HTKGSModels::readIndex - unsupported version") ;
+    if ( (fread( &realSize , sizeof(int) , 1 , fd ) != 1) || (realSize != (int)sizeof(real)) )
+        error("HTKGSModels::readIndex - index written with a different real size") ;
+    if ( (fread( &vs , sizeof(int) , 1 , fd ) != 1) || (vs != vecSize) )
+        error("HTKGSModels::readIndex - vecSize does not match the models") ;
+    if ( (fread( &nMix , sizeof(int) , 1 , fd ) != 1) || (nMix != nMixtures) )
+        error("HTKGSModels::readIndex - nMixtures does not match the models") ;
+    if ( (fread( &nCodewords , sizeof(int) , 1 , fd ) != 1) || (nCodewords < 1) )
+        error("HTKGSModels::readIndex - error reading nCodewords") ;
+    if ( fread( &fGSThreshold , sizeof(real) , 1 , fd ) != 1 )
+        error("HTKGSModels::readIndex - error reading threshold") ;
+    if ( fread( &fGSMinComps , sizeof(int) , 1 , fd ) != 1 )
+        error("HTKGSModels::readIndex - error reading minComps") ;
+
+    freeIndex() ;
+    allocCodewords( nCodewords ) ;
+    for ( int c=0 ; c<fnCodewords ; c++ )
+    {
+        if ( fread( fCWMeans+c*fvecSize4 , sizeof(real) , vecSize , fd ) != (size_t)vecSize )
+            error("HTKGSModels::readIndex - error reading codeword means") ;
+    }
+    for ( int c=0 ; c<fnCodewords ; c++ )
+    {
+        real *iv = fCWVars+c*fvecSize4 ;
+        if ( fread( iv , sizeof(real) , vecSize , fd ) != (size_t)vecSize )
+            error("HTKGSModels::readIndex - error reading codeword variances") ;
+        double det = 0.0 ;
+        for ( int d=0 ; d<vecSize ; d++ )
+        {
+            det += log( iv[d] ) ;
+            iv[d] = 1.0 / iv[d] ;
+        }
+        fCWDets[c] = -0.5*det ;
+    }
+
+    int nOffsets = fnCodewords*nMixtures + 1 ;
+    fGSOffsets = new int[nOffsets] ;
+    if ( fread( fGSOffsets , sizeof(int) , nOffsets , fd ) != (size_t)nOffsets )
+        error("HTKGSModels::readIndex - error reading offsets") ;
+    int nComps = fGSOffsets[nOffsets-1] ;
+    fGSComps = new unsigned short[nComps] ;
+    if ( fread( fGSComps , sizeof(unsigned short) , nComps , fd ) != (size_t)nComps )
+        error("HTKGSModels::readIndex - error reading shortlists") ;
+    fclose( fd ) ;
+
+    long nFull = 0 ;
+    for ( int c=0 ; c<fnCodewords ; c++ )
+    {
+        for ( int i=0 ; i<nMixtures ; i++ )
+        {
+            int e = c*nMixtures + i ;
+            if ( (fGSOffsets[e] > fGSOffsets[e+1]) || (fGSOffsets[e+1] > nComps) )
+                error("HTKGSModels::readIndex - invalid offsets") ;
+            for ( int k=fGSOffsets[e] ; k<fGSOffsets[e+1] ; k++ )
+            {
+                if ( fGSComps[k] >= fMixtures[i].compNum )
+                    error("HTKGSModels::readIndex - component out of range") ;
+            }
+            nFull += fMixtures[i].compNum ;
+        }
+    }
+
+    LogFile::printf("HTKGSModels loaded %d codewords from %s, shortlists of %.2f of %.2f components per mixture\n",
+                    fnCodewords, fName, (double)nComps/((double)fnCodewords*nMixtures),
+                    (double)nFull/((double)fnCodewords*nMixtures));
+}
+
+void HTKGSModels::newFrame( int frame , real **input, int nData) {
+    HTKFlatModels::newFrame(frame, input, nData);
+    if (fGSOffsets == NULL)
+        return;
+
+    // find the best codeword of each frame once, for all GMMs
+    int m = min(nData, fnBlock);
+    for (int k = 0; k < m; ++k) {
+        fKernel(fInput+k*fvecSize4, fCWMeans, fCWVars, fCWDets,
+                fnCodewords, fvecSize4, fCWScores);
+        fCodeword[k] = std::max_element(fCWScores, fCWScores+fnCodewords) - fCWScores;
+    }
+}
+
+void HTKGSModels::calcGMMBlockOutput( int gmmInd )
+{
+    if (fGSOffsets == NULL) {
+        HTKFlatModels::calcGMMBlockOutput(gmmInd);
+        return;
+    }
+
+    int m = min(currInputLen, fnBlock);
+    real* cache = fCache+gmmInd*fnBlock;
+    int mixInd = gMMs[gmmInd].mixtureInd;
+    real* means = fMean(mixInd);
+    real* vars = fVar(mixInd);
+    real* dets = fDet(mixInd);
+    // the weights of a shared mixture are not in its dets
+    const real* logWeights = NULL;
+    if (fnShared && fShareInd[mixInd] >= 0)
+        logWeights = fGMMWeights+gmmInd*fMaxCompNum;
+    for (int k = 0; k < m; ++k) {
+        const real* x = fInput+k*fvecSize4;
+        int e = fCodeword[k]*nMixtures + mixInd;
+        int n = fGSOffsets[e+1] - fGSOffsets[e];
+        const unsigned short* comps = fGSComps + fGSOffsets[e];
+        // frames of the block often share their codeword, so the shortlist
+        // is only gathered when it changes
+        if (e != fGSGathered) {
+            for (int i = 0; i < n; ++i) {
+                int j = comps[i];
+                memcpy(fGSMeans+i*fvecSize4, means+j*fvecSize4, sizeof(real)*fvecSize4);
+                memcpy(fGSVars+i*fvecSize4, vars+j*fvecSize4, sizeof(real)*fvecSize4);
+                fGSDets[i] = dets[j];
+            }
+            fGSGathered = e;
+        }
+        fKernel(x, fGSMeans, fGSVars, fGSDets, n, fvecSize4, fCompOutputs);
+        if (logWeights)
+            for (int i = 0; i < n; ++i)
+                fCompOutputs[i] += logWeights[comps[i]];
+        real logProb = logSumKernel(fCompOutputs, n);
+        cache[k] = logProb;
+
+        fnCompsScored += n;
+        fnCompsFull += fMixtures[mixInd].compNum;
+        if (++fnGMMFrames % GS_CHECK_INTERVAL == 0) {
+            real err = calcGMMFrameOutput(gmmInd, k, fCompOutputs) - logProb;
+            fSumAbsErr += fabs(err);
+            if (fabs(err) > fMaxAbsErr)
+                fMaxAbsErr = fabs(err);
+            ++fnChecked;
+        }
+    }
+    fCacheT[gmmInd] = currFrame;
+}
+
+}; // namespace juicer
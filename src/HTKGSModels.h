@@ -0,0 +1,79 @@
+/*
+ * Copyright 2009 by Idiap Research Institute
+ *                   http://www.idiap.ch
+ *
+ * See the file COPYING for the licence associated with this software.
+ */
+
+/*
+ * vi:ts=4:tw=78:shiftwidth=4:expandtab
+ * vim600:fdm=marker
+ *
+ * HTKGSModels.h  -  HTKFlatModels with Gaussian selection: all Gaussians
+ * are clustered into codewords offline, and for each frame only the
+ * components shortlisted for the best codeword are scored.
+ *
+ */
+
+#ifndef _HTKGSMODELS_H
+#define _HTKGSMODELS_H
+
+#include "HTKFlatModels.h"
+
+namespace Juicer
+{
+    class HTKGSModels : public HTKFlatModels {
+    public:
+        HTKGSModels();
+        virtual ~HTKGSModels();
+        virtual void init();
+        void newFrame( int frame , real **input, int nFrame);
+
+        // the side file read by init(), usually the MMF name + ".gs"
+        void setIndexFName( const char *fName );
+
+        /**
+         * Build the index: a VQ tree of nCodewords (a power of 2) over
+         * the Gaussians, then for each codeword and mixture the
+         * components whose normalised distance to the codeword is below
+         * threshold, but at least minComps of them.
+         */
+        void buildIndex( int nCodewords , real threshold , int minComps );
+        void readIndex( const char *fName );
+        void writeIndex( const char *fName );
+
+    protected:
+        char* fGSFName;
+        int fnCodewords;
+        real fGSThreshold;
+        int fGSMinComps;
+        real* fCWMeans;          // codeword means, fvecSize4 each
+        real* fCWVars;           // codeword inverse variances
+        real* fCWDets;           // -0.5*sum log(var) of each codeword
+        real* fCWScores;         // scratch, fnCodewords
+        int* fGSOffsets;         // shortlist of [codeword*nMixtures+mixture]
+        unsigned short* fGSComps;
+        int* fCodeword;          // best codeword of each frame of the block
+        real* fGSMeans;          // the shortlist fGSGathered, gathered to be
+        real* fGSVars;           // scored in one kernel call
+        real* fGSDets;
+        int fGSGathered;         // codeword*nMixtures+mixture, -1 for none
+
+        // statistics for the speed/accuracy report
+        long fnGMMFrames;
+        long fnCompsScored;
+        long fnCompsFull;
+        long fnChecked;
+        double fSumAbsErr;
+        real fMaxAbsErr;
+
+        void calcGMMBlockOutput( int gmmInd );
+        void allocCodewords( int nCodewords );
+        void updateCodewords(
+            int nCodewords , int nGauss , const int *gauss , const int *assign
+        );
+        void freeIndex();
+    };
+
+}; // namespace juicer
+#endif /* ifndef _HTKGSMODELS_H */
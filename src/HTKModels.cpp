@@ -69,6 +69,10 @@ HTKModels::HTKModels()
    inFD = NULL ;
    fromBinFile = false ;
 
+   logSumType = LOGSUM_EXACT ;
+   logSumKernel = getLogSumKernel( GAUSS_KERNEL_AUTO , logSumType ) ;
+   logSumBuffer = NULL ;
+   logSumBufferSize = 0 ;
 }
 
 
@@ -391,6 +395,14 @@ HTKModels::~HTKModels()
    }
    // free trP and SEIndexes
     delete[] transBuffer;
+   delete [] logSumBuffer ;
+}
+
+
+void HTKModels::setLogSum( LogSumType type )
+{
+   logSumType = type ;
+   logSumKernel = getLogSumKernel( GAUSS_KERNEL_AUTO , logSumType ) ;
 }
 
 
@@ -2139,14 +2151,17 @@ real HTKModels::calcMixtureOutput( int mixInd , const real *logCompWeights )
       mix->currCompOutputsValid = true ;
    }
 
-   // weight the mixture output and add to the output value.
-   real logProb = LOG_ZERO ;
-   for ( i=0 ; i<mix->nComps ; i++ )
+   // weight the mixture output and sum them in one log-sum-exp
+   if ( mix->nComps > logSumBufferSize )
    {
-      logProb = logAdd( logProb , mix->currCompOutputs[i] + logCompWeights[i] ) ;
+      delete [] logSumBuffer ;
+      logSumBufferSize = mix->nComps ;
+      logSumBuffer = new real[logSumBufferSize] ;
    }
+   for ( i=0 ; i<mix->nComps ; i++ )
+      logSumBuffer[i] = mix->currCompOutputs[i] + logCompWeights[i] ;
 
-	return logProb ;
+	return logSumKernel( logSumBuffer , mix->nComps ) ;
 }
 
 
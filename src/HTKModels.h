@@ -13,6 +13,7 @@
 #define HTKMODELS_INC
 
 #include "Models.h"
+#include "GaussianKernels.h"
 
 /*
   Author:	Darren Moore (moore@idiap.ch)
@@ -100,11 +101,13 @@ namespace Juicer
         void setBlockSize(int bs);
         real calcOutput( int hmmInd , int stateInd ) ;
         real calcOutput( int gmmInd ) ;
+        void setLogSum( LogSumType type ) ;
 
         int getNumHMMs() { return nHMMs ; } ;
         int getCurrFrame() { return currFrame ; } ;
         const char* getHMMName( int hmmInd ) { return hMMs[hmmInd].name ; } ;
         int getInputVecSize() { return vecSize ; } ;
+        int getGMMIndex( int hmmInd , int stateInd ) { return hMMs[hmmInd].gmmInds[stateInd] ; } ;
 
         int getNumStates(int hmmInd) { return hMMs[hmmInd].nStates; }
         int getNumSuccessors(int hmmInd, int stateInd)
@@ -170,6 +173,11 @@ namespace Juicer
         bool           hybridMode ;
         real           *logPriors ;
 
+        LogSumType     logSumType ;
+        LogSumKernel   logSumKernel ;
+        real           *logSumBuffer ;   // weighted component outputs
+        int            logSumBufferSize ;
+
         void initFromHTKParseResult() ;
 
         void createTrPandSEIndex();
@@ -48,6 +48,27 @@ namespace Juicer
         virtual real calcOutput( int hmmInd , int stateInd ) = 0 ;
         virtual real calcOutput( int gmmInd ) = 0 ;
 
+        // Early rejection: as calcOutput(), but a model with a cheap upper
+        // bound on its GMMs may return LOG_ZERO instead of scoring one
+        // whose bound is below minOutput, the lowest output that keeps the
+        // decoder's token within its beam.  LOG_ZERO never rejects.
+        virtual real calcBoundedOutput(
+            int hmmInd , int stateInd , real minOutput
+        ) { return calcOutput( hmmInd , stateInd ); }
+        virtual real calcBoundedOutput( int gmmInd , real minOutput )
+        { return calcOutput( gmmInd ); }
+
+        // Batched scoring: a decoder passes the GMMs it is going to ask
+        // for in the current frame so they can be scored together; the
+        // scores are then read back with calcOutput() as usual.
+        virtual bool batchOutput() { return false; }
+        virtual void calcOutputs( int nGMMInds , const int *gmmInds ) {}
+        virtual int getGMMIndex( int hmmInd , int stateInd ) { return -1; }
+
+        // true when all GMMs were scored for the current frame rather than
+        // on demand, for the decoder statistics
+        virtual bool denseOutput() { return false; }
+
         virtual int getNumHMMs() = 0 ;
         virtual int getCurrFrame() = 0 ;
         virtual const char* getHMMName( int hmmInd ) = 0 ;
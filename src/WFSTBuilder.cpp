@@ -0,0 +1,1018 @@
+/*
+ * Copyright 2009 by Idiap Research Institute
+ *                   http://www.idiap.ch
+ *
+ * See the file COPYING for the licence associated with this software.
+ */
+
+#include <math.h>
+#include <string.h>
+#include <map>
+#include <deque>
+#include <algorithm>
+#include <pthread.h>
+
+#include "WFSTBuilder.h"
+#include "LogFile.h"
+
+using namespace Torch ;
+
+namespace Juicer {
+
+
+const double WFSTBuildFSM::WFST_BUILD_ZERO = HUGE_VAL ;
+
+// Weights within this of each other are the same to determinize() and
+// minimize(), as the kDelta of the FSM toolkits
+static const double WFST_BUILD_DELTA = 1.0 / 1024.0 ;
+
+// Convergence of distanceToFinal(), and the number of relaxations per arc
+// after which it gives up
+static const double WFST_BUILD_SD_DELTA = 1.0e-6 ;
+static const long WFST_BUILD_SD_MAX_RELAX = 1000 ;
+
+
+static long long quantizeWeight( double weight )
+{
+   if ( weight >= WFSTBuildFSM::WFST_BUILD_ZERO )
+      return 0x7fffffffffffffffLL ;
+   return (long long)floor( weight / WFST_BUILD_DELTA + 0.5 ) ;
+}
+
+
+static bool arcLessByIn( const WFSTBuildFSM::Arc &a1 , const WFSTBuildFSM::Arc &a2 )
+{
+   if ( a1.in != a2.in )
+      return a1.in < a2.in ;
+   return a1.out < a2.out ;
+}
+
+
+static bool arcLessByOut( const WFSTBuildFSM::Arc &a1 , const WFSTBuildFSM::Arc &a2 )
+{
+   if ( a1.out != a2.out )
+      return a1.out < a2.out ;
+   return a1.in < a2.in ;
+}
+
+
+static bool arcInLess( const WFSTBuildFSM::Arc &arc , int in )
+{
+   return arc.in < in ;
+}
+
+
+WFSTBuildFSM::WFSTBuildFSM()
+{
+   initState = -1 ;
+}
+
+
+WFSTBuildFSM::~WFSTBuildFSM()
+{
+}
+
+
+void WFSTBuildFSM::clear()
+{
+   arcs.clear() ;
+   finals.clear() ;
+   initState = -1 ;
+}
+
+
+double WFSTBuildFSM::plus( double w1 , double w2 )
+{
+   if ( w1 >= WFST_BUILD_ZERO )
+      return w2 ;
+   if ( w2 >= WFST_BUILD_ZERO )
+      return w1 ;
+   if ( w1 > w2 )
+      return w2 - log1p( exp( w2 - w1 ) ) ;
+   return w1 - log1p( exp( w1 - w2 ) ) ;
+}
+
+
+void WFSTBuildFSM::readFSM( const char *fsmFName )
+{
+   FILE *fd ;
+   if ( (fd = fopen( fsmFName , "r" )) == NULL )
+      error("WFSTBuildFSM::readFSM - error opening %s" , fsmFName ) ;
+
+   clear() ;
+   char line[1000] ;
+   char *fields[6] ;
+   char *save ;
+   int lineNum=0 ;
+   while ( fgets( line , 1000 , fd ) != NULL )
+   {
+      lineNum++ ;
+      int nFields = 0 ;
+      char *field = strtok_r( line , " \t\r\n" , &save ) ;
+      while ( (field != NULL) && (nFields < 6) )
+      {
+         fields[nFields++] = field ;
+         field = strtok_r( NULL , " \t\r\n" , &save ) ;
+      }
+      if ( nFields == 0 )
+         continue ;
+
+      if ( (nFields == 3) || (nFields > 5) )
+         error("WFSTBuildFSM::readFSM - bad line %d in %s" , lineNum , fsmFName ) ;
+
+      int from = atoi( fields[0] ) ;
+      int to = (nFields >= 4) ? atoi( fields[1] ) : from ;
+      if ( (from < 0) || (to < 0) )
+         error("WFSTBuildFSM::readFSM - bad state on line %d in %s" , lineNum , fsmFName ) ;
+      while ( (getNumStates() <= from) || (getNumStates() <= to) )
+         addState() ;
+
+      if ( nFields >= 4 )
+      {
+         if ( initState < 0 )
+            initState = from ;
+         addArc( from , to , atoi( fields[2] ) , atoi( fields[3] ) ,
+                 (nFields == 5) ? atof( fields[4] ) : 0.0 ) ;
+      }
+      else
+         setFinal( from , (nFields == 2) ? atof( fields[1] ) : 0.0 ) ;
+   }
+   fclose( fd ) ;
+
+   if ( initState < 0 )
+      error("WFSTBuildFSM::readFSM - no transitions in %s" , fsmFName ) ;
+}
+
+
+void WFSTBuildFSM::writeFSM( const char *fsmFName )
+{
+   FILE *fd ;
+   if ( (fd = fopen( fsmFName , "w" )) == NULL )
+      error("WFSTBuildFSM::writeFSM - error opening %s" , fsmFName ) ;
+   if ( initState < 0 )
+      error("WFSTBuildFSM::writeFSM - %s would be empty" , fsmFName ) ;
+
+   // The first transition has to leave the initial state
+   int nStates = getNumStates() ;
+   for ( int i=-1 ; i<nStates ; i++ )
+   {
+      int state = (i < 0) ? initState : i ;
+      if ( (i >= 0) && (state == initState) )
+         continue ;
+      for ( unsigned a=0 ; a<arcs[state].size() ; a++ )
+      {
+         const Arc &arc = arcs[state][a] ;
+         writeFSMTransition( fd , state , arc.to , arc.in , arc.out , (real)arc.weight ) ;
+      }
+   }
+   for ( int i=0 ; i<nStates ; i++ )
+   {
+      if ( isFinal( i ) )
+         writeFSMFinalState( fd , i , (real)finals[i] ) ;
+   }
+   fclose( fd ) ;
+}
+
+
+int WFSTBuildFSM::addState()
+{
+   arcs.push_back( vector<Arc>() ) ;
+   finals.push_back( WFST_BUILD_ZERO ) ;
+   return getNumStates() - 1 ;
+}
+
+
+void WFSTBuildFSM::addArc( int from , int to , int in , int out , double weight )
+{
+   if ( (from < 0) || (from >= getNumStates()) || (to < 0) || (to >= getNumStates()) )
+      error("WFSTBuildFSM::addArc - state out of range") ;
+
+   Arc arc ;
+   arc.to = to ;
+   arc.in = in ;
+   arc.out = out ;
+   arc.weight = weight ;
+   arcs[from].push_back( arc ) ;
+}
+
+
+void WFSTBuildFSM::setFinal( int state , double weight )
+{
+   if ( (state < 0) || (state >= getNumStates()) )
+      error("WFSTBuildFSM::setFinal - state out of range") ;
+   finals[state] = weight ;
+}
+
+
+int WFSTBuildFSM::getNumArcs() const
+{
+   int nArcs = 0 ;
+   for ( unsigned i=0 ; i<arcs.size() ; i++ )
+      nArcs += arcs[i].size() ;
+   return nArcs ;
+}
+
+
+void WFSTBuildFSM::arcSort( bool byInput )
+{
+   for ( unsigned i=0 ; i<arcs.size() ; i++ )
+      stable_sort( arcs[i].begin() , arcs[i].end() , byInput ? arcLessByIn : arcLessByOut ) ;
+}
+
+
+void WFSTBuildFSM::invert()
+{
+   for ( unsigned i=0 ; i<arcs.size() ; i++ )
+   {
+      for ( unsigned a=0 ; a<arcs[i].size() ; a++ )
+         swap( arcs[i][a].in , arcs[i][a].out ) ;
+   }
+}
+
+
+void WFSTBuildFSM::connect()
+{
+   int nStates = getNumStates() ;
+   if ( initState < 0 )
+   {
+      clear() ;
+      return ;
+   }
+
+   // Accessible states
+   vector<bool> access( nStates , false ) ;
+   vector<int> stack ;
+   access[initState] = true ;
+   stack.push_back( initState ) ;
+   while ( ! stack.empty() )
+   {
+      int state = stack.back() ;
+      stack.pop_back() ;
+      for ( unsigned a=0 ; a<arcs[state].size() ; a++ )
+      {
+         int to = arcs[state][a].to ;
+         if ( ! access[to] )
+         {
+            access[to] = true ;
+            stack.push_back( to ) ;
+         }
+      }
+   }
+
+   // Coaccessible states, backwards from the final states
+   vector< vector<int> > from( nStates ) ;
+   for ( int i=0 ; i<nStates ; i++ )
+   {
+      if ( ! access[i] )
+         continue ;
+      for ( unsigned a=0 ; a<arcs[i].size() ; a++ )
+         from[arcs[i][a].to].push_back( i ) ;
+   }
+   vector<bool> coaccess( nStates , false ) ;
+   for ( int i=0 ; i<nStates ; i++ )
+   {
+      if ( access[i] && isFinal( i ) )
+      {
+         coaccess[i] = true ;
+         stack.push_back( i ) ;
+      }
+   }
+   while ( ! stack.empty() )
+   {
+      int state = stack.back() ;
+      stack.pop_back() ;
+      for ( unsigned f=0 ; f<from[state].size() ; f++ )
+      {
+         if ( ! coaccess[from[state][f]] )
+         {
+            coaccess[from[state][f]] = true ;
+            stack.push_back( from[state][f] ) ;
+         }
+      }
+   }
+
+   if ( ! coaccess[initState] )
+   {
+      clear() ;
+      return ;
+   }
+
+   vector<int> newIndex( nStates , -1 ) ;
+   int nNew = 0 ;
+   for ( int i=0 ; i<nStates ; i++ )
+   {
+      if ( coaccess[i] )
+         newIndex[i] = nNew++ ;
+   }
+   for ( int i=0 ; i<nStates ; i++ )
+   {
+      if ( newIndex[i] < 0 )
+         continue ;
+      vector<Arc> kept ;
+      for ( unsigned a=0 ; a<arcs[i].size() ; a++ )
+      {
+         if ( newIndex[arcs[i][a].to] >= 0 )
+         {
+            kept.push_back( arcs[i][a] ) ;
+            kept.back().to = newIndex[arcs[i][a].to] ;
+         }
+      }
+      arcs[newIndex[i]].swap( kept ) ;
+      finals[newIndex[i]] = finals[i] ;
+   }
+   arcs.resize( nNew ) ;
+   finals.resize( nNew ) ;
+   initState = newIndex[initState] ;
+}
+
+
+void WFSTBuildFSM::closure()
+{
+   if ( initState < 0 )
+   {
+      // The closure of the empty language is the empty string
+      initState = addState() ;
+      setFinal( initState , 0.0 ) ;
+      return ;
+   }
+
+   int oldInit = initState ;
+   int nStates = getNumStates() ;
+   for ( int i=0 ; i<nStates ; i++ )
+   {
+      if ( isFinal( i ) )
+         addArc( i , oldInit , WFST_EPSILON , WFST_EPSILON , finals[i] ) ;
+   }
+   initState = addState() ;
+   setFinal( initState , 0.0 ) ;
+   addArc( initState , oldInit , WFST_EPSILON , WFST_EPSILON , 0.0 ) ;
+}
+
+
+void WFSTBuildFSM::epsilonInputs( const vector<bool> &isEpsilon )
+{
+   for ( unsigned i=0 ; i<arcs.size() ; i++ )
+   {
+      for ( unsigned a=0 ; a<arcs[i].size() ; a++ )
+      {
+         int in = arcs[i][a].in ;
+         if ( (in >= 0) && (in < (int)isEpsilon.size()) && isEpsilon[in] )
+            arcs[i][a].in = WFST_EPSILON ;
+      }
+   }
+}
+
+
+// Open addressing from a 64 bit key to a state index, for the state tuples
+// of compose()
+class WFSTBuildKeyIndex
+{
+public:
+   WFSTBuildKeyIndex() : keys( 1024 ) , values( 1024 , -1 ) , nUsed( 0 ) {} ;
+
+   // The index of key, or the value given if it was not there
+   int insert( unsigned long long key , int value )
+   {
+      if ( 2 * (nUsed + 1) > keys.size() )
+         grow() ;
+      size_t i = slot( key ) ;
+      if ( values[i] >= 0 )
+         return values[i] ;
+      keys[i] = key ;
+      values[i] = value ;
+      nUsed++ ;
+      return value ;
+   } ;
+
+private:
+   vector<unsigned long long>    keys ;
+   vector<int>                   values ;
+   size_t                        nUsed ;
+
+   size_t slot( unsigned long long key ) const
+   {
+      size_t mask = keys.size() - 1 ;
+      size_t i = (size_t)((key * 0x9e3779b97f4a7c15ULL) >> 20) & mask ;
+      while ( (values[i] >= 0) && (keys[i] != key) )
+         i = (i + 1) & mask ;
+      return i ;
+   } ;
+
+   void grow()
+   {
+      vector<unsigned long long> oldKeys( keys.size() * 2 ) ;
+      vector<int> oldValues( values.size() * 2 , -1 ) ;
+      oldKeys.swap( keys ) ;
+      oldValues.swap( values ) ;
+      for ( size_t i=0 ; i<oldKeys.size() ; i++ )
+      {
+         if ( oldValues[i] >= 0 )
+         {
+            size_t j = slot( oldKeys[i] ) ;
+            keys[j] = oldKeys[i] ;
+            values[j] = oldValues[i] ;
+         }
+      }
+   } ;
+};
+
+
+// A state of a composition: the states of both operands and of the
+// epsilon filter
+struct WFSTComposeTuple
+{
+   int   a ;
+   int   b ;
+   int   filter ;
+};
+
+
+static int composeState(
+      WFSTBuildFSM *c , WFSTBuildKeyIndex *index , vector<WFSTComposeTuple> *tuples ,
+      int nStatesB , int a , int b , int filter )
+{
+   unsigned long long key =
+      ((unsigned long long)a * nStatesB + b) * 3 + filter ;
+   int state = index->insert( key , c->getNumStates() ) ;
+   if ( state == c->getNumStates() )
+   {
+      WFSTComposeTuple tuple ;
+      tuple.a = a ;
+      tuple.b = b ;
+      tuple.filter = filter ;
+      tuples->push_back( tuple ) ;
+      c->addState() ;
+   }
+   return state ;
+}
+
+
+// Composition with the epsilon filter of Mohri, Pereira and Riley, so that
+// a path with epsilons on both sides is only taken one way.  Filter state 0
+// follows a real match (or both epsilons), 1 an epsilon output of a alone
+// and 2 an epsilon input of b alone; 1 cannot be followed by 2 and vice
+// versa.
+void WFSTBuildFSM::compose(
+      const WFSTBuildFSM *a , const WFSTBuildFSM *b , WFSTBuildFSM *c )
+{
+   c->clear() ;
+   if ( (a->initState < 0) || (b->initState < 0) )
+      return ;
+
+   // b indexed by input label
+   vector< vector<Arc> > bArcs( b->arcs ) ;
+   for ( unsigned i=0 ; i<bArcs.size() ; i++ )
+      stable_sort( bArcs[i].begin() , bArcs[i].end() , arcLessByIn ) ;
+
+   int nStatesB = b->getNumStates() ;
+   WFSTBuildKeyIndex index ;
+   vector<WFSTComposeTuple> tuples ;
+   c->initState = composeState( c , &index , &tuples , nStatesB , a->initState , b->initState , 0 ) ;
+
+   for ( int s=0 ; s<(int)tuples.size() ; s++ )
+   {
+      WFSTComposeTuple tuple = tuples[s] ;
+      const vector<Arc> &arcsA = a->arcs[tuple.a] ;
+      const vector<Arc> &arcsB = bArcs[tuple.b] ;
+
+      if ( a->isFinal( tuple.a ) && b->isFinal( tuple.b ) )
+         c->finals[s] = a->finals[tuple.a] + b->finals[tuple.b] ;
+
+      for ( unsigned i=0 ; i<arcsA.size() ; i++ )
+      {
+         const Arc &arcA = arcsA[i] ;
+         if ( arcA.out == WFST_EPSILON )
+         {
+            // a moves alone
+            if ( tuple.filter != 2 )
+            {
+               int to = composeState( c , &index , &tuples , nStatesB , arcA.to , tuple.b , 1 ) ;
+               c->addArc( s , to , arcA.in , WFST_EPSILON , arcA.weight ) ;
+            }
+            // Both epsilons together
+            if ( tuple.filter != 0 )
+               continue ;
+         }
+
+         vector<Arc>::const_iterator arcB =
+            lower_bound( arcsB.begin() , arcsB.end() , arcA.out , arcInLess ) ;
+         for ( ; (arcB != arcsB.end()) && (arcB->in == arcA.out) ; ++arcB )
+         {
+            int to = composeState( c , &index , &tuples , nStatesB , arcA.to , arcB->to , 0 ) ;
+            c->addArc( s , to , arcA.in , arcB->out , arcA.weight + arcB->weight ) ;
+         }
+      }
+
+      // b moves alone
+      if ( tuple.filter != 1 )
+      {
+         for ( unsigned i=0 ; (i < arcsB.size()) && (arcsB[i].in == WFST_EPSILON) ; i++ )
+         {
+            int to = composeState( c , &index , &tuples , nStatesB , tuple.a , arcsB[i].to , 2 ) ;
+            c->addArc( s , to , WFST_EPSILON , arcsB[i].out , arcsB[i].weight ) ;
+         }
+      }
+   }
+
+   c->connect() ;
+}
+
+
+// An element of a determinized state: a state, the weight still to be
+// applied on leaving it and the output labels still to be emitted
+struct WFSTDetElement
+{
+   int            state ;
+   double         weight ;
+   vector<int>    residual ;
+};
+
+
+// A transition of a determinized state before the transitions with the same
+// input label are merged
+struct WFSTDetCandidate
+{
+   int            in ;
+   int            to ;
+   double         weight ;
+   vector<int>    residual ;
+};
+
+
+static bool detCandidateLess( const WFSTDetCandidate &c1 , const WFSTDetCandidate &c2 )
+{
+   return c1.in < c2.in ;
+}
+
+
+static bool detElementLess( const WFSTDetElement &e1 , const WFSTDetElement &e2 )
+{
+   if ( e1.state != e2.state )
+      return e1.state < e2.state ;
+   return e1.residual < e2.residual ;
+}
+
+
+void WFSTBuildFSM::determinize( int maxStates )
+{
+   if ( initState < 0 )
+      return ;
+
+   WFSTBuildFSM det ;
+   vector< vector<WFSTDetElement> > subsets ;
+   vector<int> detStates ;
+   map< vector<long long> , int > subsetIndex ;
+
+   WFSTDetElement initElem ;
+   initElem.state = initState ;
+   initElem.weight = 0.0 ;
+   subsets.push_back( vector<WFSTDetElement>( 1 , initElem ) ) ;
+   detStates.push_back( det.addState() ) ;
+   det.initState = detStates[0] ;
+   vector<long long> key ;
+   key.push_back( initState ) ;
+   key.push_back( 0 ) ;
+   key.push_back( 0 ) ;
+   subsetIndex[key] = 0 ;
+
+   vector<WFSTDetCandidate> cands ;
+   vector<WFSTDetElement> next ;
+   for ( int s=0 ; s<(int)subsets.size() ; s++ )
+   {
+      // Elements are only needed once, the index keeps the key
+      vector<WFSTDetElement> subset ;
+      subset.swap( subsets[s] ) ;
+      int from = detStates[s] ;
+
+      // Final weight, and output labels still to emit after it
+      double finalWeight = WFST_BUILD_ZERO ;
+      const vector<int> *finalResidual = NULL ;
+      for ( unsigned e=0 ; e<subset.size() ; e++ )
+      {
+         if ( ! isFinal( subset[e].state ) )
+            continue ;
+         if ( finalResidual == NULL )
+            finalResidual = &subset[e].residual ;
+         else if ( *finalResidual != subset[e].residual )
+            error("WFSTBuildFSM::determinize - transducer is not functional") ;
+         finalWeight = plus( finalWeight , subset[e].weight + finals[subset[e].state] ) ;
+      }
+      if ( finalResidual != NULL )
+      {
+         int state = from ;
+         double weight = finalWeight ;
+         for ( unsigned l=0 ; l<finalResidual->size() ; l++ )
+         {
+            int to = det.addState() ;
+            det.addArc( state , to , WFST_EPSILON , (*finalResidual)[l] , weight ) ;
+            state = to ;
+            weight = 0.0 ;
+         }
+         det.setFinal( state , weight ) ;
+      }
+
+      cands.clear() ;
+      for ( unsigned e=0 ; e<subset.size() ; e++ )
+      {
+         const vector<Arc> &stateArcs = arcs[subset[e].state] ;
+         for ( unsigned a=0 ; a<stateArcs.size() ; a++ )
+         {
+            cands.push_back( WFSTDetCandidate() ) ;
+            WFSTDetCandidate &cand = cands.back() ;
+            cand.in = stateArcs[a].in ;
+            cand.to = stateArcs[a].to ;
+            cand.weight = subset[e].weight + stateArcs[a].weight ;
+            cand.residual = subset[e].residual ;
+            if ( stateArcs[a].out != WFST_EPSILON )
+               cand.residual.push_back( stateArcs[a].out ) ;
+         }
+      }
+      stable_sort( cands.begin() , cands.end() , detCandidateLess ) ;
+
+      for ( unsigned c0=0 , c1 ; c0<cands.size() ; c0=c1 )
+      {
+         // The weight of the new transition is the sum over the candidates,
+         // its output the first label they all have to emit
+         double weight = WFST_BUILD_ZERO ;
+         int out = cands[c0].residual.empty() ? WFST_EPSILON : cands[c0].residual[0] ;
+         for ( c1=c0 ; (c1 < cands.size()) && (cands[c1].in == cands[c0].in) ; c1++ )
+         {
+            weight = plus( weight , cands[c1].weight ) ;
+            if ( cands[c1].residual.empty() || (cands[c1].residual[0] != out) )
+               out = WFST_EPSILON ;
+         }
+
+         next.clear() ;
+         for ( unsigned c=c0 ; c<c1 ; c++ )
+         {
+            next.push_back( WFSTDetElement() ) ;
+            WFSTDetElement &elem = next.back() ;
+            elem.state = cands[c].to ;
+            elem.weight = cands[c].weight - weight ;
+            if ( out == WFST_EPSILON )
+               elem.residual.swap( cands[c].residual ) ;
+            else
+               elem.residual.assign( cands[c].residual.begin()+1 , cands[c].residual.end() ) ;
+         }
+         sort( next.begin() , next.end() , detElementLess ) ;
+         unsigned nNext = 0 ;
+         for ( unsigned e=0 ; e<next.size() ; e++ )
+         {
+            if ( (nNext > 0) && (next[nNext-1].state == next[e].state) &&
+                 (next[nNext-1].residual == next[e].residual) )
+               next[nNext-1].weight = plus( next[nNext-1].weight , next[e].weight ) ;
+            else if ( nNext++ != e )
+            {
+               next[nNext-1].state = next[e].state ;
+               next[nNext-1].weight = next[e].weight ;
+               next[nNext-1].residual.swap( next[e].residual ) ;
+            }
+         }
+         next.resize( nNext ) ;
+
+         key.clear() ;
+         for ( unsigned e=0 ; e<next.size() ; e++ )
+         {
+            key.push_back( next[e].state ) ;
+            key.push_back( quantizeWeight( next[e].weight ) ) ;
+            key.push_back( next[e].residual.size() ) ;
+            key.insert( key.end() , next[e].residual.begin() , next[e].residual.end() ) ;
+         }
+         map< vector<long long> , int >::iterator found = subsetIndex.find( key ) ;
+         int to ;
+         if ( found != subsetIndex.end() )
+            to = detStates[found->second] ;
+         else
+         {
+            if ( (maxStates > 0) && ((int)subsets.size() >= maxStates) )
+               error("WFSTBuildFSM::determinize - more than %d states, "
+                     "the transducer may not be determinizable" , maxStates ) ;
+            subsetIndex[key] = subsets.size() ;
+            subsets.push_back( next ) ;
+            to = det.addState() ;
+            detStates.push_back( to ) ;
+         }
+         det.addArc( from , to , cands[c0].in , out , weight ) ;
+      }
+   }
+
+   arcs.swap( det.arcs ) ;
+   finals.swap( det.finals ) ;
+   initState = det.initState ;
+}
+
+
+// Generic single source shortest distance in the log semiring (Mohri),
+// from the final states over the reversed transducer
+void WFSTBuildFSM::distanceToFinal( vector<double> *dist )
+{
+   int nStates = getNumStates() ;
+   dist->assign( nStates , WFST_BUILD_ZERO ) ;
+
+   vector< vector< pair<int,double> > > from( nStates ) ;
+   long nArcs = 0 ;
+   for ( int i=0 ; i<nStates ; i++ )
+   {
+      for ( unsigned a=0 ; a<arcs[i].size() ; a++ )
+         from[arcs[i][a].to].push_back( make_pair( i , arcs[i][a].weight ) ) ;
+      nArcs += arcs[i].size() ;
+   }
+
+   vector<double> residual( nStates , WFST_BUILD_ZERO ) ;
+   vector<bool> queued( nStates , false ) ;
+   deque<int> queue ;
+   for ( int i=0 ; i<nStates ; i++ )
+   {
+      if ( isFinal( i ) )
+      {
+         (*dist)[i] = finals[i] ;
+         residual[i] = finals[i] ;
+         queued[i] = true ;
+         queue.push_back( i ) ;
+      }
+   }
+
+   long maxRelax = WFST_BUILD_SD_MAX_RELAX * (nArcs + nStates) ;
+   long nRelax = 0 ;
+   while ( ! queue.empty() )
+   {
+      int state = queue.front() ;
+      queue.pop_front() ;
+      queued[state] = false ;
+      double r = residual[state] ;
+      residual[state] = WFST_BUILD_ZERO ;
+
+      for ( unsigned f=0 ; f<from[state].size() ; f++ )
+      {
+         int prev = from[state][f].first ;
+         double w = r + from[state][f].second ;
+         double d = plus( (*dist)[prev] , w ) ;
+         if ( ((*dist)[prev] >= WFST_BUILD_ZERO) || ((*dist)[prev] - d > WFST_BUILD_SD_DELTA) )
+         {
+            (*dist)[prev] = d ;
+            residual[prev] = plus( residual[prev] , w ) ;
+            if ( ! queued[prev] )
+            {
+               queued[prev] = true ;
+               queue.push_back( prev ) ;
+            }
+         }
+         if ( ++nRelax > maxRelax )
+            error("WFSTBuildFSM::distanceToFinal - no convergence, cycles of "
+                  "probability one or more? (an insertion penalty may help)") ;
+      }
+   }
+}
+
+
+void WFSTBuildFSM::pushWeights()
+{
+   if ( initState < 0 )
+      return ;
+
+   vector<double> dist ;
+   distanceToFinal( &dist ) ;
+   double total = dist[initState] ;
+   if ( total >= WFST_BUILD_ZERO )
+      return ;
+
+   bool initReentered = false ;
+   int nStates = getNumStates() ;
+   for ( int i=0 ; i<nStates ; i++ )
+   {
+      if ( dist[i] >= WFST_BUILD_ZERO )
+         continue ;
+      for ( unsigned a=0 ; a<arcs[i].size() ; a++ )
+      {
+         Arc &arc = arcs[i][a] ;
+         if ( dist[arc.to] < WFST_BUILD_ZERO )
+            arc.weight += dist[arc.to] - dist[i] ;
+         if ( arc.to == initState )
+            initReentered = true ;
+      }
+      if ( isFinal( i ) )
+         finals[i] -= dist[i] ;
+   }
+
+   // Put the total weight back at the start of every path, through a new
+   // initial state if the old one can be reentered
+   if ( initReentered )
+   {
+      int oldInit = initState ;
+      initState = addState() ;
+      addArc( initState , oldInit , WFST_EPSILON , WFST_EPSILON , total ) ;
+   }
+   else
+   {
+      for ( unsigned a=0 ; a<arcs[initState].size() ; a++ )
+         arcs[initState][a].weight += total ;
+      if ( isFinal( initState ) )
+         finals[initState] += total ;
+   }
+}
+
+
+// Moore partition refinement over the pushed transducer, transitions
+// matching on both labels, the weight and the class of their destination
+void WFSTBuildFSM::minimize()
+{
+   connect() ;
+   if ( initState < 0 )
+      return ;
+
+   // There is nothing to push in an unweighted transducer such as C, whose
+   // cycles would not converge anyway
+   bool weighted = false ;
+   for ( int i=0 ; (i < getNumStates()) && !weighted ; i++ )
+   {
+      weighted = isFinal( i ) && (finals[i] != 0.0) ;
+      for ( unsigned a=0 ; a<arcs[i].size() ; a++ )
+         weighted = weighted || (arcs[i][a].weight != 0.0) ;
+   }
+   if ( weighted )
+      pushWeights() ;
+
+   int nStates = getNumStates() ;
+   vector<int> classes( nStates ) ;
+   int nClasses ;
+   {
+      map<long long,int> finalIndex ;
+      for ( int i=0 ; i<nStates ; i++ )
+      {
+         long long key = quantizeWeight( finals[i] ) ;
+         map<long long,int>::iterator found = finalIndex.find( key ) ;
+         if ( found == finalIndex.end() )
+            found = finalIndex.insert( make_pair( key , (int)finalIndex.size() ) ).first ;
+         classes[i] = found->second ;
+      }
+      nClasses = finalIndex.size() ;
+   }
+
+   vector<int> newClasses( nStates ) ;
+   vector<long long> sig ;
+   vector< vector<long long> > arcSigs ;
+   while ( true )
+   {
+      map< vector<long long> , int > sigIndex ;
+      for ( int i=0 ; i<nStates ; i++ )
+      {
+         arcSigs.resize( arcs[i].size() ) ;
+         for ( unsigned a=0 ; a<arcs[i].size() ; a++ )
+         {
+            arcSigs[a].resize( 4 ) ;
+            arcSigs[a][0] = arcs[i][a].in ;
+            arcSigs[a][1] = arcs[i][a].out ;
+            arcSigs[a][2] = quantizeWeight( arcs[i][a].weight ) ;
+            arcSigs[a][3] = classes[arcs[i][a].to] ;
+         }
+         sort( arcSigs.begin() , arcSigs.end() ) ;
+
+         sig.clear() ;
+         sig.push_back( classes[i] ) ;
+         for ( unsigned a=0 ; a<arcSigs.size() ; a++ )
+            sig.insert( sig.end() , arcSigs[a].begin() , arcSigs[a].end() ) ;
+         map< vector<long long> , int >::iterator found = sigIndex.find( sig ) ;
+         if ( found == sigIndex.end() )
+            found = sigIndex.insert( make_pair( sig , (int)sigIndex.size() ) ).first ;
+         newClasses[i] = found->second ;
+      }
+
+      // Classes are only ever split, so the same number means no change
+      classes.swap( newClasses ) ;
+      if ( (int)sigIndex.size() == nClasses )
+         break ;
+      nClasses = sigIndex.size() ;
+   }
+
+   // One state per class, from its first member
+   vector< vector<Arc> > minArcs( nClasses ) ;
+   vector<double> minFinals( nClasses , WFST_BUILD_ZERO ) ;
+   vector<bool> done( nClasses , false ) ;
+   for ( int i=0 ; i<nStates ; i++ )
+   {
+      int c = classes[i] ;
+      if ( done[c] )
+         continue ;
+      done[c] = true ;
+      minArcs[c].swap( arcs[i] ) ;
+      for ( unsigned a=0 ; a<minArcs[c].size() ; a++ )
+         minArcs[c][a].to = classes[minArcs[c][a].to] ;
+      minFinals[c] = finals[i] ;
+   }
+   initState = classes[initState] ;
+   arcs.swap( minArcs ) ;
+   finals.swap( minFinals ) ;
+}
+
+
+WFSTBuilder::WFSTBuilder(
+      const vector<bool> &lexAuxInLabels_ , bool optimiseFinal_ , int maxDetStates_ )
+{
+   lexAuxInLabels = lexAuxInLabels_ ;
+   optimiseFinal = optimiseFinal_ ;
+   maxDetStates = maxDetStates_ ;
+}
+
+
+WFSTBuilder::~WFSTBuilder()
+{
+}
+
+
+void WFSTBuilder::prepareGram( WFSTBuildFSM *gram )
+{
+   gram->arcSort() ;
+   gram->determinize( maxDetStates ) ;
+}
+
+
+void WFSTBuilder::prepareLex( WFSTBuildFSM *lex )
+{
+   lex->arcSort() ;
+   lex->closure() ;
+}
+
+
+// C is determinized on its output (phone) side
+void WFSTBuilder::prepareCD( WFSTBuildFSM *cd )
+{
+   cd->arcSort() ;
+   cd->connect() ;
+   cd->invert() ;
+   cd->determinize( maxDetStates ) ;
+   cd->minimize() ;
+   cd->invert() ;
+}
+
+
+struct WFSTBuilderJob
+{
+   WFSTBuilder    *builder ;
+   WFSTBuildFSM   *fsm ;
+   void           (WFSTBuilder::*prepare)( WFSTBuildFSM * ) ;
+};
+
+
+static void *prepareThread( void *arg )
+{
+   WFSTBuilderJob *job = (WFSTBuilderJob *)arg ;
+   (job->builder->*(job->prepare))( job->fsm ) ;
+   return NULL ;
+}
+
+
+static void logFSM( const char *name , const WFSTBuildFSM *fsm )
+{
+   LogFile::printf( "WFSTBuilder: %s nStates=%d nArcs=%d\n" ,
+                    name , fsm->getNumStates() , fsm->getNumArcs() ) ;
+}
+
+
+void WFSTBuilder::build(
+      WFSTBuildFSM *gram , WFSTBuildFSM *lex , WFSTBuildFSM *cd , WFSTBuildFSM *clg )
+{
+   // G, L and C are independent until they are composed
+   WFSTBuilderJob jobs[3] ;
+   jobs[0].fsm = gram ;
+   jobs[0].prepare = &WFSTBuilder::prepareGram ;
+   jobs[1].fsm = lex ;
+   jobs[1].prepare = &WFSTBuilder::prepareLex ;
+   jobs[2].fsm = cd ;
+   jobs[2].prepare = &WFSTBuilder::prepareCD ;
+   pthread_t threads[3] ;
+   for ( int j=0 ; j<3 ; j++ )
+   {
+      jobs[j].builder = this ;
+      if ( pthread_create( &threads[j] , NULL , prepareThread , &jobs[j] ) != 0 )
+         error("WFSTBuilder::build - pthread_create failed") ;
+   }
+   for ( int j=0 ; j<3 ; j++ )
+      pthread_join( threads[j] , NULL ) ;
+   logFSM( "det(G)" , gram ) ;
+   logFSM( "closure(L)" , lex ) ;
+   logFSM( "inv(min(det(inv(C))))" , cd ) ;
+
+   WFSTBuildFSM lg ;
+   WFSTBuildFSM::compose( lex , gram , &lg ) ;
+   logFSM( "LG" , &lg ) ;
+   lg.determinize( maxDetStates ) ;
+   logFSM( "det(LG)" , &lg ) ;
+   lg.minimize() ;
+   logFSM( "min(det(LG))" , &lg ) ;
+   if ( ! optimiseFinal )
+      lg.epsilonInputs( lexAuxInLabels ) ;
+   lg.arcSort() ;
+
+   WFSTBuildFSM::compose( cd , &lg , clg ) ;
+   logFSM( "CLG" , clg ) ;
+   if ( optimiseFinal )
+   {
+      clg->determinize( maxDetStates ) ;
+      clg->minimize() ;
+      logFSM( "min(det(CLG))" , clg ) ;
+   }
+   clg->pushWeights() ;
+}
+
+
+}
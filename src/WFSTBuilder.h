@@ -0,0 +1,129 @@
+/*
+ * Copyright 2009 by Idiap Research Institute
+ *                   http://www.idiap.ch
+ *
+ * See the file COPYING for the licence associated with this software.
+ */
+
+#ifndef WFST_BUILDER_INC
+#define WFST_BUILDER_INC
+
+#include <vector>
+#include "general.h"
+#include "WFSTGeneral.h"
+
+using namespace std ;
+
+namespace Juicer {
+
+
+/**
+ * An editable weighted transducer for building decoding networks in
+ * memory.  Weights are costs (negative natural log probabilities) as in the
+ * FSM files of the generators, combined in the log semiring: a path costs
+ * the sum of its weights, alternative paths the negative log of the sum of
+ * their probabilities.  Input epsilons are an ordinary label to
+ * determinize(), as for the FSM toolkits.
+ */
+class WFSTBuildFSM
+{
+public:
+   struct Arc
+   {
+      int      to ;
+      int      in ;
+      int      out ;
+      double   weight ;
+   };
+
+   WFSTBuildFSM() ;
+   virtual ~WFSTBuildFSM() ;
+
+   /// Reads an FSM in text format with numeric labels; the first
+   /// transition leaves the initial state
+   void readFSM( const char *fsmFName ) ;
+   void writeFSM( const char *fsmFName ) ;
+
+   int addState() ;
+   void addArc( int from , int to , int in , int out , double weight ) ;
+   void setFinal( int state , double weight ) ;
+   void setInitState( int state ) { initState = state ; } ;
+   int getInitState() const { return initState ; } ;
+   int getNumStates() const { return (int)arcs.size() ; } ;
+   int getNumArcs() const ;
+   bool isFinal( int state ) const { return finals[state] < WFST_BUILD_ZERO ; } ;
+   const vector<Arc> &getArcs( int state ) const { return arcs[state] ; } ;
+   double getFinalWeight( int state ) const { return finals[state] ; } ;
+
+   /// Sorts the arcs of each state by input (or output) label
+   void arcSort( bool byInput=true ) ;
+   /// Swaps input and output labels
+   void invert() ;
+   /// Removes the states that are not on a path from the initial state to
+   /// a final state
+   void connect() ;
+   /// Kleene star
+   void closure() ;
+   /// Replaces the input labels l with isEpsilon[l] true by epsilon
+   void epsilonInputs( const vector<bool> &isEpsilon ) ;
+   /// Weighted transducer determinization.  Gives up with an error after
+   /// maxStates states (0 for no limit), as a transducer that is not
+   /// determinizable would never finish.
+   void determinize( int maxStates=0 ) ;
+   /// Pushes the weights towards the initial state
+   void pushWeights() ;
+   /// Minimization of a deterministic transducer, after pushing
+   void minimize() ;
+   /// c = a o b, connected
+   static void compose(
+         const WFSTBuildFSM *a , const WFSTBuildFSM *b , WFSTBuildFSM *c ) ;
+
+   // Costs of the zero and one of the semiring, and its sum
+   static const double WFST_BUILD_ZERO ;
+   static double plus( double w1 , double w2 ) ;
+
+protected:
+   vector< vector<Arc> >   arcs ;
+   vector<double>          finals ;    // WFST_BUILD_ZERO if not final
+   int                     initState ;
+
+   // Cost of the paths from each state to the final states
+   void distanceToFinal( vector<double> *dist ) ;
+   void clear() ;
+};
+
+
+/**
+ * Builds the CLG decoding network from the grammar, lexicon and context
+ * dependency FSMs as bin/build-wfst-openfst does with the OpenFst tools,
+ * but in one process.  G, L and C are prepared in parallel threads.
+ */
+class WFSTBuilder
+{
+public:
+   /// lexAuxInLabels marks the auxiliary symbols of the lexicon input,
+   /// removed from LG unless optimiseFinal
+   WFSTBuilder(
+         const vector<bool> &lexAuxInLabels_ , bool optimiseFinal_=false ,
+         int maxDetStates_=0 ) ;
+   virtual ~WFSTBuilder() ;
+
+   /// Builds clg; gram, lex and cd are modified
+   void build(
+         WFSTBuildFSM *gram , WFSTBuildFSM *lex , WFSTBuildFSM *cd ,
+         WFSTBuildFSM *clg ) ;
+
+   void prepareGram( WFSTBuildFSM *gram ) ;
+   void prepareLex( WFSTBuildFSM *lex ) ;
+   void prepareCD( WFSTBuildFSM *cd ) ;
+
+private:
+   vector<bool>   lexAuxInLabels ;
+   bool           optimiseFinal ;
+   int            maxDetStates ;
+};
+
+
+}
+
+#endif
@@ -518,6 +518,9 @@ void WFSTDecoder::processActiveModelsEmitStates()
               "currFrame != models->getCurrFrame()") ;
 #endif
 
+   if ( models->batchOutput() )
+      requestModelOutputs() ;
+
    WFSTModel *model = activeModelsList ;
    WFSTModel *prevModel = NULL ;
    while ( model != NULL )
@@ -543,6 +546,29 @@ void WFSTDecoder::processActiveModelsEmitStates()
 }
 
 
+// Collect the GMMs of the emitting state hypotheses that will pass the
+// emitting beam in processModelEmitStates() and let the models score them
+// in one batch, in every frame as for WFSTDecoderLite.
+void WFSTDecoder::requestModelOutputs()
+{
+    batchGMMs.clear() ;
+    for ( WFSTModel *model = activeModelsList ; model != NULL ; model = model->next )
+    {
+        // currHyps become prevHyps in processModelEmitStates()
+        int nEmitStates = models->getNumStates(model->hmmIndex) - 1 ;
+        for ( int i=1 ; i<nEmitStates ; i++ )
+        {
+            real score = model->currHyps[i].score ;
+            if ( score <= LOG_ZERO )
+                continue ;
+            score -= normaliseScore ;
+            if ( score > currEmitPruneThresh )
+                batchGMMs.push_back( models->getGMMIndex( model->hmmIndex , i ) ) ;
+        }
+    }
+    models->calcOutputs( batchGMMs.size() , batchGMMs.empty() ? NULL : &batchGMMs[0] ) ;
+}
+
 void WFSTDecoder::processModelEmitStates( WFSTModel *model )
 {
     int i ;
@@ -12,6 +12,8 @@
 #ifndef WFST_DECODER_INC
 #define WFST_DECODER_INC
 
+#include <vector>
+
 #include "TracterObject.h"
 #include "WFSTNetwork.h"
 #include "WFSTModel.h"
@@ -173,6 +175,9 @@ namespace Juicer
 
         void extendModelInitState( WFSTModel *model ) ;
         void processModelEmitStates( WFSTModel *model ) ;
+        void requestModelOutputs() ;
+
+        std::vector<int>  batchGMMs ;   // GMMs requested in the current frame
         void extendModelEndState( DecHyp *endHyp , WFSTTransition *trans ) ;
 
 
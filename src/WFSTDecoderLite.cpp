@@ -17,6 +17,10 @@
 #endif
 
 #include <cassert>
+#include <cstdlib>
+#include <ctime>
+#include <algorithm>
+#include <unistd.h>
 
 #include <log_add.h>
 #include "LogFile.h"
@@ -27,6 +31,13 @@
 
 #define MEMORY_POOL_REALLOC_AMOUNT 5000
 
+// NetInsts in a PropagationChunk
+#define PROPAGATION_CHUNK_SIZE 64
+
+// refCount of the paths of a PropagationChunk, link is the path the merge
+// created for them
+#define CHUNK_PATH -1
+
 using namespace std;
 using namespace Torch;
 
@@ -34,9 +45,135 @@ namespace Juicer
 {
     const Token nullToken = {LOG_ZERO, LOG_ZERO, LOG_ZERO, NULL};
 
+static double wallTime() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static inline bool sameToken(const Token& a, const Token& b) {
+    return a.score == b.score && a.acousticScore == b.acousticScore &&
+        a.lmScore == b.lmScore && a.path == b.path;
+}
+
+// the path the merge created for a path of a PropagationChunk
+static inline Path* mergedPath(Path* p) {
+    return (p != NULL && p->refCount == CHUNK_PATH) ? p->link : p;
+}
+
+
+NetInstMap::NetInstMap() {
+    mask = 1023;
+    nEntries = 0;
+    entries = new Entry[mask + 1];
+    clear();
+}
+
+NetInstMap::~NetInstMap() {
+    delete[] entries;
+}
+
+void NetInstMap::insert(int transID, NetInst* inst) {
+    assert(inst != NULL);
+    if (2 * (nEntries + 1) > (int)(mask + 1))
+        grow();
+    unsigned int i = hash(transID);
+    while (entries[i].inst != NULL) {
+        assert(entries[i].transID != transID);
+        i = (i + 1) & mask;
+    }
+    entries[i].transID = transID;
+    entries[i].inst = inst;
+    ++nEntries;
+}
+
+void NetInstMap::clear() {
+    for (unsigned int i = 0; i <= mask; ++i)
+        entries[i].inst = NULL;
+    nEntries = 0;
+}
+
+// double the capacity, keeping the load at most a half
+void NetInstMap::grow() {
+    Entry* old = entries;
+    unsigned int oldSize = mask + 1;
+    mask = 2 * oldSize - 1;
+    entries = new Entry[mask + 1];
+    clear();
+    for (unsigned int i = 0; i < oldSize; ++i)
+        if (old[i].inst != NULL)
+            insert(old[i].transID, old[i].inst);
+    delete[] old;
+}
+
+
+PropagationTargets::PropagationTargets() {
+    mask = 255;
+    nEntries = 0;
+    stamp = 0;
+    Target free;
+    free.stamp = -1;
+    entries.assign(mask + 1, free);
+}
+
+void PropagationTargets::clear() {
+    ++stamp;
+    nEntries = 0;
+}
+
+// double the capacity and add transID
+PropagationTargets::Target* PropagationTargets::grow(int transID, bool* added) {
+    vector<Target> old;
+    old.swap(entries);
+    mask = 2 * old.size() - 1;
+    Target free;
+    free.stamp = -1;
+    entries.assign(mask + 1, free);
+    nEntries = 0;
+    for (unsigned int i = 0; i < old.size(); ++i) {
+        if (old[i].stamp == stamp) {
+            bool a;
+            *get(old[i].transID, &a) = old[i];
+        }
+    }
+    return get(transID, added);
+}
+
+
+TokenStore::TokenStore() {
+    size = capacity = 0;
+    score = acousticScore = NULL;
+    lmScore = NULL;
+    path = NULL;
+}
+
+TokenStore::~TokenStore() {
+    free(score);
+    free(acousticScore);
+    free(lmScore);
+    free(path);
+}
+
+void TokenStore::setNull(int i) {
+    set(i, nullToken);
+}
+
+void TokenStore::grow(int minCapacity) {
+    int n = capacity ? capacity : 4096;
+    while (n < minCapacity)
+        n *= 2;
+    score = (score_t*)realloc(score, sizeof(score_t)*n);
+    acousticScore = (score_t*)realloc(acousticScore, sizeof(score_t)*n);
+    lmScore = (real*)realloc(lmScore, sizeof(real)*n);
+    path = (Path**)realloc(path, sizeof(Path*)*n);
+    if (!score || !acousticScore || !lmScore || !path)
+        error("TokenStore: fail to allocate memory for %d tokens", n);
+    capacity = n;
+}
+
 
 WFSTDecoderLite::WFSTDecoderLite(
-    WFSTNetwork* network_ ,
+    const WFSTNetwork* network_ ,
     IModels *models_ ,
     real phoneStartPruneWin_,
     real emitPruneWin_,
@@ -83,35 +220,24 @@ WFSTDecoderLite::WFSTDecoderLite(
 
     // initialise memory pools
 
-    maxNStates = 0;
-    for (int i = 0; i < hmmModels->getNumHMMs(); ++i)
-        if (hmmModels->getNumStates(i) > maxNStates)
-            maxNStates = hmmModels->getNumStates(i);
-    nStatePools = maxNStates;
-
     pathPool = new BlockMemPool(sizeof(Path), MEMORY_POOL_REALLOC_AMOUNT);
-    stateNPools = new BlockMemPool*[maxNStates];
-    --stateNPools; /* address from 1 to maxNStates */
-    for (int i = 1; i <= maxNStates; ++i)
-        stateNPools[i] = new BlockMemPool(
-            sizeof(NetInst)  + sizeof(Token)*i,
-            MEMORY_POOL_REALLOC_AMOUNT/2
-        );
+    instPool = new BlockMemPool(sizeof(NetInst), MEMORY_POOL_REALLOC_AMOUNT/2);
 
     nAllocInsts = 0;
 
     dhhPool = NULL;   
     bestDecHyp = NULL;
 
-
-    this->tokenBuf = new Token[maxNStates];
-    this->tokenBuf[0] = nullToken; /* states other than entry will be overwritten during decoding */
-
     resetPathLists();
 
-    activeNetInstList = NULL;
-    newActiveNetInstList = NULL;
-    newActiveNetInstListLastElem = NULL;
+    tokens = &tokenStores[0];
+    newTokens = &tokenStores[1];
+
+    propPool = NULL;
+    nPropChunks = 0;
+    chunkTask = NULL;
+    partitionTask = NULL;
+    propPartMask = 0;
 
 #ifdef PARTIAL_DECODING
     int pti = GetEnv("PartialTraceInterval", 0);
@@ -121,17 +247,38 @@ WFSTDecoderLite::WFSTDecoderLite(
 
     WFSTDecoderLite::~WFSTDecoderLite() throw ()
 {
-    delete[] tokenBuf;
-    for (int i = 1; i <= nStatePools; ++i)
-        delete stateNPools[i];
-    ++stateNPools;
-    delete[] stateNPools;
+    delete instPool;
     delete pathPool;
 
     delete dhhPool;
     delete bestDecHyp;
 
     delete emitHypsHistogram;
+    delete propPool;
+}
+
+void WFSTDecoderLite::setPropagationThreads(int nThreads) {
+    assert(nThreads > 0);
+    // the outputs are added in a serial pass, see
+    // parallelInternalPropagation(), which must not be where they are scored
+    if (nThreads > 1 && !hmmModels->batchOutput())
+        error("WFSTDecoderLite::setPropagationThreads - the models must score in batches");
+    // threads beyond the cores only add hand-overs to every frame
+    int nCores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nCores > 0 && nThreads > nCores) {
+        LogFile::printf("WFSTDecoderLite: %d token propagation threads reduced to the %d cores\n",
+                        nThreads, nCores);
+        nThreads = nCores;
+    }
+    delete propPool;
+    propPool = (nThreads > 1 ? new WorkerPool(nThreads) : NULL);
+    // a few partitions a thread even out the entries they get
+    int nParts = 1;
+    while (nParts < 4*nThreads)
+        nParts *= 2;
+    propParts.resize(nThreads > 1 ? nParts : 0);
+    propPartMask = nParts - 1;
+    LogFile::printf("WFSTDecoderLite: %d token propagation threads\n", nThreads);
 }
 
 // start recognition for a new utterance, so initialise per-utterance 
@@ -147,24 +294,21 @@ void WFSTDecoderLite::recognitionStart() {
     //  <<Free per-utterance memory>>
     {
 
-        NetInst* inst = activeNetInstList;
-        while (inst) {
-            inst->nActiveHyps = 0;
-            for (int i = 0; i < inst->nStates; ++i)
-                inst->states[i] = nullToken;
-            inst = inst->next;
+        for (unsigned int k = 0; k < activeInsts.size(); ++k) {
+            activeInsts[k]->nActiveHyps = 0;
+            activeInsts[k]->tokens = -1;
         }
-        activeNetInstList = NULL;
-        assert(newActiveNetInstList == NULL);
+        activeInsts.clear();
+        assert(newActiveInsts.empty());
+        tokens->clear();
 
         // free all paths
         pathPool->purge_memory();
         resetPathLists();
 
         if (nAllocInsts > maxAllocModels) {
-            network->resetTransitionHooks();
-            for (int i = 1; i <= maxNStates; ++i)
-                stateNPools[i]->purge_memory();
+            netInsts.clear();
+            instPool->purge_memory();
             nAllocInsts = 0;
         }
 
@@ -198,6 +342,7 @@ void WFSTDecoderLite::recognitionStart() {
     currEndPruneThresh = LOG_ZERO;
     currWordPruneThresh = LOG_ZERO;
     currEmitPruneThresh = LOG_ZERO;
+    boundOutputs = false;
 
     lastPathCollectFrame = -1;
 
@@ -210,11 +355,16 @@ void WFSTDecoderLite::recognitionStart() {
     totalActiveEndHyps = 0;
     totalProcEmitHyps = 0;
     totalProcEndHyps = 0;
+    totalDenseFrames = 0;
+    totalRejectedEmitHyps = 0;
+    totalSearchTime = 0.0;
+    outputModes.clear();
 
     nActiveInsts = 0;
     nActiveEmitHyps = 0;
     nActiveEndHyps = 0;
     nEmitHypsProcessed = 0;
+    nEmitHypsRejected = 0;
     nEndHypsProcessed = 0;
 
     // create an empty token and propogate it into the network's entry transitions
@@ -239,6 +389,21 @@ DecHyp* WFSTDecoderLite::recognitionFinish() {
             ((real)totalProcEmitHyps)/(currFrame+1),
             ((real)totalProcEndHyps)/(currFrame+1)
             ) ;
+    if (totalDenseFrames > 0) {
+        // GMM scoring mode of each frame, run length encoded
+        LogFile::printf("  denseOutputFrames=%d\n  outputModes=", totalDenseFrames);
+        for (unsigned int i = 0; i < outputModes.size(); ) {
+            unsigned int j = i;
+            while (j < outputModes.size() && outputModes[j] == outputModes[i])
+                ++j;
+            LogFile::printf("%c%d ", outputModes[i], j-i);
+            i = j;
+        }
+        LogFile::printf("\n");
+    }
+    if (totalRejectedEmitHyps > 0)
+        LogFile::printf("  avgRejectedEmitHyps=%.2f\n", ((real)totalRejectedEmitHyps)/(currFrame+1));
+    LogFile::printf("  searchWallTime=%.3f\n", totalSearchTime);
 
     Token best = bestFinalToken; 
 
@@ -313,6 +478,12 @@ void WFSTDecoderLite::processFrame(real **inputVec, int frame_, int nFrames_) {
     currFrame = frame_;
 
     hmmModels->newFrame(currFrame, inputVec, nFrames_); 
+    if (hmmModels->denseOutput()) {
+        ++totalDenseFrames;
+        outputModes.push_back('D');
+    } else {
+        outputModes.push_back('L');
+    }
     bestFinalToken = nullToken; 
 
     //    <<Update start & emit pruning thresholds>>
@@ -336,8 +507,15 @@ void WFSTDecoderLite::processFrame(real **inputVec, int frame_, int nFrames_) {
 #else
         currStartPruneThresh = (phoneStartPruneWin > 0.0 ? (bestEmitScore - phoneStartPruneWin) : LOG_ZERO);
 #endif
+
+        // A token whose output leaves it more than emitPruneWin below the
+        // best emitting score so far is pruned in the next frame, so its
+        // GMM need not be scored.  Not in the last frame, where it may
+        // still reach a final state.
+        boundOutputs = (emitPruneWin > 0.0 && nFrames_ > 1);
     } // end of <<Update start & emit pruning thresholds>>
 
+    double startTime = wallTime();
     doHMMInternalPropagation();
 
     // Update end pruning thresholds
@@ -351,6 +529,7 @@ void WFSTDecoderLite::processFrame(real **inputVec, int frame_, int nFrames_) {
 #endif
 
     doHMMExternalPropagation();
+    totalSearchTime += wallTime() - startTime;
 
     // path collection
     // To speed up token assginment, the unused paths are collocted in a 
@@ -362,133 +541,150 @@ void WFSTDecoderLite::processFrame(real **inputVec, int frame_, int nFrames_) {
         if ((pathRatio > 12. && nPath > 10000) || (currFrame - lastPathCollectFrame > 100)) {
             // printf("pathRatio = %f, nPath = %d, nPathNew = %d\n", pathRatio, nPath, nPathNew);
             collectPaths();
-#ifdef PARTIAL_DECODING
-            // trace every partialTraceInterval frames
-            if (partialTraceInterval > 0 && (currFrame - lastPartialTraceFrame > partialTraceInterval))
-                tracePartialPath();
-#endif
         }
     }
+
+#ifdef PARTIAL_DECODING
+    // trace every partialTraceInterval frames, rather than with the path
+    // collection only, so that a live client sees the words in time
+    if (partialTraceInterval > 0 && (currFrame - lastPartialTraceFrame > partialTraceInterval))
+        tracePartialPath();
+#endif
 }
 
 // internal propagation passes tokens within an HMM, tee transition is not 
-// dealt with here
+// dealt with here.  The tokens of |inst| are read from |tokens| and the
+// result written to the end of |newTokens|
 void WFSTDecoderLite::HMMInternalPropagation(NetInst* inst) {
     int N_1 = inst->nStates - 1; // nStates-1 is the only way nStates will be used here
-    Token* res;
-    Token* cur;
     real** trP = hmmModels->getTransMat(inst->hmmIndex);
     SEIndex* se = hmmModels->getSEIndex(inst->hmmIndex);
-    
+    int cur = inst->tokens;
+    int res = newTokens->alloc(inst->nStates);
+    const TokenStore& from = *tokens;
+    TokenStore& to = *newTokens;
+
+    inst->tokens = res;
+    inst->nActiveHyps = 0;
+
     // <<Token propagation of emitting states>>
     {
+        // the entry token is nullToken ready for next propagation
+        to.setNull(res);
+
         // scan emitting states first
-        res = tokenBuf+1;
-        for (int j = 1 ; j < N_1; ++j, ++res) {
+        for (int j = 1 ; j < N_1; ++j) {
+            // find the best incoming transition on the scores alone
             int i = se[j].start;
             int endi = se[j].end;
-            cur = &inst->states[i];
-            
-            // assume a transition from i to j
-            *res = *cur;
-            
-            res->score += trP[i][j];
-            res->acousticScore += trP[i][j];
-            
-            // then compare with all other possible incoming transitions
-            for (++i, ++cur; i < endi; ++i, ++cur) {
-                score_t tmpScore = cur->score + trP[i][j];
-                if (tmpScore > res->score) {
-                    *res = *cur;
-                    res->score = tmpScore;
-                    res->acousticScore += trP[i][j];
+            int best = i;
+            score_t score = from.score[cur+i] + trP[i][j];
+            for (++i; i < endi; ++i) {
+                score_t tmpScore = from.score[cur+i] + trP[i][j];
+                if (tmpScore > score) {
+                    score = tmpScore;
+                    best = i;
                 }
             }
+            
             // add output probability if above emitting threshold
-            res->score -= normaliseScore;
-            if (res->score > currEmitPruneThresh) {
+            score -= normaliseScore;
+            if (score > currEmitPruneThresh) {
                 ++nEmitHypsProcessed;
-                real outp = hmmModels->calcOutput(inst->hmmIndex, j);
-                res->score += outp;
-                res->acousticScore += outp;
+                real minOutput = LOG_ZERO;
+                if (boundOutputs && bestEmitScore > LOG_ZERO)
+                    minOutput = bestEmitScore - emitPruneWin - score;
+                real outp = hmmModels->calcBoundedOutput(inst->hmmIndex, j, minOutput);
+                if (outp <= LOG_ZERO) {
+                    // rejected by the models
+                    ++nEmitHypsRejected;
+                    to.setNull(res+j);
+                    continue;
+                }
+                score += outp;
+                to.score[res+j] = score;
+                to.acousticScore[res+j] = from.acousticScore[cur+best] + trP[best][j] + outp;
+                to.lmScore[res+j] = from.lmScore[cur+best];
+                to.path[res+j] = from.path[cur+best];
+                if (score > LOG_ZERO)
+                    ++inst->nActiveHyps;
                 if (emitHypsHistogram) {
-                    emitHypsHistogram->addScore(res->score, LOG_ZERO);
+                    emitHypsHistogram->addScore(score, LOG_ZERO);
                 }
-                if (res->score > bestEmitScore)
-                    bestEmitScore = res->score;
+                if (score > bestEmitScore)
+                    bestEmitScore = score;
     
             } else {
                 // pruned away
-                *res = nullToken;
+                to.setNull(res+j);
             }
         }
-        
-        // copy all result tokens back to the instance, the entry token (tokenBuf[0]) is nullToken
-        // ready for next propagation
-        inst->nActiveHyps = 0;
-        res = tokenBuf;
-        cur = inst->states;
-        for (int i = 0; i < N_1; ++i) {
-            if (res->score > LOG_ZERO)
-                ++inst->nActiveHyps;
-            *cur++ = *res++;
-        }
         nActiveEmitHyps += inst->nActiveHyps;
         
     } // end of <<Token propagation of emitting states>>
 
     // <<Token propagation of exit states>>
-    // note the SEIndex does not include tee transition, which are dealt 
-    // elsewhere
     {
-        int i = se[N_1].start;
-        int endi = se[N_1].end;
-        
-        res = &inst->states[N_1];
-        cur = &inst->states[i];
-        
-        // assume a transition from i to exit
-        *res = *cur;
-        
-        res->score += trP[i][N_1];
-        res->acousticScore += trP[i][N_1];
-        
-        // compare with all other possible to-exit transitions
-        for (++i, ++cur; i < endi; ++i, ++cur) {
-            score_t tmpScore = cur->score + trP[i][N_1];
-            if (tmpScore > res->score) {
-                *res = *cur;
-                res->score = tmpScore;
-                res->acousticScore += trP[i][N_1];
-                // non-emit states can not have higher score so no need to compare with bestEmitScore
-            }
-        }
-        
-        if (res->score <= LOG_ZERO) {
-            *res = nullToken;
-       } else {
+        score_t score = HMMExitPropagation(inst);
+        if (score > LOG_ZERO) {
 #ifndef OPT_SINGLE_BEST
-            if (res->score > bestEndScore)
-                bestEndScore = res->score;
+            if (score > bestEndScore)
+                bestEndScore = score;
 #else
             // non-emit states can not have higher score so no need to compare with bestEmitScore
-            // if (res->score > bestEmitScore)
-            //     bestEmitScore = res->score;
+            // if (score > bestEmitScore)
+            //     bestEmitScore = score;
 #endif
             ++inst->nActiveHyps;
             ++nActiveEndHyps;
-       }
-       
-       
+        }
     } // end of <<Token propagation of exit states>>
 }
 
+// pass the best token of the emitting states of |inst| in |newTokens| to
+// its exit state; returns the score of the exit token.  Note the SEIndex
+// does not include tee transition, which are dealt elsewhere
+score_t WFSTDecoderLite::HMMExitPropagation(NetInst* inst) {
+    int N_1 = inst->nStates - 1;
+    real** trP = hmmModels->getTransMat(inst->hmmIndex);
+    SEIndex* se = hmmModels->getSEIndex(inst->hmmIndex);
+    int res = inst->tokens;
+    TokenStore& to = *newTokens;
+
+    int i = se[N_1].start;
+    int endi = se[N_1].end;
+    int best = i;
+
+    // assume a transition from i to exit
+    score_t score = to.score[res+i] + trP[i][N_1];
+
+    // compare with all other possible to-exit transitions
+    for (++i; i < endi; ++i) {
+        score_t tmpScore = to.score[res+i] + trP[i][N_1];
+        if (tmpScore > score) {
+            score = tmpScore;
+            best = i;
+            // non-emit states can not have higher score so no need to compare with bestEmitScore
+        }
+    }
+
+    if (score <= LOG_ZERO) {
+        to.setNull(res+N_1);
+    } else {
+        to.score[res+N_1] = score;
+        to.acousticScore[res+N_1] = to.acousticScore[res+best] + trP[best][N_1];
+        to.lmScore[res+N_1] = to.lmScore[res+best];
+        to.path[res+N_1] = to.path[res+best];
+    }
+    return score;
+}
+
 // pass token to a list of WFSTTransition following |trans|, tee transition 
 // and eplison transion will be dealt with here
 // new NetInst will be created and attached to new transition.
 // this function also record word boundary from the trans argument if it's not
 // NULL
-void WFSTDecoderLite::propagateToken(Token* tok, WFSTTransition* trans) {
+void WFSTDecoderLite::propagateToken(Token* tok, WFSTTransition* trans, PropagationChunk* chunk) {
     assert(tok->score > LOG_ZERO);
     if (trans != NULL) {
         // for non-NULl transition do:
@@ -496,14 +692,14 @@ void WFSTDecoderLite::propagateToken(Token* tok, WFSTTransition* trans) {
         {
             if (trans->outLabel != WFST_EPSILON) {
                 Path* p;
-                p = createNewNoRefPath();
+                p = createNewPath(chunk);
                 p->frame = currFrame;
                 p->score = tok->score;
                 p->lmScore = tok->lmScore;
                 p->acousticScore = tok->acousticScore;
                 p->label = trans->outLabel;
                 p->prev = tok->path;
-                if (p->prev != NULL)
+                if (p->prev != NULL && chunk == NULL)
                     refPath(p->prev);
                 tok->path = p;
             }
@@ -512,7 +708,13 @@ void WFSTDecoderLite::propagateToken(Token* tok, WFSTTransition* trans) {
         {
             if (network->transGoesToFinalState(trans)) {
                 real weight = network->getFinalStateWeight(trans);
-                if (tok->score + weight > bestFinalToken.score) {
+                if (chunk != NULL) {
+                    if (tok->score + weight > chunk->finalTok.score + chunk->finalWeight) {
+                        chunk->finalTok = *tok;
+                        chunk->finalWeight = weight;
+                        chunk->finalClosure = NULL;
+                    }
+                } else if (tok->score + weight > bestFinalToken.score) {
                     bestFinalToken = *tok;
                     bestFinalToken.score += weight;
                     bestFinalToken.lmScore += weight;
@@ -521,15 +723,23 @@ void WFSTDecoderLite::propagateToken(Token* tok, WFSTTransition* trans) {
         }
     }
 
-    // now retrieve the list of next transitions following |trans|
+    // a state with a precomputed epsilon closure is expanded in one step
+    const WFSTEpsClosure* closure = network->getEpsClosure(trans);
+    if (closure != NULL) {
+        propagateTokenClosure(tok, closure, chunk);
+        return;
+    }
+
+    // now retrieve the range of next transitions following |trans|
     int nTrans;
-    WFSTTransition* transList;
-    nTrans = network->getTransitions(trans, &transList);
+    int firstTrans = network->getFirstTransition(trans, &nTrans);
 
-    // <<Pass |tok| to each |trans| in |transList|>>
+    // <<Pass |tok| to each |trans| in the range>>
     {
         for (int iTrans = 0;  iTrans < nTrans ;  ++iTrans) {
-            WFSTTransition* trans = transList + iTrans;
+            WFSTTransition nextTrans;
+            network->getTransition(firstTrans + iTrans, &nextTrans);
+            WFSTTransition* trans = &nextTrans;
             if (trans->inLabel == WFST_EPSILON /* || trans->inLabel == network->getWordEndMarker() */ ) {
                 // there is no instance attached to an epsilon transition
                 // the token is simply passed on
@@ -537,71 +747,156 @@ void WFSTDecoderLite::propagateToken(Token* tok, WFSTTransition* trans) {
                 tmp.score += trans->weight;
                 tmp.lmScore += trans->weight;
                 if (tmp.score > currEndPruneThresh) 
-                    propagateToken(&tmp, trans);
+                    propagateToken(&tmp, trans, chunk);
             } else {
-                // normal transition, pass tok to the entry state of it's attached instance
-                // create new NetInst if neccssary
-                NetInst* inst = (NetInst*)trans->hook;
-                if (inst == NULL) {
-                    inst = attachNetInst(trans);
-                } else  {
-                    if (inst->nActiveHyps == 0) {
-                        // this inst is reused for the 1st time
-                        // put it into newActiveNetInstList
-                        inst->next = newActiveNetInstList;
-                        newActiveNetInstList = inst;
-                        if (newActiveNetInstListLastElem == NULL)
-                            newActiveNetInstListLastElem = inst;
-                        ++nActiveInsts;
-                    }
-                }
+                enterNetInst(tok, trans, chunk);
+            }
+        }
+    } // end <<Pass |tok| to each |trans| in the range>>
+}
 
-                // pass token to entry state
-                Token* res = inst->states;
-                score_t newScore = tok->score + trans->weight;
+// pass |tok| through every epsilon path of |closure| at once.  The labels
+// and the final state met on the way are recorded as propagateToken() would
+// have done for each epsilon transition; pruning is applied to the score at
+// the end of the path
+void WFSTDecoderLite::propagateTokenClosure(Token* tok, const WFSTEpsClosure* closure, PropagationChunk* chunk) {
+    // best final state reached by epsilon transitions only
+    if (closure->finalTransWeight > LOG_ZERO &&
+        tok->score + closure->finalTransWeight > currEndPruneThresh) {
+        real weight = closure->finalTransWeight + closure->finalStateWeight;
+        if (chunk != NULL) {
+            // the labels are added if it is still the best after the merge
+            if (tok->score + weight > chunk->finalTok.score + chunk->finalWeight) {
+                chunk->finalTok = *tok;
+                chunk->finalWeight = weight;
+                chunk->finalClosure = closure;
+            }
+        } else if (tok->score + weight > bestFinalToken.score) {
+            Token tmp = *tok;
+            addClosureLabels(&tmp, closure->finalLabels, closure->nFinalLabels);
+            bestFinalToken = tmp;
+            bestFinalToken.score += weight;
+            bestFinalToken.lmScore += weight;
+        }
+    }
 
-                if (newScore > res->score) {
+    for (int i = 0; i < closure->nArcs; ++i) {
+        const WFSTClosureArc* arc = network->getClosureArc(closure->firstArc + i);
+        WFSTTransition trans;
+        network->getTransition(arc->trans, &trans);
+        if (i < closure->nDirect) {
+            enterNetInst(tok, &trans, chunk);
+            continue;
+        }
+        Token tmp = *tok;
+        tmp.score += arc->weight;
+        tmp.lmScore += arc->weight;
+        if (tmp.score <= currEndPruneThresh)
+            continue;
+        addClosureLabels(&tmp, arc->firstLabel, arc->nLabels, chunk);
+        enterNetInst(&tmp, &trans, chunk);
+    }
+}
 
-                    if (res->score <= LOG_ZERO)
-                        ++inst->nActiveHyps;
+// add the word boundaries of an epsilon path to |tok|; the label weights
+// are relative to the score |tok| had at the start of the path
+void WFSTDecoderLite::addClosureLabels(Token* tok, int firstLabel, int nLabels, PropagationChunk* chunk) {
+    score_t score = tok->score;
+    score_t lmScore = tok->lmScore;
+    for (int i = 0; i < nLabels; ++i) {
+        const WFSTClosureLabel* l = network->getClosureLabel(firstLabel + i);
+        Path* p;
+        p = createNewPath(chunk);
+        p->frame = currFrame;
+        p->score = score + l->weight;
+        p->lmScore = lmScore + l->weight;
+        p->acousticScore = tok->acousticScore;
+        p->label = l->label;
+        p->prev = tok->path;
+        if (p->prev != NULL && chunk == NULL)
+            refPath(p->prev);
+        tok->path = p;
+    }
+}
 
-                    *res = *tok;
-                    res->score = newScore;
-                    res->lmScore += trans->weight;
+// pass |tok| to the entry state of the NetInst attached to |trans|,
+// creating the NetInst if neccssary.  Inline, as it is the innermost step
+// of the serial search
+inline NetInst* WFSTDecoderLite::enterEntryState(const Token* tok, WFSTTransition* trans) {
+    // create new NetInst if neccssary
+    NetInst* inst = netInsts.find(trans->id);
+    if (inst == NULL)
+        inst = attachNetInst(trans);
+    if (inst->nActiveHyps == 0) {
+        // this inst is new or reused for the 1st time
+        activateNetInst(inst);
+    }
+
+    // pass token to entry state
+    int res = inst->tokens;
+    score_t newScore = tok->score + trans->weight;
+
+    if (newScore > tokens->score[res]) {
+
+        if (tokens->score[res] <= LOG_ZERO)
+            ++inst->nActiveHyps;
 
-                    if (newScore > bestEmitScore)
-                        bestEmitScore = newScore;
+        tokens->score[res] = newScore;
+        tokens->acousticScore[res] = tok->acousticScore;
+        tokens->lmScore[res] = tok->lmScore + trans->weight;
+        tokens->path[res] = tok->path;
+
+        if (newScore > bestEmitScore)
+            bestEmitScore = newScore;
 
 #ifndef OPT_SINGLE_BEST
-                    if (newScore > bestStartScore)
-                        bestStartScore = newScore;
+        if (newScore > bestStartScore)
+            bestStartScore = newScore;
 #else
-                    if (newScore > bestEmitScore)
-                        bestEmitScore = newScore;
+        if (newScore > bestEmitScore)
+            bestEmitScore = newScore;
 #endif
-                }
+    }
+    return inst;
+}
 
-                if (inst->teeWeight > LOG_ZERO) {
-                    real teeWeight = inst->teeWeight;
-                    newScore += teeWeight;
-                    // if there is a tee transition, pass the token on
-                    // and propagate it to next transitions
-                    Token tmp = *tok;
-                    tmp.score = newScore;
-                    tmp.acousticScore += teeWeight;
-                    tmp.lmScore += trans->weight;
-                    if (inst->trans->outLabel != WFST_EPSILON) {
-                        if ( newScore > currWordPruneThresh )
-                            propagateToken(&tmp, trans);
-                    } else {
-                        if (newScore > currEndPruneThresh) 
-                            propagateToken(&tmp, trans);
-                    }
-                } // handle teeWeight
+// pass |tok| to the entry state of the NetInst attached to the non-epsilon
+// transition |trans|, and on through its tee transition if it has one
+void WFSTDecoderLite::enterNetInst(Token* tok, WFSTTransition* trans, PropagationChunk* chunk) {
+    real teeWeight;
+    if (chunk != NULL) {
+        teeWeight = addPropagationEntry(chunk, tok, trans);
+    } else {
+        teeWeight = enterEntryState(tok, trans)->teeWeight;
+    }
 
-            }
+    if (teeWeight > LOG_ZERO) {
+        score_t newScore = tok->score + trans->weight;
+        newScore += teeWeight;
+        // if there is a tee transition, pass the token on
+        // and propagate it to next transitions
+        Token tmp = *tok;
+        tmp.score = newScore;
+        tmp.acousticScore += teeWeight;
+        tmp.lmScore += trans->weight;
+        if (trans->outLabel != WFST_EPSILON) {
+            if ( newScore > currWordPruneThresh )
+                propagateToken(&tmp, trans, chunk);
+        } else {
+            if (newScore > currEndPruneThresh) 
+                propagateToken(&tmp, trans, chunk);
         }
-    } // end <<Pass |tok| to each |trans| in |transList|>>
+    } // handle teeWeight
+}
+
+// a path of the decoder, or of |chunk| if not NULL
+inline Path* WFSTDecoderLite::createNewPath(PropagationChunk* chunk) {
+    if (chunk == NULL)
+        return createNewNoRefPath();
+    chunk->paths.push_back(Path());
+    Path* p = &chunk->paths.back();
+    p->refCount = CHUNK_PATH;
+    return p;
 }
 
 // newly created path is added to the front of noRefList
@@ -700,12 +995,11 @@ void WFSTDecoderLite::collectPaths() {
 
     // before each collection, the directlyUsedByToken of each path should be false
     // first scan all tokens in all instances and mark the directly referred paths
-    NetInst* inst = activeNetInstList;
-    while (inst) {
-        int n = inst->nStates;
-        Token* tok = inst->states;
-        for (int i = 0; i < n; ++tok, ++i) {
-            Path* path = tok->path;
+    for (unsigned int k = 0; k < activeInsts.size(); ++k) {
+        NetInst* inst = activeInsts[k];
+        Path** tokPath = tokens->path + inst->tokens;
+        for (int i = 0; i < inst->nStates; ++i) {
+            Path* path = tokPath[i];
             if (path && path->directlyUsedByToken == false) {
                 path->directlyUsedByToken = true;
                 if (path->refCount > 0) {
@@ -713,7 +1007,6 @@ void WFSTDecoderLite::collectPaths() {
                 }
             }
         }
-        inst = inst->next;
     }
 
     // now all directly referred path has directlyUsedByToken == true
@@ -746,62 +1039,51 @@ void WFSTDecoderLite::collectPaths() {
     lastPathCollectFrame = currFrame;
 }
 
-// attach a NetInst to non-eplison transition, and add it to the *front* 
-// active inst list, so it will be processed at the next frame
+// attach an inactive NetInst to non-eplison transition
 NetInst* WFSTDecoderLite::attachNetInst(WFSTTransition* trans) {
-    assert(trans->hook == NULL);
+    assert(netInsts.find(trans->id) == NULL);
     
     int hmmIndex = trans->inLabel - 1;
     assert(hmmIndex >= 0 );
     int n = hmmModels->getNumStates(hmmIndex);
-    assert(n > 0); // stateNPools starts at 1
-    NetInst* inst = (NetInst*)stateNPools[n]->malloc();
+    assert(n > 0);
+    NetInst* inst = (NetInst*)instPool->malloc();
     inst->hmmIndex = hmmIndex;
     inst->nStates = n;
-    for (int i = 0; i < n; ++i)
-        inst->states[i] = nullToken;
-    trans->hook = inst;
-    inst->trans = trans;
+    netInsts.insert(trans->id, inst);
+    inst->trans = *trans;
     inst->teeWeight = hmmModels->getTeeLogProb(hmmIndex);
     inst->nActiveHyps = 0;
-    inst->next = newActiveNetInstList;
-    newActiveNetInstList = inst;
-    if (newActiveNetInstListLastElem == NULL)
-        newActiveNetInstListLastElem = inst;
-    ++nActiveInsts;
+    inst->tokens = -1;
     ++nAllocInsts;
     return inst;
 }
 
+// give an inactive NetInst null tokens and add it to newActiveInsts, so it
+// will be processed at the next frame
+void WFSTDecoderLite::activateNetInst(NetInst* inst) {
+    inst->tokens = tokens->alloc(inst->nStates);
+    for (int i = 0; i < inst->nStates; ++i)
+        tokens->setNull(inst->tokens + i);
+    newActiveInsts.push_back(inst);
+    ++nActiveInsts;
+}
 
-NetInst* WFSTDecoderLite::returnNetInst(NetInst* inst, NetInst* prevInst) {
-    // Return the model to the pool and remove it from the linked list of
-    //   active models.
-    if ( prevInst == NULL ) {
-        // Model we are deactivating is at head of list.
-        activeNetInstList = inst->next;
-        for (int i = 0; i < inst->nStates; ++i)
-            inst->states[i] = nullToken;
-        inst = activeNetInstList;
-    } else {
-        // Model we are deactivating is not at head of list.
-        prevInst->next = inst->next;
-        for (int i = 0; i < inst->nStates; ++i)
-            inst->states[i] = nullToken;
-        inst = prevInst->next;
-    }
-
+// Deactivate a NetInst with no active tokens left; the caller removes it
+// from activeInsts.  Its tokens are left behind until the next internal
+// propagation compacts the store.
+void WFSTDecoderLite::returnNetInst(NetInst* inst) {
+    inst->tokens = -1;
     --nActiveInsts;
-    // Return the pointer to the next active model in the linked list.
-    return inst ;
 }
 
+// the NetInsts activated in the frame go to the front of the active list,
+// the latest first
 void WFSTDecoderLite::joinNewActiveInstList() {
-    if (newActiveNetInstList == NULL)
+    if (newActiveInsts.empty())
         return;
-    newActiveNetInstListLastElem->next = activeNetInstList;
-    activeNetInstList = newActiveNetInstList;
-    newActiveNetInstList = newActiveNetInstListLastElem = NULL;
+    activeInsts.insert(activeInsts.begin(), newActiveInsts.rbegin(), newActiveInsts.rend());
+    newActiveInsts.clear();
 }
 
 void WFSTDecoderLite::setMaxAllocModels(int maxAllocModels_) {
@@ -811,7 +1093,7 @@ void WFSTDecoderLite::setMaxAllocModels(int maxAllocModels_) {
         maxAllocModels = network->getNumTransitions()*maxAllocModels_/100;
     } else if (maxAllocModels_ >= 100 && maxAllocModels_ < 8000) {
         // it's a memory limit in MB
-        maxAllocModels = maxAllocModels_*1024*1024/(sizeof(NetInst)+sizeof(Token)*nStatePools);
+        maxAllocModels = maxAllocModels_*1024*1024/sizeof(NetInst);
     } else {
         // it's just a limit
         maxAllocModels = maxAllocModels_;
@@ -839,30 +1121,50 @@ bool WFSTDecoderLite::tracePartialPath() {
         }
     }
 
-    // step 2: go through all open hypothesises and try to find a path that all paths converge into
-    NetInst* inst = activeNetInstList;
-    while (!found && inst) {
-        // as all tokens within a NetInst have the same path history
-        // so we only need to trace from the first valid one
-        Token* tok = inst->states;
-        Path* path = tok->path;
-        while (path == NULL) {
-            ++tok;
-            path = tok->path;
-        }
-
-        // backtrace from this path
-        while (path != NULL)  {
-            if (path->frame > lastTracedFrame && ++path->jointCount == nActiveInsts) {
-                found = true;
-                // there may be other winning paths leading to this one but can not
-                // be discovered by the algorithm, let's backtrace to find them out
-                traceWinningPaths(path);
-                break;
+    // step 2: the converged path is the oldest point where the history of
+    // the first open token meets that of any other.  Tokens within a NetInst
+    // do not all share a history (the entry state may hold a newer word), so
+    // every live token is traced.  jointCount marks the history of the first
+    // token with 2 + its position there, and 1 on the other paths walked, so
+    // that each path is walked once
+    vector<Path*> chain;
+    size_t oldest = 0;
+    bool diverged = false;  // met only at or before the last traced path
+    for (unsigned int k = 0; k < activeInsts.size() && !diverged; ++k) {
+        NetInst* inst = activeInsts[k];
+        for (int i = 0; i < inst->nStates && !diverged; ++i) {
+            if (tokens->score[inst->tokens + i] <= LOG_ZERO)
+                continue;
+            Path* path = tokens->path[inst->tokens + i];
+            if (path == NULL) {
+                // before the first word nothing can be common
+                lastPartialTraceFrame = currFrame;
+                return false;
+            }
+            if (chain.empty()) {
+                for (; path != NULL && path->frame > lastTracedFrame; path = path->prev) {
+                    path->jointCount = 2 + chain.size();
+                    chain.push_back(path);
+                }
+                diverged = chain.empty();
+                continue;
+            }
+            while (path != NULL && path->frame > lastTracedFrame && path->jointCount == 0) {
+                path->jointCount = 1;
+                path = path->prev;
             }
-            path = path->prev;
+            if (path == NULL || path->frame <= lastTracedFrame)
+                diverged = true;
+            else if (path->jointCount >= 2 && (size_t)path->jointCount - 2 > oldest)
+                oldest = path->jointCount - 2;
         }
-        inst = inst->next;
+    }
+
+    if (!diverged && !chain.empty()) {
+        found = true;
+        // there may be other winning paths leading to this one but can not
+        // be discovered by the algorithm, let's backtrace to find them out
+        traceWinningPaths(chain[oldest]);
     }
 
     lastPartialTraceFrame = currFrame;
@@ -900,6 +1202,7 @@ void WFSTDecoderLite::doHMMInternalPropagation() {
     nActiveEmitHyps = 0;
     nActiveEndHyps = 0;
     nEmitHypsProcessed = 0;
+    nEmitHypsRejected = 0;
     nEndHypsProcessed = 0;
 
     bestEmitScore = LOG_ZERO; /* bestEmitScore & bestEndScore will be updated in HMMInternalPropagation() */
@@ -907,31 +1210,93 @@ void WFSTDecoderLite::doHMMInternalPropagation() {
     bestEndScore = LOG_ZERO;
 #endif
 
-    NetInst* prevInst = NULL;
-    NetInst* inst = activeNetInstList;
-    while (inst) {
-        // language model pruning
-        Token* entry = inst->states;
-        if (entry->score > LOG_ZERO && entry->score < currStartPruneThresh) {
-            *entry = nullToken;
-            --inst->nActiveHyps;
-        }
+    if (propPool)
+        splitActiveInsts();
 
-        HMMInternalPropagation(inst);
+    if (hmmModels->batchOutput())
+        requestHMMOutputs();
 
-        // post-emitting pruning
-        assert(inst->nActiveHyps >= 0);
-        if (inst->nActiveHyps == 0) {
-            inst = returnNetInst(inst, prevInst);
-        } else {
-            prevInst = inst;
-            inst = inst->next;
+    if (propPool) {
+        parallelInternalPropagation();
+    } else {
+        // the tokens of the surviving NetInsts are written to newTokens in the
+        // order of activeInsts, which is compacted in the same pass
+        newTokens->clear();
+        unsigned int nKept = 0;
+        for (unsigned int k = 0; k < activeInsts.size(); ++k) {
+            NetInst* inst = activeInsts[k];
+
+            // language model pruning
+            int entry = inst->tokens;
+            if (tokens->score[entry] > LOG_ZERO && tokens->score[entry] < currStartPruneThresh) {
+                tokens->setNull(entry);
+                --inst->nActiveHyps;
+            }
+
+            HMMInternalPropagation(inst);
+
+            // post-emitting pruning
+            assert(inst->nActiveHyps >= 0);
+            if (inst->nActiveHyps == 0) {
+                newTokens->truncate(inst->tokens);
+                returnNetInst(inst);
+            } else {
+                activeInsts[nKept++] = inst;
+            }
         }
+        activeInsts.resize(nKept);
     }
+    std::swap(tokens, newTokens);
 
     totalActiveEmitHyps += nActiveEmitHyps;
     totalActiveEndHyps += nActiveEndHyps;
     totalProcEmitHyps += nEmitHypsProcessed;
+    totalRejectedEmitHyps += nEmitHypsRejected;
+}
+
+// Collect the GMMs of the emitting states that will pass the emitting
+// beam in HMMInternalPropagation() and let the models score them in one
+// batch.  This repeats the token maximisation without changing any token.
+// The models hear from every frame, even with nothing to score, as
+// HTKFlatModelsStreams waits for all its decoders in each frame.
+void WFSTDecoderLite::requestHMMOutputs() {
+    batchGMMs.clear();
+    if (propPool) {
+        // each chunk collects its GMMs, in the order of the serial decoder
+        runChunkTasks(&WFSTDecoderLite::requestChunkOutputs);
+        for (int c = 0; c < nPropChunks; ++c)
+            batchGMMs.insert(batchGMMs.end(), propChunks[c].gmms.begin(), propChunks[c].gmms.end());
+    } else {
+        requestHMMOutputs(0, activeInsts.size(), &batchGMMs);
+    }
+    hmmModels->calcOutputs(batchGMMs.size(), batchGMMs.empty() ? NULL : &batchGMMs[0]);
+}
+
+// append the GMMs of activeInsts[first .. last-1] that requestHMMOutputs()
+// has to score to |gmms|
+void WFSTDecoderLite::requestHMMOutputs(unsigned int first, unsigned int last, vector<int>* gmms) {
+    for (unsigned int k = first; k < last; ++k) {
+        NetInst* inst = activeInsts[k];
+        int N_1 = inst->nStates - 1;
+        real** trP = hmmModels->getTransMat(inst->hmmIndex);
+        SEIndex* se = hmmModels->getSEIndex(inst->hmmIndex);
+        const score_t* tokScore = tokens->score + inst->tokens;
+        for (int j = 1; j < N_1; ++j) {
+            score_t best = LOG_ZERO;
+            for (int i = se[j].start; i < se[j].end; ++i) {
+                score_t score = tokScore[i];
+                // the entry token is subject to language model pruning
+                if (i == 0 && score < currStartPruneThresh)
+                    continue;
+                score += trP[i][j];
+                if (score > best)
+                    best = score;
+            }
+            best -= normaliseScore;
+            if (best > currEmitPruneThresh)
+                gmms->push_back(hmmModels->getGMMIndex(inst->hmmIndex, j));
+        }
+    }
 }
 
 void WFSTDecoderLite::doHMMExternalPropagation() {
@@ -941,38 +1306,44 @@ void WFSTDecoderLite::doHMMExternalPropagation() {
     bestStartScore = LOG_ZERO; /* bestStartScore will be updated in propagateToken */
 #endif
 
-    NetInst* prevInst = NULL;
-    NetInst* inst = activeNetInstList;
-    while (inst) {
-        WFSTTransition* trans = inst->trans;
-        Token* exit_tok = &inst->states[inst->nStates - 1];
-        if (exit_tok->score > LOG_ZERO) {
-            // VW - word based pruning
-            // Use a different purning threshold when a word is emitted
-            if (inst->trans->outLabel == WFST_EPSILON) {
-                if (exit_tok->score > currEndPruneThresh) {
-                    ++nEndHypsProcessed;
-                    propagateToken(exit_tok, trans);
-                }
-            } else {
-                if (exit_tok->score > currWordPruneThresh) {
-                    ++nEndHypsProcessed;
-                    propagateToken(exit_tok, trans);
+    if (propPool) {
+        parallelExternalPropagation();
+    } else {
+        // NetInsts entered here go to newActiveInsts, and tokens may grow, so
+        // the exit token is taken out of the store before it is passed on
+        unsigned int nKept = 0;
+        for (unsigned int k = 0; k < activeInsts.size(); ++k) {
+            NetInst* inst = activeInsts[k];
+            WFSTTransition* trans = &inst->trans;
+            int exit = inst->tokens + inst->nStates - 1;
+            if (tokens->score[exit] > LOG_ZERO) {
+                Token exit_tok;
+                tokens->get(exit, &exit_tok);
+                tokens->setNull(exit); // de-active exit_tok
+
+                // VW - word based pruning
+                // Use a different purning threshold when a word is emitted
+                if (inst->trans.outLabel == WFST_EPSILON) {
+                    if (exit_tok.score > currEndPruneThresh) {
+                        ++nEndHypsProcessed;
+                        propagateToken(&exit_tok, trans);
+                    }
+                } else {
+                    if (exit_tok.score > currWordPruneThresh) {
+                        ++nEndHypsProcessed;
+                        propagateToken(&exit_tok, trans);
+                    }
                 }
-            }
 
-            *exit_tok = nullToken; // de-active exit_tok
-            assert(inst->nActiveHyps >= 0);
-            if (--inst->nActiveHyps == 0) {
-                inst = returnNetInst(inst, prevInst);
-            } else {
-                prevInst = inst;
-                inst = inst->next;
+                assert(inst->nActiveHyps >= 0);
+                if (--inst->nActiveHyps == 0) {
+                    returnNetInst(inst);
+                    continue;
+                }
             }
-        } else {
-            prevInst = inst;
-            inst = inst->next;
+            activeInsts[nKept++] = inst;
         }
+        activeInsts.resize(nKept);
     }
 
     totalProcEndHyps += nEndHypsProcessed;
@@ -982,5 +1353,454 @@ void WFSTDecoderLite::doHMMExternalPropagation() {
 }
 
 
-};
+// Parallel token propagation
+//
+// activeInsts is split into chunks of PROPAGATION_CHUNK_SIZE NetInsts that
+// the threads of propPool take one at a time.  Whatever depends on the
+// order in which the serial decoder visits the NetInsts is left to serial
+// steps that go through the chunks in order: the GMM outputs, bounded by
+// the best emitting score so far, and everything external propagation
+// does to the NetInsts, paths and best scores.
+
+void WFSTDecoderLite::splitActiveInsts() {
+    unsigned int n = activeInsts.size();
+    nPropChunks = (n + PROPAGATION_CHUNK_SIZE - 1) / PROPAGATION_CHUNK_SIZE;
+    if ((int)propChunks.size() < nPropChunks)
+        propChunks.resize(nPropChunks);
+    for (int c = 0; c < nPropChunks; ++c) {
+        propChunks[c].first = c * PROPAGATION_CHUNK_SIZE;
+        propChunks[c].last = propChunks[c].first + PROPAGATION_CHUNK_SIZE;
+        if (propChunks[c].last > n)
+            propChunks[c].last = n;
+    }
+}
+
+void WFSTDecoderLite::runChunkTasks(ChunkTask task) {
+    chunkTask = task;
+    propPool->run(runChunkTask, this, nPropChunks);
+}
+
+void WFSTDecoderLite::runChunkTask(void* arg, int i) {
+    WFSTDecoderLite* d = (WFSTDecoderLite*)arg;
+    (d->*(d->chunkTask))(&d->propChunks[i]);
+}
+
+void WFSTDecoderLite::runPartitionTasks(PartitionTask task) {
+    partitionTask = task;
+    propPool->run(runPartitionTask, this, propParts.size());
+}
+
+void WFSTDecoderLite::runPartitionTask(void* arg, int i) {
+    WFSTDecoderLite* d = (WFSTDecoderLite*)arg;
+    (d->*(d->partitionTask))(&d->propParts[i]);
+}
+
+void WFSTDecoderLite::requestChunkOutputs(PropagationChunk* chunk) {
+    chunk->gmms.clear();
+    requestHMMOutputs(chunk->first, chunk->last, &chunk->gmms);
+}
+
+// HMMInternalPropagation() in three passes: the chunks find the best token
+// of each emitting state, the outputs are added in the order of the serial
+// decoder, then the chunks pass the tokens on to the exit states.  The
+// tokens of a chunk start where they would if no NetInst were pruned, so
+// newTokens holds those of the pruned NetInsts too, until the next frame.
+void WFSTDecoderLite::parallelInternalPropagation() {
+    newTokens->clear();
+    for (int c = 0; c < nPropChunks; ++c) {
+        PropagationChunk& chunk = propChunks[c];
+        int n = 0;
+        for (unsigned int k = chunk.first; k < chunk.last; ++k)
+            n += activeInsts[k]->nStates;
+        chunk.tokens = newTokens->alloc(n);
+    }
+
+    runChunkTasks(&WFSTDecoderLite::propagateChunkEmitStates);
+
+    TokenStore& to = *newTokens;
+    for (int c = 0; c < nPropChunks; ++c) {
+        PropagationChunk& chunk = propChunks[c];
+        nEmitHypsProcessed += chunk.nEmitHypsProcessed;
+        for (unsigned int i = 0; i < chunk.emitStates.size(); ++i) {
+            const PropagationChunk::EmitState& e = chunk.emitStates[i];
+            score_t score = to.score[e.token];
+            real minOutput = LOG_ZERO;
+            if (boundOutputs && bestEmitScore > LOG_ZERO)
+                minOutput = bestEmitScore - emitPruneWin - score;
+            real outp = hmmModels->calcBoundedOutput(e.hmmIndex, e.state, minOutput);
+            if (outp <= LOG_ZERO) {
+                // rejected by the models
+                ++nEmitHypsRejected;
+                to.setNull(e.token);
+                continue;
+            }
+            score += outp;
+            to.score[e.token] = score;
+            to.acousticScore[e.token] += outp;
+            if (emitHypsHistogram) {
+                emitHypsHistogram->addScore(score, LOG_ZERO);
+            }
+            if (score > bestEmitScore)
+                bestEmitScore = score;
+        }
+    }
+
+    runChunkTasks(&WFSTDecoderLite::propagateChunkExitStates);
+
+    unsigned int nKept = 0;
+    for (int c = 0; c < nPropChunks; ++c) {
+        PropagationChunk& chunk = propChunks[c];
+        nActiveEmitHyps += chunk.nActiveEmitHyps;
+        nActiveEndHyps += chunk.nActiveEndHyps;
+#ifndef OPT_SINGLE_BEST
+        if (chunk.bestEndScore > bestEndScore)
+            bestEndScore = chunk.bestEndScore;
+#endif
+        for (unsigned int k = chunk.first; k < chunk.last; ++k) {
+            NetInst* inst = activeInsts[k];
+            // post-emitting pruning
+            if (inst->nActiveHyps == 0)
+                returnNetInst(inst);
+            else
+                activeInsts[nKept++] = inst;
+        }
+    }
+    activeInsts.resize(nKept);
+}
+
+// the emitting states of HMMInternalPropagation(), after language model
+// pruning, up to the output: the states that pass the emitting beam are
+// left in chunk->emitStates
+void WFSTDecoderLite::propagateChunkEmitStates(PropagationChunk* chunk) {
+    const TokenStore& from = *tokens;
+    TokenStore& to = *newTokens;
+    int res = chunk->tokens;
+
+    chunk->emitStates.clear();
+    chunk->nEmitHypsProcessed = 0;
+    for (unsigned int k = chunk->first; k < chunk->last; ++k) {
+        NetInst* inst = activeInsts[k];
+        int N_1 = inst->nStates - 1;
+        real** trP = hmmModels->getTransMat(inst->hmmIndex);
+        SEIndex* se = hmmModels->getSEIndex(inst->hmmIndex);
+        int cur = inst->tokens;
+
+        // language model pruning
+        if (tokens->score[cur] > LOG_ZERO && tokens->score[cur] < currStartPruneThresh)
+            tokens->setNull(cur);
+
+        inst->tokens = res;
+        to.setNull(res);
+        for (int j = 1 ; j < N_1; ++j) {
+            int i = se[j].start;
+            int endi = se[j].end;
+            int best = i;
+            score_t score = from.score[cur+i] + trP[i][j];
+            for (++i; i < endi; ++i) {
+                score_t tmpScore = from.score[cur+i] + trP[i][j];
+                if (tmpScore > score) {
+                    score = tmpScore;
+                    best = i;
+                }
+            }
 
+            score -= normaliseScore;
+            if (score > currEmitPruneThresh) {
+                ++chunk->nEmitHypsProcessed;
+                to.score[res+j] = score;
+                to.acousticScore[res+j] = from.acousticScore[cur+best] + trP[best][j];
+                to.lmScore[res+j] = from.lmScore[cur+best];
+                to.path[res+j] = from.path[cur+best];
+                PropagationChunk::EmitState e = {res+j, inst->hmmIndex, j};
+                chunk->emitStates.push_back(e);
+            } else {
+                // pruned away
+                to.setNull(res+j);
+            }
+        }
+        res += inst->nStates;
+    }
+}
+
+// the rest of HMMInternalPropagation(), once the outputs are added
+void WFSTDecoderLite::propagateChunkExitStates(PropagationChunk* chunk) {
+    const TokenStore& to = *newTokens;
+
+    chunk->nActiveEmitHyps = 0;
+    chunk->nActiveEndHyps = 0;
+#ifndef OPT_SINGLE_BEST
+    chunk->bestEndScore = LOG_ZERO;
+#endif
+    for (unsigned int k = chunk->first; k < chunk->last; ++k) {
+        NetInst* inst = activeInsts[k];
+        int N_1 = inst->nStates - 1;
+        inst->nActiveHyps = 0;
+        for (int j = 1; j < N_1; ++j)
+            if (to.score[inst->tokens+j] > LOG_ZERO)
+                ++inst->nActiveHyps;
+        chunk->nActiveEmitHyps += inst->nActiveHyps;
+
+        score_t score = HMMExitPropagation(inst);
+        if (score > LOG_ZERO) {
+#ifndef OPT_SINGLE_BEST
+            if (score > chunk->bestEndScore)
+                chunk->bestEndScore = score;
+#endif
+            ++inst->nActiveHyps;
+            ++chunk->nActiveEndHyps;
+        }
+    }
+}
+
+static bool activatedBefore(
+    const PropagationPartition::Activation& a, const PropagationPartition::Activation& b)
+{
+    return a.order < b.order;
+}
+
+// doHMMExternalPropagation() in three passes.  The chunks pass on their exit
+// tokens, recording the paths they create and the entries to the NetInsts,
+// by partition.  Then the paths and NetInsts are created in order, and the
+// partitions replay the entries to their NetInsts in the order of the
+// serial decoder, so each entry state gets the token it would have got.
+// Last the NetInsts activated on the way join newActiveInsts in the order
+// of the entries that activated them.
+void WFSTDecoderLite::parallelExternalPropagation() {
+    splitActiveInsts();
+    returnedInsts.resize(activeInsts.size());
+    runChunkTasks(&WFSTDecoderLite::propagateChunkExits);
+
+    int nEntries = 0;
+    int finalChunk = -1;
+    score_t finalScore = bestFinalToken.score;
+    for (int c = 0; c < nPropChunks; ++c) {
+        PropagationChunk& chunk = propChunks[c];
+        chunk.firstEntry = nEntries;
+        nEntries += chunk.nEntries;
+        nEndHypsProcessed += chunk.nEndHypsProcessed;
+        for (unsigned int i = 0; i < chunk.paths.size(); ++i)
+            mergePath(&chunk.paths[i]);
+        for (unsigned int i = 0; i < chunk.unattached.size(); ++i) {
+            PropagationChunk::Unattached& u = chunk.unattached[i];
+            NetInst* inst = netInsts.find(u.trans.id);
+            if (inst == NULL)
+                inst = attachNetInst(&u.trans);
+            chunk.entries[u.partition][u.entry].inst = inst;
+        }
+        if (chunk.finalTok.score + chunk.finalWeight > finalScore) {
+            finalScore = chunk.finalTok.score + chunk.finalWeight;
+            finalChunk = c;
+        }
+    }
+    if (finalChunk >= 0) {
+        PropagationChunk& chunk = propChunks[finalChunk];
+        Token tok = chunk.finalTok;
+        tok.path = mergedPath(tok.path);
+        if (chunk.finalClosure != NULL)
+            addClosureLabels(&tok, chunk.finalClosure->finalLabels, chunk.finalClosure->nFinalLabels);
+        bestFinalToken = tok;
+        bestFinalToken.score += chunk.finalWeight;
+        bestFinalToken.lmScore += chunk.finalWeight;
+    }
+
+    runPartitionTasks(&WFSTDecoderLite::propagatePartitionEntries);
+
+    vector<PropagationPartition::Activation> activations;
+    for (unsigned int p = 0; p < propParts.size(); ++p) {
+        PropagationPartition& part = propParts[p];
+        activations.insert(activations.end(), part.activations.begin(), part.activations.end());
+        nActiveInsts -= part.nReturned;
+        if (part.bestEmitScore > bestEmitScore)
+            bestEmitScore = part.bestEmitScore;
+#ifndef OPT_SINGLE_BEST
+        if (part.bestStartScore > bestStartScore)
+            bestStartScore = part.bestStartScore;
+#endif
+    }
+    sort(activations.begin(), activations.end(), activatedBefore);
+    for (unsigned int i = 0; i < activations.size(); ++i) {
+        activateNetInst(activations[i].inst);
+        tokens->set(activations[i].inst->tokens, activations[i].tok);
+    }
+
+    unsigned int nKept = 0;
+    for (unsigned int k = 0; k < activeInsts.size(); ++k)
+        if (!returnedInsts[k])
+            activeInsts[nKept++] = activeInsts[k];
+    activeInsts.resize(nKept);
+}
+
+// doHMMExternalPropagation() of the NetInsts of |chunk|, leaving the
+// NetInsts they enter, the paths and the best scores to the merge
+void WFSTDecoderLite::propagateChunkExits(PropagationChunk* chunk) {
+    chunk->toks.clear();
+    chunk->paths.clear();
+    chunk->entries.resize(propParts.size());
+    for (unsigned int p = 0; p < chunk->entries.size(); ++p)
+        chunk->entries[p].clear();
+    chunk->unattached.clear();
+    chunk->targets.clear();
+    chunk->nEntries = 0;
+    chunk->finalTok = nullToken;
+    chunk->finalWeight = 0.0;
+    chunk->finalClosure = NULL;
+    chunk->nEndHypsProcessed = 0;
+    for (unsigned int k = chunk->first; k < chunk->last; ++k) {
+        NetInst* inst = activeInsts[k];
+        WFSTTransition* trans = &inst->trans;
+        int exit = inst->tokens + inst->nStates - 1;
+        returnedInsts[k] = false;
+        if (tokens->score[exit] > LOG_ZERO) {
+            Token exit_tok;
+            tokens->get(exit, &exit_tok);
+            tokens->setNull(exit);
+
+            real thresh = (trans->outLabel == WFST_EPSILON ? currEndPruneThresh : currWordPruneThresh);
+            if (exit_tok.score > thresh) {
+                ++chunk->nEndHypsProcessed;
+                propagateToken(&exit_tok, trans, chunk);
+            }
+
+            // the end of its turn, after the entries it made to itself
+            bool added;
+            PropagationTargets::Target* t = chunk->targets.get(trans->id, &added);
+            if (added)
+                t->teeWeight = inst->teeWeight;
+            t->entry = -1;
+            PropagationEntry e;
+            e.inst = inst;
+            e.tok = -1;
+            e.order = k;
+            chunk->entries[trans->id & propPartMask].push_back(e);
+        }
+    }
+}
+
+// Pass |tok| to the entry state of the NetInst on |trans| in the chunk.
+// Of the tokens the chunk passes to a NetInst between two of its turns,
+// only the first best can take the entry state, as it would in the serial
+// decoder; the first gives the order of the entry.  Returns the weight of
+// the tee transition of the NetInst
+real WFSTDecoderLite::addPropagationEntry(
+    PropagationChunk* chunk, const Token* tok, WFSTTransition* trans)
+{
+    bool added;
+    PropagationTargets::Target* t = chunk->targets.get(trans->id, &added);
+    NetInst* inst = NULL;
+    if (added) {
+        inst = netInsts.find(trans->id);
+        t->entry = -1;
+        t->teeWeight = (inst != NULL ? inst->teeWeight : hmmModels->getTeeLogProb(trans->inLabel - 1));
+    }
+
+    score_t score = tok->score + trans->weight;
+    int order = chunk->nEntries++;
+    if (t->entry >= 0 && !(score > t->score))
+        return t->teeWeight;
+
+    vector<PropagationEntry>& entries = chunk->entries[trans->id & propPartMask];
+    if (chunk->toks.empty() || !sameToken(chunk->toks.back(), *tok))
+        chunk->toks.push_back(*tok);
+    if (t->entry < 0) {
+        if (!added)
+            inst = netInsts.find(trans->id);
+        if (inst == NULL) {
+            PropagationChunk::Unattached u = {trans->id & propPartMask, (int)entries.size(), *trans};
+            chunk->unattached.push_back(u);
+        }
+        t->entry = entries.size();
+        entries.push_back(PropagationEntry());
+        entries[t->entry].inst = inst;
+        entries[t->entry].order = order;
+    }
+    PropagationEntry& e = entries[t->entry];
+    e.tok = chunk->toks.size() - 1;
+    e.score = score;
+    e.weight = trans->weight;
+    t->score = score;
+    return t->teeWeight;
+}
+
+// enterEntryState() and the end of the turn of the sources in
+// doHMMExternalPropagation(), for the NetInsts of |part|.  An activated
+// NetInst keeps its entry token in |part| until the merge gives it tokens
+void WFSTDecoderLite::propagatePartitionEntries(PropagationPartition* part) {
+    unsigned int p = part - &propParts[0];
+    part->activations.clear();
+    part->nReturned = 0;
+    part->bestEmitScore = LOG_ZERO;
+#ifndef OPT_SINGLE_BEST
+    part->bestStartScore = LOG_ZERO;
+#endif
+    for (int c = 0; c < nPropChunks; ++c) {
+        const PropagationChunk& chunk = propChunks[c];
+        const vector<PropagationEntry>& entries = chunk.entries[p];
+        for (unsigned int i = 0; i < entries.size(); ++i) {
+            const PropagationEntry& e = entries[i];
+            NetInst* inst = e.inst;
+            if (e.tok < 0) {
+                assert(inst->nActiveHyps >= 0);
+                if (--inst->nActiveHyps == 0) {
+                    inst->tokens = -1;
+                    returnedInsts[e.order] = true;
+                    ++part->nReturned;
+                }
+                continue;
+            }
+
+            if (inst->nActiveHyps == 0) {
+                PropagationPartition::Activation a;
+                a.order = chunk.firstEntry + e.order;
+                a.inst = inst;
+                a.tok = nullToken;
+                inst->tokens = -2 - (int)part->activations.size();
+                part->activations.push_back(a);
+            }
+
+            int res = inst->tokens;
+            Token* pending = (res < 0 ? &part->activations[-2-res].tok : NULL);
+            score_t score = (pending != NULL ? pending->score : tokens->score[res]);
+            if (e.score > score) {
+                if (score <= LOG_ZERO)
+                    ++inst->nActiveHyps;
+
+                const Token& tok = chunk.toks[e.tok];
+                Token entry;
+                entry.score = e.score;
+                entry.acousticScore = tok.acousticScore;
+                entry.lmScore = tok.lmScore + e.weight;
+                entry.path = mergedPath(tok.path);
+                if (pending != NULL)
+                    *pending = entry;
+                else
+                    tokens->set(res, entry);
+
+                if (e.score > part->bestEmitScore)
+                    part->bestEmitScore = e.score;
+#ifndef OPT_SINGLE_BEST
+                if (e.score > part->bestStartScore)
+                    part->bestStartScore = e.score;
+#endif
+            }
+        }
+    }
+}
+
+// create the path of the decoder for a path of a chunk
+Path* WFSTDecoderLite::mergePath(Path* p) {
+    assert(p->refCount == CHUNK_PATH);
+    Path* q = createNewNoRefPath();
+    q->frame = p->frame;
+    q->score = p->score;
+    q->acousticScore = p->acousticScore;
+    q->lmScore = p->lmScore;
+    q->label = p->label;
+    q->prev = mergedPath(p->prev);
+    if (q->prev != NULL)
+        refPath(q->prev);
+    p->link = q;
+    return q;
+}
+
+
+};
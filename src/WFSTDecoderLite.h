@@ -16,6 +16,7 @@
 #define _WFSTDECODERLITE_H
 
 #include <vector>
+#include <deque>
 #include <TracterObject.h>
 
 #include "WFSTNetwork.h"
@@ -24,6 +25,7 @@
 #include "DecHypHistPool.h"
 #include "Decoder.h"
 #include "Histogram.h"
+#include "WorkerPool.h"
 
 using namespace std;
 
@@ -50,7 +52,7 @@ namespace Juicer
         int refCount;               /* counts this path is referred by other path's prev field */
         bool directlyUsedByToken;   /* normally false, used during path collection */
 #ifdef PARTIAL_DECODING
-        int jointCount;   /* how many paths go via this one */
+        int jointCount;   /* marks the paths walked by tracePartialPath() */
 #endif
     } Path;
 
@@ -63,23 +65,225 @@ namespace Juicer
 
     /* an NetInst is attached to each non-eplison transition */
     typedef struct NetInst_ {
-        struct NetInst_* next;
-
         int hmmIndex;
         int nStates;
         int nActiveHyps;
-        WFSTTransition* trans;  // the transition this inst is attached to
+        int tokens;             // index of the entry state in the TokenStore of the
+                                // frame, the nStates states (including non-emitting
+                                // entry and exit states) follow it; -1 when inactive,
+                                // -2-i while it is the i-th activation of its
+                                // PropagationPartition
+        WFSTTransition trans;   // copy of the transition this inst is attached to
         real teeWeight;
-        Token states[];         // states[nStates] including non-emitting entry and exit states
-                                // NetInst + states[n] are allocated by stateNPools
     } NetInst;
 
+    /* the tokens of the active NetInsts, a field per array so that a pass
+       over the states touches only the fields it needs.  The decoder keeps
+       two: HMM internal propagation reads one and writes the survivors of
+       each frame to the other, back to back in active list order */
+    class TokenStore {
+    public:
+        TokenStore();
+        ~TokenStore();
+
+        score_t* score;
+        score_t* acousticScore;
+        real* lmScore;
+        Path** path;
+
+        // index of n more tokens, not initialised; the arrays may move
+        int alloc(int n) {
+            if (size + n > capacity)
+                grow(size + n);
+            int i = size;
+            size += n;
+            return i;
+        }
+        // drop the tokens from index i on
+        void truncate(int i) { size = i; }
+        void clear() { size = 0; }
+        int getSize() const { return size; }
+
+        void get(int i, Token* tok) const {
+            tok->score = score[i];
+            tok->acousticScore = acousticScore[i];
+            tok->lmScore = lmScore[i];
+            tok->path = path[i];
+        }
+        void set(int i, const Token& tok) {
+            score[i] = tok.score;
+            acousticScore[i] = tok.acousticScore;
+            lmScore[i] = tok.lmScore;
+            path[i] = tok.path;
+        }
+        void setNull(int i);
+
+    private:
+        int size;
+        int capacity;
+        void grow(int minCapacity);
+    };
+
+    /* maps transition ids to their attached NetInsts, an open addressing
+       hash table kept by each decoder so that the network is never written
+       and can be shared by several decoders */
+    class NetInstMap {
+    public:
+        NetInstMap();
+        ~NetInstMap();
+
+        NetInst* find(int transID) const {
+            unsigned int i = hash(transID);
+            while (entries[i].inst != NULL) {
+                if (entries[i].transID == transID)
+                    return entries[i].inst;
+                i = (i + 1) & mask;
+            }
+            return NULL;
+        }
+        void insert(int transID, NetInst* inst);
+        void clear();
+        int size() const { return nEntries; }
+
+    private:
+        struct Entry {
+            int transID;
+            NetInst* inst;
+        };
+        Entry* entries;
+        unsigned int mask;    // capacity - 1, capacity is a power of 2
+        int nEntries;
+
+        unsigned int hash(int transID) const {
+            return ((unsigned int)transID * 2654435761u) & mask;
+        }
+        void grow();
+    };
+
+    /* the best token a chunk of external propagation on several threads
+       passes to the entry state of |inst| between two turns of |inst| as a
+       source, or, with tok -1, the end of the turn of |inst| as the source
+       at position |order| in activeInsts */
+    typedef struct PropagationEntry_ {
+        NetInst* inst;      // NULL until the merge attaches one
+        int tok;            // index in the tokens of the chunk
+        int order;          // of the first token among those of the chunk
+        score_t score;      // in the entry state
+        real weight;        // of the transition
+    } PropagationEntry;
+
+    /* the current PropagationEntry of a chunk for each transition entered,
+       an open addressing hash table cleared for each frame */
+    class PropagationTargets {
+    public:
+        struct Target {
+            int transID;
+            int stamp;          // entries from other frames are free
+            int entry;          // in the entries of the partition, -1 for none
+            score_t score;      // of the entry
+            real teeWeight;
+        };
+
+        PropagationTargets();
+
+        // the target for transID, with *added set if it is new
+        Target* get(int transID, bool* added) {
+            unsigned int i = hash(transID);
+            while (entries[i].stamp == stamp) {
+                if (entries[i].transID == transID) {
+                    *added = false;
+                    return &entries[i];
+                }
+                i = (i + 1) & mask;
+            }
+            if (2 * (nEntries + 1) > (int)(mask + 1))
+                return grow(transID, added);
+            entries[i].transID = transID;
+            entries[i].stamp = stamp;
+            ++nEntries;
+            *added = true;
+            return &entries[i];
+        }
+        void clear();
+
+    private:
+        vector<Target> entries;
+        unsigned int mask;    // capacity - 1, capacity is a power of 2
+        int nEntries;
+        int stamp;
+
+        unsigned int hash(int transID) const {
+            return ((unsigned int)transID * 2654435761u) & mask;
+        }
+        Target* grow(int transID, bool* added);
+    };
+
+    /* a slice of activeInsts propagated by one task when tokens are
+       propagated on several threads, with what it leaves to the serial
+       steps.  The slices do not depend on the number of threads, and the
+       serial steps take them in order, so neither does the result */
+    typedef struct PropagationChunk_ {
+        unsigned int first;     // [first, last) in activeInsts
+        unsigned int last;
+        int tokens;             // index of its first token in newTokens
+
+        // HMM internal propagation
+        vector<int> gmms;       // for requestHMMOutputs()
+        struct EmitState {
+            int token;          // in newTokens, its output not added yet
+            int hmmIndex;
+            int state;
+        };
+        vector<EmitState> emitStates;
+        int nEmitHypsProcessed;
+        int nActiveEmitHyps;
+        int nActiveEndHyps;
+#ifndef OPT_SINGLE_BEST
+        real bestEndScore;
+#endif
+
+        // HMM external propagation
+        vector<Token> toks;     // the tokens passed on
+        PropagationTargets targets;
+        deque<Path> paths;      // word boundaries, created by the merge
+        vector< vector<PropagationEntry> > entries;  // by partition of the NetInst
+        struct Unattached {
+            int partition;
+            int entry;
+            WFSTTransition trans;
+        };
+        vector<Unattached> unattached;  // entries with no NetInst yet
+        int nEntries;
+        int firstEntry;         // entries of the chunks before it
+        Token finalTok;         // best token reaching the final state, before
+        real finalWeight;       // the final weight is added and the labels of
+        const WFSTEpsClosure* finalClosure;  // an epsilon path
+        int nEndHypsProcessed;
+    } PropagationChunk;
+
+    /* the NetInsts whose transition ids are equal modulo the number of
+       partitions, a power of 2; a task replays the entries to them in the
+       order of the serial decoder */
+    typedef struct PropagationPartition_ {
+        struct Activation {
+            int order;          // of the entry, counted over all chunks
+            NetInst* inst;
+            Token tok;          // for its entry state
+        };
+        vector<Activation> activations;  // tokens are allocated by the merge
+        int nReturned;
+        real bestEmitScore;
+#ifndef OPT_SINGLE_BEST
+        real bestStartScore;
+#endif
+    } PropagationPartition;
+
     class WFSTDecoderLite : public IDecoder,
                             public Tracter::Object
     {
     public:
         WFSTDecoderLite(
-            WFSTNetwork*network_ ,
+            const WFSTNetwork* network_ ,
             IModels *models_ ,
             real phoneStartPruneWin_,
             real emitPruneWin_,
@@ -106,18 +310,25 @@ namespace Juicer
         bool modelLevelOutput() { return false ; } ;
         WFSTLattice *getLattice() { return 0 ; } ;
 
+        // propagate the tokens of each frame on nThreads threads, the
+        // caller's included; the models are still asked for the GMM
+        // outputs by the caller alone, in the order of the serial decoder,
+        // so the result does not depend on nThreads
+        void setPropagationThreads(int nThreads);
+
     protected:
         // essential variables for decoding
         // need to be reset for each utterance
-        Token* tokenBuf;      /* temp updated tokens */
         Path noRefList;       /* list of paths that has no reference (refCount is 0) */
         Path noRefListTail;
         Path yesRefList;      /* Path with refCount > 0 */
         Path yesRefListTail;
 
-        NetInst* activeNetInstList;
-        NetInst* newActiveNetInstList;
-        NetInst* newActiveNetInstListLastElem;
+        vector<NetInst*> activeInsts;      /* processed in this order */
+        vector<NetInst*> newActiveInsts;   /* activated since the last joinNewActiveInstList(), oldest first */
+        TokenStore tokenStores[2];
+        TokenStore* tokens;       /* tokens of the active NetInsts */
+        TokenStore* newTokens;    /* written by HMM internal propagation */
 
         int currFrame;
         int nPath;           /* # of all paths in lists */
@@ -143,6 +354,7 @@ namespace Juicer
         real currEndPruneThresh;
         real currWordPruneThresh;
         real currEmitPruneThresh;
+        bool boundOutputs;   // let the models reject GMMs below the beam
 
         int maxAllocModels; // free up all NetInsts when this limit is reached
 
@@ -154,26 +366,29 @@ namespace Juicer
         int totalActiveEndHyps;
         int totalProcEmitHyps;
         int totalProcEndHyps;
+        int totalDenseFrames;
+        int totalRejectedEmitHyps;
+        double totalSearchTime;   // wall time of token propagation, GMM outputs included
+        vector<char> outputModes; // 'D' where the models scored all GMMs, 'L' otherwise
 
         int nActiveEmitHyps;
         int nActiveEndHyps;
         int nActiveInsts;
 
         int nEmitHypsProcessed;
+        int nEmitHypsRejected;
         int nEndHypsProcessed;
 
         int nAllocInsts;
+        NetInstMap netInsts;   // NetInst attached to each transition
 
         // other resources
         IModels* hmmModels;
-        WFSTNetwork* network;
-        int maxNStates;
+        const WFSTNetwork* network;  // shared, never written by the decoder
 
         // memory resources
         BlockMemPool* pathPool;
-        BlockMemPool** stateNPools;
-
-        int nStatePools;
+        BlockMemPool* instPool;
 
         /* compatible with WFSTDecoder interface */
         BlockMemPool   *dhhPool;
@@ -188,13 +403,52 @@ namespace Juicer
         void movePathYesRefList(Path* p);
         void movePathYesRefListTail(Path* p);
         void resetPathLists();
-        void propagateToken(Token* tok, WFSTTransition* trans);
+        // with a |chunk|, these leave the NetInsts, paths and best scores
+        // alone and record what they pass on in the chunk instead
+        void propagateToken(Token* tok, WFSTTransition* trans, PropagationChunk* chunk = NULL);
+        void propagateTokenClosure(Token* tok, const WFSTEpsClosure* closure, PropagationChunk* chunk = NULL);
+        void addClosureLabels(Token* tok, int firstLabel, int nLabels, PropagationChunk* chunk = NULL);
+        void enterNetInst(Token* tok, WFSTTransition* trans, PropagationChunk* chunk = NULL);
+        NetInst* enterEntryState(const Token* tok, WFSTTransition* trans);
+        Path* createNewPath(PropagationChunk* chunk);
         NetInst* attachNetInst(WFSTTransition* trans);
+        void activateNetInst(NetInst* inst);
         void joinNewActiveInstList();
-        NetInst* returnNetInst(NetInst* inst, NetInst* prevInst);
+        void returnNetInst(NetInst* inst);
         virtual void doHMMInternalPropagation(); // to be overloaded in WFSTDecoderLiteThreading
         void doHMMExternalPropagation();
         void HMMInternalPropagation(NetInst* inst);
+        score_t HMMExitPropagation(NetInst* inst);
+        void requestHMMOutputs();
+        void requestHMMOutputs(unsigned int first, unsigned int last, vector<int>* gmms);
+
+        vector<int> batchGMMs;  // GMMs requested in the current frame
+
+        // parallel token propagation
+        WorkerPool* propPool;   // NULL to propagate on the caller's thread
+        vector<PropagationChunk> propChunks;
+        int nPropChunks;
+        vector<PropagationPartition> propParts;  // a power of 2
+        int propPartMask;       // of the transition ids, for their partition
+        vector<char> returnedInsts;   // by position in activeInsts
+        typedef void (WFSTDecoderLite::*ChunkTask)(PropagationChunk* chunk);
+        typedef void (WFSTDecoderLite::*PartitionTask)(PropagationPartition* part);
+        ChunkTask chunkTask;
+        PartitionTask partitionTask;
+        void runChunkTasks(ChunkTask task);
+        void runPartitionTasks(PartitionTask task);
+        static void runChunkTask(void* arg, int i);
+        static void runPartitionTask(void* arg, int i);
+        void splitActiveInsts();
+        void parallelInternalPropagation();
+        void parallelExternalPropagation();
+        void requestChunkOutputs(PropagationChunk* chunk);
+        void propagateChunkEmitStates(PropagationChunk* chunk);
+        void propagateChunkExitStates(PropagationChunk* chunk);
+        void propagateChunkExits(PropagationChunk* chunk);
+        real addPropagationEntry(PropagationChunk* chunk, const Token* tok, WFSTTransition* trans);
+        void propagatePartitionEntries(PropagationPartition* part);
+        Path* mergePath(Path* p);
 
 #ifdef PARTIAL_DECODING
         vector<Path*> partialPaths; // list of joint Path node in the hypothesis network
@@ -204,6 +458,12 @@ namespace Juicer
         int partialTraceInterval;   // in terms of frames
     public:
         void setPartialDecodeOptions(int traceInterval);
+
+        // the paths all hypotheses go through, oldest first, found by
+        // tracing every traceInterval frames; they stay until the next
+        // recognitionStart()
+        int getNumPartialPaths() { return partialPaths.size(); }
+        const Path* getPartialPath(int i) { return partialPaths[i]; }
 #endif
 
 
@@ -8,8 +8,8 @@
  *
  * See the file COPYING for the licence associated with this software.
  *
- * WFSTDecoderLiteThreading.cpp  -  WFST decoder based on token-passing principle that uses a separate 
- * thread to handle GMM calculation. It can only handle HMMs with one to-exit transition, not counting tee transitions. 
+ * WFSTDecoderLiteThreading.cpp  -  WFST decoder based on token-passing principle that uses separate
+ * threads to handle GMM calculation. It can only handle HMMs with one to-exit transition, not counting tee transitions. 
  * Which is the case for all left-to-right HMMs commonly used in speech recognition.
  *
  */
@@ -19,6 +19,7 @@
 #endif
 
 #include <cassert>
+#include <algorithm>
 
 #include "LogFile.h"
 #include "WFSTDecoderLiteThreading.h"
@@ -31,7 +32,7 @@ namespace Juicer {
 
 
 WFSTDecoderLiteThreading::WFSTDecoderLiteThreading(
-    WFSTNetwork* network_ ,
+    const WFSTNetwork* network_ ,
     IModels *models_ ,
     real phoneStartPruneWin_,
     real emitPruneWin_,
@@ -94,80 +95,78 @@ void WFSTDecoderLiteThreading::doHMMInternalPropagation() {
         }
 
         unsigned long oldGMMQueued = gmmQueued;
-        NetInst* prevInst = NULL;
-        NetInst* inst = activeNetInstList;
-        while (inst) {
+        newTokens->clear();
+        unsigned int nKept = 0;
+        for (unsigned int k = 0; k < activeInsts.size(); ++k) {
+            NetInst* inst = activeInsts[k];
+
             // language model pruning
-            Token* entry = inst->states;
-            if (entry->score > LOG_ZERO && entry->score < currStartPruneThresh) {
-                *entry = nullToken;
+            int entry = inst->tokens;
+            if (tokens->score[entry] > LOG_ZERO && tokens->score[entry] < currStartPruneThresh) {
+                tokens->setNull(entry);
                 --inst->nActiveHyps;
             }
 
+            int res = newTokens->getSize();
             if (inst->nActiveHyps > 0) 
                 HMMInternalPropagationPass1(inst);
 
             // post-emitting pruning
             assert(inst->nActiveHyps >= 0);
             if (inst->nActiveHyps == 0) {
-                inst = returnNetInst(inst, prevInst);
+                newTokens->truncate(res);
+                returnNetInst(inst);
             } else {
-                prevInst = inst;
-                inst = inst->next;
+                activeInsts[nKept++] = inst;
             }
         }
+        activeInsts.resize(nKept);
 
 
     {
-        // process all hmm emitting states in queue
-        int i = 0;
-        int j = -1;
-        while (waiting > j) {
-            j = threadHMMModels->nReadyStates();
-            if ((j >= waiting) || (j > (i+5))) {
-                for(;i<=j;i++){
-                    int gmmInd = waitGMMs[i];
-                    real outp = threadHMMModels->readOutput(gmmInd);
-
-                    for (int k = 0; k < waitStateQueue[gmmInd].size(); ++k) {
-                        WaitState ws = waitStateQueue[gmmInd][k];
-                        Token* res = ws.inst->states + ws.state;
-                        res->score += outp;
-                        res->acousticScore += outp;
-                        if (emitHypsHistogram) {
-                            emitHypsHistogram->addScore(res->score, LOG_ZERO);
-                        }
-                        if (res->score > bestEmitScore)
-                            bestEmitScore = res->score;
-
-                        // process exit state
-                        int N_1 = ws.inst->nStates-1;
-                        if (ws.state == N_1-1) {
-                            Token* exit = res+1;
-                            assert(exit == &ws.inst->states[N_1]);
-                            *exit = *res;
-                            real** trP = threadHMMModels->getTransMat(ws.inst->hmmIndex);
-                            exit->score += trP[ws.state][N_1];
-                            exit->acousticScore += trP[ws.state][N_1];
+        // process all hmm emitting states in queue, in the order the
+        // GMMs were queued so the earliest ones are usually done
+        TokenStore& to = *newTokens;
+        for (int i = 0; i <= waiting; i++) {
+            int gmmInd = waitGMMs[i];
+            real outp = threadHMMModels->waitOutput(gmmInd);
+
+            for (int k = 0; k < waitStateQueue[gmmInd].size(); ++k) {
+                WaitState ws = waitStateQueue[gmmInd][k];
+                int res = ws.inst->tokens + ws.state;
+                to.score[res] += outp;
+                to.acousticScore[res] += outp;
+                if (emitHypsHistogram) {
+                    emitHypsHistogram->addScore(to.score[res], LOG_ZERO);
+                }
+                if (to.score[res] > bestEmitScore)
+                    bestEmitScore = to.score[res];
+
+                // process exit state
+                int N_1 = ws.inst->nStates-1;
+                if (ws.state == N_1-1) {
+                    int exit = res+1;
+                    real** trP = threadHMMModels->getTransMat(ws.inst->hmmIndex);
+                    to.score[exit] = to.score[res] + trP[ws.state][N_1];
+                    to.acousticScore[exit] = to.acousticScore[res] + trP[ws.state][N_1];
+                    to.lmScore[exit] = to.lmScore[res];
+                    to.path[exit] = to.path[res];
 #ifndef OPT_SINGLE_BEST
-                            if (exit->score > bestEndScore)
-                                bestEndScore = cur->score;
+                    if (to.score[exit] > bestEndScore)
+                        bestEndScore = to.score[exit];
 #else
-                            // exit->score is always smaller than res->score
-                            // so no point to compare with bestEmitScore in this case
-                            // if (exit->score > bestEmitScore)
-                            //     bestEmitScore = exit->score;
+                    // exit->score is always smaller than res->score
+                    // so no point to compare with bestEmitScore in this case
+                    // if (exit->score > bestEmitScore)
+                    //     bestEmitScore = exit->score;
 #endif
-                            ++ws.inst->nActiveHyps;
-                            ++nActiveEndHyps;
-                        }
-                    }
+                    ++ws.inst->nActiveHyps;
+                    ++nActiveEndHyps;
                 }
-            } else {
             }
         }
-        threadHMMModels->sync();
     }
+    std::swap(tokens, newTokens);
 
     totalActiveEmitHyps += nActiveEmitHyps;
     totalActiveEndHyps += nActiveEndHyps;
@@ -178,64 +177,70 @@ void WFSTDecoderLiteThreading::doHMMInternalPropagation() {
 // internal propagation: scan all emitting states and add states to wait queue 
 void WFSTDecoderLiteThreading::HMMInternalPropagationPass1(NetInst* inst) {
     int N_1 = inst->nStates - 1; // nStates-1 is the only way nStates will be used here
-    Token* res;
-    Token* cur;
     real** trP = threadHMMModels->getTransMat(inst->hmmIndex);
     SEIndex* se = threadHMMModels->getSEIndex(inst->hmmIndex);
+    int cur = inst->tokens;
+    int res = newTokens->alloc(inst->nStates);
+    const TokenStore& from = *tokens;
+    TokenStore& to = *newTokens;
 
+    inst->tokens = res;
     inst->nActiveHyps = 0;
     
     // <<Token propagation of emitting states>>
     {
+        // the entry token is nullToken ready for next propagation, the
+        // exit one stays null unless the last emitting state is scored
+        to.setNull(res);
+        to.setNull(res+N_1);
+
         // scan emitting states first
-        res = tokenBuf+1;
-        for (int j = 1 ; j < N_1; ++j, ++res) {
+        for (int j = 1 ; j < N_1; ++j) {
             int i = se[j].start;
             int endi = se[j].end;
-            cur = &inst->states[i];
-            
-            // assume a transition from i to j
-            *res = *cur;
-            
-            res->score += trP[i][j];
-            res->acousticScore += trP[i][j];
+            int best = i;
+            score_t score = from.score[cur+i] + trP[i][j];
             
             // then compare with all other possible incoming transitions
-            for (++i, ++cur; i < endi; ++i, ++cur) {
-                score_t tmpScore = cur->score + trP[i][j];
-                if (tmpScore > res->score) {
-                    *res = *cur;
-                    res->score = tmpScore;
-                    res->acousticScore += trP[i][j];
+            for (++i; i < endi; ++i) {
+                score_t tmpScore = from.score[cur+i] + trP[i][j];
+                if (tmpScore > score) {
+                    score = tmpScore;
+                    best = i;
                 }
             }
             // add output probability if above emitting threshold
-            res->score -= normaliseScore;
-            if (res->score > currEmitPruneThresh) {
+            score -= normaliseScore;
+            if (score > currEmitPruneThresh) {
                 ++nEmitHypsProcessed;
                 ++gmmRequested;
+                to.score[res+j] = score;
+                to.acousticScore[res+j] = from.acousticScore[cur+best] + trP[best][j];
+                to.lmScore[res+j] = from.lmScore[cur+best];
+                to.path[res+j] = from.path[cur+best];
 
                 real outp;
                 int gmmInd = threadHMMModels->gmmInd(inst->hmmIndex, j);
                 if (threadHMMModels->cachedOutput(gmmInd, &outp)) {
-                    res->score += outp;
-                    res->acousticScore += outp;
+                    to.score[res+j] += outp;
+                    to.acousticScore[res+j] += outp;
                     if (emitHypsHistogram) {
-                        emitHypsHistogram->addScore(res->score, LOG_ZERO);
+                        emitHypsHistogram->addScore(to.score[res+j], LOG_ZERO);
                     }
-                    if (res->score > bestEmitScore)
-                        bestEmitScore = res->score;
+                    if (to.score[res+j] > bestEmitScore)
+                        bestEmitScore = to.score[res+j];
                     ++gmmCalced;
 
                     // pass to exit state
                     if (j == N_1-1) {
-                        Token* exit = &inst->states[N_1];
-                        *exit = *res;
-                        exit->score += trP[j][N_1];
-                        exit->acousticScore += trP[j][N_1];
+                        int exit = res+N_1;
+                        to.score[exit] = to.score[res+j] + trP[j][N_1];
+                        to.acousticScore[exit] = to.acousticScore[res+j] + trP[j][N_1];
+                        to.lmScore[exit] = to.lmScore[res+j];
+                        to.path[exit] = to.path[res+j];
 #ifndef OPT_SINGLE_BEST
-                        if (exit->score > bestEndScore)
-                            bestEndScore = cur->score;
+                        if (to.score[exit] > bestEndScore)
+                            bestEndScore = to.score[exit];
 #else
                         // exit->score is always smaller than res->score
                         // so no point to compare with bestEmitScore in this case
@@ -261,25 +266,16 @@ void WFSTDecoderLiteThreading::HMMInternalPropagationPass1(NetInst* inst) {
                 }
             } else {
                 // pruned away
-                *res = nullToken;
+                to.setNull(res+j);
             }
         }
 
-        // in singleToExitTransitionModel res is the only emitting state that goes to exit state
-        if ((res-1)->score <= LOG_ZERO) {
-            inst->states[N_1] = nullToken;
-        }
-        
-        // copy all result tokens back to the instance, the entry token (tokenBuf[0]) is nullToken
-        // ready for next propagation
-        res = tokenBuf;
-        cur = inst->states;
+        // count the active tokens, those waiting for their GMM included
         for (int i = 0; i < N_1; ++i) {
-            if (res->score > LOG_ZERO) {
+            if (to.score[res+i] > LOG_ZERO) {
                 ++inst->nActiveHyps;
                 ++nActiveEmitHyps;
             }
-            *cur++ = *res++;
         }
     }
 }
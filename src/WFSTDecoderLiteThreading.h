@@ -33,7 +33,7 @@ namespace Juicer
     {
     public:
         WFSTDecoderLiteThreading(
-            WFSTNetwork*network_ ,
+            const WFSTNetwork* network_ ,
             IModels *models_ ,
             real phoneStartPruneWin_,
             real emitPruneWin_,
@@ -10,8 +10,16 @@
  */
 
 #include <assert.h>
+#include <vector>
+#include <map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include "WFSTNetwork.h"
+#include "WFSTBuilder.h"
 #include "log_add.h"
 
 using namespace Torch;
@@ -30,6 +38,146 @@ using namespace Torch;
 namespace Juicer {
 
 
+//****** Text file scanning ******
+
+// Text FSM and symbols files are mapped and scanned in place.  The
+// scanners read fields as the sscanf() calls they replace did, but never
+// past the end of the line.
+
+static const char *mapTextFile( const char *fname , long *len , const char *who )
+{
+   int fd ;
+   struct stat st ;
+   if ( (fd = open( fname , O_RDONLY )) < 0 )
+      error("%s - error opening %s" , who , fname ) ;
+   if ( fstat( fd , &st ) != 0 )
+      error("%s - error reading %s" , who , fname ) ;
+   *len = st.st_size ;
+   if ( *len == 0 )
+   {
+      close( fd ) ;
+      return NULL ;
+   }
+   void *map = mmap( NULL , *len , PROT_READ , MAP_PRIVATE , fd , 0 ) ;
+   close( fd ) ;
+   if ( map == MAP_FAILED )
+      error("%s - error mapping %s" , who , fname ) ;
+   madvise( map , *len , MADV_SEQUENTIAL ) ;
+   return (const char *)map ;
+}
+
+static inline bool isBlank( char c )
+{
+   return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\v') || (c == '\f') ;
+}
+
+// Up to |max| whitespace separated fields of the line [p,end); returns
+// the number found
+static int splitFields( const char *p , const char *end , const char **fields , int max )
+{
+   int n = 0 ;
+   while ( n < max )
+   {
+      while ( (p < end) && isBlank( *p ) )
+         p++ ;
+      if ( p == end )
+         break ;
+      fields[n++] = p ;
+      while ( (p < end) && !isBlank( *p ) )
+         p++ ;
+   }
+   return n ;
+}
+
+// Leading integer of a field, as %d
+static bool scanInt( const char *p , const char *end , int *val )
+{
+   bool neg = false ;
+   if ( (p < end) && ((*p == '-') || (*p == '+')) )
+      neg = ( *p++ == '-' ) ;
+   if ( (p == end) || (*p < '0') || (*p > '9') )
+      return false ;
+   long v = 0 ;
+   while ( (p < end) && (*p >= '0') && (*p <= '9') )
+   {
+      if ( v < 0x7fffffffL )
+         v = v*10 + (*p - '0') ;
+      p++ ;
+   }
+   if ( v > 0x7fffffffL )
+      v = 0x7fffffffL ;
+   *val = (int)( neg ? -v : v ) ;
+   return true ;
+}
+
+// Leading floating point number of a field, as %f, including inf
+static bool scanFloat( const char *p , const char *end , float *val )
+{
+   static const double pow10[] = {
+      1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+   } ;
+   bool neg = false ;
+   if ( (p < end) && ((*p == '-') || (*p == '+')) )
+      neg = ( *p++ == '-' ) ;
+   if ( (end - p >= 3) && (strncasecmp( p , "inf" , 3 ) == 0) )
+   {
+      *val = neg ? -HUGE_VAL : HUGE_VAL ;
+      return true ;
+   }
+
+   // Up to 18 significant digits in an integer, then the exponent
+   long long mant = 0 ;
+   int nDigits = 0 , exp10 = 0 ;
+   bool any = false ;
+   while ( (p < end) && (*p >= '0') && (*p <= '9') )
+   {
+      if ( nDigits < 18 )
+      {
+         mant = mant*10 + (*p - '0') ;
+         if ( mant > 0 )
+            nDigits++ ;
+      }
+      else
+         exp10++ ;
+      any = true ;
+      p++ ;
+   }
+   if ( (p < end) && (*p == '.') )
+   {
+      p++ ;
+      while ( (p < end) && (*p >= '0') && (*p <= '9') )
+      {
+         if ( nDigits < 18 )
+         {
+            mant = mant*10 + (*p - '0') ;
+            if ( mant > 0 )
+               nDigits++ ;
+            exp10-- ;
+         }
+         any = true ;
+         p++ ;
+      }
+   }
+   if ( ! any )
+      return false ;
+   if ( (end - p >= 2) && ((*p == 'e') || (*p == 'E')) )
+   {
+      int e ;
+      if ( scanInt( p+1 , end , &e ) )
+         exp10 += e ;
+   }
+
+   double v = (double)mant ;
+   if ( exp10 < 0 )
+      v = ( exp10 >= -22 ) ? v / pow10[-exp10] : v * pow( 10.0 , exp10 ) ;
+   else if ( exp10 > 0 )
+      v = ( exp10 <= 22 ) ? v * pow10[exp10] : v * pow( 10.0 , exp10 ) ;
+   *val = (float)( neg ? -v : v ) ;
+   return true ;
+}
+
+
 //****** WFSTAlphabet Implementation ******
 
 
@@ -41,14 +189,15 @@ WFSTAlphabet::WFSTAlphabet()
    labels = NULL ;
    nAux = 0 ;
    isAux = NULL ;
+   labelArena = NULL ;
+   index = NULL ;
+   indexMask = 0 ;
    fromBinFile = false ;
 }
 
 
 WFSTAlphabet::WFSTAlphabet( const char *symbolsFilename )
 {
-   FILE *fd ;
-   char *line , *symStr ;
    int symID , i ;
 
    maxLabel = -1 ;
@@ -57,37 +206,66 @@ WFSTAlphabet::WFSTAlphabet( const char *symbolsFilename )
    labels = NULL ;
    nAux = 0 ;
    isAux = NULL ;
+   labelArena = NULL ;
+   index = NULL ;
+   indexMask = 0 ;
 
    if ( symbolsFilename == NULL )
       error("WFSTAlphabet::WFSTAlphabet - symbolsFilename is NULL") ;
 
-   if ( (fd = fopen( symbolsFilename , "rb" )) == NULL )
-      error("WFSTAlphabet::WFSTAlphabet - error opening symbols filename %s" , symbolsFilename ) ;
-
-   line = new char[10000] ;
-   symStr = new char[10000] ;
-   while ( (line = fgets( line , 10000 , fd )) != NULL )
+   // The symbols are gathered first so that their strings can be put in
+   // one block
+   long len ;
+   const char *text = mapTextFile( symbolsFilename , &len , "WFSTAlphabet::WFSTAlphabet" ) ;
+   const char *end = text + len ;
+   const char *line , *eol ;
+   vector<int> symIDs , symLens ;
+   vector<const char *> syms ;
+   long arenaSize = 0 ;
+   for ( line=text ; line<end ; line=eol+1 )
    {
-      if ( sscanf( line , "%s %d" , symStr , &symID ) != 2 )
+      // "symbol id"
+      if ( (eol = (const char *)memchr( line , '\n' , end - line )) == NULL )
+         eol = end ;
+      const char *fields[2] ;
+      if ( (splitFields( line , eol , fields , 2 ) != 2) || !scanInt( fields[1] , eol , &symID ) )
          continue ;
+      const char *symEnd = fields[0] ;
+      while ( !isBlank( *symEnd ) )
+         symEnd++ ;
+      int symLen = (int)( symEnd - fields[0] ) ;
+      if ( symID < 0 )
+         error("WFSTAlphabet::WFSTAlphabet - negative id for symbol %.*s" , symLen , fields[0] ) ;
+
+      symIDs.push_back( symID ) ;
+      syms.push_back( fields[0] ) ;
+      symLens.push_back( symLen ) ;
+      arenaSize += symLen + 1 ;
+      if ( symID > maxLabel )
+         maxLabel = symID ;
+   }
 
-      if ( symID >= nLabelsAlloc )
-      {
-         labels = (char **)realloc( labels , (symID+1000)*sizeof(char *) ) ;
-         for ( i=nLabelsAlloc ; i<(symID+1000) ; i++ )
-            labels[i] = NULL ;
-         nLabelsAlloc = symID + 1000 ;
-      }
-
+   nLabelsAlloc = maxLabel + 1 ;
+   if ( nLabelsAlloc > 0 )
+   {
+      labels = (char **)malloc( nLabelsAlloc * sizeof(char *) ) ;
+      for ( i=0 ; i<nLabelsAlloc ; i++ )
+         labels[i] = NULL ;
+   }
+   labelArena = new char[arenaSize+1] ;
+   char *str = labelArena ;
+   for ( i=0 ; i<(int)syms.size() ; i++ )
+   {
+      symID = symIDs[i] ;
       if ( labels[symID] != NULL )
-         error("WFSTAlphabet::WFSTAlphabet - duplicate symbol detected for %s" , symStr ) ;
-
-      labels[symID] = new char[strlen(symStr)+1] ;
-      strcpy( labels[symID] , symStr ) ;
+         error("WFSTAlphabet::WFSTAlphabet - duplicate symbol detected for %.*s" ,
+               symLens[i] , syms[i] ) ;
 
+      labels[symID] = str ;
+      memcpy( str , syms[i] , symLens[i] ) ;
+      str[symLens[i]] = '\0' ;
+      str += symLens[i] + 1 ;
       nLabels++ ;
-      if ( symID > maxLabel )
-         maxLabel = symID ;
    }
 
    // Now allocate memory for isAux and do a pass through labels to determine
@@ -105,27 +283,67 @@ WFSTAlphabet::WFSTAlphabet( const char *symbolsFilename )
          isAux[i] = false ;
    }
 
-   delete [] line ;
-   delete [] symStr ;
-   fclose( fd ) ;
+   if ( text != NULL )
+      munmap( (void *)text , len ) ;
    fromBinFile = false ;
+   buildIndex() ;
 }
 
 
 WFSTAlphabet::~WFSTAlphabet()
 {
-   int i ;
-
+   // The label strings are all in labelArena
    if ( labels != NULL )
    {
-      for ( i=0 ; i<nLabelsAlloc ; i++ )
-         delete [] labels[i] ;
       if ( fromBinFile )
          delete [] labels ;
       else
          free( labels ) ;
    }
+   delete [] labelArena ;
    delete [] isAux ;
+   delete [] index ;
+}
+
+
+// FNV-1a
+static unsigned int hashLabel( const char *label )
+{
+   unsigned int h = 2166136261u ;
+   for ( ; *label != '\0' ; label++ )
+      h = (h ^ (unsigned char)*label) * 16777619u ;
+   return h ;
+}
+
+
+// Hash table from label to index, open addressing with at most half the
+// slots used.  Labels are entered in index order, so a label given twice
+// is found at its lowest index, as the linear search did.
+void WFSTAlphabet::buildIndex()
+{
+   int n = 0 , nSlots = 16 ;
+   for ( int i=0 ; i<=maxLabel ; i++ )
+   {
+      if ( labels[i] != NULL )
+         n++ ;
+   }
+   while ( nSlots < 2*n )
+      nSlots *= 2 ;
+   delete [] index ;
+   index = new int[nSlots] ;
+   indexMask = nSlots - 1 ;
+   for ( int i=0 ; i<nSlots ; i++ )
+      index[i] = -1 ;
+
+   for ( int i=0 ; i<=maxLabel ; i++ )
+   {
+      if ( labels[i] == NULL )
+         continue ;
+      unsigned int h = hashLabel( labels[i] ) & indexMask ;
+      while ( index[h] >= 0 )
+         h = (h + 1) & indexMask ;
+      index[h] = i ;
+   }
 }
 
 
@@ -149,15 +367,15 @@ const char *WFSTAlphabet::getLabel( int index )
 
 int WFSTAlphabet::getIndex( const char *label )
 {
-   if ( (label == NULL) || (label[0] == '\0') )
+   if ( (label == NULL) || (label[0] == '\0') || (index == NULL) )
       return -1 ;
 
-   for ( int i=0 ; i<=maxLabel ; i++ )
+   unsigned int h = hashLabel( label ) & indexMask ;
+   while ( index[h] >= 0 )
    {
-      if ( labels[i] == NULL )
-         continue ;
-      if ( strcmp( label , labels[i] ) == 0 )
-         return i ;
+      if ( strcmp( label , labels[index[h]] ) == 0 )
+         return index[h] ;
+      h = (h + 1) & indexMask ;
    }
 
    return -1 ;
@@ -265,9 +483,11 @@ void WFSTAlphabet::readBinary( FILE *fd )
 
    if ( maxLabel >= 0 )
    {
-      // 2. Allocate and read labels array
+      // 2. Allocate and read labels array, the strings into one block
       nLabelsAlloc = maxLabel + 1 ;
       labels = new char*[nLabelsAlloc] ;
+      vector<long> offsets( nLabelsAlloc , -1 ) ;
+      vector<char> arena ;
       int i , len ;
       for ( i=0 ; i<=maxLabel ; i++ )
       {
@@ -275,15 +495,19 @@ void WFSTAlphabet::readBinary( FILE *fd )
             error("WFSTAlphabet::readBinary - error reading label length") ;
          if ( len > 0 )
          {
-            labels[i] = new char[len] ;
-            if ( (int)fread( labels[i] , sizeof(char) , len , fd ) != len )
+            offsets[i] = arena.size() ;
+            arena.resize( arena.size() + len ) ;
+            if ( (int)fread( &arena[offsets[i]] , sizeof(char) , len , fd ) != len )
                error("WFSTAlphabet::readBinary - error reading label string") ;
-            if ( labels[i][len-1] != '\0' )
+            if ( arena.back() != '\0' )
                error("WFSTAlphabet::readBinary - last char of label string was not nul") ;
          }
-         else
-            labels[i] = NULL ;
       }
+      labelArena = new char[arena.size()+1] ;
+      if ( ! arena.empty() )
+         memcpy( labelArena , &arena[0] , arena.size() ) ;
+      for ( i=0 ; i<=maxLabel ; i++ )
+         labels[i] = ( offsets[i] >= 0 ) ? labelArena + offsets[i] : NULL ;
 
       // 3. Read nAux and isAux array
       if ( fread( &nAux , sizeof(int) , 1 , fd ) != 1 )
@@ -294,11 +518,142 @@ void WFSTAlphabet::readBinary( FILE *fd )
    }
 
    fromBinFile = true ;
+   buildIndex() ;
 }
 
 
 //****** WFSTNetwork Implementation ******
 
+static bool inLabelLess( const WFSTTransition &a , const WFSTTransition &b )
+{
+   return a.inLabel < b.inLabel ;
+}
+
+
+// One line of an AT&T text FSM, as the cascade of sscanf() calls used to
+// read it: "from to in out [weight]" is a transition and "state [weight]"
+// a final state.  Returns 2 for a transition, 1 for a final state and 0
+// for anything else.
+static int scanFSMLine( const char *line , const char *eol , int *v , float *weight )
+{
+   const char *f[5] ;
+   int n = splitFields( line , eol , f , 5 ) ;
+   if ( (n >= 4) && scanInt( f[0] , eol , v ) && scanInt( f[1] , eol , v+1 ) &&
+        scanInt( f[2] , eol , v+2 ) && scanInt( f[3] , eol , v+3 ) )
+   {
+      if ( (n < 5) || !scanFloat( f[4] , eol , weight ) )
+         *weight = 0.0 ;
+      return 2 ;
+   }
+   if ( (n >= 1) && scanInt( f[0] , eol , v ) )
+   {
+      if ( (n < 2) || !scanFloat( f[1] , eol , weight ) )
+         *weight = 0.0 ;
+      return 1 ;
+   }
+   return 0 ;
+}
+
+// A range of whole lines of the FSM file, parsed by one thread.  The first
+// pass counts, the second fills the arrays from the offsets the counts give.
+typedef struct {
+   const char *begin ;
+   const char *end ;
+   bool fill ;
+
+   int nTrans ;
+   int nFinals ;
+   int firstFrom ;      // from state of the first transition, or -1
+   int maxState ;
+   int maxIn ;
+   int maxOut ;
+   const char *badLine ;
+
+   WFSTTransition *trans ;
+   WFSTFinalState *finals ;
+   real scale ;
+   real insPenalty ;
+} FSMChunk ;
+
+static void *scanFSMChunk( void *arg )
+{
+   FSMChunk *c = (FSMChunk *)arg ;
+   int v[4] , nTrans=0 , nFinals=0 ;
+   float weight ;
+   const char *line , *eol ;
+   for ( line=c->begin ; line<c->end ; line=eol+1 )
+   {
+      if ( (eol = (const char *)memchr( line , '\n' , c->end - line )) == NULL )
+         eol = c->end ;
+      int kind = scanFSMLine( line , eol , v , &weight ) ;
+      if ( kind == 2 )
+      {
+         if ( c->fill )
+         {
+            // id holds the from state until packTransitions()
+            WFSTTransition *t = c->trans + nTrans ;
+            t->id = v[0] ;
+            t->toState = v[1] ;
+            t->inLabel = v[2] ;
+            t->outLabel = v[3] ;
+
+            // FSM weights are -ve log; the insertion penalty is for words
+            t->weight = (real)(-weight * c->scale) ;
+            if ( v[3] > 0 )
+               t->weight += c->insPenalty ;
+         }
+         else
+         {
+            if ( ((v[0] | v[1] | v[2] | v[3]) < 0) && (c->badLine == NULL) )
+               c->badLine = line ;
+            if ( c->firstFrom < 0 )
+               c->firstFrom = v[0] ;
+            if ( v[0] > c->maxState )
+               c->maxState = v[0] ;
+            if ( v[1] > c->maxState )
+               c->maxState = v[1] ;
+            if ( v[2] > c->maxIn )
+               c->maxIn = v[2] ;
+            if ( v[3] > c->maxOut )
+               c->maxOut = v[3] ;
+         }
+         nTrans++ ;
+      }
+      else if ( kind == 1 )
+      {
+         if ( c->fill )
+         {
+            c->finals[nFinals].id = v[0] ;
+            c->finals[nFinals].weight = (real)(-weight * c->scale) ;
+         }
+         nFinals++ ;
+      }
+   }
+   c->nTrans = nTrans ;
+   c->nFinals = nFinals ;
+   return NULL ;
+}
+
+static void scanFSMChunks( vector<FSMChunk> &chunks )
+{
+   int n = (int)chunks.size() ;
+   vector<pthread_t> threads( n ) ;
+   vector<bool> started( n , false ) ;
+   for ( int i=1 ; i<n ; i++ )
+      started[i] = ( pthread_create( &threads[i] , NULL , scanFSMChunk , &chunks[i] ) == 0 ) ;
+   for ( int i=0 ; i<n ; i++ )
+   {
+      if ( ! started[i] )
+         scanFSMChunk( &chunks[i] ) ;
+   }
+   for ( int i=1 ; i<n ; i++ )
+   {
+      if ( started[i] )
+         pthread_join( threads[i] , NULL ) ;
+   }
+}
+
+
 WFSTNetwork::WFSTNetwork()
 {
    inputAlphabet = NULL ;
@@ -320,8 +675,17 @@ WFSTNetwork::WFSTNetwork()
    nTransitionsAlloc = 0 ;
    transitions = NULL ;
    maxOutTransitions = 0 ;
+   packedTransitions = NULL ;
+   weightCodebook = NULL ;
+   weightBits = 0 ;
+   closureOf = NULL ;
+   closures = NULL ;
+   closureArcs = NULL ;
+   closureLabels = NULL ;
 
    fromBinFile = false ;
+   binMap = NULL ;
+   binMapLen = 0 ;
    transWeightScalingFactor = 1.0 ;
    insPenalty = 0.0 ;
    wordEndMarker = -1 ;
@@ -351,8 +715,17 @@ WFSTNetwork::WFSTNetwork( real transWeightScalingFactor_ , real insPenalty_ )
    nTransitionsAlloc = 0 ;
    transitions = NULL ;
    maxOutTransitions = 0 ;
+   packedTransitions = NULL ;
+   weightCodebook = NULL ;
+   weightBits = 0 ;
+   closureOf = NULL ;
+   closures = NULL ;
+   closureArcs = NULL ;
+   closureLabels = NULL ;
 
    fromBinFile = false ;
+   binMap = NULL ;
+   binMapLen = 0 ;
    transWeightScalingFactor = transWeightScalingFactor_ ;
    insPenalty = insPenalty_;
    wordEndMarker = -1 ;
@@ -394,149 +767,176 @@ WFSTNetwork::WFSTNetwork(
    nTransitionsAlloc = 0 ;
    transitions = NULL ;
    maxOutTransitions = 0 ;
-
+   packedTransitions = NULL ;
+   weightCodebook = NULL ;
+   weightBits = 0 ;
+   closureOf = NULL ;
+   closures = NULL ;
+   closureArcs = NULL ;
+   closureLabels = NULL ;
+
+   binMap = NULL ;
+   binMapLen = 0 ;
    transWeightScalingFactor = transWeightScalingFactor_ ;
    insPenalty = insPenalty_ ;
    wordEndMarker = -1 ;
    silMarker = -1;
    spMarker = -1;
 
-   FILE *fd ;
+   int maxOutLab , maxInLab ;
+   readTextFSM( wfstFilename , "WFSTNetwork::WFSTNetwork" , &maxInLab , &maxOutLab ) ;
 
-   if ( (fd = fopen( wfstFilename , "rb" )) == NULL )
-      error("WFSTNetwork::WFSTNetwork - error opening wfstFilename") ;
+   packTransitions() ;
 
-   int cnt , i ;
-   int from , to , in , out , final , maxOutLab=-1 , maxInLab=-1;
-   float weight ;
-   char *line ;
+   finishLoad( inSymsFilename , outSymsFilename , maxInLab , maxOutLab ,
+               removeAuxOption ) ;
+}
 
-   line = new char[10000] ;
-   while ( fgets( line , 10000 , fd ) != NULL )
-   {
-      if ( (cnt = sscanf( line , "%d %d %d %d %f" , &from , &to , &in , &out , &weight )) != 5 )
-      {
-         if ( (cnt = sscanf( line , "%d %d %d %d" , &from , &to , &in , &out )) != 4 )
-         {
-            if ( (cnt = sscanf( line , "%d %f" , &final , &weight )) != 2 )
-            {
-               if ( (cnt = sscanf( line , "%d" , &final )) != 1 )
-               {
-                  // Blank line or line with invalid format - just go to next line.
-                  continue ;
-               }
-               else
-                  weight = 0.0 ;
-            }
 
-            // Final state line
-            if ( nFinalStates == nFinalStatesAlloc )
-            {
-               finalStates = (WFSTFinalState *)realloc( finalStates ,
-                                        (nFinalStatesAlloc+1000)*sizeof(WFSTFinalState) ) ;
-               nFinalStatesAlloc += 1000 ;
-            }
+// The network of a transducer built in memory, as if it had been written
+// as a text FSM and loaded with the constructor above, but without the
+// rounding of the weights in the text.
+WFSTNetwork::WFSTNetwork(
+	const WFSTBuildFSM *fsm , const char *inSymsFilename ,
+	const char *outSymsFilename ,
+    real transWeightScalingFactor_ , real insPenalty_ ,
+	RemoveAuxOption removeAuxOption
+	)
+{
+   inputAlphabet = NULL ;
+   outputAlphabet = NULL ;
+   stateAlphabet = NULL ;
 
-            finalStates[nFinalStates].id = final ;
-            finalStates[nFinalStates].weight = (real)(-weight * transWeightScalingFactor) ;
-            nFinalStates++ ;
-            continue ;
-         }
-         else
-            weight = 0.0 ;
-      }
+   initState = -1 ;
+   maxState = -1 ;
 
-      if ( (from < 0) || (to < 0) || (in < 0) || (out < 0) )
-         error("WFSTNetwork::WFSTNetwork - something < 0. %d %d %d %d",from,to,in,out) ;
+   nStates = 0 ;
+   nStatesAlloc = 0 ;
+   states = NULL ;
 
-      if ( initState < 0 )
-         initState = from ;   // init state is source state in first line of file
+   nFinalStates = 0 ;
+   nFinalStatesAlloc = 0 ;
+   finalStates = NULL ;
 
-      if ( from > maxState )
-         maxState = from ;
-      if ( to > maxState )
-         maxState = to ;
+   nTransitions = 0 ;
+   nTransitionsAlloc = 0 ;
+   transitions = NULL ;
+   maxOutTransitions = 0 ;
+   packedTransitions = NULL ;
+   weightCodebook = NULL ;
+   weightBits = 0 ;
+   closureOf = NULL ;
+   closures = NULL ;
+   closureArcs = NULL ;
+   closureLabels = NULL ;
+
+   binMap = NULL ;
+   binMapLen = 0 ;
+   transWeightScalingFactor = transWeightScalingFactor_ ;
+   insPenalty = insPenalty_ ;
+   wordEndMarker = -1 ;
+   silMarker = -1;
+   spMarker = -1;
 
-      // Add the new transition to the array of transitions
-      if ( nTransitions == nTransitionsAlloc )
-      {
-         nTransitionsAlloc += 1000000 ;
-         transitions = (WFSTTransition *)realloc(
-             transitions , nTransitionsAlloc * sizeof(WFSTTransition)
-         ) ;
-         if ( transitions == NULL )
-            error("WFSTNetwork::WFSTNetwork - transitions realloc failed") ;
-         for ( i=nTransitions ; i<nTransitionsAlloc ; i++ )
-            initWFSTTransition( transitions + i ) ;
-      }
+   if ( fsm == NULL )
+      error("WFSTNetwork::WFSTNetwork - fsm is NULL") ;
 
-      transitions[nTransitions].id = nTransitions ;
-      //transitions[nTransitions].fromState = from ;
-      transitions[nTransitions].toState = to ;
-      transitions[nTransitions].inLabel = in ;
-      transitions[nTransitions].outLabel = out ;
-      transitions[nTransitions].hook = NULL;
+   int i , maxOutLab=-1 , maxInLab=-1 ;
+   initState = fsm->getInitState() ;
+   maxState = fsm->getNumStates() - 1 ;
+   if ( (initState < 0) || (initState > maxState) )
+      error("WFSTNetwork::WFSTNetwork - fsm has no initial state") ;
 
-      // FSM weights are -ve log
-      transitions[nTransitions].weight = (real)(-weight * transWeightScalingFactor ) ;
+   nStatesAlloc = maxState + 1 ;
+   states = (WFSTState *)malloc( nStatesAlloc * sizeof(WFSTState) ) ;
+   if ( states == NULL )
+      error("WFSTNetwork::WFSTNetwork - states malloc failed") ;
 
-      // This is implemented as a word insertion penalty as is normal.
-      // It could conceivably also be a model insertion penalty.
-      if (out > 0)
-          transitions[nTransitions].weight += insPenalty;
+   nTransitions = fsm->getNumArcs() ;
+   if ( nTransitions > 0 )
+   {
+      transitions = (WFSTTransition *)malloc( nTransitions * sizeof(WFSTTransition) ) ;
+      if ( transitions == NULL )
+         error("WFSTNetwork::WFSTNetwork - transitions malloc failed") ;
+   }
+   nTransitionsAlloc = nTransitions ;
 
-      ++nTransitions ;
+   // The arcs of each state are already contiguous, in the order the text
+   // FSM would list them
+   int nTrans = 0 ;
+   for ( i=0 ; i<=maxState ; i++ )
+   {
+      initWFSTState( states + i ) ;
+      states[i].label = i ;
+      states[i].trans = nTrans ;
 
-      if ( in > maxInLab ) {
-         maxInLab = in;
-      }
-      if ( out > maxOutLab ) {
-         maxOutLab = out;
+      const vector<WFSTBuildFSM::Arc> &arcs = fsm->getArcs( i ) ;
+      for ( int j=0 ; j<(int)arcs.size() ; j++ )
+      {
+         const WFSTBuildFSM::Arc &a = arcs[j] ;
+         if ( (a.in < 0) || (a.out < 0) || (a.to < 0) || (a.to > maxState) )
+            error("WFSTNetwork::WFSTNetwork - state %d arc %d out of range" , i , j ) ;
+
+         WFSTTransition *t = transitions + nTrans ;
+         t->id = nTrans++ ;
+         t->toState = a.to ;
+         t->inLabel = a.in ;
+         t->outLabel = a.out ;
+         t->weight = (real)(-a.weight * transWeightScalingFactor) ;
+         if ( a.out > 0 )
+            t->weight += insPenalty ;
+
+         if ( a.in > maxInLab )
+            maxInLab = a.in ;
+         if ( a.out > maxOutLab )
+            maxOutLab = a.out ;
       }
+      states[i].nTrans = (int)arcs.size() ;
+      if ( states[i].nTrans > maxOutTransitions )
+         maxOutTransitions = states[i].nTrans ;
+
+      if ( fsm->isFinal( i ) )
+         nFinalStates++ ;
+   }
 
-      // Make sure we have state entries for both from and to states in the
-      // new transition.
-      if ( maxState >= nStatesAlloc )
+   if ( nFinalStates > 0 )
+   {
+      finalStates = (WFSTFinalState *)malloc( nFinalStates * sizeof(WFSTFinalState) ) ;
+      if ( finalStates == NULL )
+         error("WFSTNetwork::WFSTNetwork - finalStates malloc failed") ;
+   }
+   nFinalStatesAlloc = nFinalStates ;
+   int nFinals = 0 ;
+   for ( i=0 ; i<=maxState ; i++ )
+   {
+      if ( fsm->isFinal( i ) )
       {
-          // Was running out of memory for large transducers.  In
-          // fact, this would be better either with a two pass
-          // strategy or a binary format.
-          //int nAlloc = maxState + 1000;
-          int nAlloc = maxState ? maxState * 2 : 1024;
-          states = (WFSTState *)realloc(
-              states, nAlloc * sizeof(WFSTState)
-          );
-          assert(states);
-          for ( i=nStatesAlloc ; i<nAlloc ; i++ )
-              initWFSTState( states + i ) ;
-          nStatesAlloc = nAlloc ;
+         finalStates[nFinals].id = i ;
+         finalStates[nFinals++].weight =
+            (real)(-fsm->getFinalWeight( i ) * transWeightScalingFactor) ;
       }
+   }
 
-      // Initialise the from and to state labels if not already done.
-      if ( states[from].label < 0 )
-         states[from].label = from ;
-      else if ( states[from].label != from )
-         error("WFSTNetwork::WFSTNetwork - from state %d label mismatch" , from ) ;
-
-      if ( states[to].label < 0 )
-         states[to].label = to ;
-      else if ( states[to].label != to )
-         error("WFSTNetwork::WFSTNetwork - to state %d label mismatch" , to ) ;
+   finishLoad( inSymsFilename , outSymsFilename , maxInLab , maxOutLab ,
+               removeAuxOption ) ;
+}
 
-      // Add the new transition index to the list in the from state
-      int ind = (states[from].nTrans)++ ;
-      states[from].trans = (int *)realloc( states[from].trans , states[from].nTrans*sizeof(int) ) ;
-      states[from].trans[ind] = nTransitions - 1 ;
-      if ( states[from].nTrans > maxOutTransitions )
-         maxOutTransitions = states[from].nTrans ;
-   }
 
+// The rest of loading a network once its states, transitions and final
+// states are in place: the final state indices, the alphabets, the
+// auxiliary symbols and the sil and sp labels.
+void WFSTNetwork::finishLoad(
+	const char *inSymsFilename , const char *outSymsFilename ,
+	int maxInLab , int maxOutLab , RemoveAuxOption removeAuxOption
+	)
+{
+   int i ;
    for ( i=0 ; i<nFinalStates ; i++ )
    {
       if ( (finalStates[i].id < 0) || (finalStates[i].id > maxState) )
-         error("WFSTNetwork::WFSTNetwork - finalState[%d].id out of range" , i ) ;
+         error("WFSTNetwork::finishLoad - finalState[%d].id out of range" , i ) ;
       if ( states[finalStates[i].id].label < 0 )
-         error("WFSTNetwork::WFSTNetwork - finalState[%d] state label < 0" , i ) ;
+         error("WFSTNetwork::finishLoad - finalState[%d] state label < 0" , i ) ;
 
       states[finalStates[i].id].finalInd = i ;
    }
@@ -546,14 +946,14 @@ WFSTNetwork::WFSTNetwork(
    {
       inputAlphabet = new WFSTAlphabet( inSymsFilename ) ;
       if ( maxInLab > inputAlphabet->getMaxLabel() )
-         error("WFSTNetwork::WFSTNetwork - maxInLab > inputAlphabet->getMaxLabel()");
+         error("WFSTNetwork::finishLoad - maxInLab > inputAlphabet->getMaxLabel()");
       maxInLab = inputAlphabet->getMaxLabel();
    }
    if ( outSymsFilename != NULL )
    {
       outputAlphabet = new WFSTAlphabet( outSymsFilename ) ;
       if ( maxOutLab > outputAlphabet->getMaxLabel() ) {
-         error("WFSTNetwork::WFSTNetwork - maxOutLab=%d > outputAlphabet->getMaxLabel()=%d",
+         error("WFSTNetwork::finishLoad - maxOutLab=%d > outputAlphabet->getMaxLabel()=%d",
                maxOutLab, outputAlphabet->getMaxLabel() );
       }
       maxOutLab = outputAlphabet->getMaxLabel();
@@ -583,7 +983,7 @@ WFSTNetwork::WFSTNetwork(
       case NOTREMOVE:
 	 break ;
       default:
-	 error ("WFSTNetwork::WFSTNetwork - Invalid removeAuxOption") ;
+	 error ("WFSTNetwork::finishLoad - Invalid removeAuxOption") ;
 	 break ;
    }
    /*
@@ -595,9 +995,6 @@ WFSTNetwork::WFSTNetwork(
    */
    // *************************************
 
-   delete [] line ;
-   fclose( fd ) ;
-
    fromBinFile = false ;
    nStates = (maxState+1) ;
 
@@ -618,21 +1015,35 @@ WFSTNetwork::WFSTNetwork(
 
 WFSTNetwork::~WFSTNetwork()
 {
-   int i ;
+   freeArrays() ;
 
-   if ( states != NULL )
+   delete inputAlphabet ;
+   delete outputAlphabet ;
+   delete stateAlphabet ;
+}
+
+
+void WFSTNetwork::freeArrays()
+{
+   if ( binMap != NULL )
    {
-      for ( i=0 ; i<=maxState ; i++ )
+      // states, finalStates and transitions all point into the map, as
+      // do compact transitions unless compactTransitions() made them
+      if ( ((char *)packedTransitions >= binMap) &&
+           ((char *)packedTransitions < binMap + binMapLen) )
       {
-         if ( states[i].trans != NULL )
-         {
-            if ( fromBinFile )
-               delete [] states[i].trans ;
-            else
-               free( states[i].trans ) ;
-         }
+         packedTransitions = NULL ;
+         weightCodebook = NULL ;
       }
+      munmap( binMap , binMapLen ) ;
+      binMap = NULL ;
+      states = NULL ;
+      finalStates = NULL ;
+      transitions = NULL ;
+   }
 
+   if ( states != NULL )
+   {
       if ( fromBinFile )
          delete [] states ;
       else
@@ -655,18 +1066,29 @@ WFSTNetwork::~WFSTNetwork()
           free( finalStates ) ;
    }
 
-   delete inputAlphabet ;
-   delete outputAlphabet ;
-   delete stateAlphabet ;
-}
-
+   if ( packedTransitions != NULL )
+      free( packedTransitions ) ;
+   if ( weightCodebook != NULL )
+      free( weightCodebook ) ;
 
-void WFSTNetwork::resetTransitionHooks() {
-    for (int i = 0; i < nTransitions; ++i) {
-        transitions[i].hook = NULL;
-    }
+   states = NULL ;
+   transitions = NULL ;
+   finalStates = NULL ;
+   packedTransitions = NULL ;
+   weightCodebook = NULL ;
+   weightBits = 0 ;
+
+   delete [] closureOf ;
+   delete [] closures ;
+   delete [] closureArcs ;
+   delete [] closureLabels ;
+   closureOf = NULL ;
+   closures = NULL ;
+   closureArcs = NULL ;
+   closureLabels = NULL ;
 }
 
+
 void WFSTNetwork::getTransitions(
     WFSTTransition *prev , int *nNext , WFSTTransition **next
 )
@@ -676,6 +1098,8 @@ void WFSTNetwork::getTransitions(
       error("WFSTNetwork::getTransitions - nNext is NULL") ;
    if ( next == NULL )
       error("WFSTNetwork::getTransitions - next is NULL") ;
+   if ( packedTransitions != NULL )
+      error("WFSTNetwork::getTransitions - transitions are compact") ;
 #endif
 
    int state ;
@@ -690,15 +1114,13 @@ void WFSTNetwork::getTransitions(
 #endif
 
    int n = states[state].nTrans ;
-   int* trans = states[state].trans;
-   for ( int i=0 ; i<n ; i++ )
-   {
+   WFSTTransition* trans = transitions + states[state].trans;
 #ifdef DEBUG
-      if ( (states[state].trans[i] < 0) || (states[state].trans[i] >= nTransitions) )
-         error("WFSTNetwork::getTransitions - states[state].trans[i] invalid") ;
+   if ( (n > 0) && ((states[state].trans < 0) || (states[state].trans+n > nTransitions)) )
+      error("WFSTNetwork::getTransitions - states[state].trans invalid") ;
 #endif
-      next[i] = transitions + trans[i];
-   }
+   for ( int i=0 ; i<n ; i++ )
+      next[i] = trans + i;
    *nNext = n;
 }
 
@@ -710,13 +1132,17 @@ int WFSTNetwork::getTransitions(
     WFSTTransition *prev, WFSTTransition **next
 )
 {
+#ifdef DEBUG
+    if ( packedTransitions != NULL )
+        error("WFSTNetwork::getTransitions - transitions are compact") ;
+#endif
     int state ;
     if ( prev == NULL )
         state = initState ;
     else
         state = prev->toState ;
     if (states[state].nTrans > 0)
-        *next = transitions + states[state].trans[0] ;
+        *next = transitions + states[state].trans ;
     return states[state].nTrans ;
 }
 
@@ -769,11 +1195,11 @@ real WFSTNetwork::getFinalStateWeight( int stateIndex )
 #endif
 
 // Changes by Octavian
-const int *WFSTNetwork::getTransitions( const WFSTTransition *prev , int *nNext )
+int WFSTNetwork::getFirstTransition( const WFSTTransition *prev , int *nNext ) const
 {
 #ifdef DEBUG
    if ( nNext == NULL )
-      error("WFSTNetwork::getTransitions (2) - nNext is NULL") ;
+      error("WFSTNetwork::getFirstTransition - nNext is NULL") ;
 #endif
 
    int state ;
@@ -784,7 +1210,7 @@ const int *WFSTNetwork::getTransitions( const WFSTTransition *prev , int *nNext
 
 #ifdef DEBUG
    if ( (state < 0) || (state > maxState) )
-      error("WFSTNetwork::getTransitions (2) - state out of range") ;
+      error("WFSTNetwork::getFirstTransition - state out of range") ;
 #endif
 
    *nNext = states[state].nTrans ;
@@ -798,6 +1224,8 @@ WFSTTransition *WFSTNetwork::getOneTransition( int transIndex )
 #ifdef DEBUG
    if (( transIndex < 0 ) || ( transIndex >= nTransitions ))
       error("WFSTNetwork::getOneTransition - transIndex out of range") ;
+   if ( packedTransitions != NULL )
+      error("WFSTNetwork::getOneTransition - transitions are compact") ;
 #endif
    return ( transitions + transIndex ) ;
 }
@@ -815,12 +1243,13 @@ int WFSTNetwork::getInfoOfOneTransition( const int gState, const int n, real *we
       error("WFSTNetwork::getInfoOfOneTransition - n = %d out of range (state = %d)", n , gState ) ;
 #endif
 
-   int transIndex = states[gState].trans[n] ;
+   WFSTTransition trans ;
+   getTransition( states[gState].trans + n , &trans ) ;
 
-   *weight = transitions[transIndex].weight ;
-   *toState = transitions[transIndex].toState ;
-   *outLabel = transitions[transIndex].outLabel ;
-   return ( transitions[transIndex].inLabel ) ;
+   *weight = trans.weight ;
+   *toState = trans.toState ;
+   *outLabel = trans.outLabel ;
+   return ( trans.inLabel ) ;
 }
 
 // Changes Octavian 20060616
@@ -835,8 +1264,9 @@ int WFSTNetwork::getInLabelOfOneTransition( const int gState , const int n )
       error("WFSTNetwork::getInLabelOfOneTransition - n = %d out of range (state = %d)", n , gState ) ;
 #endif
 
-   int transIndex = states[gState].trans[n] ;
-   return ( transitions[transIndex].inLabel ) ;
+   WFSTTransition trans ;
+   getTransition( states[gState].trans + n , &trans ) ;
+   return ( trans.inLabel ) ;
 }
 
 
@@ -894,11 +1324,12 @@ void WFSTNetwork::outputText( int type )
    if ( type == 0 )
    {
       // Print transitions out of initial state first
+      WFSTTransition trans ;
       for ( j=0 ; j<states[initState].nTrans ; j++ )
       {
-         WFSTTransition *trans = transitions + states[initState].trans[j] ;
+         getTransition( states[initState].trans + j , &trans ) ;
          printf("%-10d %-10d %-10d %-10d %0.3f\n" , states[initState].label ,
-               trans->toState , trans->inLabel , trans->outLabel , -(trans->weight) ) ;
+               trans.toState , trans.inLabel , trans.outLabel , -(trans.weight) ) ;
       }
 
       // Print all other transitions
@@ -911,9 +1342,9 @@ void WFSTNetwork::outputText( int type )
          {
             for ( j=0 ; j<states[i].nTrans ; j++ )
             {
-               WFSTTransition *trans = transitions + states[i].trans[j] ;
+               getTransition( states[i].trans + j , &trans ) ;
                printf("%-10d %-10d %-10d %-10d %0.3f\n" , states[i].label ,
-                     trans->toState , trans->inLabel , trans->outLabel , -(trans->weight) ) ;
+                     trans.toState , trans.inLabel , trans.outLabel , -(trans.weight) ) ;
             }
          }
       }
@@ -937,6 +1368,8 @@ void WFSTNetwork::outputText( int type )
 
 void WFSTNetwork::generateSequences( int maxSeqs , bool logBase10 )
 {
+   if ( packedTransitions != NULL )
+      error("WFSTNetwork::generateSequences - transitions are compact") ;
    if ( maxSeqs <= 0 )
       maxSeqs = 5 ;
 
@@ -1103,143 +1536,336 @@ void WFSTNetwork::writeFSM( const char *fsmFName , const char *inSymsFName ,
 }
 
 
-void WFSTNetwork::writeBinary( const char *fname )
+// Binary network file.  The header is followed by the states, final states
+// and transitions arrays laid out exactly as they are held in memory, each
+// starting on a WFST_ALIGN boundary, so that readBinary() can map the file
+// and use the arrays in place.  The weights are stored as used in decoding,
+// with the scaling factor and insertion penalty recorded in the header.
+// A compact network has no transitions section but the packed transitions
+// and the weight codebook, whose weights do not include the penalty.
+// The alphabets follow in the stream format of WFSTAlphabet::writeBinary().
+#define WFST_VERSION 3
+#define WFST_ALIGN 64
+
+enum {
+   WFST_STATES = 0,     // WFSTState, nStates
+   WFST_FINALS,         // WFSTFinalState, nFinalStates
+   WFST_TRANS,          // WFSTTransition, nTransitions
+   WFST_PACKED,         // uint64_t, nTransitions, if compact
+   WFST_CODEBOOK,       // real, 2^weightBits, if compact
+   WFST_ALPHABETS,      // haveAlphabet flag and alphabet, input then output
+   WFST_NSECTIONS
+};
+
+typedef struct {
+   char id[4] ;         // "JWNC"
+   int version ;
+   int realSize ;
+   int transSize ;      // sizeof(WFSTTransition) of the writer
+   int align ;
+   int initState ;
+   int maxState ;
+   int nStates ;
+   int maxOutTransitions ;
+   int wordEndMarker ;
+   int silMarker ;
+   int spMarker ;
+   int nFinalStates ;
+   int nTransitions ;
+   int weightBits ;     // 0 unless compact
+   int toStateBits ;
+   int inLabelBits ;
+   int outLabelBits ;
+   real transWeightScalingFactor ;  // already applied to the weights
+   real insPenalty ;                // already added to the full weights
+   int sections[WFST_NSECTIONS] ;   // offsets in units of align
+} WFSTBinHeader ;
+
+// section offsets from the counts of the header
+static void wfstLayout( WFSTBinHeader *h )
 {
-    // always save original weight w/o insPenalty, this is done before weight scaling
-    if (insPenalty != 0.0) {
-        for ( int i=0 ; i<nTransitions ; i++ )
-        {
-            if (transitions[i].outLabel > 0)
-                transitions[i].weight -= insPenalty ;
-        }
-    }
+   long len[WFST_NSECTIONS] ;
+   len[WFST_STATES] = sizeof(WFSTState) * (long)h->nStates ;
+   len[WFST_FINALS] = sizeof(WFSTFinalState) * (long)h->nFinalStates ;
+   if ( h->weightBits > 0 )
+   {
+      len[WFST_TRANS] = 0 ;
+      len[WFST_PACKED] = sizeof(uint64_t) * (long)h->nTransitions ;
+      len[WFST_CODEBOOK] = sizeof(real) << h->weightBits ;
+   }
+   else
+   {
+      len[WFST_TRANS] = sizeof(WFSTTransition) * (long)h->nTransitions ;
+      len[WFST_PACKED] = 0 ;
+      len[WFST_CODEBOOK] = 0 ;
+   }
+   len[WFST_ALPHABETS] = 0 ;
 
-   // If we have scaled all transition weights, unscale them before we write
-   // them to binary file.
+   long pos = sizeof(WFSTBinHeader) ;
+   for ( int s=0 ; s<WFST_NSECTIONS ; s++ )
+   {
+      h->sections[s] = (pos+WFST_ALIGN-1) / WFST_ALIGN ;
+      pos = (long)h->sections[s]*WFST_ALIGN + len[s] ;
+   }
+}
 
-   if ( transWeightScalingFactor != 1.0 )
+// zero padding up to |offset| blocks
+static void padWFSTSection( FILE *fd , int offset )
+{
+   static const char zeros[WFST_ALIGN] = {0} ;
+   long pos = ftell( fd ) ;
+   while ( pos < (long)offset*WFST_ALIGN )
    {
-      for ( int i=0 ; i<nTransitions ; i++ )
-      {
-         transitions[i].weight /= transWeightScalingFactor ;
-      }
+      long n = (long)offset*WFST_ALIGN - pos ;
+      if ( n > WFST_ALIGN )
+         n = WFST_ALIGN ;
+      fwrite( zeros , 1 , n , fd ) ;
+      pos += n ;
    }
+}
 
+
+void WFSTNetwork::writeBinary( const char *fname )
+{
    FILE *fd ;
    if ( (fd = fopen( fname , "wb" )) == NULL )
       error("WFSTNetwork::writeBinary - error opening output file") ;
 
-   char id[5] ;
-   strcpy( id , "JWNT" ) ;
-
-   // 1. Write ID, initState , maxState, nStates, maxOutTransitions,
-   // wordEndMarker,  silMarker , spMarker
-   fwrite( (int *)id , sizeof(int) , 1 , fd ) ;
-   fwrite( &initState , sizeof(int) , 1 , fd ) ;
-   fwrite( &maxState , sizeof(int) , 1 , fd ) ;
-   fwrite( &nStates , sizeof(int) , 1 , fd ) ;
-   fwrite( &maxOutTransitions , sizeof(int) , 1 , fd ) ;
-   fwrite( &wordEndMarker , sizeof(int) , 1 , fd ) ;
-   fwrite( &silMarker , sizeof(int) , 1 , fd ) ;
-   fwrite( &spMarker , sizeof(int) , 1 , fd ) ;
-
-   // 2. Write states array
-   int i ;
-   for ( i=0 ; i<=maxState ; i++ )
+   WFSTBinHeader h ;
+   memset( &h , 0 , sizeof(WFSTBinHeader) ) ;
+   memcpy( h.id , "JWNC" , 4 ) ;
+   h.version = WFST_VERSION ;
+   h.realSize = sizeof(real) ;
+   h.transSize = sizeof(WFSTTransition) ;
+   h.align = WFST_ALIGN ;
+   h.initState = initState ;
+   h.maxState = maxState ;
+   h.nStates = nStates ;
+   h.maxOutTransitions = maxOutTransitions ;
+   h.wordEndMarker = wordEndMarker ;
+   h.silMarker = silMarker ;
+   h.spMarker = spMarker ;
+   h.nFinalStates = nFinalStates ;
+   h.nTransitions = nTransitions ;
+   if ( packedTransitions != NULL )
    {
-      fwrite( &(states[i].label) , sizeof(int) , 1 , fd ) ;
-      fwrite( &(states[i].finalInd) , sizeof(int) , 1 , fd ) ;
-      fwrite( &(states[i].nTrans) , sizeof(int) , 1 , fd ) ;
-      if ( states[i].nTrans > 0 )
-         fwrite( states[i].trans , sizeof(int) , states[i].nTrans , fd ) ;
-   }
-
-   // 3. Write nFinalStates and finalStates array.
-   fwrite( &nFinalStates , sizeof(int) , 1 , fd ) ;
-   for (i=0; i<nFinalStates; i++)
+      h.weightBits = weightBits ;
+      h.toStateBits = toStateBits ;
+      h.inLabelBits = inLabelBits ;
+      h.outLabelBits = outLabelBits ;
+   }
+   h.transWeightScalingFactor = transWeightScalingFactor ;
+   h.insPenalty = insPenalty ;
+   wfstLayout( &h ) ;
+
+   // 1. Header
+   fwrite( &h , sizeof(WFSTBinHeader) , 1 , fd ) ;
+
+   // 2. States and final states
+   padWFSTSection( fd , h.sections[WFST_STATES] ) ;
+   if ( (int)fwrite( states , sizeof(WFSTState) , nStates , fd ) != nStates )
+      error("WFSTNetwork::writeBinary - error writing states") ;
+   padWFSTSection( fd , h.sections[WFST_FINALS] ) ;
+   if ( (int)fwrite( finalStates , sizeof(WFSTFinalState) , nFinalStates , fd ) != nFinalStates )
+      error("WFSTNetwork::writeBinary - error writing finalStates") ;
+
+   // 3. Transitions, or the compact transitions and codebook
+   padWFSTSection( fd , h.sections[WFST_TRANS] ) ;
+   if ( packedTransitions == NULL )
    {
-       fwrite( &(finalStates[i].id) , sizeof(int) , 1 , fd ) ;
-       fwrite( &(finalStates[i].weight) , sizeof(real) , 1 , fd ) ;
+      if ( (int)fwrite( transitions , sizeof(WFSTTransition) , nTransitions , fd ) != nTransitions )
+         error("WFSTNetwork::writeBinary - error writing transitions") ;
    }
+   else
+   {
+      padWFSTSection( fd , h.sections[WFST_PACKED] ) ;
+      if ( (int)fwrite( packedTransitions , sizeof(uint64_t) , nTransitions , fd ) != nTransitions )
+         error("WFSTNetwork::writeBinary - error writing packedTransitions") ;
+      padWFSTSection( fd , h.sections[WFST_CODEBOOK] ) ;
+      if ( (int)fwrite( weightCodebook , sizeof(real) , 1 << weightBits , fd ) != (1 << weightBits) )
+         error("WFSTNetwork::writeBinary - error writing weightCodebook") ;
+   }
+
+   // 4. Write inputAlphabet and outputAlphabet
+   padWFSTSection( fd , h.sections[WFST_ALPHABETS] ) ;
+   bool haveAlphabet = ( inputAlphabet != NULL ) ;
+   fwrite( &haveAlphabet , sizeof(bool) , 1 , fd ) ;
+   if ( haveAlphabet )
+      inputAlphabet->writeBinary( fd ) ;
 
-   // 4. Write nTransitions and transitions array.
-   fwrite( &nTransitions , sizeof(int) , 1 , fd ) ;
-   for (i=0; i<nTransitions; i++)
+   haveAlphabet = ( outputAlphabet != NULL ) ;
+   fwrite( &haveAlphabet , sizeof(bool) , 1 , fd ) ;
+   if ( haveAlphabet )
+      outputAlphabet->writeBinary( fd ) ;
+
+   // 5. Write the ID (again).
+   fwrite( h.id , 4 , 1 , fd ) ;
+
+   fclose( fd ) ;
+}
+
+
+void WFSTNetwork::readBinary( const char *fname )
+{
+   if ( (states != NULL) || (transitions != NULL) || (packedTransitions != NULL) )
+      error("WFSTNetwork::readBinary - network already loaded") ;
+
+   FILE *fd ;
+   if ( (fd = fopen( fname , "rb" )) == NULL )
+      error("WFSTNetwork::readBinary - error opening input file") ;
+
+   char id[5] ;
+   if ( fread( id , 4 , 1 , fd ) != 1 )
+      error("WFSTNetwork::readBinary - error reading ID") ;
+   id[4] = '\0' ;
+   if ( strcmp( id , "JWNC" ) == 0 )
    {
-       fwrite( &(transitions[i].id) , sizeof(int) , 1 , fd ) ;
-       fwrite( &(transitions[i].toState) , sizeof(int) , 1 , fd ) ;
-       fwrite( &(transitions[i].weight) , sizeof(real) , 1 , fd ) ;
-       fwrite( &(transitions[i].inLabel) , sizeof(int) , 1 , fd ) ;
-       fwrite( &(transitions[i].outLabel) , sizeof(int) , 1 , fd ) ;
+      fclose( fd ) ;
+      mapBinary( fname ) ;
+      return ;
    }
+   if ( strcmp( id , "JWNT" ) != 0 )
+      error("WFSTNetwork::readBinary - invalid ID") ;
 
-   // 5. Write inputAlphabet and outputAlphabet
-   bool haveAlphabet ;
-   if ( inputAlphabet == NULL )
+   readLegacyBinary( fd ) ;
+   fclose( fd ) ;
+}
+
+
+void WFSTNetwork::mapBinary( const char *fname )
+{
+   int fd ;
+   struct stat st ;
+   if ( (fd = open( fname , O_RDONLY )) < 0 )
+      error("WFSTNetwork::mapBinary - error opening %s" , fname ) ;
+   if ( fstat( fd , &st ) != 0 || st.st_size < (off_t)sizeof(WFSTBinHeader) )
+      error("WFSTNetwork::mapBinary - error reading header") ;
+
+   // A private mapping: pages stay shared with the page cache, and so with
+   // other processes using the same file, unless rescaling below writes
+   // them.  The map is read-only once loaded.
+   void *map = mmap( NULL , st.st_size , PROT_READ|PROT_WRITE , MAP_PRIVATE , fd , 0 ) ;
+   close( fd ) ;
+   if ( map == MAP_FAILED )
+      error("WFSTNetwork::mapBinary - error mapping %s" , fname ) ;
+
+   const WFSTBinHeader *h = (const WFSTBinHeader *)map ;
+   if ( h->version != WFST_VERSION )
+      error("WFSTNetwork::mapBinary - unsupported version %d" , h->version ) ;
+   if ( h->realSize != (int)sizeof(real) || h->transSize != (int)sizeof(WFSTTransition) ||
+        h->align != WFST_ALIGN )
+      error("WFSTNetwork::mapBinary - file written with a different real size or transition layout") ;
+   WFSTBinHeader layout = *h ;
+   wfstLayout( &layout ) ;
+   if ( memcmp( layout.sections , h->sections , sizeof(layout.sections) ) != 0 ||
+        h->nStates != h->maxState+1 || (h->weightBits < 0) || (h->weightBits > 16) ||
+        ( (h->weightBits > 0) &&
+          ( (h->toStateBits < 1) || (h->inLabelBits < 1) || (h->outLabelBits < 1) ||
+            (h->toStateBits+h->inLabelBits+h->outLabelBits+h->weightBits > 64) ) ) ||
+        st.st_size < (off_t)h->sections[WFST_ALPHABETS]*WFST_ALIGN )
+      error("WFSTNetwork::mapBinary - inconsistent or truncated file") ;
+
+   char *base = (char *)map ;
+   binMap = base ;
+   binMapLen = st.st_size ;
+
+   initState = h->initState ;
+   maxState = h->maxState ;
+   nStates = h->nStates ;
+   maxOutTransitions = h->maxOutTransitions ;
+   wordEndMarker = h->wordEndMarker ;
+   silMarker = h->silMarker ;
+   spMarker = h->spMarker ;
+   nFinalStates = h->nFinalStates ;
+   nTransitions = h->nTransitions ;
+   nStatesAlloc = 0 ;
+   nFinalStatesAlloc = 0 ;
+   nTransitionsAlloc = 0 ;
+   states = (WFSTState *)(base + (long)h->sections[WFST_STATES]*WFST_ALIGN) ;
+   finalStates = (WFSTFinalState *)(base + (long)h->sections[WFST_FINALS]*WFST_ALIGN) ;
+   if ( h->weightBits > 0 )
    {
-      haveAlphabet = false ;
-      fwrite( &haveAlphabet , sizeof(bool) , 1 , fd ) ;
+      transitions = NULL ;
+      packedTransitions = (uint64_t *)(base + (long)h->sections[WFST_PACKED]*WFST_ALIGN) ;
+      weightCodebook = (real *)(base + (long)h->sections[WFST_CODEBOOK]*WFST_ALIGN) ;
+      weightBits = h->weightBits ;
+      toStateBits = h->toStateBits ;
+      inLabelBits = h->inLabelBits ;
+      outLabelBits = h->outLabelBits ;
+      setCompactMasks() ;
    }
    else
+      transitions = (WFSTTransition *)(base + (long)h->sections[WFST_TRANS]*WFST_ALIGN) ;
+
+   // Alphabets are read as a stream from their offset
+   FILE *afd ;
+   if ( (afd = fopen( fname , "rb" )) == NULL )
+      error("WFSTNetwork::mapBinary - error opening %s" , fname ) ;
+   if ( fseek( afd , (long)h->sections[WFST_ALPHABETS]*WFST_ALIGN , SEEK_SET ) != 0 )
+      error("WFSTNetwork::mapBinary - error seeking to alphabets") ;
+   bool haveAlphabet ;
+   if ( fread( &haveAlphabet , sizeof(bool) , 1 , afd ) != 1 )
+      error("WFSTNetwork::mapBinary - error reading inputAlphabet haveAlphabet") ;
+   if ( haveAlphabet )
    {
-      haveAlphabet = true ;
-      fwrite( &haveAlphabet , sizeof(bool) , 1 , fd ) ;
-      inputAlphabet->writeBinary( fd ) ;
+      inputAlphabet = new WFSTAlphabet() ;
+      inputAlphabet->readBinary( afd ) ;
    }
-
-   if ( outputAlphabet == NULL )
+   if ( fread( &haveAlphabet , sizeof(bool) , 1 , afd ) != 1 )
+      error("WFSTNetwork::mapBinary - error reading outputAlphabet haveAlphabet") ;
+   if ( haveAlphabet )
    {
-      haveAlphabet = false ;
-      fwrite( &haveAlphabet , sizeof(bool) , 1 , fd ) ;
+      outputAlphabet = new WFSTAlphabet() ;
+      outputAlphabet->readBinary( afd ) ;
    }
-   else
+   char id[5] ;
+   if ( fread( id , 4 , 1 , afd ) != 1 )
+      error("WFSTNetwork::mapBinary - error reading ID (2)") ;
+   id[4] = '\0' ;
+   if ( strcmp( id , "JWNC" ) != 0 )
+      error("WFSTNetwork::mapBinary - invalid ID (2)") ;
+   fclose( afd ) ;
+
+   // Weights written with a different scaling factor or insertion penalty
+   // are converted, at the cost of private copies of those pages.  The
+   // codebook has no penalty, that is added by getTransition().
+   real fileScale = h->transWeightScalingFactor ;
+   real filePenalty = h->insPenalty ;
+   if ( (weightBits > 0) && (fileScale != transWeightScalingFactor) )
    {
-      haveAlphabet = true ;
-      fwrite( &haveAlphabet , sizeof(bool) , 1 , fd ) ;
-      outputAlphabet->writeBinary( fd ) ;
+      for ( int k=0 ; k<(1 << weightBits) ; k++ )
+         weightCodebook[k] = weightCodebook[k] / fileScale * transWeightScalingFactor ;
+      for ( int i=0 ; i<nFinalStates ; i++ )
+         finalStates[i].weight = finalStates[i].weight / fileScale * transWeightScalingFactor ;
    }
-
-   // 6. Write the ID (again).
-   fwrite( (int *)id , sizeof(int) , 1 , fd ) ;
-
-   fclose( fd ) ;
-
-   // If we have unscaled all transition weights for writing to binary file,
-   //   re-scale them back to their original values.
-   if ( transWeightScalingFactor != 1.0 )
+   else if ( (weightBits == 0) &&
+             ((fileScale != transWeightScalingFactor) || (filePenalty != insPenalty)) )
    {
       for ( int i=0 ; i<nTransitions ; i++ )
       {
-         transitions[i].weight *= transWeightScalingFactor ;
+         real w = transitions[i].weight ;
+         if ( transitions[i].outLabel > 0 )
+            w -= filePenalty ;
+         w = w / fileScale * transWeightScalingFactor ;
+         if ( transitions[i].outLabel > 0 )
+            w += insPenalty ;
+         transitions[i].weight = w ;
       }
+      for ( int i=0 ; i<nFinalStates ; i++ )
+         finalStates[i].weight = finalStates[i].weight / fileScale * transWeightScalingFactor ;
    }
 
-   // restore insPenalty, this is done after weight scaling
-   if (insPenalty != 0.0) {
-       for ( int i=0 ; i<nTransitions ; i++ )
-       {
-           if (transitions[i].outLabel > 0)
-               transitions[i].weight += insPenalty ;
-       }
-   }
+   if ( mprotect( binMap , binMapLen , PROT_READ ) != 0 )
+      error("WFSTNetwork::mapBinary - error protecting %s" , fname ) ;
 }
 
 
-void WFSTNetwork::readBinary( const char *fname )
+// The stream format written by earlier versions: per-state transition index
+// lists, which are packed into contiguous ranges here.
+void WFSTNetwork::readLegacyBinary( FILE *fd )
 {
-   FILE *fd ;
-   if ( (fd = fopen( fname , "rb" )) == NULL )
-      error("WFSTNetwork::readBinary - error opening input file") ;
-
-   char id[5] ;
-
-   // 1. Read ID, initState , maxState, nStates, maxOutTransitions
+   // 1. Read initState , maxState, nStates, maxOutTransitions
    // wordEndMarker,  silMarker , spMarker
-   if ( fread( (int *)id , sizeof(int) , 1 , fd ) != 1 )
-      error("WFSTNetwork::readBinary - error reading ID") ;
-   id[4] = '\0' ;
-   if ( strcmp( id , "JWNT" ) != 0 )
-      error("WFSTNetwork::readBinary - invalid ID") ;
    if ( fread( &initState , sizeof(int) , 1 , fd ) != 1 )
       error("WFSTNetwork::readBinary - error reading initState") ;
    if ( fread( &maxState , sizeof(int) , 1 , fd ) != 1 )
@@ -1255,9 +1881,11 @@ void WFSTNetwork::readBinary( const char *fname )
    if ( fread( &spMarker , sizeof(int) , 1 , fd ) != 1 )
       error("WFSTNetwork::readBinary - error reading spMarker") ;
 
-   // 2. Allocate and read the states array
+   // 2. Allocate and read the states array, keeping the transition
+   // index lists in order to pack the transitions after reading them
    nStatesAlloc = maxState + 1 ;
    states = new WFSTState[nStatesAlloc] ;
+   vector<int> order ;
    int i ;
    for ( i=0 ; i<=maxState ; i++ )
    {
@@ -1267,14 +1895,13 @@ void WFSTNetwork::readBinary( const char *fname )
          error("WFSTNetwork::readBinary - error reading states[i].finalInd") ;
       if ( fread( &(states[i].nTrans) , sizeof(int) , 1 , fd ) != 1 )
          error("WFSTNetwork::readBinary - error reading states[i].nTrans") ;
+      states[i].trans = order.size() ;
       if ( states[i].nTrans > 0 )
       {
-         states[i].trans = new int[states[i].nTrans] ;
-         if ( (int)fread( states[i].trans, sizeof(int), states[i].nTrans, fd ) != states[i].nTrans )
+         order.resize( order.size() + states[i].nTrans ) ;
+         if ( (int)fread( &order[states[i].trans], sizeof(int), states[i].nTrans, fd ) != states[i].nTrans )
             error("WFSTNetwork::readBinary - error reading states[i].trans array") ;
       }
-      else
-         states[i].trans = NULL ;
    }
 
    // 3. Read nFinalStates and finalStates array.
@@ -1297,23 +1924,34 @@ void WFSTNetwork::readBinary( const char *fname )
    // 4. Read nTransitions and transitions array.
    if ( fread( &nTransitions , sizeof(int) , 1 , fd ) != 1 )
       error("WFSTNetwork::readBinary - error reading nTransitions") ;
+   if ( nTransitions != (int)order.size() )
+      error("WFSTNetwork::readBinary - nTransitions does not match the states") ;
    if ( nTransitions > 0 )
    {
-      transitions = new WFSTTransition[nTransitions] ;
+      WFSTTransition *unpacked = new WFSTTransition[nTransitions] ;
       for (i=0; i<nTransitions; i++)
       {
-          if ( fread( &(transitions[i].id) , sizeof(int) , 1 , fd ) != 1 )
+          if ( fread( &(unpacked[i].id) , sizeof(int) , 1 , fd ) != 1 )
               error("WFSTNetwork::readBinary - error reading transitions id");
-          if ( fread( &(transitions[i].toState) , sizeof(int) , 1 , fd ) != 1 )
+          if ( fread( &(unpacked[i].toState) , sizeof(int) , 1 , fd ) != 1 )
               error("WFSTNetwork::readBinary - error reading transitions ts");
-          if ( fread( &(transitions[i].weight) , sizeof(int) , 1 , fd ) != 1 )
+          if ( fread( &(unpacked[i].weight) , sizeof(int) , 1 , fd ) != 1 )
               error("WFSTNetwork::readBinary - error reading transitions wt");
-          if ( fread( &(transitions[i].inLabel) , sizeof(int) , 1 , fd ) != 1 )
+          if ( fread( &(unpacked[i].inLabel) , sizeof(int) , 1 , fd ) != 1 )
               error("WFSTNetwork::readBinary - error reading transitions il");
-          if ( fread( &(transitions[i].outLabel) , sizeof(int) , 1 , fd ) != 1)
+          if ( fread( &(unpacked[i].outLabel) , sizeof(int) , 1 , fd ) != 1)
               error("WFSTNetwork::readBinary - error reading transitions id");
-          transitions[i].hook = 0;
       }
+
+      transitions = new WFSTTransition[nTransitions] ;
+      for (i=0; i<nTransitions; i++)
+      {
+          if ( (order[i] < 0) || (order[i] >= nTransitions) )
+              error("WFSTNetwork::readBinary - invalid transition index %d" , order[i] ) ;
+          transitions[i] = unpacked[order[i]] ;
+          transitions[i].id = i ;
+      }
+      delete [] unpacked ;
    }
    else
       transitions = NULL ;
@@ -1341,49 +1979,458 @@ void WFSTNetwork::readBinary( const char *fname )
       outputAlphabet = NULL ;
 
    // 6. Read the ID field
+   char id[5] ;
    if ( fread( (int *)id , sizeof(int) , 1 , fd ) != 1 )
       error("WFSTNetwork::readBinary - error reading ID (2)") ;
    id[4] = '\0' ;
    if ( strcmp( id , "JWNT" ) != 0 )
       error("WFSTNetwork::readBinary - invalid ID (2)") ;
 
-   fclose( fd ) ;
+   fromBinFile = true ;
+
+   // Scaled all transition weights if a scaling factor is specified
+   if ( transWeightScalingFactor != 1.0 )
+   {
+      for ( int i=0 ; i<nTransitions ; i++ )
+      {
+         transitions[i].weight *= transWeightScalingFactor ;
+      }
+   }
+    // restore insPenalty, this is done after weight scaling
+   if (insPenalty != 0.0) {
+       for ( int i=0 ; i<nTransitions ; i++ )
+       {
+           if (transitions[i].outLabel > 0)
+               transitions[i].weight += insPenalty ;
+       }
+   }
+}
+
+
+// Change Octavian 20060616
+void WFSTNetwork::printNumOutTransitions( const char *fname )
+{
+   FILE *fptr ;
+
+   if ( (fptr = fopen( fname, "w" )) == NULL )
+      error("WFSTNetwork::printNumOutTransitions - Cannot open file") ;
+
+   for ( int i = 0 ; i < nStates ; i++ )  {
+      fprintf( fptr, "%d, ", states[i].nTrans ) ;
+   }
+
+   fclose( fptr ) ;
+
+}
+
+
+void WFSTNetwork::renumberStates( const int *order )
+{
+   if ( packedTransitions != NULL )
+      error("WFSTNetwork::renumberStates - transitions are compact") ;
+   int i , j ;
+   int *newIndex = new int[nStates] ;
+   for ( i=0 ; i<nStates ; i++ )
+      newIndex[i] = -1 ;
+   for ( i=0 ; i<nStates ; i++ )
+   {
+      if ( (order[i] < 0) || (order[i] >= nStates) || (newIndex[order[i]] >= 0) )
+         error("WFSTNetwork::renumberStates - order is not a permutation of the states") ;
+      newIndex[order[i]] = i ;
+   }
+
+   WFSTState *newStates = (WFSTState *)malloc( nStates * sizeof(WFSTState) ) ;
+   WFSTTransition *newTransitions = NULL ;
+   WFSTFinalState *newFinalStates = NULL ;
+   if ( nTransitions > 0 )
+      newTransitions = (WFSTTransition *)malloc( nTransitions * sizeof(WFSTTransition) ) ;
+   if ( nFinalStates > 0 )
+      newFinalStates = (WFSTFinalState *)malloc( nFinalStates * sizeof(WFSTFinalState) ) ;
+   if ( (newStates == NULL) || ((nTransitions > 0) && (newTransitions == NULL)) ||
+        ((nFinalStates > 0) && (newFinalStates == NULL)) )
+      error("WFSTNetwork::renumberStates - malloc failed") ;
+
+   int pos = 0 ;
+   for ( i=0 ; i<nStates ; i++ )
+   {
+      const WFSTState *old = states + order[i] ;
+      newStates[i].label = ( old->label >= 0 ) ? i : -1 ;
+      newStates[i].finalInd = old->finalInd ;
+      newStates[i].nTrans = old->nTrans ;
+      newStates[i].trans = pos ;
+      for ( j=0 ; j<old->nTrans ; j++ , pos++ )
+      {
+         newTransitions[pos] = transitions[old->trans+j] ;
+         newTransitions[pos].id = pos ;
+         newTransitions[pos].toState = newIndex[newTransitions[pos].toState] ;
+      }
+   }
+
+   for ( i=0 ; i<nFinalStates ; i++ )
+   {
+      newFinalStates[i] = finalStates[i] ;
+      newFinalStates[i].id = newIndex[finalStates[i].id] ;
+   }
+   initState = newIndex[initState] ;
+   delete [] newIndex ;
+
+   freeArrays() ;
+   fromBinFile = false ;
+   states = newStates ;
+   nStatesAlloc = nStates ;
+   transitions = newTransitions ;
+   nTransitionsAlloc = nTransitions ;
+   finalStates = newFinalStates ;
+   nFinalStatesAlloc = nFinalStates ;
+}
+
+
+// number of bits needed to hold 0..maxValue
+static int wfstFieldBits( int maxValue )
+{
+   int n = 1 ;
+   while ( (n < 31) && ((maxValue >> n) != 0) )
+      n++ ;
+   return n ;
+}
+
+
+void WFSTNetwork::setCompactMasks()
+{
+   toStateMask = ((uint64_t)1 << toStateBits) - 1 ;
+   inLabelMask = ((uint64_t)1 << inLabelBits) - 1 ;
+   outLabelMask = ((uint64_t)1 << outLabelBits) - 1 ;
+}
+
+
+// The codebook is fitted to the weights without the insertion penalty, so
+// that it is not spent on two copies of every LM weight.  When there are no
+// more distinct weights than entries they are kept exactly; otherwise the
+// entries are found by Lloyd's algorithm on the sorted distinct weights.
+real WFSTNetwork::compactTransitions( int weightBits_ )
+{
+   if ( (weightBits_ < 1) || (weightBits_ > 16) )
+      error("WFSTNetwork::compactTransitions - weightBits %d not in 1..16" , weightBits_ ) ;
+   if ( packedTransitions != NULL )
+      error("WFSTNetwork::compactTransitions - transitions are already compact") ;
+
+   int i , k ;
+   int maxIn = 0 , maxOut = 0 ;
+   for ( i=0 ; i<nTransitions ; i++ )
+   {
+      if ( (transitions[i].inLabel < 0) || (transitions[i].outLabel < 0) )
+         error("WFSTNetwork::compactTransitions - negative label on transition %d" , i ) ;
+      if ( transitions[i].inLabel > maxIn )
+         maxIn = transitions[i].inLabel ;
+      if ( transitions[i].outLabel > maxOut )
+         maxOut = transitions[i].outLabel ;
+   }
+   toStateBits = wfstFieldBits( nStates - 1 ) ;
+   inLabelBits = wfstFieldBits( maxIn ) ;
+   outLabelBits = wfstFieldBits( maxOut ) ;
+   if ( toStateBits + inLabelBits + outLabelBits + weightBits_ > 64 )
+      error("WFSTNetwork::compactTransitions - %d+%d+%d state and label bits leave no room for %d weight bits" ,
+            toStateBits , inLabelBits , outLabelBits , weightBits_ ) ;
+
+   // Distinct weights and their counts
+   vector<real> w( nTransitions ) ;
+   for ( i=0 ; i<nTransitions ; i++ )
+   {
+      w[i] = transitions[i].weight ;
+      if ( transitions[i].outLabel > 0 )
+         w[i] -= insPenalty ;
+   }
+   sort( w.begin() , w.end() ) ;
+   vector<real> val ;
+   vector<int> cnt ;
+   for ( i=0 ; i<nTransitions ; i++ )
+   {
+      if ( val.empty() || (w[i] != val.back()) )
+      {
+         val.push_back( w[i] ) ;
+         cnt.push_back( 0 ) ;
+      }
+      cnt.back()++ ;
+   }
+   vector<real>().swap( w ) ;
+
+   int nCodes = 1 << weightBits_ ;
+   int nVal = (int)val.size() ;
+   real *codebook = (real *)malloc( nCodes * sizeof(real) ) ;
+   if ( codebook == NULL )
+      error("WFSTNetwork::compactTransitions - codebook malloc failed") ;
+   if ( nVal <= nCodes )
+   {
+      for ( k=0 ; k<nCodes ; k++ )
+         codebook[k] = ( nVal > 0 ) ? val[(k < nVal) ? k : nVal-1] : 0.0 ;
+   }
+   else
+   {
+      // Start from evenly spaced distinct weights; each iteration is one
+      // sweep since the cells of a sorted codebook are intervals.
+      for ( k=0 ; k<nCodes ; k++ )
+         codebook[k] = val[ (int)( ((long)2*k+1) * nVal / (2*nCodes) ) ] ;
+      vector<double> sum( nCodes ) ;
+      vector<long> n( nCodes ) ;
+      for ( int iter=0 ; iter<50 ; iter++ )
+      {
+         fill( sum.begin() , sum.end() , 0.0 ) ;
+         fill( n.begin() , n.end() , 0 ) ;
+         k = 0 ;
+         for ( i=0 ; i<nVal ; i++ )
+         {
+            while ( (k < nCodes-1) && (val[i] > (codebook[k]+codebook[k+1])/2) )
+               k++ ;
+            sum[k] += (double)val[i] * cnt[i] ;
+            n[k] += cnt[i] ;
+         }
+         bool changed = false ;
+         for ( k=0 ; k<nCodes ; k++ )
+         {
+            if ( n[k] == 0 )
+               continue ;
+            real c = (real)( sum[k] / n[k] ) ;
+            if ( c != codebook[k] )
+               changed = true ;
+            codebook[k] = c ;
+         }
+         if ( ! changed )
+            break ;
+         sort( codebook , codebook + nCodes ) ;
+      }
+   }
+
+   // Pack, each weight taking its nearest entry
+   uint64_t *packed = (uint64_t *)malloc( (nTransitions > 0 ? nTransitions : 1) * sizeof(uint64_t) ) ;
+   if ( packed == NULL )
+      error("WFSTNetwork::compactTransitions - packedTransitions malloc failed") ;
+   int labelShift = toStateBits + inLabelBits ;
+   int codeShift = labelShift + outLabelBits ;
+   real maxErr = 0.0 ;
+   for ( i=0 ; i<nTransitions ; i++ )
+   {
+      const WFSTTransition *t = transitions + i ;
+      real x = t->weight ;
+      if ( t->outLabel > 0 )
+         x -= insPenalty ;
+      int code = (int)( lower_bound( codebook , codebook + nCodes , x ) - codebook ) ;
+      if ( code == nCodes )
+         code-- ;
+      else if ( (code > 0) && (x - codebook[code-1] < codebook[code] - x) )
+         code-- ;
+      real err = ( x > codebook[code] ) ? x - codebook[code] : codebook[code] - x ;
+      if ( err > maxErr )
+         maxErr = err ;
+      packed[i] = (uint64_t)t->toState |
+                  ((uint64_t)t->inLabel << toStateBits) |
+                  ((uint64_t)t->outLabel << labelShift) |
+                  ((uint64_t)code << codeShift) ;
+   }
+
+   // Mapped transitions are left to the map
+   if ( binMap == NULL )
+   {
+      if ( fromBinFile )
+         delete [] transitions ;
+      else
+         free( transitions ) ;
+   }
+   transitions = NULL ;
+   nTransitionsAlloc = 0 ;
+
+   packedTransitions = packed ;
+   weightCodebook = codebook ;
+   weightBits = weightBits_ ;
+   setCompactMasks() ;
+   return maxErr ;
+}
 
-   fromBinFile = true ;
+// Walk state for buildEpsClosures()
+struct EpsFrame
+{
+   int state ;
+   int next ;        // next transition to follow
+   int end ;
+   real weight ;     // of the path to state
+   int nLabels ;     // labels on the path to state
+} ;
 
-   // Scaled all transition weights if a scaling factor is specified
-   if ( transWeightScalingFactor != 1.0 )
+struct EpsCandidate
+{
+   int trans ;
+   real weight ;
+   vector<WFSTClosureLabel> labels ;
+} ;
+
+// Each closure is found by a depth-first walk over the epsilon paths from
+// the state that do not visit a state twice, keeping the best path to each
+// transition.  A state whose walk goes beyond maxArcs transitions, or
+// becomes much longer than that, keeps the transition-by-transition walk.
+int WFSTNetwork::buildEpsClosures( int maxArcs )
+{
+   if ( maxArcs <= 0 )
+      error("WFSTNetwork::buildEpsClosures - maxArcs %d <= 0" , maxArcs ) ;
+
+   delete [] closureOf ;
+   delete [] closures ;
+   delete [] closureArcs ;
+   delete [] closureLabels ;
+   closureOf = new int[nStates] ;
+
+   vector<WFSTEpsClosure> cls ;
+   vector<WFSTClosureArc> arcs ;
+   vector<WFSTClosureLabel> labels ;
+   vector<char> onPath( nStates , 0 ) ;
+   vector<int> bestAt( nTransitions , -1 ) ;
+   vector<EpsFrame> stack ;
+   vector<WFSTClosureLabel> pathLabels , finalLabels ;
+   vector<EpsCandidate> cands ;
+   long maxWork = 64L * maxArcs + 1024 ;
+   WFSTTransition t ;
+   int s , i ;
+
+   for ( s=0 ; s<nStates ; s++ )
    {
-      for ( int i=0 ; i<nTransitions ; i++ )
+      closureOf[s] = -1 ;
+
+      // Only states with epsilon input transitions
+      int nDirect = 0 ;
+      for ( i=0 ; i<states[s].nTrans ; i++ )
       {
-         transitions[i].weight *= transWeightScalingFactor ;
+         getTransition( states[s].trans + i , &t ) ;
+         if ( t.inLabel != WFST_EPSILON )
+            nDirect++ ;
       }
-   }
-    // restore insPenalty, this is done after weight scaling
-   if (insPenalty != 0.0) {
-       for ( int i=0 ; i<nTransitions ; i++ )
-       {
-           if (transitions[i].outLabel > 0)
-               transitions[i].weight += insPenalty ;
-       }
-   }
-}
-
+      if ( (nDirect == states[s].nTrans) || (nDirect > maxArcs) )
+         continue ;
 
-// Change Octavian 20060616
-void WFSTNetwork::printNumOutTransitions( const char *fname )
-{
-   FILE *fptr ;
+      WFSTEpsClosure c ;
+      c.firstArc = (int)arcs.size() ;
+      c.nDirect = nDirect ;
+      c.finalTransWeight = LOG_ZERO ;
+      c.finalStateWeight = LOG_ZERO ;
+      c.nFinalLabels = 0 ;
+      cands.clear() ;
+      pathLabels.clear() ;
+      finalLabels.clear() ;
+
+      EpsFrame f = { s , states[s].trans , states[s].trans + states[s].nTrans , 0.0 , 0 } ;
+      stack.push_back( f ) ;
+      onPath[s] = 1 ;
+      long work = 0 ;
+      bool ok = true ;
+      while ( ok && !stack.empty() )
+      {
+         EpsFrame &top = stack.back() ;
+         if ( top.next == top.end )
+         {
+            onPath[top.state] = 0 ;
+            pathLabels.resize( top.nLabels ) ;
+            stack.pop_back() ;
+            continue ;
+         }
+         int index = top.next++ ;
+         getTransition( index , &t ) ;
+         if ( ++work > maxWork )
+         {
+            ok = false ;
+            break ;
+         }
 
-   if ( (fptr = fopen( fname, "w" )) == NULL )
-      error("WFSTNetwork::printNumOutTransitions - Cannot open file") ;
+         if ( t.inLabel != WFST_EPSILON )
+         {
+            // The direct transitions are added below
+            if ( top.state == s )
+               continue ;
+            int k = bestAt[index] ;
+            if ( k < 0 )
+            {
+               if ( nDirect + (int)cands.size() >= maxArcs )
+               {
+                  ok = false ;
+                  break ;
+               }
+               bestAt[index] = (int)cands.size() ;
+               cands.resize( cands.size() + 1 ) ;
+               cands.back().trans = index ;
+               cands.back().weight = top.weight ;
+               cands.back().labels = pathLabels ;
+            }
+            else if ( top.weight > cands[k].weight )
+            {
+               cands[k].weight = top.weight ;
+               cands[k].labels = pathLabels ;
+            }
+            continue ;
+         }
 
-   for ( int i = 0 ; i < nStates ; i++ )  {
-      fprintf( fptr, "%d, ", states[i].nTrans ) ;
-   }
+         if ( onPath[t.toState] )
+            continue ;
+         EpsFrame next = { t.toState , states[t.toState].trans ,
+                        states[t.toState].trans + states[t.toState].nTrans ,
+                        top.weight + t.weight , (int)pathLabels.size() } ;
+         if ( t.outLabel != WFST_EPSILON )
+         {
+            WFSTClosureLabel l = { t.outLabel , next.weight } ;
+            pathLabels.push_back( l ) ;
+         }
+         if ( isFinalState( t.toState ) )
+         {
+            real w = getFinalStateWeight( t.toState ) ;
+            if ( next.weight + w > c.finalTransWeight + c.finalStateWeight )
+            {
+               c.finalTransWeight = next.weight ;
+               c.finalStateWeight = w ;
+               finalLabels = pathLabels ;
+            }
+         }
+         onPath[t.toState] = 1 ;
+         stack.push_back( next ) ;
+      }
 
-   fclose( fptr ) ;
+      // Clear the walk state for the next state
+      for ( i=0 ; i<(int)stack.size() ; i++ )
+         onPath[stack[i].state] = 0 ;
+      stack.clear() ;
+      for ( i=0 ; i<(int)cands.size() ; i++ )
+         bestAt[cands[i].trans] = -1 ;
+      if ( ! ok )
+         continue ;
 
+      for ( i=0 ; i<states[s].nTrans ; i++ )
+      {
+         getTransition( states[s].trans + i , &t ) ;
+         if ( t.inLabel == WFST_EPSILON )
+            continue ;
+         WFSTClosureArc a = { states[s].trans + i , 0.0 , (int)labels.size() , 0 } ;
+         arcs.push_back( a ) ;
+      }
+      for ( i=0 ; i<(int)cands.size() ; i++ )
+      {
+         WFSTClosureArc a = { cands[i].trans , cands[i].weight , (int)labels.size() ,
+                              (int)cands[i].labels.size() } ;
+         arcs.push_back( a ) ;
+         labels.insert( labels.end() , cands[i].labels.begin() , cands[i].labels.end() ) ;
+      }
+      c.nArcs = (int)arcs.size() - c.firstArc ;
+      c.finalLabels = (int)labels.size() ;
+      c.nFinalLabels = (int)finalLabels.size() ;
+      labels.insert( labels.end() , finalLabels.begin() , finalLabels.end() ) ;
+
+      closureOf[s] = (int)cls.size() ;
+      cls.push_back( c ) ;
+   }
+
+   closures = new WFSTEpsClosure[cls.size()+1] ;
+   closureArcs = new WFSTClosureArc[arcs.size()+1] ;
+   closureLabels = new WFSTClosureLabel[labels.size()+1] ;
+   if ( ! cls.empty() )
+      memcpy( closures , &cls[0] , cls.size() * sizeof(WFSTEpsClosure) ) ;
+   if ( ! arcs.empty() )
+      memcpy( closureArcs , &arcs[0] , arcs.size() * sizeof(WFSTClosureArc) ) ;
+   if ( ! labels.empty() )
+      memcpy( closureLabels , &labels[0] , labels.size() * sizeof(WFSTClosureLabel) ) ;
+   return (int)cls.size() ;
 }
 
 
@@ -1397,7 +2444,7 @@ void WFSTNetwork::initWFSTState( WFSTState *state )
    state->label = -1 ;
    state->finalInd = -1 ;
    state->nTrans = 0 ;
-   state->trans = NULL ;
+   state->trans = 0 ;
 }
 
 void WFSTNetwork::initWFSTTransition( WFSTTransition *transition )
@@ -1415,6 +2462,200 @@ void WFSTNetwork::initWFSTTransition( WFSTTransition *transition )
    transition->weight = LOG_ZERO ;
 }
 
+// Reads an AT&T text FSM into the transitions, in file order with the from
+// state in their id, the final states, and the states with their labels
+// and transition counts, ready for packTransitions().  The mapped file is
+// split at line boundaries among up to one thread per processor, which
+// count their lines and then fill their part of the exactly sized arrays.
+void WFSTNetwork::readTextFSM( const char *wfstFilename , const char *who ,
+                               int *maxInLab , int *maxOutLab )
+{
+   long len ;
+   const char *text = mapTextFile( wfstFilename , &len , who ) ;
+   const char *end = text + len ;
+
+   // At least 4MB for each thread
+   long nChunks = sysconf( _SC_NPROCESSORS_ONLN ) ;
+   if ( nChunks > len / (1L << 22) )
+      nChunks = len / (1L << 22) ;
+   if ( nChunks > 64 )
+      nChunks = 64 ;
+   if ( nChunks < 1 )
+      nChunks = 1 ;
+
+   int i ;
+   vector<FSMChunk> chunks( nChunks ) ;
+   const char *p = text ;
+   for ( i=0 ; i<nChunks ; i++ )
+   {
+      FSMChunk &c = chunks[i] ;
+      memset( &c , 0 , sizeof(FSMChunk) ) ;
+      c.begin = p ;
+      if ( i < nChunks-1 )
+      {
+         p = text + len / nChunks * (i+1) ;
+         if ( p < c.begin )
+            p = c.begin ;
+         const char *eol = (const char *)memchr( p , '\n' , end - p ) ;
+         p = ( eol != NULL ) ? eol+1 : end ;
+      }
+      else
+         p = end ;
+      c.end = p ;
+      c.firstFrom = -1 ;
+      c.maxState = -1 ;
+      c.maxIn = -1 ;
+      c.maxOut = -1 ;
+      c.scale = transWeightScalingFactor ;
+      c.insPenalty = insPenalty ;
+   }
+
+   // 1. Count
+   scanFSMChunks( chunks ) ;
+
+   *maxInLab = -1 ;
+   *maxOutLab = -1 ;
+   nTransitions = 0 ;
+   nFinalStates = 0 ;
+   for ( i=0 ; i<nChunks ; i++ )
+   {
+      FSMChunk &c = chunks[i] ;
+      if ( c.badLine != NULL )
+      {
+         const char *eol = (const char *)memchr( c.badLine , '\n' , end - c.badLine ) ;
+         error("%s - something < 0. %.*s" , who ,
+               (int)( (eol != NULL ? eol : end) - c.badLine ) , c.badLine ) ;
+      }
+      // init state is source state in first line of file
+      if ( (initState < 0) && (c.firstFrom >= 0) )
+         initState = c.firstFrom ;
+      if ( c.maxState > maxState )
+         maxState = c.maxState ;
+      if ( c.maxIn > *maxInLab )
+         *maxInLab = c.maxIn ;
+      if ( c.maxOut > *maxOutLab )
+         *maxOutLab = c.maxOut ;
+      nTransitions += c.nTrans ;
+      nFinalStates += c.nFinals ;
+   }
+
+   // 2. Fill
+   if ( nTransitions > 0 )
+   {
+      transitions = (WFSTTransition *)malloc( nTransitions * sizeof(WFSTTransition) ) ;
+      if ( transitions == NULL )
+         error("%s - transitions malloc failed" , who ) ;
+   }
+   nTransitionsAlloc = nTransitions ;
+   if ( nFinalStates > 0 )
+   {
+      finalStates = (WFSTFinalState *)malloc( nFinalStates * sizeof(WFSTFinalState) ) ;
+      if ( finalStates == NULL )
+         error("%s - finalStates malloc failed" , who ) ;
+   }
+   nFinalStatesAlloc = nFinalStates ;
+
+   int nTrans = 0 , nFinals = 0 ;
+   for ( i=0 ; i<nChunks ; i++ )
+   {
+      FSMChunk &c = chunks[i] ;
+      c.fill = true ;
+      c.trans = transitions + nTrans ;
+      c.finals = finalStates + nFinals ;
+      nTrans += c.nTrans ;
+      nFinals += c.nFinals ;
+   }
+   scanFSMChunks( chunks ) ;
+   if ( text != NULL )
+      munmap( (void *)text , len ) ;
+
+   // 3. States that appear in a transition, and their transition counts
+   if ( maxState >= 0 )
+   {
+      nStatesAlloc = maxState + 1 ;
+      states = (WFSTState *)malloc( nStatesAlloc * sizeof(WFSTState) ) ;
+      if ( states == NULL )
+         error("%s - states malloc failed" , who ) ;
+      for ( i=0 ; i<nStatesAlloc ; i++ )
+         initWFSTState( states + i ) ;
+   }
+   for ( i=0 ; i<nTransitions ; i++ )
+   {
+      const WFSTTransition *t = transitions + i ;
+      states[t->id].label = t->id ;
+      states[t->toState].label = t->toState ;
+      if ( ++(states[t->id].nTrans) > maxOutTransitions )
+         maxOutTransitions = states[t->id].nTrans ;
+   }
+}
+
+
+// Makes the transitions out of each state contiguous, in the order they
+// were read (or by input label if sortInLabel), and sets states[].trans to
+// the first of them.  The parser leaves the from state of each transition
+// in its id field and the count in states[].nTrans; the permutation is
+// done in place so no second copy of the transitions is needed.
+void WFSTNetwork::packTransitions( bool sortInLabel )
+{
+   int i , pos=0 ;
+   for ( i=0 ; i<=maxState ; i++ )
+   {
+      states[i].trans = pos ;
+      pos += states[i].nTrans ;
+   }
+   if ( pos != nTransitions )
+      error("WFSTNetwork::packTransitions - state counts do not match nTransitions") ;
+   if ( nTransitions == 0 )
+      return ;
+
+   // Shrink the transitions array
+   if ( nTransitionsAlloc > nTransitions )
+   {
+      transitions = (WFSTTransition *)realloc(
+          transitions , nTransitions * sizeof(WFSTTransition)
+      ) ;
+      if ( transitions == NULL )
+         error("WFSTNetwork::packTransitions - transitions realloc failed") ;
+      nTransitionsAlloc = nTransitions ;
+   }
+
+   // Destination of each transition, then follow the cycles
+   int *next = new int[maxState+1] ;
+   for ( i=0 ; i<=maxState ; i++ )
+      next[i] = states[i].trans ;
+   for ( i=0 ; i<nTransitions ; i++ )
+      transitions[i].id = next[transitions[i].id]++ ;
+   delete [] next ;
+
+   for ( i=0 ; i<nTransitions ; i++ )
+   {
+      while ( transitions[i].id != i )
+      {
+         WFSTTransition tmp = transitions[transitions[i].id] ;
+         transitions[transitions[i].id] = transitions[i] ;
+         transitions[i] = tmp ;
+      }
+   }
+
+   if ( sortInLabel )
+   {
+      for ( i=0 ; i<=maxState ; i++ )
+      {
+         WFSTTransition *trans = transitions + states[i].trans ;
+         int n = states[i].nTrans ;
+         stable_sort( trans , trans + n , inLabelLess ) ;
+         for ( int j=1 ; j<n ; j++ )
+         {
+            if ( trans[j].inLabel == trans[j-1].inLabel )
+               error("WFSTNetwork::packTransitions - state %d has two transitions with inLabel %d" ,
+                     i , trans[j].inLabel ) ;
+         }
+      }
+      for ( i=0 ; i<nTransitions ; i++ )
+         transitions[i].id = i ;
+   }
+}
+
 // Changes Octavian 20060523
 // If any changes appear in this function, consider changing it in
 // removeAuxiliaryInputSymbols() as well.
@@ -1505,12 +2746,22 @@ void WFSTNetwork::removeAuxiliaryInputSymbols( bool markAux )
 WFSTLabelPushingNetwork::WFSTLabelPushingNetwork() : WFSTNetwork()
 {
    arc_outlabset_map = NULL ;
+   labelSets = NULL ;
+   nLabelSets = 0 ;
+   labelSetLabels = NULL ;
+   labelSetBits = NULL ;
+   arc_labelsets = NULL ;
 }
 
 // Changes 20060325
 WFSTLabelPushingNetwork::WFSTLabelPushingNetwork( real transWeightScalingFactor_ ) : WFSTNetwork( transWeightScalingFactor_ , 0.0 )
 {
    arc_outlabset_map = NULL ;
+   labelSets = NULL ;
+   nLabelSets = 0 ;
+   labelSetLabels = NULL ;
+   labelSetBits = NULL ;
+   arc_labelsets = NULL ;
 }
 
 // Changes Octavian 20060523
@@ -1522,6 +2773,13 @@ WFSTLabelPushingNetwork::WFSTLabelPushingNetwork(
 				outSymsFilename , transWeightScalingFactor_ ,
 				removeAuxOption )
 {
+   arc_outlabset_map = NULL ;
+   labelSets = NULL ;
+   nLabelSets = 0 ;
+   labelSetLabels = NULL ;
+   labelSetBits = NULL ;
+   arc_labelsets = NULL ;
+
    if (( nStates == 0 )||( nTransitions == 0 ))
       return;
 
@@ -1534,6 +2792,7 @@ WFSTLabelPushingNetwork::~WFSTLabelPushingNetwork()
 {
    delete [] arc_outlabset_map ;
    arc_outlabset_map = NULL ;
+   freeLabelSets() ;
 }
 
 
@@ -1557,18 +2816,17 @@ const WFSTLabelPushingNetwork::LabelSet *WFSTLabelPushingNetwork::getOneLabelSet
 #ifdef DEBUG
    if ((transIndex < 0 ) || (transIndex >= nTransitions))
       error("WFSTLabelPushingNetwork::getOneLabelSet - transIndex out of range") ;
-   if ( arc_outlabset_map == NULL )
-      error("WFSTLabelPushingNetwork::getOneLabelSet - arc_outlabset_map == NULL") ;
+   if ( arc_labelsets == NULL )
+      error("WFSTLabelPushingNetwork::getOneLabelSet - arc_labelsets == NULL") ;
 #endif
    // Changes 20060325
-   return arc_outlabset_map[transIndex] ;
+   return arc_labelsets[transIndex] ;
 
 }
 
 // Changes Octavian 20060616
 int WFSTLabelPushingNetwork::getMaxOutLabels( const char *fname )
 {
-   set<LabelSet>::iterator iter ;
    int maxLabels = -1 ;
 
    //**********
@@ -1580,10 +2838,8 @@ int WFSTLabelPushingNetwork::getMaxOutLabels( const char *fname )
    }
    //**********
 
-   for ( iter = unique_outlabsets.begin() ;
-	 iter != unique_outlabsets.end() ;
-	 iter++ )  {
-      int numLabels = (*iter).size() ;
+   for ( int i = 0 ; i < nLabelSets ; i++ )  {
+      int numLabels = labelSets[i].nLabels ;
 
       //*******
       if ( fptr != NULL )
@@ -1606,16 +2862,14 @@ int WFSTLabelPushingNetwork::getMaxOutLabels( const char *fname )
 #ifdef DEBUG
 void WFSTLabelPushingNetwork::printLabelSet()
 {
-   if ( arc_outlabset_map != NULL )  {
+   if ( arc_labelsets != NULL )  {
       for ( int i = 0 ; i < nTransitions ; i++ )  {
-	 const LabelSet *labSet = arc_outlabset_map[i] ;
+	 const LabelSet *labSet = arc_labelsets[i] ;
 	 print("Trans: %d \n ", i ) ;
 
 	 if ( labSet != NULL )  {
-	    for ( LabelSet::iterator labSetIter = labSet->begin() ;
-		  labSetIter != labSet->end() ;
-		  labSetIter++ )  {
-	       print("%d ", (*labSetIter) ) ;
+	    for ( int j = 0 ; j < labSet->nLabels ; j++ )  {
+	       print("%d ", labSet->labels[j] ) ;
 	    }
 	 }
 
@@ -1649,12 +2903,12 @@ void WFSTLabelPushingNetwork::assignOutlabsToTrans()
    unique_outlabsets.clear() ;
 
    // Changes Octavian 20060325
-   arc_outlabset_map = new const LabelSet *[nTransitions] ;
+   arc_outlabset_map = new const OutLabSet *[nTransitions] ;
    for ( i = 0 ; i < nTransitions ; i++ )
       arc_outlabset_map[i] = NULL ;
 
    int nInitTrans = states[initState].nTrans ;
-   int *initTrans = states[initState].trans ;
+   int initTrans = states[initState].trans ;
    bool *hasVisited = new bool[nTransitions] ;
 
    // First, determine labelset of each trans.
@@ -1667,7 +2921,7 @@ void WFSTLabelPushingNetwork::assignOutlabsToTrans()
 
    // Transverse to all transitions. Collect all the deadlock transitions
    for ( i = 0 ; i < nInitTrans ; i++ )  {
-      findUndecidedTrans( initTrans[i], hasVisited, undecidedTrans ) ;
+      findUndecidedTrans( initTrans+i, hasVisited, undecidedTrans ) ;
    }
 
    // Second, find out a set of transitions which are the start of a loop.
@@ -1682,7 +2936,7 @@ void WFSTLabelPushingNetwork::assignOutlabsToTrans()
       hasReturned[i] = false ;
    }
 
-   const LabelSet *returnLabelSet ;
+   const OutLabSet *returnLabelSet ;
    set<int> newUndecidedTrans ;
    set<int> loopStartTrans ;
 
@@ -1749,7 +3003,7 @@ void WFSTLabelPushingNetwork::assignOutlabsToTrans()
       error("WFSTLabelPushingNetwork::assignOutlabsToTrans - finalUndecidedTrans != empty") ;
 
    for ( i = 0 ; i < nTransitions ; i++ )  {
-      const LabelSet *tmpLabelSet = arc_outlabset_map[i] ;
+      const OutLabSet *tmpLabelSet = arc_outlabset_map[i] ;
       if ( tmpLabelSet == NULL )
 	 error("WFSTLabelPushingNetwork::_assignOutLabelToTrans - Trans %d has NULL labelset", i ) ;
       else if ( tmpLabelSet->empty() )
@@ -1761,10 +3015,95 @@ void WFSTLabelPushingNetwork::assignOutlabsToTrans()
    delete [] hasVisited ;
    delete [] hasReturned ;
 
+   internLabelSets() ;
+}
+
+
+// Sets with at least this many labels get a bitmap, if it is no bigger
+// than the labels themselves
+static const int LABELSET_BITS_MIN_LABELS = 32 ;
+
+static bool labelSetIsDense( const set<int> &labSet )
+{
+   if ( (int)labSet.size() < LABELSET_BITS_MIN_LABELS )
+      return false ;
+   long span = (long)*(labSet.rbegin()) - *(labSet.begin()) + 1 ;
+   return ( ( span + 31 ) / 32 <= (long)labSet.size() ) ;
+}
+
+// Copies each unique label set into one array of labels (and of bitmaps),
+// points each transition at its copy and frees the std::sets.  The
+// decoders then look up labels in contiguous memory.
+void WFSTLabelPushingNetwork::internLabelSets()
+{
+   freeLabelSets() ;
+
+   nLabelSets = (int)unique_outlabsets.size() ;
+   long nLabels = 0 ;
+   long nWords = 0 ;
+   set<OutLabSet>::iterator iter ;
+   for ( iter = unique_outlabsets.begin() ; iter != unique_outlabsets.end() ; iter++ )  {
+      nLabels += iter->size() ;
+      if ( labelSetIsDense( *iter ) )
+	 nWords += ( *(iter->rbegin()) - *(iter->begin()) + 32 ) / 32 ;
+   }
+
+   labelSets = new LabelSet[nLabelSets+1] ;
+   labelSetLabels = new int[nLabels+1] ;
+   labelSetBits = new unsigned[nWords+1] ;
+
+   // Interned set of each std::set
+   map<const OutLabSet *, const LabelSet *> interned ;
+   int *labels = labelSetLabels ;
+   unsigned *bits = labelSetBits ;
+   int i = 0 ;
+   for ( iter = unique_outlabsets.begin() ; iter != unique_outlabsets.end() ; iter++ , i++ )  {
+      labelSets[i].labels = labels ;
+      labelSets[i].nLabels = (int)iter->size() ;
+      labelSets[i].bits = NULL ;
+      copy( iter->begin() , iter->end() , labels ) ;
+      if ( labelSetIsDense( *iter ) )  {
+	 int nSetWords = ( labels[iter->size()-1] - labels[0] + 32 ) / 32 ;
+	 memset( bits , 0 , nSetWords * sizeof(unsigned) ) ;
+	 for ( int j = 0 ; j < (int)iter->size() ; j++ )  {
+	    unsigned offset = labels[j] - labels[0] ;
+	    bits[offset >> 5] |= 1u << ( offset & 31 ) ;
+	 }
+	 labelSets[i].bits = bits ;
+	 bits += nSetWords ;
+      }
+      labels += iter->size() ;
+      interned[&(*iter)] = labelSets + i ;
+   }
+
+   arc_labelsets = new const LabelSet *[nTransitions] ;
+   for ( i = 0 ; i < nTransitions ; i++ )  {
+      if ( arc_outlabset_map[i] == NULL )
+	 arc_labelsets[i] = NULL ;
+      else
+	 arc_labelsets[i] = interned[arc_outlabset_map[i]] ;
+   }
+
+   delete [] arc_outlabset_map ;
+   arc_outlabset_map = NULL ;
+   unique_outlabsets.clear() ;
+}
+
+void WFSTLabelPushingNetwork::freeLabelSets()
+{
+   delete [] labelSets ;
+   delete [] labelSetLabels ;
+   delete [] labelSetBits ;
+   delete [] arc_labelsets ;
+   labelSets = NULL ;
+   nLabelSets = 0 ;
+   labelSetLabels = NULL ;
+   labelSetBits = NULL ;
+   arc_labelsets = NULL ;
 }
 
 // This function finds a set of undecided trans
-const WFSTLabelPushingNetwork::LabelSet* WFSTLabelPushingNetwork::findUndecidedTrans( int transIndex , bool *hasVisited , set<int>& undecidedTrans )
+const WFSTLabelPushingNetwork::OutLabSet* WFSTLabelPushingNetwork::findUndecidedTrans( int transIndex , bool *hasVisited , set<int>& undecidedTrans )
 {
    // Check if the transitions has been visited before
    if ( hasVisited[transIndex] == true )  {
@@ -1776,16 +3115,16 @@ const WFSTLabelPushingNetwork::LabelSet* WFSTLabelPushingNetwork::findUndecidedT
    hasVisited[transIndex] = true ;
 
    int to = transitions[transIndex].toState ;
-   int *nextTrans = states[to].trans ;
+   int nextTrans = states[to].trans ;
    int nextNTrans = states[to].nTrans ;
 
    // Use for collecting labels of successors
-   const LabelSet *succLabelSet ;
+   const OutLabSet *succLabelSet ;
 
    // Changes Octavian 20060523
-   // LabelSet thisTransLabelSet ;
+   // OutLabSet thisTransLabelSet ;
    // A pointer to a set which stores the output labels for this transition
-   LabelSet *thisTransLabelSet = NULL ;
+   OutLabSet *thisTransLabelSet = NULL ;
 
    // If at least one of the successors return NULL set, set it to true
    bool isSuccNullSet = false ;
@@ -1800,7 +3139,7 @@ const WFSTLabelPushingNetwork::LabelSet* WFSTLabelPushingNetwork::findUndecidedT
    // Union all the label sets from successors
    for ( int i = 0 ; i < nextNTrans ; i++ )  {
       // Find the the label set of the next transition
-      succLabelSet = findUndecidedTrans( nextTrans[i] , hasVisited , undecidedTrans ) ;
+      succLabelSet = findUndecidedTrans( nextTrans+i , hasVisited , undecidedTrans ) ;
 
       // Only need to union all labels if this transition has epsilon output
       // label and not to a final state
@@ -1813,7 +3152,7 @@ const WFSTLabelPushingNetwork::LabelSet* WFSTLabelPushingNetwork::findUndecidedT
 		  // Changes Octavian 20060523
 		  //********
 		  if ( thisTransLabelSet == NULL )
-		     thisTransLabelSet = new LabelSet ;
+		     thisTransLabelSet = new OutLabSet ;
 
 		  set_union(
 			thisTransLabelSet->begin(), thisTransLabelSet->end(),
@@ -1858,7 +3197,7 @@ const WFSTLabelPushingNetwork::LabelSet* WFSTLabelPushingNetwork::findUndecidedT
 #endif
       // Changes Octavian 20060523
       // ********************
-      thisTransLabelSet = new LabelSet ;
+      thisTransLabelSet = new OutLabSet ;
       thisTransLabelSet->insert( transitions[transIndex].outLabel ) ;
       // thisTransLabelSet.insert( transitions[transIndex].outLabel ) ;
       // ********************
@@ -1876,7 +3215,7 @@ const WFSTLabelPushingNetwork::LabelSet* WFSTLabelPushingNetwork::findUndecidedT
       // ****************************
 #endif
       // Changes Octavian 20060523
-      thisTransLabelSet = new LabelSet ;
+      thisTransLabelSet = new OutLabSet ;
       thisTransLabelSet->insert( NONPUSHING_OUTLABEL ) ;
       // thisTransLabelSet.insert( NONPUSHING_OUTLABEL ) ;
       // **************************
@@ -1886,7 +3225,7 @@ const WFSTLabelPushingNetwork::LabelSet* WFSTLabelPushingNetwork::findUndecidedT
       // But at least one of the successors are going to a final state
       // Changes Octavian 20060523
       if ( thisTransLabelSet == NULL )
-	 thisTransLabelSet = new LabelSet ;
+	 thisTransLabelSet = new OutLabSet ;
       else
 	 thisTransLabelSet->clear() ;
       thisTransLabelSet->insert( NONPUSHING_OUTLABEL ) ;
@@ -1922,8 +3261,8 @@ const WFSTLabelPushingNetwork::LabelSet* WFSTLabelPushingNetwork::findUndecidedT
 #endif
 
    // Changes Octavian 20060523
-   // pair<set<LabelSet>::iterator,bool> status = unique_outlabsets.insert( thisTransLabelSet ) ;
-   pair<set<LabelSet>::iterator,bool> status = unique_outlabsets.insert( *thisTransLabelSet ) ;
+   // pair<set<OutLabSet>::iterator,bool> status = unique_outlabsets.insert( thisTransLabelSet ) ;
+   pair<set<OutLabSet>::iterator,bool> status = unique_outlabsets.insert( *thisTransLabelSet ) ;
    thisTransLabelSet->clear() ;
    delete thisTransLabelSet ;
    // ***************************
@@ -1941,7 +3280,7 @@ const WFSTLabelPushingNetwork::LabelSet* WFSTLabelPushingNetwork::findUndecidedT
 // depth search yet, then it is LOOPEND. Otherwise, it is NOTLOOPEND.
 // If one of the next transition is the LOOPEND, then this transition is
 // the start of a loop.
-WFSTLabelPushingNetwork::LoopStatus WFSTLabelPushingNetwork::findLoopStartTrans( int transIndex, bool *hasVisited, bool *hasReturned, const WFSTLabelPushingNetwork::LabelSet **returnLabelSet, set<int> &newUndecidedTrans, set<int> &loopStartTrans )
+WFSTLabelPushingNetwork::LoopStatus WFSTLabelPushingNetwork::findLoopStartTrans( int transIndex, bool *hasVisited, bool *hasReturned, const WFSTLabelPushingNetwork::OutLabSet **returnLabelSet, set<int> &newUndecidedTrans, set<int> &loopStartTrans )
 {
    if ( arc_outlabset_map[transIndex] != NULL )  {
       *returnLabelSet = arc_outlabset_map[transIndex] ;
@@ -1964,7 +3303,7 @@ WFSTLabelPushingNetwork::LoopStatus WFSTLabelPushingNetwork::findLoopStartTrans(
    hasVisited[transIndex] = true ;
 
    int to = transitions[transIndex].toState ;
-   int *nextTrans = states[to].trans ;
+   int nextTrans = states[to].trans ;
    int nextNTrans = states[to].nTrans ;
 
 #ifdef DEBUG
@@ -1978,8 +3317,8 @@ WFSTLabelPushingNetwork::LoopStatus WFSTLabelPushingNetwork::findLoopStartTrans(
 #endif
 
    // Use for collecting labels of successors
-   const LabelSet *succLabelSet ;
-   LabelSet thisTransLabelSet ;
+   const OutLabSet *succLabelSet ;
+   OutLabSet thisTransLabelSet ;
 
    // If at least one of the successors return NULL set, set it to true
    bool isSuccNullSet = false ;
@@ -1993,7 +3332,7 @@ WFSTLabelPushingNetwork::LoopStatus WFSTLabelPushingNetwork::findLoopStartTrans(
 
    // For each successor transition
    for ( int i = 0 ; i < nextNTrans ; i++ )  {
-      LoopStatus loopStatus = findLoopStartTrans( nextTrans[i], hasVisited, hasReturned, &succLabelSet,
+      LoopStatus loopStatus = findLoopStartTrans( nextTrans+i, hasVisited, hasReturned, &succLabelSet,
 	    newUndecidedTrans, loopStartTrans ) ;
 
       // If the next transition is the end of a loop
@@ -2057,7 +3396,7 @@ WFSTLabelPushingNetwork::LoopStatus WFSTLabelPushingNetwork::findLoopStartTrans(
    }
 #endif
 
-   pair<set<LabelSet>::iterator,bool> status = unique_outlabsets.insert( thisTransLabelSet ) ;
+   pair<set<OutLabSet>::iterator,bool> status = unique_outlabsets.insert( thisTransLabelSet ) ;
    arc_outlabset_map[transIndex] = &(*(status.first)) ;
    *returnLabelSet = &(*(status.first)) ;
    return NOTLOOPEND ;
@@ -2080,7 +3419,7 @@ WFSTLabelPushingNetwork::LoopStatus WFSTLabelPushingNetwork::findLoopStartTrans(
 bool WFSTLabelPushingNetwork::findLoop( int transIndex, bool *hasVisited, const int currLoopStart, const set<int> &loopStartTransSet, set<int> &loopStatesSet, const set<int> &undecidedTransSet )
 {
 #ifdef DEBUG
-   const LabelSet *tmpLabelSet = arc_outlabset_map[transIndex] ;
+   const OutLabSet *tmpLabelSet = arc_outlabset_map[transIndex] ;
 #endif
 
    // Terminating case
@@ -2125,11 +3464,11 @@ bool WFSTLabelPushingNetwork::findLoop( int transIndex, bool *hasVisited, const
    // True if this trans is on the loop
    bool isThisTransOnTheLoop = false ;
 
-   int *nextTrans = states[to].trans ;
+   int nextTrans = states[to].trans ;
    int nextNTrans = states[to].nTrans ;
 
    for ( int i = 0 ; i < nextNTrans ; i++ )  {
-      bool isSuccOnTheLoop = findLoop( nextTrans[i], hasVisited, currLoopStart,
+      bool isSuccOnTheLoop = findLoop( nextTrans+i, hasVisited, currLoopStart,
 	    loopStartTransSet, loopStatesSet, undecidedTransSet ) ;
 
       if ( isSuccOnTheLoop )
@@ -2153,7 +3492,7 @@ void WFSTLabelPushingNetwork::combineLoop( list< set<int> > &loopList )
 {
    list< set<int> >::iterator currSet = loopList.begin() ;
    list< set<int> >::iterator nextSet ;
-   LabelSet intersectionSet ;
+   OutLabSet intersectionSet ;
 
    while ( currSet != loopList.end() )  {
       nextSet = currSet ;
@@ -2210,17 +3549,17 @@ void WFSTLabelPushingNetwork::assignOutlabsToLoops( list< set<int> > &loopList ,
 	 set<int>::iterator stateIter ;
 	 bool isDependent = false ;
 
-	 LabelSet thisLoopLabelSet ;
-	 const LabelSet *succLabelSet ;
+	 OutLabSet thisLoopLabelSet ;
+	 const OutLabSet *succLabelSet ;
 
 	 // For each state in the loop
 	 for ( stateIter = (*currLoop).begin() ; stateIter != (*currLoop).end() ; stateIter++ )  {
-	    int *nextTrans = states[*stateIter].trans ;
+	    int nextTrans = states[*stateIter].trans ;
 	    int nextNTrans = states[*stateIter].nTrans ;
 
 	    // For each transition of a state
 	    for ( int i = 0 ; i < nextNTrans ; i++ )  {
-	       isDependent = findOutlabsOfOneTransFromLoopState( nextTrans[i], currLoop, loopList, &succLabelSet, undecidedTransSet ) ;
+	       isDependent = findOutlabsOfOneTransFromLoopState( nextTrans+i, currLoop, loopList, &succLabelSet, undecidedTransSet ) ;
 
 	       // One of the next transition depends on other loops
 	       if ( isDependent )
@@ -2259,25 +3598,25 @@ void WFSTLabelPushingNetwork::assignOutlabsToLoops( list< set<int> > &loopList ,
 	       thisLoopLabelSet.insert( NONPUSHING_OUTLABEL ) ;
 	    }
 
-	    pair<set<LabelSet>::iterator,bool> status = unique_outlabsets.insert( thisLoopLabelSet ) ;
+	    pair<set<OutLabSet>::iterator,bool> status = unique_outlabsets.insert( thisLoopLabelSet ) ;
 
 	    // For each state in the loop
 	    for ( stateIter = (*currLoop).begin() ; stateIter != (*currLoop).end() ; stateIter++ )  {
 
 	       // For each transition pointing to this loop
-	       int *loopTrans = states[*stateIter].trans ;
+	       int loopTrans = states[*stateIter].trans ;
 	       int loopNTrans = states[*stateIter].nTrans ;
 	       for ( int i = 0 ; i < loopNTrans ; i++ )  {
-		  int to = transitions[loopTrans[i]].toState ;
+		  int to = transitions[loopTrans+i].toState ;
 
 		  // If the transition is pointing into the loop
 		  if ( (*currLoop).find( to ) != (*currLoop).end() )  {
-		     arc_outlabset_map[ loopTrans[i] ] = &(*(status.first)) ;
-		     undecidedTransSet.erase( loopTrans[i] ) ;
+		     arc_outlabset_map[ loopTrans+i ] = &(*(status.first)) ;
+		     undecidedTransSet.erase( loopTrans+i ) ;
 		  }
 #ifdef DEBUG
 		  else  {
-		     if ( arc_outlabset_map[ loopTrans[i] ] == NULL )
+		     if ( arc_outlabset_map[ loopTrans+i ] == NULL )
 			error("WFSTLabelPushingNetwork::_assignOutLabelToLoop - Not in loop but have no label set") ;
 		  }
 #endif
@@ -2302,7 +3641,7 @@ void WFSTLabelPushingNetwork::assignOutlabsToLoops( list< set<int> > &loopList ,
 // Return true if this transition is dependent on the other loops.
 // Otherwise return false.
 // returnLabelSet is the label set of this transition
-bool WFSTLabelPushingNetwork::findOutlabsOfOneTransFromLoopState( int transIndex, const list< set<int> >::iterator currLoop, list< set<int> > &loopList , const LabelSet **returnLabelSet , set<int> &undecidedTransSet )
+bool WFSTLabelPushingNetwork::findOutlabsOfOneTransFromLoopState( int transIndex, const list< set<int> >::iterator currLoop, list< set<int> > &loopList , const OutLabSet **returnLabelSet , set<int> &undecidedTransSet )
 {
    // Terminating case
    // If this transition has a label set
@@ -2335,14 +3674,14 @@ bool WFSTLabelPushingNetwork::findOutlabsOfOneTransFromLoopState( int transIndex
    }
 
    // Search through next transitions of this transition
-   int *nextTrans = states[to].trans ;
+   int nextTrans = states[to].trans ;
    int nextNTrans = states[to].nTrans ;
    bool isDependent = false ;
-   const LabelSet *succLabelSet ;
-   LabelSet thisLabelSet ;
+   const OutLabSet *succLabelSet ;
+   OutLabSet thisLabelSet ;
 
    for ( int i = 0 ; i < nextNTrans ; i++ )  {
-      isDependent = findOutlabsOfOneTransFromLoopState( nextTrans[i], currLoop, loopList, &succLabelSet, undecidedTransSet ) ;
+      isDependent = findOutlabsOfOneTransFromLoopState( nextTrans+i, currLoop, loopList, &succLabelSet, undecidedTransSet ) ;
       if ( isDependent )
 	 break ;
 
@@ -2371,7 +3710,7 @@ bool WFSTLabelPushingNetwork::findOutlabsOfOneTransFromLoopState( int transIndex
       thisLabelSet.insert( NONPUSHING_OUTLABEL ) ;
    }
 
-   pair<set<LabelSet>::iterator,bool> status = unique_outlabsets.insert( thisLabelSet ) ;
+   pair<set<OutLabSet>::iterator,bool> status = unique_outlabsets.insert( thisLabelSet ) ;
 
    arc_outlabset_map[transIndex] = &(*(status.first)) ;
    undecidedTransSet.erase( transIndex ) ;
@@ -2383,148 +3722,33 @@ bool WFSTLabelPushingNetwork::findOutlabsOfOneTransFromLoopState( int transIndex
 
 //****** WFSTSortedInLabelNetwork Implementation ******
 // Changes Octavian
-WFSTSortedInLabelNetwork::WFSTSortedInLabelNetwork() : WFSTNetwork() {}
+WFSTSortedInLabelNetwork::WFSTSortedInLabelNetwork() : WFSTNetwork()
+{
+   labelIndexOf = NULL ;
+   labelIndexes = NULL ;
+   labelIndexTables = NULL ;
+}
 
-WFSTSortedInLabelNetwork::WFSTSortedInLabelNetwork( real transWeightScalingFactor_ ) : WFSTNetwork( transWeightScalingFactor_ , 0.0 ) {}
+WFSTSortedInLabelNetwork::WFSTSortedInLabelNetwork( real transWeightScalingFactor_ ) : WFSTNetwork( transWeightScalingFactor_ , 0.0 )
+{
+   labelIndexOf = NULL ;
+   labelIndexes = NULL ;
+   labelIndexTables = NULL ;
+}
 
 // Changes Octavian 20060523
 WFSTSortedInLabelNetwork::WFSTSortedInLabelNetwork( const char *wfstFilename , const char *inSymsFilename , const char *outSymsFilename , real transWeightScalingFactor_ , RemoveAuxOption removeAuxOption ) : WFSTNetwork( transWeightScalingFactor_ , 0.0 )
 {
-   FILE *fd ;
-
-   if ( (fd = fopen( wfstFilename , "rb" )) == NULL )
-      error("WFSTSortedInLabelNetwork::WFSTSortedInLabelNetwork - error opening wfstFilename") ;
-
-   int cnt , i ;
-   int from , to , in , out , final , maxOutLab=-1 , maxInLab=-1;
-   float weight ;
-   char *line ;
-
-   line = new char[10000] ;
-   while ( fgets( line , 10000 , fd ) != NULL )
-   {
-      if ( (cnt = sscanf( line , "%d %d %d %d %f" , &from , &to , &in , &out , &weight )) != 5 )
-      {
-         if ( (cnt = sscanf( line , "%d %d %d %d" , &from , &to , &in , &out )) != 4 )
-         {
-            if ( (cnt = sscanf( line , "%d %f" , &final , &weight )) != 2 )
-            {
-               if ( (cnt = sscanf( line , "%d" , &final )) != 1 )
-               {
-                  // Blank line or line with invalid format - just go to next line.
-                  continue ;
-               }
-               else
-                  weight = 0.0 ;
-            }
-
-            // Final state line
-            if ( nFinalStates == nFinalStatesAlloc )
-            {
-               finalStates = (WFSTFinalState *)realloc( finalStates ,
-                                        (nFinalStatesAlloc+1000)*sizeof(WFSTFinalState) ) ;
-               nFinalStatesAlloc += 1000 ;
-            }
-
-            finalStates[nFinalStates].id = final ;
-            finalStates[nFinalStates].weight = (real)(-weight * transWeightScalingFactor) ;
-            nFinalStates++ ;
-            continue ;
-         }
-         else
-            weight = 0.0 ;
-      }
-
-      if ( (from < 0) || (to < 0) || (in < 0) || (out < 0) )
-         error("WFSTSortedInLabelNetwork::WFSTSortedInLabelNetwork - something < 0. %d %d %d %d",from,to,in,out) ;
-
-      if ( initState < 0 )
-         initState = from ;   // init state is source state in first line of file
-
-      if ( from > maxState )
-         maxState = from ;
-      if ( to > maxState )
-         maxState = to ;
-
-      // Add the new transition to the array of transitions
-      if ( nTransitions == nTransitionsAlloc )
-      {
-         nTransitionsAlloc += 1000000 ;
-         transitions = (WFSTTransition *)realloc( transitions ,
-                                                  nTransitionsAlloc * sizeof(WFSTTransition) ) ;
-         if ( transitions == NULL )
-            error("WFSTSortedInLabelNetwork::WFSTSortedInLabelNetwork - transitions realloc failed") ;
-         for ( i=nTransitions ; i<nTransitionsAlloc ; i++ )
-            initWFSTTransition( transitions + i ) ;
-      }
-
-      transitions[nTransitions].id = nTransitions ;
-      //transitions[nTransitions].fromState = from ;
-      transitions[nTransitions].toState = to ;
-      transitions[nTransitions].inLabel = in ;
-      transitions[nTransitions].outLabel = out ;
-
-      // FSM weights are -ve log
-      transitions[nTransitions].weight = (real)(-weight * transWeightScalingFactor ) ;
-      ++nTransitions ;
-
-      if ( in > maxInLab ) {
-         maxInLab = in;
-      }
-      if ( out > maxOutLab ) {
-         maxOutLab = out;
-      }
-
-      // Make sure we have state entries for both from and to states in the
-      // new transition.
-      if ( maxState >= nStatesAlloc )
-      {
-         states = (WFSTState *)realloc( states , (maxState+1000)*sizeof(WFSTState) ) ;
-         for ( i=nStatesAlloc ; i<(maxState+1000) ; i++ )
-            initWFSTState( states + i ) ;
-         nStatesAlloc = maxState + 1000 ;
-      }
-
-      // Initialise the from and to state labels if not already done.
-      if ( states[from].label < 0 )
-         states[from].label = from ;
-      else if ( states[from].label != from )
-         error("WFSTSortedInLabelNetwork::WFSTSortedInLabelNetwork - from state %d label mismatch" , from ) ;
-
-      if ( states[to].label < 0 )
-         states[to].label = to ;
-      else if ( states[to].label != to )
-         error("WFSTSortedInLabelNetwork::WFSTSortedInLabelNetwork - to state %d label mismatch" , to ) ;
-
-      // Add the new transition index to the list in the from state
-      // int ind = (states[from].nTrans)++ ;
-      (states[from].nTrans)++ ;
-
-      states[from].trans = (int *)realloc( states[from].trans , states[from].nTrans*sizeof(int) ) ;
-      // Changes by Octavian
-      int *insPtr = binarySearchInLabel( states[from].trans, states[from].nTrans-1, transitions[nTransitions-1].inLabel ) ;
-      for (int *i = states[from].trans + states[from].nTrans - 1 ; i > insPtr ; i-- )  {
-	 *i = *(i-1) ;
-      }
-      *insPtr = nTransitions - 1 ;
-      //states[from].trans[ind] = nTransitions - 1 ;
-      //**************************
-      if ( states[from].nTrans > maxOutTransitions )
-         maxOutTransitions = states[from].nTrans ;
-   }
+   int i , maxOutLab , maxInLab ;
+   labelIndexOf = NULL ;
+   labelIndexes = NULL ;
+   labelIndexTables = NULL ;
+   readTextFSM( wfstFilename , "WFSTSortedInLabelNetwork::WFSTSortedInLabelNetwork" ,
+                &maxInLab , &maxOutLab ) ;
 
    // Changes by Octavian
-   // Shrink the transitions array
-   if ( nTransitionsAlloc > nTransitions )  {
-      transitions = (WFSTTransition *)realloc( transitions ,
-	       nTransitions * sizeof(WFSTTransition) ) ;
-
-      if ( transitions == NULL )
-	 error("WFSTSortedInLableNetwork::WFSTSortedInLabelNetwork - transitions realloc failed") ;
-
-      nTransitionsAlloc = nTransitions ;
-   }
-   //**************
+   // The transitions of each state are sorted by input label
+   packTransitions( true ) ;
 
    for ( i=0 ; i<nFinalStates ; i++ )
    {
@@ -2590,14 +3814,118 @@ WFSTSortedInLabelNetwork::WFSTSortedInLabelNetwork( const char *wfstFilename , c
    */
    // ***********************************
 
-   delete [] line ;
-   fclose( fd ) ;
-
    //fromBinFile = false ;
    nStates = (maxState+1) ;
 
 }
 
+WFSTSortedInLabelNetwork::~WFSTSortedInLabelNetwork()
+{
+   freeLabelIndex() ;
+}
+
+void WFSTSortedInLabelNetwork::freeLabelIndex()
+{
+   delete [] labelIndexOf ;
+   delete [] labelIndexes ;
+   delete [] labelIndexTables ;
+   labelIndexOf = NULL ;
+   labelIndexes = NULL ;
+   labelIndexTables = NULL ;
+}
+
+// A state whose input labels span no more than this many times its number
+// of transitions gets a direct table, otherwise a hash table at most half
+// full.  The unigram state of an n-gram G, with a transition for most
+// words, is direct.
+static const int LABEL_INDEX_MAX_DIRECT_SPAN = 4 ;
+
+int WFSTSortedInLabelNetwork::buildLabelIndex( int minTrans )
+{
+   if ( minTrans <= 0 )
+      error("WFSTSortedInLabelNetwork::buildLabelIndex - minTrans %d <= 0" , minTrans ) ;
+
+   freeLabelIndex() ;
+   labelIndexOf = new int[nStates] ;
+
+   vector<WFSTLabelIndex> indexes ;
+   vector<long> offsets ;
+   vector<int> tables ;
+   WFSTTransition trans ;
+   int s , n ;
+   for ( s=0 ; s<nStates ; s++ )
+   {
+      labelIndexOf[s] = -1 ;
+      int nTrans = states[s].nTrans ;
+      if ( nTrans < minTrans )
+         continue ;
+
+      int maxLabel = 0 ;
+      for ( n=0 ; n<nTrans ; n++ )
+      {
+         getTransition( states[s].trans + n , &trans ) ;
+         if ( trans.inLabel > maxLabel )
+            maxLabel = trans.inLabel ;
+      }
+
+      WFSTLabelIndex index ;
+      long offset = (long)tables.size() ;
+      index.direct = ( (long)maxLabel + 1 <= (long)LABEL_INDEX_MAX_DIRECT_SPAN * nTrans ) ;
+      if ( index.direct )
+      {
+         index.size = maxLabel + 1 ;
+         tables.resize( offset + index.size , -1 ) ;
+      }
+      else
+      {
+         unsigned nSlots = 16 ;
+         while ( nSlots < 2 * (unsigned)nTrans )
+            nSlots *= 2 ;
+         index.size = nSlots - 1 ;
+         tables.resize( offset + 2 * nSlots , -1 ) ;
+      }
+
+      // The first transition with each label is kept, as a binary search
+      // would find one of them anyway
+      int *table = &tables[offset] ;
+      for ( n=0 ; n<nTrans ; n++ )
+      {
+         getTransition( states[s].trans + n , &trans ) ;
+         if ( trans.inLabel < 0 )
+            continue ;
+         if ( index.direct )
+         {
+            if ( table[trans.inLabel] < 0 )
+               table[trans.inLabel] = n ;
+            continue ;
+         }
+         unsigned slot = ( (unsigned)trans.inLabel * 2654435761u ) & index.size ;
+         while ( ( table[2*slot] >= 0 ) && ( table[2*slot] != trans.inLabel ) )
+            slot = ( slot + 1 ) & index.size ;
+         if ( table[2*slot] < 0 )
+         {
+            table[2*slot] = trans.inLabel ;
+            table[2*slot+1] = n ;
+         }
+      }
+
+      labelIndexOf[s] = (int)indexes.size() ;
+      indexes.push_back( index ) ;
+      offsets.push_back( offset ) ;
+   }
+
+   labelIndexes = new WFSTLabelIndex[indexes.size()+1] ;
+   labelIndexTables = new int[tables.size()+1] ;
+   if ( ! tables.empty() )
+      memcpy( labelIndexTables , &tables[0] , tables.size() * sizeof(int) ) ;
+   for ( s=0 ; s<(int)indexes.size() ; s++ )
+   {
+      labelIndexes[s] = indexes[s] ;
+      labelIndexes[s].table = labelIndexTables + offsets[s] ;
+   }
+   return (int)indexes.size() ;
+}
+
 // Get the weight, output label and state number on the epsilon path
 // gStateArray will store the state numbers
 // epsWeightArray will store the weights
@@ -2667,57 +3995,5 @@ int WFSTSortedInLabelNetwork::getNextStateOnEpsPath( int gState, real *backoffWe
 }
 
 
-// A function which does binary search for inLabel on the array which
-// contains transitions coming from the same state.
-// The return pointer is the insertion point.
-int *WFSTSortedInLabelNetwork::binarySearchInLabel( int *start, const int length, const int inLabel )
-{
-   // Terminating case
-   // length = The length of the integer array before insertion
-   if ( length == 0 )  {
-      // Don't have anything - just insert to the start
-      return start ;
-   }
-#ifdef DEBUG
-   else if ( length < 0 )  {
-      error("WFSTSortedInLabelNetwork::binarySearchInLabel - length < 0") ;
-      return NULL ;
-   }
-#endif
-   else if ( length == 1 )  {
-      // Have one element in the array before insertion
-      int inLabelInTransArray = transitions[*start].inLabel ;
-      if ( inLabel < inLabelInTransArray )  {
-	 return start ;
-      }
-      else if ( inLabel == inLabelInTransArray )  {
-	 error("WFSTSortedInLabelNetwork::binarySearchInLabel - inLabel == inLabelInTransArray") ;
-	 return NULL ;
-      }
-      else  {
-	 return (start+1) ;
-      }
-   }
-   else  {
-      int middle = length / 2 ;
-      int middleInLabel = transitions[*(start+middle)].inLabel ;
-
-      if ( inLabel < middleInLabel )  {
-	 return binarySearchInLabel( start, middle, inLabel ) ;
-      }
-      else if ( inLabel == middleInLabel )  {
-	 error("WFSTSortedInLabelNetwork::binarySearchInLabel - inLabel == middleInLabel") ;
-	 return NULL ;
-      }
-      else  {
-	 if ( length == 2 )
-	    return ( start + middle + 1 ) ;
-	 else
-	    return binarySearchInLabel( start+middle+1, length-middle-1, inLabel ) ;
-      }
-   }
-}
-
-
 }
 
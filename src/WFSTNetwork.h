@@ -18,6 +18,7 @@
 #include <algorithm>
 
 #include <cassert>
+#include <stdint.h>
 #include "general.h"
 #include "WFSTGeneral.h"
 
@@ -46,15 +47,12 @@ struct WFSTTransition
     real     weight ;
     int      inLabel ;
     int      outLabel ;
-
-    // add by zl for use in WFSTDecoderLite to store NetInst instance
-    void*    hook;
 };
 
 
 struct WFSTState
 {
-    int      *trans ;    // indices of transitions out of this state
+    int      trans ;     // index of the first transition out of this state
     int      label ;
     int      finalInd ;  // index into array of final state entries (-1 if not final)
     int      nTrans ;    // number of transitions out of this state
@@ -67,6 +65,35 @@ struct WFSTFinalState
    real     weight ;
 };
 
+
+// Epsilon closure of a state: the transitions with non-epsilon input that
+// can be reached from it through epsilon input transitions, each by its
+// best path, and the best final state so reached.
+struct WFSTEpsClosure
+{
+   int      firstArc ;      // index of the first WFSTClosureArc
+   int      nArcs ;
+   int      nDirect ;       // the first nDirect arcs leave the state itself
+   real     finalTransWeight ;   // path to the best final state, LOG_ZERO if none
+   real     finalStateWeight ;
+   int      finalLabels ;   // output labels on that path
+   int      nFinalLabels ;
+};
+
+struct WFSTClosureArc
+{
+   int      trans ;         // transition with non-epsilon input
+   real     weight ;        // of the epsilon transitions before it
+   int      firstLabel ;    // output labels of those transitions
+   int      nLabels ;
+};
+
+struct WFSTClosureLabel
+{
+   int      label ;
+   real     weight ;        // path weight up to and including its transition
+};
+
 /**
  * WFST symbol set
  */
@@ -98,7 +125,13 @@ private:
    int   nAux ;
    bool  *isAux ;
 
+   char  *labelArena ;   // all the label strings
+   int   *index ;        // hash table of label indices, -1 if empty
+   int   indexMask ;     // size of index - 1, a power of 2
+
    bool  fromBinFile ;
+
+   void buildIndex() ;
 };
 
 
@@ -106,8 +139,12 @@ private:
 /** Enum variable for aux symbol removal */
 typedef enum { REMOVEBOTH, REMOVEINPUT, NOTREMOVE } RemoveAuxOption ;
 
+class WFSTBuildFSM ;
+
 /**
- * Transducer
+ * Transducer.  Once loaded the network is not changed by decoding, so one
+ * instance can be shared by any number of decoders, in any threads, using
+ * its const interface.
  */
 class WFSTNetwork
 {
@@ -121,32 +158,41 @@ public:
         real transWeightScalingFactor_=1.0 , real insPenalty_=0.0 ,
         RemoveAuxOption removeAuxOption=REMOVEBOTH
     ) ;
+    // From a transducer built in memory, as if loaded from its text FSM
+    WFSTNetwork(
+        const WFSTBuildFSM *fsm , const char *inSymsFilename ,
+        const char *outSymsFilename ,
+        real transWeightScalingFactor_=1.0 , real insPenalty_=0.0 ,
+        RemoveAuxOption removeAuxOption=REMOVEBOTH
+    ) ;
     virtual ~WFSTNetwork() ;
 
-   int getInitState() { return initState ; } ;
+   int getInitState() const { return initState ; } ;
    void getTransitions(
 	 WFSTTransition *prev , int *nNext , WFSTTransition **next ) ;
     int getTransitions(
         WFSTTransition *prev, WFSTTransition **next
     );
-   int getMaxOutTransitions() { return maxOutTransitions ; } ;
-   int getNumTransitions() { return nTransitions ; } ;
-   int getNumStates() { return nStates ; } ;
-   int getWordEndMarker() { return wordEndMarker ; } ;
-   int getNumTransitionsOfOneState ( int state )  {
+   int getMaxOutTransitions() const { return maxOutTransitions ; } ;
+   int getNumTransitions() const { return nTransitions ; } ;
+   int getNumStates() const { return nStates ; } ;
+   int getWordEndMarker() const { return wordEndMarker ; } ;
+   int getNumTransitionsOfOneState ( int state ) const {
        return states[state].nTrans ;
    }
    // Changes Octavian 20050325
    int getNumOutLabels() { return outputAlphabet->getNumLabels() ; } ;
 
    // Changes by Octavian
-   bool isFinalState( int stateIndex ) {
+   bool isFinalState( int stateIndex ) const {
        return states[stateIndex].finalInd >= 0;
    }
-   real getFinalStateWeight( int stateIndex ) {
+   real getFinalStateWeight( int stateIndex ) const {
       return finalStates[states[stateIndex].finalInd].weight ;
    }
-   const int *getTransitions( const WFSTTransition *prev , int *nNext ) ;
+   // The transitions out of a state are contiguous, so the nNext of them
+   // start at the returned index.
+   int getFirstTransition( const WFSTTransition *prev , int *nNext ) const ;
    WFSTTransition *getOneTransition( int transIndex ) ;
    int getInfoOfOneTransition(
 	 const int gState, const int n, real *weight, int *toState,
@@ -155,17 +201,58 @@ public:
    int getInLabelOfOneTransition( const int gState , const int n ) ;
 
    // Changes Octavian 20060430
-   int getTransID( int stateIndex, int nth ) {
-      return states[stateIndex].trans[nth] ; } ;
+   int getTransID( int stateIndex, int nth ) const {
+      return states[stateIndex].trans + nth ; } ;
 
-   bool transGoesToFinalState( WFSTTransition *trans ) {
+   bool transGoesToFinalState( const WFSTTransition *trans ) const {
        assert(trans);
        return  states[trans->toState].finalInd >= 0;
    }
-   real getFinalStateWeight( WFSTTransition *trans ) {
+   real getFinalStateWeight( const WFSTTransition *trans ) const {
        return finalStates[states[trans->toState].finalInd].weight ;
    }
 
+   // Changes for compact transitions
+   // Replaces the transitions by 64 bit words holding toState, inLabel,
+   // outLabel and an index into a codebook of 2^weightBits weights.
+   // Returns the largest weight error.  Functions returning pointers to
+   // transitions are then unavailable; use getTransition() instead.
+   real compactTransitions( int weightBits ) ;
+   bool isCompact() const { return packedTransitions != NULL ; } ;
+   int getCompactWeightBits() const { return weightBits ; } ;
+   void getTransition( int transIndex , WFSTTransition *trans ) const {
+      if ( packedTransitions == NULL ) {
+         *trans = transitions[transIndex] ;
+         return ;
+      }
+      uint64_t p = packedTransitions[transIndex] ;
+      trans->id = transIndex ;
+      trans->toState = (int)( p & toStateMask ) ;
+      p >>= toStateBits ;
+      trans->inLabel = (int)( p & inLabelMask ) ;
+      p >>= inLabelBits ;
+      trans->outLabel = (int)( p & outLabelMask ) ;
+      trans->weight = weightCodebook[p >> outLabelBits] ;
+      if ( trans->outLabel > 0 )
+         trans->weight += insPenalty ;
+   }
+
+   // Changes for epsilon closures
+   // Tabulates the epsilon closure of each state with epsilon input
+   // transitions, unless it has more than maxArcs arcs.  Returns the
+   // number of states tabulated.
+   int buildEpsClosures( int maxArcs ) ;
+   const WFSTEpsClosure *getEpsClosure( const WFSTTransition *prev ) const {
+      if ( closureOf == NULL )
+         return NULL ;
+      int c = closureOf[ ( prev == NULL ) ? initState : prev->toState ] ;
+      return ( c < 0 ) ? NULL : closures + c ;
+   }
+   const WFSTClosureArc *getClosureArc( int index ) const {
+      return closureArcs + index ; } ;
+   const WFSTClosureLabel *getClosureLabel( int index ) const {
+      return closureLabels + index ; } ;
+
    void outputText( int type=0 ) ;
    void generateSequences( int maxSeqs=0 , bool logBase10=false ) ;
    void writeFSM(
@@ -177,12 +264,14 @@ public:
    // Changes Octavian 20060616
    void printNumOutTransitions( const char *fname ) ;
 
+   // New state i is old state order[i], a permutation of the states; the
+   // transitions are laid out again in the new state order.  For use
+   // before any per-transition data of derived classes is built.
+   void renumberStates( const int *order ) ;
+
    int               silMarker ;
    int               spMarker ;
 
-
-   void resetTransitionHooks();
-
 protected:
    WFSTAlphabet      *inputAlphabet ;
    WFSTAlphabet      *outputAlphabet ;
@@ -204,7 +293,27 @@ protected:
    WFSTTransition    *transitions ;
    int               maxOutTransitions ;  // max outgoing transitions in any state
 
+   // Compact transitions, see compactTransitions().  The codebook weights
+   // are scaled but do not include insPenalty.
+   uint64_t          *packedTransitions ;
+   real              *weightCodebook ;
+   int               weightBits ;
+   int               toStateBits ;
+   int               inLabelBits ;
+   int               outLabelBits ;
+   uint64_t          toStateMask ;
+   uint64_t          inLabelMask ;
+   uint64_t          outLabelMask ;
+
+   // Epsilon closures, see buildEpsClosures()
+   int               *closureOf ;     // per state, -1 if not tabulated
+   WFSTEpsClosure    *closures ;
+   WFSTClosureArc    *closureArcs ;
+   WFSTClosureLabel  *closureLabels ;
+
    bool              fromBinFile ;
+   char              *binMap ;     // states, finalStates and transitions
+   long              binMapLen ;   // when they were mapped by readBinary()
    real              transWeightScalingFactor ;
    real              insPenalty ;
    int               wordEndMarker ;
@@ -212,6 +321,17 @@ protected:
 
    void initWFSTState( WFSTState *state ) ;
    void initWFSTTransition( WFSTTransition *transition ) ;
+   void readTextFSM(
+	 const char *wfstFilename , const char *who , int *maxInLab ,
+	 int *maxOutLab ) ;
+   void packTransitions( bool sortInLabel=false ) ;
+   void finishLoad(
+	 const char *inSymsFilename , const char *outSymsFilename ,
+	 int maxInLab , int maxOutLab , RemoveAuxOption removeAuxOption ) ;
+   void freeArrays() ;
+   void setCompactMasks() ;
+   void readLegacyBinary( FILE *fd ) ;
+   void mapBinary( const char *fname ) ;
    void removeAuxiliarySymbols( bool markAuxOutputs=false ) ;
    // Changes Octavian 20060523
    void removeAuxiliaryInputSymbols ( bool markAuxOutputs=false ) ;
@@ -226,7 +346,25 @@ class WFSTLabelPushingNetwork : public WFSTNetwork
 {
 public:
    // Changes Octavian
-   typedef set<int> LabelSet ;
+   // An output label set, interned so that equal sets share one instance.
+   // The labels are stored in ascending order; a set dense enough also
+   // has a bitmap with one bit per label from labels[0] upwards.
+   struct LabelSet
+   {
+      const int         *labels ;
+      int               nLabels ;
+      const unsigned    *bits ;    // NULL for a sparse set
+      bool contains( int label ) const {
+         if ( bits != NULL )  {
+            unsigned offset = (unsigned)( label - labels[0] ) ;
+            return ( offset <= (unsigned)( labels[nLabels-1] - labels[0] ) ) &&
+                   ( ( bits[offset >> 5] >> ( offset & 31 ) ) & 1 ) ;
+         }
+         const int *end = labels + nLabels ;
+         const int *pos = lower_bound( labels , end , label ) ;
+         return ( pos != end ) && ( *pos == label ) ;
+      }
+   };
 
    WFSTLabelPushingNetwork() ;
    WFSTLabelPushingNetwork( real transWeightScalingFactor_ ) ;
@@ -242,7 +380,7 @@ public:
    virtual void readBinary( const char *fname ) ;
 
    const LabelSet *getOneLabelSet( int transIndex ) ;
-   const LabelSet **getLabelArray() { return arc_outlabset_map ; } ;
+   const LabelSet **getLabelArray() { return arc_labelsets ; } ;
 
    // Changes Octavian 20060616
    // Get the max number of outlabels from all label sets
@@ -254,7 +392,10 @@ public:
 
 protected:
    // Changes Octavian 20060325
-   typedef const LabelSet **ArcToLabelSetMap ;
+   // Label sets are assigned as std::sets, then interned by
+   // internLabelSets()
+   typedef set<int> OutLabSet ;
+   typedef const OutLabSet **ArcToLabelSetMap ;
    typedef enum { LOOPEND, NOTLOOPEND } LoopStatus ;
 
    // Data structure for storing output symbol label set
@@ -265,9 +406,20 @@ protected:
    // If the transition has epsilon output and there is no non-eps
    // transitions on the path to the final state, the label set
    // will have just one label - NONPUSHING_OUTLABEL
-   set<LabelSet> unique_outlabsets ;
+   set<OutLabSet> unique_outlabsets ;
    ArcToLabelSetMap arc_outlabset_map ;
 
+   // The interned label sets, and the one of each transition
+   LabelSet *labelSets ;
+   int nLabelSets ;
+   int *labelSetLabels ;
+   unsigned *labelSetBits ;
+   const LabelSet **arc_labelsets ;
+
+   // Replaces the assigned std::sets by interned LabelSets
+   void internLabelSets() ;
+   void freeLabelSets() ;
+
    // Assign output label set to each transition
    // Main function which assigns output label set for each transition
    void assignOutlabsToTrans() ;
@@ -276,7 +428,7 @@ protected:
    // Find a set of transitions in which we cannot decide its label set
    // Starting to do depth-first search from transIndex. Put "undecided"
    // transitions in undecidedTrans set
-   const LabelSet* findUndecidedTrans(
+   const OutLabSet* findUndecidedTrans(
 	 int transIndex, bool *hasVisited, set<int>& undecidedTrans ) ;
 
    // This function iterates all undecided trans and find the start trans of
@@ -286,7 +438,7 @@ protected:
    // a loop.
    LoopStatus findLoopStartTrans(
 	 int transIndex, bool *hasVisited, bool *hasReturned,
-	 const LabelSet **returnLabelSet, set<int> &newUndecidedTrans,
+	 const OutLabSet **returnLabelSet, set<int> &newUndecidedTrans,
 	 set<int> &loopStartTrans ) ;
 
    // This function starts transversing from the start of a loop and collects
@@ -312,12 +464,22 @@ protected:
    // returnLabelSet is the label set of this transition
    bool findOutlabsOfOneTransFromLoopState(
 	 int transIndex, const list< set<int> >::iterator currLoop,
-	 list< set<int> > &loopList , const LabelSet **returnLabelSet ,
+	 list< set<int> > &loopList , const OutLabSet **returnLabelSet ,
 	 set<int> &undecidedTransSet ) ;
 
 };
 
 
+// Label index of one state of a WFSTSortedInLabelNetwork.  A direct
+// table has an entry per input label; a hashed one has pairs of input
+// label and transition, empty slots having label -1.
+struct WFSTLabelIndex
+{
+   const int   *table ;
+   unsigned    size ;      // entries for direct, else mask of the slots
+   bool        direct ;
+};
+
 // Changes by Octavian
 /**
  * A network in which the input label is sorted
@@ -333,7 +495,7 @@ public:
 	 const char *outSymsFilename=NULL ,
 	 real transWeightScalingFactor_=1.0 ,
 	 RemoveAuxOption removeAuxOption=REMOVEBOTH ) ;
-   virtual ~WFSTSortedInLabelNetwork() {} ;
+   virtual ~WFSTSortedInLabelNetwork() ;
 
     /**
      * Searching for all states on an eps-only path with the accumuated weight
@@ -349,15 +511,36 @@ public:
    virtual void writeBinary( const char *fname ) {
       WFSTNetwork::writeBinary(fname) ; return ; };
    virtual void readBinary( const char *fname ) {
-      WFSTNetwork::readBinary(fname) ; return ; };
+      freeLabelIndex() ; WFSTNetwork::readBinary(fname) ; return ; };
+
+   // Indexes the transitions of each state with at least minTrans of them
+   // by input label, so that they are found without a binary search.
+   // Returns the number of states indexed.
+   int buildLabelIndex( int minTrans ) ;
+   bool hasLabelIndex( int gState ) const {
+      return ( labelIndexOf != NULL ) && ( labelIndexOf[gState] >= 0 ) ; } ;
+
+   // Returns n such that the n'th transition of gState has input label
+   // inLabel, or -1.  gState must have a label index.
+   int findIndexedTrans( int gState , int inLabel ) const {
+      const WFSTLabelIndex *index = labelIndexes + labelIndexOf[gState] ;
+      if ( index->direct )
+         return ( (unsigned)inLabel < index->size ) ? index->table[inLabel] : -1 ;
+      unsigned slot = ( (unsigned)inLabel * 2654435761u ) & index->size ;
+      while ( index->table[2*slot] >= 0 )  {
+         if ( index->table[2*slot] == inLabel )
+            return index->table[2*slot+1] ;
+         slot = ( slot + 1 ) & index->size ;
+      }
+      return -1 ;
+   }
 
 protected:
-    /**
-     * A function which does binary search for inLabel on the array
-     * which contains transitions coming from the same state.  The
-     * return pointer is the insertion point.
-     */
-   int *binarySearchInLabel( int *start, const int length, const int inLabel ) ;
+   int               *labelIndexOf ;    // per state, -1 if not indexed
+   WFSTLabelIndex    *labelIndexes ;
+   int               *labelIndexTables ;
+
+   void freeLabelIndex() ;
 };
 
 
@@ -2570,7 +2570,7 @@ void WFSTOnTheFlyDecoder::findMatchedTransWithPushing( WFSTTransition *prev, int
    
    // Get an array of indices of next transitions from the C o L transducer
    int nTransInCL ;
-   const int *transInCLNetwork = network->getTransitions( prev , &nTransInCL ) ;
+   int firstTransInCL = network->getFirstTransition( prev , &nTransInCL ) ;
    
    // Get the number of transitons in the G transducer
    int nTransInG = gNetwork->getNumTransitionsOfOneState( gState ) ;
@@ -2605,7 +2605,7 @@ void WFSTOnTheFlyDecoder::findMatchedTransWithPushing( WFSTTransition *prev, int
       // Changes Octavian 20060726
 #ifdef CASEIRO
       if ( isSuffix )  {
-	 next[*nNext] = network->getOneTransition( transInCLNetwork[i] ) ;
+	 next[*nNext] = network->getOneTransition( firstTransInCL+i ) ;
 	 nextGState[*nNext] = FOLLOWON_TRANS ;
 	 (*nNext)++ ;
 	 continue ;
@@ -2613,7 +2613,7 @@ void WFSTOnTheFlyDecoder::findMatchedTransWithPushing( WFSTTransition *prev, int
 #endif
       // Changes Octavian 20060325
       // First, only search for common weights if the label set are different
-      const WFSTLabelPushingNetwork::LabelSet *labelSet = networkOTF->getOneLabelSet(transInCLNetwork[i]) ;
+      const WFSTLabelPushingNetwork::LabelSet *labelSet = networkOTF->getOneLabelSet(firstTransInCL+i) ;
 
       // Changes Octavian 20060726
 #ifndef CASEIRO
@@ -2622,7 +2622,7 @@ void WFSTOnTheFlyDecoder::findMatchedTransWithPushing( WFSTTransition *prev, int
       if ( ( prev != NULL ) && ( prev->inLabel != network->getWordEndMarker() ) && ( labelSet == labelSetPrevTrans ) )  {
 #endif
 	 // Notice only "next" and "nextGState" is assigned to values. 
-	 next[*nNext] = network->getOneTransition( transInCLNetwork[i] ) ;
+	 next[*nNext] = network->getOneTransition( firstTransInCL+i ) ;
 	 nextGState[*nNext] = FOLLOWON_TRANS ;
 	 (*nNext)++ ;
 	 continue ;
@@ -2640,7 +2640,7 @@ void WFSTOnTheFlyDecoder::findMatchedTransWithPushing( WFSTTransition *prev, int
 	 // Label and weight pushing - dont care the third argument
 	 // Changes Octavian 20060531
 	 bool isFound = pushingWeightCache->findPushingWeight(
-	       transInCLNetwork[i], gState, WFST_EPSILON, 
+	       firstTransInCL+i, gState, WFST_EPSILON, 
 	       &tmpWeight, &tmpNextGState, &tmpNextOutLabel,
 	       &tmpMatchedOutLabel ) ;
 
@@ -2650,7 +2650,7 @@ void WFSTOnTheFlyDecoder::findMatchedTransWithPushing( WFSTTransition *prev, int
 	       error("WFSTOnTheFlyDecoder::findMatchedTransWithPushing - tmpNextGState out of range") ;
 #endif
 	    if ( tmpNextGState != DEAD_TRANS )  {
-	       next[*nNext] = network->getOneTransition( transInCLNetwork[i] ) ;
+	       next[*nNext] = network->getOneTransition( firstTransInCL+i ) ;
 	       commonWeights[*nNext] = tmpWeight ;
 	       nextGState[*nNext] = tmpNextGState ;
 	       nextOutLabel[*nNext] = tmpNextOutLabel ;
@@ -2670,13 +2670,13 @@ void WFSTOnTheFlyDecoder::findMatchedTransWithPushing( WFSTTransition *prev, int
       // we don't want to do weight pushing before a final state is because 
       // we don't want to push the weights which are supposed to be after the
       // final state.
-      if ( labelSet->find( NONPUSHING_OUTLABEL ) != labelSet->end() )  {
+      if ( labelSet->labels[0] == NONPUSHING_OUTLABEL )  {
 #ifdef DEBUG
-	 if ( labelSet->size() != 1 )
+	 if ( labelSet->nLabels != 1 )
 	    error("WFSTOnTheFlyDecoder::findMatchedTransWithPushing - size != 1 but NONPUSHING_OUTLABEL is found") ;
 #endif
 
-	 next[*nNext] = network->getOneTransition( transInCLNetwork[i] ) ;
+	 next[*nNext] = network->getOneTransition( firstTransInCL+i ) ;
 	 commonWeights[*nNext] = 0.0 ;
 	 nextGState[*nNext] = NOPUSHING_TRANS ;
 	 nextOutLabel[*nNext] = UNDECIDED_OUTLABEL ;
@@ -2689,7 +2689,7 @@ void WFSTOnTheFlyDecoder::findMatchedTransWithPushing( WFSTTransition *prev, int
 	    // Don't care about the third argument
 	    // Changes Octavian 20060531
 	    pushingWeightCache->insertPushingWeight(
-		  transInCLNetwork[i], gState, WFST_EPSILON, 0.0, 
+		  firstTransInCL+i, gState, WFST_EPSILON, 0.0, 
 		  NOPUSHING_TRANS, UNDECIDED_OUTLABEL, UNDECIDED_OUTLABEL ) ;
 	 }
 	 continue ;
@@ -2718,7 +2718,7 @@ void WFSTOnTheFlyDecoder::findMatchedTransWithPushing( WFSTTransition *prev, int
 	    // Don't care about the third argument
 	    // Changes Octavian 20060531
 	    pushingWeightCache->insertPushingWeight(
-		  transInCLNetwork[i], gState, WFST_EPSILON, 
+		  firstTransInCL+i, gState, WFST_EPSILON, 
 		  tmpWeight, tmpNextGState, tmpNextOutLabel, 
 		  tmpMatchedOutLabel ) ;
 	 }
@@ -2727,7 +2727,7 @@ void WFSTOnTheFlyDecoder::findMatchedTransWithPushing( WFSTTransition *prev, int
 	    // Don't care about the third argrument
 	    // Changes Octavian 20060531
 	    pushingWeightCache->insertPushingWeight(
-		  transInCLNetwork[i], gState, WFST_EPSILON, 
+		  firstTransInCL+i, gState, WFST_EPSILON, 
 		  0.0, DEAD_TRANS, UNDECIDED_OUTLABEL, UNDECIDED_OUTLABEL ) ;
 	 }
       }
@@ -2735,7 +2735,7 @@ void WFSTOnTheFlyDecoder::findMatchedTransWithPushing( WFSTTransition *prev, int
       // Finally, if we have an intersection (ie at least one intersection),
       // output the relevant infomation to appropriate array.
       if ( hasIntersection )  {
-	 next[*nNext] = network->getOneTransition( transInCLNetwork[i] ) ;
+	 next[*nNext] = network->getOneTransition( firstTransInCL+i ) ;
 	 commonWeights[*nNext] = tmpWeight ;
 	 nextGState[*nNext] = tmpNextGState ;
 	 nextOutLabel[*nNext] = tmpNextOutLabel ;
@@ -2771,7 +2771,7 @@ void WFSTOnTheFlyDecoder::findMatchedTransNoPushing( WFSTTransition *prev, int *
    
    // Get an array of indices of next transitions from the C o L transducer
    int nTransInCL ;
-   const int *transInCLNetwork = network->getTransitions( prev , &nTransInCL ) ;
+   int firstTransInCL = network->getFirstTransition( prev , &nTransInCL ) ;
    
    // Get the number of transitons in the G transducer
    int nTransInG = gNetwork->getNumTransitionsOfOneState( gState ) ;
@@ -2793,7 +2793,7 @@ void WFSTOnTheFlyDecoder::findMatchedTransNoPushing( WFSTTransition *prev, int *
    // return ;
 
    for ( int i = 0 ; i < nTransInCL ; i++ )  {
-      WFSTTransition *nextPotentialCLTrans = network->getOneTransition( transInCLNetwork[i] ) ;
+      WFSTTransition *nextPotentialCLTrans = network->getOneTransition( firstTransInCL+i ) ;
       int outLabelCL = nextPotentialCLTrans->outLabel ;
 
       // Check whether if the output label is eps or not.
@@ -2834,7 +2834,7 @@ void WFSTOnTheFlyDecoder::findMatchedTransNoPushing( WFSTTransition *prev, int *
 	    // Changes 20060325
 	    // Changes Octavian 20060531
 	    bool isFoundInCache = pushingWeightCache->findPushingWeight( 
-		  transInCLNetwork[i], gState, outLabelCL, &tmpWeight, 
+		  firstTransInCL+i, gState, outLabelCL, &tmpWeight, 
 		  &tmpNextGState, &tmpNextOutLabel, &tmpMatchedOutLabel ) ;
 
 	    if ( isFoundInCache )  {
@@ -2856,9 +2856,17 @@ void WFSTOnTheFlyDecoder::findMatchedTransNoPushing( WFSTTransition *prev, int *
 	 }
 
 	 // Second, if not found in cache, do actual matching.
-	 bool isFound = binarySearchGTrans( 
-	       outLabelCL, gState, 0, nTransInG, &tmpWeight, &tmpNextGState,
-	       &tmpClosestTransInG, &tmpNextOutLabel ) ;
+	 bool isFound ;
+	 if ( gNetwork->hasLabelIndex( gState ) )  {
+	    isFound = indexedSearchGTrans( 
+		  outLabelCL, gState, &tmpWeight, &tmpNextGState, 
+		  &tmpNextOutLabel ) ;
+	 }
+	 else  {
+	    isFound = binarySearchGTrans( 
+		  outLabelCL, gState, 0, nTransInG, &tmpWeight, &tmpNextGState,
+		  &tmpClosestTransInG, &tmpNextOutLabel ) ;
+	 }
 
 	 // Changes Octavian 20060531
 	 if ( isFound )
@@ -2876,7 +2884,7 @@ void WFSTOnTheFlyDecoder::findMatchedTransNoPushing( WFSTTransition *prev, int *
 	       // Changes 20060325
 	       // Changes Octavian 20060531
 	       pushingWeightCache->insertPushingWeight(
-		     transInCLNetwork[i], gState, outLabelCL, 
+		     firstTransInCL+i, gState, outLabelCL, 
 		     tmpWeight, tmpNextGState, tmpNextOutLabel,
 		     tmpMatchedOutLabel ) ;
 	    }
@@ -2884,7 +2892,7 @@ void WFSTOnTheFlyDecoder::findMatchedTransNoPushing( WFSTTransition *prev, int *
 	       // Changes 20060325
 	       // Changes Octavian 20060531
 	       pushingWeightCache->insertPushingWeight(
-		     transInCLNetwork[i], gState, outLabelCL, 
+		     firstTransInCL+i, gState, outLabelCL, 
 		     0.0, DEAD_TRANS, UNDECIDED_OUTLABEL, 
 		     UNDECIDED_OUTLABEL ) ;
 	    }
@@ -2909,11 +2917,10 @@ void WFSTOnTheFlyDecoder::findMatchedTransNoPushing( WFSTTransition *prev, int *
 bool WFSTOnTheFlyDecoder::findIntersection( const WFSTLabelPushingNetwork::LabelSet *labelSet, const int gState, const int totalNTransInG , real *commonWeight, int *nextGState, int *nextOutLabel, int *matchedOutLabel )
 {
    int numMatched = 0 ;
-   WFSTLabelPushingNetwork::LabelSet::iterator labelIterInCL ;
-   int startTransInG = 0 ;
-   int nTransInG = totalNTransInG ;
-   int closestTransInG = 0 ;
-   bool isFound ;
+   const int *labels = labelSet->labels ;
+   const int nLabels = labelSet->nLabels ;
+   int labelIndex = 0 ;
+   int transInG = 0 ;
 
    real tmpWeight = 0.0 ;
    int tmpNextGState = -1 ;
@@ -2931,124 +2938,95 @@ bool WFSTOnTheFlyDecoder::findIntersection( const WFSTLabelPushingNetwork::Label
 #endif
 
 #ifdef DEBUG
-   if ( labelSet->empty() )
+   if ( nLabels <= 0 )
       error("WFSTOnTheFlyDecoder::findIntersection - labelSet is empty") ;
-   int tmpInLabel ;
-#endif
- 
-   // *****************************
-   // Changes Octavian 20060616
-   /*
-   for ( labelIterInCL = labelSet->begin() ; labelIterInCL != labelSet->end() ; labelIterInCL++ )  {
-   */
-   labelIterInCL = labelSet->begin() ;
-   WFSTLabelPushingNetwork::LabelSet::iterator endIter = labelSet->end() ;
-   while ( labelIterInCL != endIter )  { 
-#ifdef DEBUG
-      if ( labelIterInCL == labelSet->begin() )  {
-	 tmpInLabel = *labelIterInCL ;
-      }
-      else  {
-	 if ( *labelIterInCL <= tmpInLabel )
-	    error("WFSTOnTheFlyDecoder::findIntersection - labelSet is not in ascending order") ;
-	 tmpInLabel = *labelIterInCL ;
-      }
-
-      if ( (*labelIterInCL) <= 0 )
+   for ( int i = 0 ; i < nLabels ; i++ )  {
+      if ( labels[i] <= 0 )
 	 error("WFSTOnTheFlyDecoder::findIntersection - inLabel <= 0") ;
-#endif
-      // *******************************
-
-      // For each label in the set, try to find a match in G.
-      isFound = binarySearchGTrans( 
-	    *labelIterInCL, gState, startTransInG, nTransInG, &tmpWeight, 
-	    &tmpNextGState, &closestTransInG, &tmpNextOutLabel ) ;
-
-      if ( isFound )  {
-	 if ( numMatched == 0 )  {
-	    // Changes Octavian 20060328
-	    //minWeight = tmpWeight ;
-	    // Changes Octavian 20060810
-#ifndef LOG_ADD_LOOKAHEAD
-	    maxWeight = tmpWeight ;
-#else
-	    logSumWeight = tmpWeight ;
-#endif
+      if ( ( i > 0 ) && ( labels[i] <= labels[i-1] ) )
+	 error("WFSTOnTheFlyDecoder::findIntersection - labelSet is not in ascending order") ;
+   }
+#endif
+
+   // If gState has a label index and more transitions than the set has
+   // labels, each label is looked up in the index. Else a dense set is
+   // looked up in its bitmap for each G transition in its range. Otherwise
+   // the labels and the G transitions, both sorted, are merged, galloping
+   // over whichever falls behind.
+   bool isIndexed = ( nLabels <= totalNTransInG ) && gNetwork->hasLabelIndex( gState ) ;
+   if (( ! isIndexed ) && ( labelSet->bits != NULL ))
+      transInG = gallopGTrans( labels[0], gState, 0, totalNTransInG ) ;
+
+   while ( true )  {
+      // Find the next G transition with an input label in the set
+      int matchedTransInG = -1 ;
+      if ( isIndexed )  {
+	 while ( labelIndex < nLabels )  {
+	    matchedTransInG = gNetwork->findIndexedTrans( gState, labels[labelIndex++] ) ;
+	    if ( matchedTransInG >= 0 )
+	       break ;
 	 }
-	 else  {
-	    // Changes Octavian 20060328
-	    // Changes Octavian 20060810
-#ifndef LOG_ADD_LOOKAHEAD
-	    if ( tmpWeight > maxWeight )
-	       maxWeight = tmpWeight ;
-#else
-	    logSumWeight = logAdd( logSumWeight, tmpWeight ) ;
-#endif
-	    /*
-	    if ( tmpWeight < minWeight )
-	       minWeight = tmpWeight ;
-	    */
+      }
+      else if ( labelSet->bits != NULL )  {
+	 while ( transInG < totalNTransInG )  {
+	    int gInLabel = gNetwork->getInLabelOfOneTransition( gState, transInG ) ;
+	    if ( gInLabel > labels[nLabels-1] )  {
+	       transInG = totalNTransInG ;
+	       break ;
+	    }
+	    transInG++ ;
+	    if ( labelSet->contains( gInLabel ) )  {
+	       matchedTransInG = transInG - 1 ;
+	       break ;
+	    }
 	 }
-	 // Changes Octavian 20060531
-	 tmpMatchedOutLabel = *labelIterInCL ;
-	 numMatched++ ;
       }
-
-      startTransInG = closestTransInG + 1 ;
-      // ************
-      // Changes Octavian 20060617
-      //nTransInG = totalNTransInG - startTransInG ;
-      // ************
-      if ( startTransInG >= totalNTransInG )
+      else  {
+	 while (( labelIndex < nLabels ) && ( transInG < totalNTransInG ))  {
+	    int gInLabel = gNetwork->getInLabelOfOneTransition( gState, transInG ) ;
+	    if ( labels[labelIndex] < gInLabel )  {
+	       labelIndex = gallopLabels( gInLabel, labels, labelIndex + 1, nLabels ) ;
+	    }
+	    else if ( labels[labelIndex] > gInLabel )  {
+	       transInG = gallopGTrans( labels[labelIndex], gState, transInG + 1, totalNTransInG ) ;
+	    }
+	    else  {
+	       matchedTransInG = transInG ;
+	       labelIndex++ ;
+	       transInG++ ;
+	       break ;
+	    }
+	 }
+      }
+      if ( matchedTransInG < 0 )
 	 break ;
 
-      // ***********************
-      // Changes Octavian 20060616 20060617
-      int gInLabel = gNetwork->getInLabelOfOneTransition( 
-	    gState, startTransInG ) ;
-      labelIterInCL = labelSet->lower_bound( gInLabel ) ;
-      if ( *labelIterInCL == gInLabel )  {
-	 gNetwork->getInfoOfOneTransition( 
-	       gState, startTransInG, &tmpWeight, &tmpNextGState, 
-	       &tmpNextOutLabel ) ;
-	 
-	 if ( numMatched == 0 )  {
-	    // Changes Octavian 20060328
-	    //minWeight = tmpWeight ;
-	    // Changes Octavian 20060810
+      // Changes Octavian 20060531
+      tmpMatchedOutLabel = gNetwork->getInfoOfOneTransition( 
+	    gState, matchedTransInG, &tmpWeight, &tmpNextGState, 
+	    &tmpNextOutLabel ) ;
+
+      if ( numMatched == 0 )  {
+	 // Changes Octavian 20060328
+	 //minWeight = tmpWeight ;
+	 // Changes Octavian 20060810
 #ifndef LOG_ADD_LOOKAHEAD
-	    maxWeight = tmpWeight ;
+	 maxWeight = tmpWeight ;
 #else
-	    logSumWeight = tmpWeight ;
+	 logSumWeight = tmpWeight ;
 #endif
-	 }
-	 else  {
-	    // Changes Octavian 20060328
-	    // Changes Octavian 20060810
+      }
+      else  {
+	 // Changes Octavian 20060328
+	 // Changes Octavian 20060810
 #ifndef LOG_ADD_LOOKAHEAD
-	    if ( tmpWeight > maxWeight )
-	       maxWeight = tmpWeight ;
+	 if ( tmpWeight > maxWeight )
+	    maxWeight = tmpWeight ;
 #else
-	    logSumWeight = logAdd( logSumWeight, tmpWeight ) ;
+	 logSumWeight = logAdd( logSumWeight, tmpWeight ) ;
 #endif
-	    /*
-	    if ( tmpWeight < minWeight )
-	       minWeight = tmpWeight ;
-	    */
-	 }
-	 // Changes Octavian 20060531
-	 tmpMatchedOutLabel = *labelIterInCL ;
-	 numMatched++ ;
-
-	 // Changes Octavian 20060617
-	 labelIterInCL++ ;
       }
-      // Changes Octavian 20060617
-      startTransInG++ ;
-      nTransInG = totalNTransInG - startTransInG ;
-      if ( startTransInG >= totalNTransInG )
-	 break ;
-      // ************************
+      numMatched++ ;
    }
 
    bool returnStatus ;
@@ -3103,6 +3081,60 @@ bool WFSTOnTheFlyDecoder::findIntersection( const WFSTLabelPushingNetwork::Label
 }
 
 
+// Changes
+// As binarySearchGTrans() over all the transitions of gState, using the
+// label index of gState
+bool WFSTOnTheFlyDecoder::indexedSearchGTrans( const int outLabelInCL, const int gState, real *weight, int *nextGState, int *nextOutLabel )
+{
+   int n = gNetwork->findIndexedTrans( gState, outLabelInCL ) ;
+   if ( n < 0 )
+      return false ;
+   gNetwork->getInfoOfOneTransition( gState, n, weight, nextGState, nextOutLabel ) ;
+   return true ;
+}
+
+// Returns the first of the G transitions first..last-1 of gState with an
+// input label not less than label. The transitions are probed at doubling
+// distances from first, so that a label close to first is found in a few
+// steps, then the last interval is bisected.
+int WFSTOnTheFlyDecoder::gallopGTrans( const int label, const int gState, int first, const int last )
+{
+   int step = 1 ;
+   int bound = first ;
+   while (( bound < last ) && ( gNetwork->getInLabelOfOneTransition( gState, bound ) < label ))  {
+      first = bound + 1 ;
+      bound = first + step ;
+      step *= 2 ;
+   }
+   if ( bound > last )
+      bound = last ;
+
+   while ( first < bound )  {
+      int middle = ( first + bound ) / 2 ;
+      if ( gNetwork->getInLabelOfOneTransition( gState, middle ) < label )
+	 first = middle + 1 ;
+      else
+	 bound = middle ;
+   }
+   return first ;
+}
+
+// As gallopGTrans() for a sorted array of labels
+int WFSTOnTheFlyDecoder::gallopLabels( const int label, const int *labels, int first, const int last )
+{
+   int step = 1 ;
+   int bound = first ;
+   while (( bound < last ) && ( labels[bound] < label ))  {
+      first = bound + 1 ;
+      bound = first + step ;
+      step *= 2 ;
+   }
+   if ( bound > last )
+      bound = last ;
+   return lower_bound( labels + first , labels + bound , label ) - labels ;
+}
+
+
 bool WFSTOnTheFlyDecoder::binarySearchGTrans( const int outLabelInCL, const int gState, const int startTransInG, const int nTransInG, real *weight, int *nextGState, int *closestTransInG, int *nextOutLabel )
 {
    real weightInG ;
@@ -244,6 +244,18 @@ protected:
 	 const int outLabelInCL, const int gState, const int startTransInG, 
 	 const int nTransInG, real *weight, int *nextGState, 
 	 int *closestTransInG, int *nextOutLabel ) ;
+
+   // Lookup in the label index of gState, for states that have one
+   bool indexedSearchGTrans( 
+	 const int outLabelInCL, const int gState, real *weight, 
+	 int *nextGState, int *nextOutLabel ) ;
+
+   // Galloping searches used by findIntersection(). Both return the first
+   // index in first..last-1 whose label is not less than label.
+   int gallopGTrans( 
+	 const int label, const int gState, int first, const int last ) ;
+   static int gallopLabels( 
+	 const int label, const int *labels, int first, const int last ) ;
    
    // *************
    // Enable/disable cache for storing pushing weights   
@@ -0,0 +1,150 @@
+/*
+ * Copyright 2009 by Idiap Research Institute
+ *                   http://www.idiap.ch
+ *
+ * See the file COPYING for the licence associated with this software.
+ *
+ * WorkerPool.cpp  -  threads that share the tasks of a job with the thread
+ * that runs it
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <cassert>
+#include <sched.h>
+#include "general.h"
+
+#include "WorkerPool.h"
+
+using namespace Torch;
+
+namespace Juicer {
+
+// polls for a new job before a worker goes to sleep
+static const int WORKER_SPIN = 20000;
+
+static inline void cpuRelax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#endif
+}
+
+WorkerPool::WorkerPool(int nThreads)
+{
+    assert(nThreads >= 1);
+    fnWorkers = nThreads - 1;
+    fTask = NULL;
+    fArg = NULL;
+    fnTasks = 0;
+    fNext = 0;
+    fJob = 0;
+    fnAcked = 0;
+    fRunning = 1;
+    fnParked = 0;
+    pthread_mutex_init(&fMutex, NULL);
+    pthread_cond_init(&fWakeUp, NULL);
+
+    fWorkers = new pthread_t[fnWorkers];
+    for (int i = 0; i < fnWorkers; ++i)
+        if (pthread_create(&fWorkers[i], NULL, workerThread, this))
+            error("WorkerPool - failed to create worker thread %d", i);
+}
+
+WorkerPool::~WorkerPool()
+{
+    pthread_mutex_lock(&fMutex);
+    __atomic_store_n(&fRunning, 0, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&fWakeUp);
+    pthread_mutex_unlock(&fMutex);
+    for (int i = 0; i < fnWorkers; ++i)
+        pthread_join(fWorkers[i], NULL);
+    delete[] fWorkers;
+    pthread_cond_destroy(&fWakeUp);
+    pthread_mutex_destroy(&fMutex);
+}
+
+// Every worker acknowledges every job, even one it found no task left in,
+// so none can still be looking at a job when run() sets up the next.
+void WorkerPool::run(Task task, void* arg, int nTasks)
+{
+    if (fnWorkers == 0 || nTasks <= 1) {
+        for (int i = 0; i < nTasks; ++i)
+            task(arg, i);
+        return;
+    }
+
+    fTask = task;
+    fArg = arg;
+    fnTasks = nTasks;
+    __atomic_store_n(&fNext, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&fnAcked, 0, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&fJob, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&fnParked, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&fMutex);
+        pthread_cond_broadcast(&fWakeUp);
+        pthread_mutex_unlock(&fMutex);
+    }
+
+    // a worker may have been preempted, so the caller yields its core now
+    // and then rather than spin
+    runTasks();
+    for (int spin = 1; __atomic_load_n(&fnAcked, __ATOMIC_ACQUIRE) < fnWorkers; ++spin) {
+        if (spin % 64 == 0)
+            sched_yield();
+        else
+            cpuRelax();
+    }
+}
+
+void WorkerPool::runTasks()
+{
+    int i;
+    while ((i = __atomic_fetch_add(&fNext, 1, __ATOMIC_RELAXED)) < fnTasks)
+        fTask(fArg, i);
+}
+
+void* WorkerPool::workerThread(void* arg)
+{
+    ((WorkerPool*)arg)->workerLoop();
+    return NULL;
+}
+
+// Take part in each new job, spinning for a while in between and then
+// sleeping until run() or the destructor wakes the worker up.  As in
+// HTKFlatModelsThreading, fnParked is raised before fJob is checked and
+// run() reads it after raising fJob, so a job can not start unnoticed.
+void WorkerPool::workerLoop()
+{
+    unsigned long job = 0;
+    int idle = 0;
+    for (;;) {
+        if (__atomic_load_n(&fJob, __ATOMIC_ACQUIRE) != job) {
+            ++job;
+            runTasks();
+            __atomic_add_fetch(&fnAcked, 1, __ATOMIC_RELEASE);
+            idle = 0;
+        } else if (!__atomic_load_n(&fRunning, __ATOMIC_ACQUIRE)) {
+            break;
+        } else if (idle < WORKER_SPIN) {
+            // now and then let a preempted thread of the job have the core
+            if (++idle % 64 == 0)
+                sched_yield();
+            else
+                cpuRelax();
+        } else {
+            pthread_mutex_lock(&fMutex);
+            __atomic_add_fetch(&fnParked, 1, __ATOMIC_SEQ_CST);
+            while (__atomic_load_n(&fRunning, __ATOMIC_SEQ_CST) &&
+                   __atomic_load_n(&fJob, __ATOMIC_SEQ_CST) == job)
+                pthread_cond_wait(&fWakeUp, &fMutex);
+            __atomic_sub_fetch(&fnParked, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&fMutex);
+            idle = 0;
+        }
+    }
+}
+
+}; // namespace juicer
@@ -0,0 +1,68 @@
+/*
+ * Copyright 2009 by Idiap Research Institute
+ *                   http://www.idiap.ch
+ *
+ * See the file COPYING for the licence associated with this software.
+ */
+
+/*
+ * vi:ts=4:tw=78:shiftwidth=4:expandtab
+ * vim600:fdm=marker
+ *
+ * WorkerPool.h  -  threads that share the tasks of a job with the thread
+ * that runs it
+ *
+ */
+
+#ifndef _WORKERPOOL_H
+#define _WORKERPOOL_H
+
+#include <pthread.h>
+
+namespace Juicer {
+
+    /**
+     * A job is a number of independent tasks.  run() hands them out one at
+     * a time to the workers and to the calling thread, and returns when all
+     * are done.  Between jobs the workers spin for a while before they go
+     * to sleep, so that the many short jobs of a decoder frame do not pay
+     * for waking them up.
+     */
+    class WorkerPool {
+        public:
+            typedef void (*Task)(void* arg, int task);
+
+            /// nThreads includes the caller of run(), so nThreads-1
+            /// workers are started
+            WorkerPool(int nThreads);
+            ~WorkerPool();
+
+            int getNumThreads() const { return fnWorkers + 1; }
+
+            /// task(arg, i) for i in 0 .. nTasks-1, in no particular order
+            void run(Task task, void* arg, int nTasks);
+
+        private:
+            int fnWorkers;
+            pthread_t* fWorkers;
+
+            // the job; written by run() before fJob is raised
+            Task fTask;
+            void* fArg;
+            int fnTasks;
+            int fNext;               // next task to hand out
+
+            unsigned long fJob;      // raised for each job
+            int fnAcked;             // workers done with the job
+            int fRunning;
+            int fnParked;            // workers asleep on fWakeUp
+            pthread_mutex_t fMutex;
+            pthread_cond_t fWakeUp;
+
+            static void* workerThread(void* arg);
+            void workerLoop();
+            void runTasks();
+    };
+
+}; // namespace juicer
+#endif /* ifndef _WORKERPOOL_H */
@@ -0,0 +1,77 @@
+/*
+ * Copyright 2009 by Idiap Research Institute
+ *                   http://www.idiap.ch
+ *
+ * See the file COPYING for the licence associated with this software.
+ */
+
+#include "general.h"
+#include "CmdLine.h"
+#include "LogFile.h"
+#include "HTKGSModels.h"
+
+/*
+ * gsgen - build the Gaussian selection index used by juicer
+ * -gaussSelection from an HTK MMF.  The index is written next to the MMF
+ * as <htkModelsFName>.gs unless -gsFName is given.
+ */
+
+using namespace Juicer ;
+using namespace Torch ;
+
+char           *htkModelsFName=NULL ;
+char           *gsFName=NULL ;
+int            nCodewords=0 ;
+float          gsThreshold=0.0 ;
+int            gsMinComps=0 ;
+char           *logFName=NULL ;
+
+
+void processCmdLine( CmdLine *cmd , int argc , char *argv[] )
+{
+	cmd->addText("\nGaussian Selection Options:") ;
+	cmd->addSCmdOption( "-htkModelsFName" , &htkModelsFName , "" ,
+			"the file containing the acoustic models in HTK MMF format" ) ;
+	cmd->addSCmdOption( "-gsFName" , &gsFName , "" ,
+			"the index output filename (default htkModelsFName.gs)" ) ;
+	cmd->addICmdOption( "-nCodewords" , &nCodewords , 256 ,
+			"number of codewords, a power of 2" ) ;
+	cmd->addRCmdOption( "-gsThreshold" , &gsThreshold , 1.5 ,
+			"shortlist components within this distance per dimension of a codeword" ) ;
+	cmd->addICmdOption( "-gsMinComps" , &gsMinComps , 2 ,
+			"minimum number of components per mixture in a shortlist" ) ;
+	cmd->addSCmdOption( "-logFName" , &logFName , "stdout" ,
+			"the name of the log file" ) ;
+
+	cmd->read( argc , argv ) ;
+
+	if ( strcmp( htkModelsFName , "" ) == 0 )
+		error("gsgen: htkModelsFName undefined") ;
+}
+
+
+int main( int argc , char *argv[] )
+{
+   CmdLine cmd ;
+
+   processCmdLine( &cmd , argc , argv ) ;
+   LogFile::open( logFName ) ;
+
+   HTKGSModels models ;
+   models.setBlockSize( 1 ) ;
+   models.Load( htkModelsFName ) ;
+   models.buildIndex( nCodewords , gsThreshold , gsMinComps ) ;
+
+   if ( strcmp( gsFName , "" ) != 0 )
+      models.writeIndex( gsFName ) ;
+   else
+   {
+      char *indexFName = new char[strlen(htkModelsFName)+4] ;
+      sprintf( indexFName , "%s.gs" , htkModelsFName ) ;
+      models.writeIndex( indexFName ) ;
+      delete [] indexFName ;
+   }
+
+   LogFile::close() ;
+   return 0 ;
+}
@@ -14,6 +14,7 @@
 #include "WFSTNetwork.h"
 #include "Decoder.h"
 #include "DecoderBatchTest.h"
+#include "DecoderServer.h"
 #include "MonophoneLookup.h"
 #include "LogFile.h"
 
@@ -40,6 +41,8 @@
 #ifdef OPT_FLATMODEL
 # include "HTKFlatModels.h"
 # include "HTKFlatModelsThreading.h"
+# include "HTKFlatModelsStreams.h"
+# include "HTKGSModels.h"
 #else
 # include "HTKModels.h"
 #endif
@@ -68,22 +71,6 @@ using namespace Torch ;
 using namespace Juicer ;
 
 
-typedef struct GMMThreadParam_ {
-    // pointers to global resources
-    HTKFlatModelsThreading* models;
-
-    // per-thread resources
-    bool running; 
-} GMMThreadParam;
-
-void* GMMThread(void* arg) {
-    GMMThreadParam* p = (GMMThreadParam*)arg;
-    LogFile::printf("GMM Thread up and running...\n");
-    p->models->calcStates();
-    LogFile::printf("GMM Thread quitting...\n");
-    pthread_exit(NULL);
-}
-
 // Version string
 bool version = false;
 
@@ -102,6 +89,9 @@ char              *sentEndWord=NULL ;
 // GMM Model parameters
 char           *htkModelsFName=NULL ;
 bool           doModelsIOTest=false ;
+bool           gaussSelection=false ;
+char           *gsFName=NULL ;
+char           *flatModelsFName=NULL ;
 #ifdef HAVE_HTKLIB
 char           *htkConfigFName=NULL ;
 bool           useHModels=false ;
@@ -138,6 +128,8 @@ float          phoneStartBeam=0.0 ;
 float          wordEmitBeam=0.0 ;
 int            maxHyps=0 ;
 int            blockSize = 5;
+char           *gmmKernel_s=NULL ;
+char           *logSum_s=NULL ;
 char           *inputFormat_s=NULL ;
 DSTDataFileFormat inputFormat ;
 char           *outputFormat_s=NULL ;
@@ -153,6 +145,19 @@ bool           latticeGeneration=false ;
 char           *latticeDir=NULL ;
 
 bool           use2Threads = false;
+int            gmmThreads = 1;
+int            nThreads = 1;
+bool           lockstep = false;
+int            propThreads = 1;
+char           *serverSocket=NULL ;
+int            partialInterval=10 ;
+bool           batchGMM = false;
+int            quantModels = 0;
+real           denseGMM = 0.6;
+int            gmmBoundDims = 0;
+int            compactWeightBits = 0;
+int            epsClosureArcs = 0;
+int            gLabelIndexArcs = 0;
 
 // Consistency checking parameters
 char           *monoListFName=NULL ;
@@ -197,6 +202,12 @@ void processCmdLine( CmdLine *cmd , int argc , char *argv[] )
                         "the file containing the acoustic models in HTK MMF format" ) ;
     cmd->addBCmdOption( "-doModelsIOTest" , &doModelsIOTest , false ,
                         "tests the text and binary acoustic models load/save" ) ;
+    cmd->addBCmdOption( "-gaussSelection" , &gaussSelection , false ,
+                        "score only the Gaussians shortlisted for each frame by a Gaussian selection index" ) ;
+    cmd->addSCmdOption( "-gsFName" , &gsFName , "" ,
+                        "the Gaussian selection index built with gsgen (default htkModelsFName.gs)" ) ;
+    cmd->addSCmdOption( "-flatModelsFName" , &flatModelsFName , "" ,
+                        "flat models file shared by decoders through mmap, written from htkModelsFName if it does not exist" ) ;
 #ifdef HAVE_HTKLIB
     cmd->addText("\nHTK Options:") ;
     cmd->addSCmdOption( "-htkConfig" , &htkConfigFName , "" ,
@@ -254,8 +265,32 @@ void processCmdLine( CmdLine *cmd , int argc , char *argv[] )
                         "Upper limit on the number of active emitting state hypotheses" ) ;
     cmd->addICmdOption( "-blockSize" , &blockSize , 5 ,
                         "speed up GMM output calculation by computing a sequence of frames (1-20) a time.");
+    cmd->addSCmdOption( "-gmmKernel" , &gmmKernel_s , "auto" ,
+                        "Gaussian kernel for HTKFlatModels (auto,scalar,sse2,avx2,avx512), auto picks the best the CPU supports" ) ;
+    cmd->addSCmdOption( "-logSum" , &logSum_s , "exact" ,
+                        "log-sum-exp used to combine mixture components (exact,approx)" ) ;
+    cmd->addBCmdOption( "-batchGMM" , &batchGMM , false ,
+                        "score the GMMs requested in a frame in one batch, as a matrix product over the block" ) ;
+    cmd->addRCmdOption( "-denseGMM" , &denseGMM , 0.6 ,
+                        "score all GMMs for the block while this fraction of them is active (0 disables)" ) ;
+    cmd->addICmdOption( "-gmmBoundDims" , &gmmBoundDims , 0 ,
+                        "skip GMMs whose score on this many dimensions puts the token below the emitting beam (0 disables)" ) ;
+    cmd->addICmdOption( "-quantModels" , &quantModels , 0 ,
+                        "store GMM means as 8 or 16 bit integers and variances as fp16 (0 keeps float)" ) ;
     cmd->addBCmdOption( "-threading" , &use2Threads , false,
                         "speed up decoding via threading, where GMM calculation is handled in a separate thread." ) ;
+    cmd->addICmdOption( "-gmmThreads" , &gmmThreads , 1 ,
+                        "number of GMM threads with -threading, 0 for one per core" ) ;
+    cmd->addICmdOption( "-nThreads" , &nThreads , 1 ,
+                        "number of files decoded in parallel, each thread with its own decoder, models and front end" ) ;
+    cmd->addBCmdOption( "-lockstep" , &lockstep , false ,
+                        "with -nThreads, share one copy of the models and score the GMMs of all threads together in each frame" ) ;
+    cmd->addICmdOption( "-propThreads" , &propThreads , 1 ,
+                        "number of threads propagating the tokens of each decoder within a frame, with -batchGMM; the result does not depend on it" ) ;
+    cmd->addSCmdOption( "-serverSocket" , &serverSocket , "" ,
+                        "decode live sessions on this Unix socket (- for one on stdin/stdout) instead of inputFName, -nThreads at a time" ) ;
+    cmd->addICmdOption( "-partialInterval" , &partialInterval , 10 ,
+                        "with -serverSocket, frames between tracebacks for the words all hypotheses agree on" ) ;
     cmd->addSCmdOption( "-inputFName" , &inputFName , "" ,
                         "the file containing the list of files to be decoded" ) ;
     cmd->addSCmdOption( "-inputFormat" , &inputFormat_s , "" ,
@@ -270,6 +305,12 @@ void processCmdLine( CmdLine *cmd , int argc , char *argv[] )
                         "the language model scaling factor" ) ;
     cmd->addRCmdOption( "-insPenalty" , &insPenalty , 0.0 ,
                         "the word insertion penalty" ) ;
+    cmd->addICmdOption( "-compactWeightBits" , &compactWeightBits , 0 ,
+                        "pack network transitions into 64 bits with a codebook of 2^n weights (1-16, 0 keeps full transitions)" ) ;
+    cmd->addICmdOption( "-epsClosureArcs" , &epsClosureArcs , 0 ,
+                        "precompute the epsilon closure of states reaching at most n transitions (0 disables)" ) ;
+    cmd->addICmdOption( "-gLabelIndexArcs" , &gLabelIndexArcs , 0 ,
+                        "index by label the G states with at least n transitions, in on-the-fly composition (0 disables)" ) ;
     cmd->addBCmdOption( "-removeSentMarks" , &removeSentMarks , false ,
                         "removes sentence start and end markers from decoding result before outputting." ) ;
     cmd->addBCmdOption( "-modelLevelOutput" , &modelLevelOutput , false ,
@@ -313,7 +354,7 @@ void processCmdLine( CmdLine *cmd , int argc , char *argv[] )
     // Basic parameter checks
     if ( strcmp( lexFName , "" ) == 0 )
         error("juicer: lexFName undefined") ;
-    if ( strcmp( inputFName , "" ) == 0 )
+    if ( (strcmp( inputFName , "" ) == 0) && (strcmp( serverSocket , "" ) == 0) )
         error("juicer: inputFName undefined") ;
     if ( strcmp( fsmFName , "" ) == 0 )
         error("juicer: fsmFName undefined") ;
@@ -405,6 +446,111 @@ void processCmdLine( CmdLine *cmd , int argc , char *argv[] )
         }
     }
 
+    if ( (compactWeightBits < 0) || (compactWeightBits > 16) )
+        error("juicer: -compactWeightBits %d not in 0..16" , compactWeightBits ) ;
+    if ( compactWeightBits > 0 )
+    {
+        if ( useBasicCore )
+            error("juicer: -compactWeightBits is not available in basicCore") ;
+        if ( onTheFlyComposition )
+            error("juicer: -compactWeightBits is not available with on-the-fly composition") ;
+    }
+
+    // the bound is computed from the float means, and the error of the
+    // quantized kernels can be more than its margin
+    if ( (gmmBoundDims > 0) && (quantModels != 0) )
+        error("juicer: -gmmBoundDims can not be used with -quantModels") ;
+
+    if ( nThreads < 1 )
+        error("juicer: -nThreads %d < 1" , nThreads ) ;
+    if ( nThreads > 1 )
+    {
+        if ( use2Threads )
+            error("juicer: -nThreads can not be used with -threading") ;
+        if ( dbtLoop )
+            error("juicer: -nThreads can not be used with -loop") ;
+#ifdef HAVE_HTKLIB
+        // HTKLib keeps the source and models in globals
+        if ( (htkConfigFName != NULL) && (htkConfigFName[0] != '\0') )
+            error("juicer: -nThreads can not be used with -htkConfigFName") ;
+#endif
+    }
+    if ( lockstep )
+    {
+#ifndef OPT_FLATMODEL
+        error("juicer: -lockstep requires HTKFlatModels") ;
+#endif
+        if ( (htkModelsFName == NULL) || (htkModelsFName[0] == '\0') )
+            error("juicer: -lockstep requires -htkModelsFName") ;
+        if ( gaussSelection )
+            error("juicer: -lockstep can not be used with -gaussSelection") ;
+        // setupModels() would build HTKFlatModelsThreading instead
+        if ( use2Threads )
+            error("juicer: -lockstep can not be used with -threading") ;
+#ifdef HAVE_HTKLIB
+        if ( useHModels )
+            error("juicer: -lockstep can not be used with -useHModels") ;
+#endif
+        // the on-the-fly decoder does not ask for its GMMs in batches, so
+        // the others would wait for it
+        if ( onTheFlyComposition )
+            error("juicer: -lockstep is not available with on-the-fly composition") ;
+        if ( nThreads < 2 )
+            fprintf(stderr, "Warning: -lockstep without -nThreads decodes one file at a time.\n");
+    }
+
+    if ( propThreads < 1 )
+        error("juicer: -propThreads %d < 1" , propThreads ) ;
+    if ( propThreads > 1 )
+    {
+        // only the plain WFSTDecoderLite splits its frames
+        if ( useBasicCore )
+            error("juicer: -propThreads is not available in basicCore") ;
+        if ( onTheFlyComposition )
+            error("juicer: -propThreads is not available with on-the-fly composition") ;
+        if ( use2Threads )
+            error("juicer: -propThreads can not be used with -threading") ;
+        if ( lockstep )
+            error("juicer: -propThreads can not be used with -lockstep") ;
+        // the GMMs are scored before the parallel passes, which leaves a
+        // serial pass of cache lookups rather than of GMM scoring
+        if ( !batchGMM )
+            error("juicer: -propThreads needs -batchGMM") ;
+    }
+
+    if ( strcmp( serverSocket , "" ) != 0 )
+    {
+        if ( modelLevelOutput || latticeGeneration )
+            error("juicer: -serverSocket outputs words only, not models or lattices") ;
+        if ( lockstep )
+            error("juicer: -serverSocket can not be used with -lockstep") ;
+        if ( dbtLoop )
+            error("juicer: -serverSocket can not be used with -loop") ;
+#ifdef HAVE_HTKLIB
+        if ( (htkConfigFName != NULL) && (htkConfigFName[0] != '\0') )
+            error("juicer: -serverSocket can not be used with -htkConfigFName") ;
+#endif
+    }
+
+    if ( gLabelIndexArcs < 0 )
+        error("juicer: -gLabelIndexArcs %d < 0" , gLabelIndexArcs ) ;
+#ifndef WITH_ONTHEFLY
+    // Only the on-the-fly decoder searches the index
+    if ( gLabelIndexArcs > 0 )
+        error("juicer: -gLabelIndexArcs needs the on-the-fly decoder, which is not compiled in") ;
+#endif
+
+    if ( epsClosureArcs < 0 )
+        error("juicer: -epsClosureArcs %d < 0" , epsClosureArcs ) ;
+    if ( epsClosureArcs > 0 )
+    {
+        // Only WFSTDecoderLite reads the closures
+        if ( useBasicCore )
+            error("juicer: -epsClosureArcs is not available in basicCore") ;
+        if ( onTheFlyComposition )
+            error("juicer: -epsClosureArcs is not available with on-the-fly composition") ;
+    }
+
 }
 
 bool fileExists( const char *fname )
@@ -416,7 +562,25 @@ bool fileExists( const char *fname )
     return true ;
 }
 
+// Packs the transitions of the static network if asked to; a binary
+// network file may also have been written compact.
+void compactNetwork( WFSTNetwork *network )
+{
+    if ( (compactWeightBits > 0) && !network->isCompact() )
+    {
+        real err = network->compactTransitions( compactWeightBits ) ;
+        LogFile::printf( "compact transitions with %d bit weights, max weight error %f .... " ,
+                         compactWeightBits , err ) ;
+    }
+    if ( network->isCompact() && useBasicCore )
+        error("juicer: network with compact transitions is not available in basicCore") ;
+}
+
 void setupModels( IModels **models ) ;
+FrontEnd *createFrontEnd( IModels *models ) ;
+IDecoder *createDecoder(
+    WFSTNetwork *network , WFSTNetwork *clNetwork ,
+    WFSTSortedInLabelNetwork *gNetwork , IModels *models ) ;
 void setupNetworks(WFSTNetwork** network_, WFSTNetwork** clNetwork_, WFSTSortedInLabelNetwork** gNetwork_);
 
 #ifdef HAVE_HTKLIB
@@ -507,6 +671,15 @@ int main( int argc , char *argv[] )
     IModels *models=NULL ;
     setupModels( &models ) ;
     LogFile::puts( "done\n" ) ;
+#ifdef OPT_FLATMODEL
+    // the decoders see the models of their own stream
+    HTKFlatModelsStreams *streamModels = NULL ;
+    if ( lockstep )
+    {
+        streamModels = (HTKFlatModelsStreams*)models ;
+        models = streamModels->getStream( 0 ) ;
+    }
+#endif
 
 #if 0
     // Check model order
@@ -527,16 +700,9 @@ int main( int argc , char *argv[] )
 #ifndef OPT_FLATMODEL
         error("GMM threading code requires HTKFlatModels");
 #endif
-        // let GMM thread run before loading network to ensure it will be in running state when
+        // let GMM threads run before loading network to ensure they will be in running state when
         // decoding starts
-        pthread_t gmm_thread;
-        GMMThreadParam gmm_thread_param;
-        gmm_thread_param.models = (HTKFlatModelsThreading*)models;
-        gmm_thread_param.running = true;
-        if (pthread_create(&gmm_thread, NULL, GMMThread, &gmm_thread_param)) {
-            fprintf(stderr, "juicer.cpp fail to create gmm_thread\n");
-            exit(-1);
-        }
+        ((HTKFlatModelsThreading*)models)->start(gmmThreads);
     }
 
     // load network
@@ -547,6 +713,134 @@ int main( int argc , char *argv[] )
     setupNetworks(&network, &clNetwork, &gNetwork);
 
     // Create front-end.
+    FrontEnd *frontend = createFrontEnd( models ) ;
+
+    // create decoder
+    LogFile::puts( "creating Decoder .... " ) ;
+    IDecoder *decoder = createDecoder( network , clNetwork , gNetwork , models ) ;
+    LogFile::puts( "done\n" ) ;
+
+    // setup phoneLookup
+    PhoneLookup *phoneLookup=NULL ;
+    if ( modelLevelOutput )
+    {
+        phoneLookup = new PhoneLookup(
+            monoListFName , silMonophone , pauseMonophone ,
+            tiedListFName , cdSepChars ) ;
+
+        // Add the model indices to the PhoneLookup
+        int i ;
+        for ( i=0 ; i<models->getNumHMMs() ; i++ )
+        {
+            const char* hmmName = models->getHMMName( i ) ;
+            phoneLookup->addModelInd( hmmName , i ) ;
+        }
+        phoneLookup->verifyAllModels() ;
+    }
+
+    // create batch tester, or the server in its place
+    DecoderBatchTest *tester = NULL ;
+    DecoderServer *server = NULL ;
+    if ( strcmp( serverSocket , "" ) != 0 )
+    {
+        // the models score blockSize frames ahead, hybrid ones only one
+        int lookahead = ( (htkModelsFName != NULL) && (htkModelsFName[0] != '\0') ) ? blockSize : 1 ;
+        server = new DecoderServer(
+            vocab , decoder , models->getInputVecSize() , lookahead ,
+            partialInterval , removeSentMarks , framesPerSec ) ;
+    }
+    else
+    {
+        LogFile::puts( "creating DecoderBatchTest .... " ) ;
+        tester = new DecoderBatchTest(
+            vocab , phoneLookup , frontend , decoder , inputFName , inputFormat ,
+            models->getInputVecSize() , outputFName , outputFormat , refFName ,
+            removeSentMarks , framesPerSec ) ;
+        tester->loop = dbtLoop;
+
+        if ( latticeGeneration )
+        {
+            tester->activateLatticeGeneration( latticeDir ) ;
+            LogFile::puts( "lattice generation activated ..." ) ;
+        }
+    }
+
+    // Further decoders for parallel decoding.  They share the network;
+    // the models hold the scores of the current frame so each decoder has
+    // its own, and -flatModelsFName maps one copy of their parameters for
+    // all.  With -lockstep they are views of the one HTKFlatModelsStreams.
+    IModels **workerModels = new IModels*[nThreads] ;
+    FrontEnd **workerFrontends = new FrontEnd*[nThreads] ;
+    IDecoder **workerDecoders = new IDecoder*[nThreads] ;
+    if ( (nThreads > 1) && !lockstep && ((flatModelsFName == NULL) || (flatModelsFName[0] == '\0')) &&
+         (htkModelsFName != NULL) && (htkModelsFName[0] != '\0') )
+        LogFile::puts( "\nWARNING: without -flatModelsFName each thread loads its own copy of the models\n" ) ;
+    for ( int t=1 ; t<nThreads ; t++ )
+    {
+        LogFile::printf( "creating decoder for thread %d .... " , t ) ;
+        workerModels[t] = NULL ;
+#ifdef OPT_FLATMODEL
+        if ( lockstep )
+            workerModels[t] = streamModels->getStream( t ) ;
+        else
+#endif
+        setupModels( &workerModels[t] ) ;
+        workerFrontends[t] = createFrontEnd( workerModels[t] ) ;
+        workerDecoders[t] = createDecoder(
+            network , clNetwork , gNetwork , workerModels[t] ) ;
+        if ( server != NULL )
+            server->addDecoder( workerDecoders[t] ) ;
+        else
+            tester->addWorker( workerDecoders[t] , workerFrontends[t] ) ;
+        LogFile::puts( "done\n" ) ;
+    }
+    LogFile::puts( "done\n\njuicer initialisation complete\n\n" ) ;
+
+
+    // run the decoder
+    if ( server != NULL )
+        server->run( serverSocket ) ;
+    else
+        tester->run();
+
+    if (use2Threads)
+        ((HTKFlatModelsThreading*)models)->stop();
+
+    // cleanup and exit
+    delete tester ;
+    delete server ;
+    delete phoneLookup ;
+    for ( int t=1 ; t<nThreads ; t++ )
+    {
+        delete workerDecoders[t] ;
+        delete workerFrontends[t] ;
+        if ( !lockstep )
+            delete workerModels[t] ;
+    }
+    delete [] workerDecoders ;
+    delete [] workerFrontends ;
+    delete [] workerModels ;
+    delete decoder ;
+    delete network ;
+#ifdef OPT_FLATMODEL
+    if ( lockstep )
+        models = streamModels ;
+#endif
+    delete models ;
+    delete vocab ;
+
+    // Clean up for on-the-fly composition
+    delete clNetwork ;
+    delete gNetwork ;
+
+    LogFile::date( "juicer finished at" ) ;
+    LogFile::close() ;
+    return 0 ;
+}
+
+
+FrontEnd *createFrontEnd( IModels *models )
+{
     FrontEndFormat source;
     switch (inputFormat)
     {
@@ -570,9 +864,14 @@ int main( int argc , char *argv[] )
             HError( 9999 , "Juicer: HTKLibSource selected but no HTK config provided" );
     }
 #endif
+    return frontend;
+}
 
-    // create decoder
-    LogFile::puts( "creating Decoder .... " ) ;
+
+IDecoder *createDecoder(
+    WFSTNetwork *network , WFSTNetwork *clNetwork ,
+    WFSTSortedInLabelNetwork *gNetwork , IModels *models )
+{
     IDecoder *decoder = NULL ;
     if ( !onTheFlyComposition )  {
         if (!useBasicCore) {
@@ -580,10 +879,14 @@ int main( int argc , char *argv[] )
                 decoder = new WFSTDecoderLiteThreading(
                         network , models , phoneStartBeam, mainBeam , phoneEndBeam , wordEmitBeam ,
                         maxHyps);
-            else
-                decoder = new WFSTDecoderLite(
+            else {
+                WFSTDecoderLite *lite = new WFSTDecoderLite(
                         network , models , phoneStartBeam, mainBeam , phoneEndBeam , wordEmitBeam ,
                         maxHyps);
+                if ( propThreads > 1 )
+                    lite->setPropagationThreads( propThreads ) ;
+                decoder = lite ;
+            }
         } else
 
         decoder = new WFSTDecoder(
@@ -601,63 +904,7 @@ int main( int argc , char *argv[] )
         assert(0);
 #endif
     }
-    LogFile::puts( "done\n" ) ;
-
-    // setup phoneLookup
-    PhoneLookup *phoneLookup=NULL ;
-    if ( modelLevelOutput )
-    {
-        phoneLookup = new PhoneLookup(
-            monoListFName , silMonophone , pauseMonophone ,
-            tiedListFName , cdSepChars ) ;
-
-        // Add the model indices to the PhoneLookup
-        int i ;
-        for ( i=0 ; i<models->getNumHMMs() ; i++ )
-        {
-            const char* hmmName = models->getHMMName( i ) ;
-            phoneLookup->addModelInd( hmmName , i ) ;
-        }
-        phoneLookup->verifyAllModels() ;
-    }
-
-    // create batch tester
-    LogFile::puts( "creating DecoderBatchTest .... " ) ;
-    DecoderBatchTest *tester = new DecoderBatchTest(
-        vocab , phoneLookup , frontend , decoder , inputFName , inputFormat ,
-        models->getInputVecSize() , outputFName , outputFormat , refFName ,
-        removeSentMarks , framesPerSec ) ;
-    tester->loop = dbtLoop;
-
-    if ( latticeGeneration )
-    {
-        tester->activateLatticeGeneration( latticeDir ) ;
-        LogFile::puts( "lattice generation activated ..." ) ;
-    }
-    LogFile::puts( "done\n\njuicer initialisation complete\n\n" ) ;
-
-
-    // run the decoder
-    tester->run();
-
-    if (use2Threads)
-        ((HTKFlatModelsThreading*)models)->stop();
-
-    // cleanup and exit
-    delete tester ;
-    delete phoneLookup ;
-    delete decoder ;
-    delete network ;
-    delete models ;
-    delete vocab ;
-
-    // Clean up for on-the-fly composition
-    delete clNetwork ;
-    delete gNetwork ;
-
-    LogFile::date( "juicer finished at" ) ;
-    LogFile::close() ;
-    return 0 ;
+    return decoder ;
 }
 
 
@@ -671,7 +918,14 @@ void setupModels( IModels **models )
             error("juicer: setupModels - "
                   "htkModelsFName defined but inputFormat not htk") ;
 
+        LogSumType logSum = logSumFromName( logSum_s ) ;
+        if ( (int)logSum < 0 )
+            error("juicer: -logSum %s ... unrecognised log-sum-exp" , logSum_s ) ;
+
         // HTK MMF model input - i.e. a HMM/GMM system
+# ifdef OPT_FLATMODEL
+        HTKFlatModels *flatModels = NULL ;
+# endif
 #ifdef HAVE_HTKLIB
         if ( useHModels ) 
         {
@@ -696,6 +950,7 @@ void setupModels( IModels **models )
         {
             LogFile::printf( "Using HModels.\n");
             sHModels = new HModels(tiedListFName);
+            sHModels->setLogSum( logSum );
             xfInfo.usePaXForm = FALSE;
             xfInfo.useInXForm = FALSE;
             sHModels->xfInfo = &xfInfo;
@@ -760,12 +1015,43 @@ void setupModels( IModels **models )
         } else {
 #endif
 # ifdef OPT_FLATMODEL
-        if (use2Threads)
-            *models = new HTKFlatModelsThreading() ;
+        if ( gaussSelection )
+        {
+            if ( use2Threads )
+                error("juicer: -gaussSelection can not be used with -threading") ;
+            HTKGSModels *gsModels = new HTKGSModels() ;
+            if ( (gsFName != NULL) && (gsFName[0] != '\0') )
+                gsModels->setIndexFName( gsFName ) ;
+            else
+            {
+                char *indexFName = new char[strlen(htkModelsFName)+4] ;
+                sprintf( indexFName , "%s.gs" , htkModelsFName ) ;
+                gsModels->setIndexFName( indexFName ) ;
+                delete [] indexFName ;
+            }
+            flatModels = gsModels ;
+        }
+        else if (use2Threads)
+            flatModels = new HTKFlatModelsThreading() ;
+        else if (lockstep)
+            flatModels = new HTKFlatModelsStreams( nThreads ) ;
         else
-            *models = new HTKFlatModels() ;
+            flatModels = new HTKFlatModels() ;
+
+        GaussKernelType gmmKernel = gaussKernelFromName( gmmKernel_s ) ;
+        if ( (int)gmmKernel < 0 )
+            error("juicer: -gmmKernel %s ... unrecognised kernel" , gmmKernel_s ) ;
+        flatModels->setGaussKernel( gmmKernel ) ;
+        flatModels->setBatchOutput( batchGMM ) ;
+        flatModels->setQuantization( quantModels ) ;
+        flatModels->setDenseOutput( denseGMM ) ;
+        flatModels->setOutputBound( gmmBoundDims ) ;
+        flatModels->setLogSum( logSum ) ;
+        *models = flatModels ;
 # else
-        *models = new HTKModels() ;
+        HTKModels *htkModels = new HTKModels() ;
+        htkModels->setLogSum( logSum ) ;
+        *models = htkModels ;
 # endif
 
         (*models)->setBlockSize(blockSize);
@@ -774,6 +1060,30 @@ void setupModels( IModels **models )
         }
 #endif
 
+# ifdef OPT_FLATMODEL
+        // the flat models file is mapped rather than read, and written
+        // from the float parameters, before they are quantized
+        if ( (flatModels != NULL) && (flatModelsFName != NULL) && (flatModelsFName[0] != '\0') )
+        {
+            if ( fileExists( flatModelsFName ) )
+            {
+                LogFile::puts( "from pre-existing flat models file .... " ) ;
+                flatModels->readFlat( flatModelsFName ) ;
+            }
+            else
+            {
+                LogFile::puts( "from ascii HTK MMF file .... " ) ;
+                flatModels->setQuantization( 0 ) ;
+                flatModels->Load( htkModelsFName , false /*fixTeeModels*/ ) ;
+                LogFile::puts( "writing new flat models file .... " ) ;
+                flatModels->outputFlat( flatModelsFName ) ;
+                if ( quantModels )
+                    LogFile::puts( "models not quantized until the flat models file is read ....\n" ) ;
+            }
+            return ;
+        }
+# endif
+
 #ifdef USE_BINARY_MODELS
         char *modelsBinFName = new char[strlen(htkModelsFName)+5] ;
         sprintf( modelsBinFName , "%s.bin" , htkModelsFName ) ;
@@ -864,6 +1174,7 @@ void setupNetworks(WFSTNetwork** network_, WFSTNetwork** clNetwork_, WFSTSortedI
             LogFile::puts( "from pre-existing binary file .... " ) ;
             network = new WFSTNetwork( lmScaleFactor, insPenalty ) ;
             network->readBinary( netBinFName ) ;
+            compactNetwork( network ) ;
         }
         else
         {
@@ -875,6 +1186,7 @@ void setupNetworks(WFSTNetwork** network_, WFSTNetwork** clNetwork_, WFSTSortedI
                 lmScaleFactor , insPenalty,
                 REMOVEBOTH
             ) ;
+            compactNetwork( network ) ;
 #ifdef USE_BINARY_WFST
             if ( writeBinaryFiles )
             {
@@ -892,6 +1204,13 @@ void setupNetworks(WFSTNetwork** network_, WFSTNetwork** clNetwork_, WFSTSortedI
         LogFile::printf( "nStates=%d nTrans=%d ... done\n" ,
                          network->getNumStates() , network->getNumTransitions() ) ;
 
+        if ( epsClosureArcs > 0 )
+        {
+            LogFile::puts( "building epsilon closures .... " ) ;
+            int nClosures = network->buildEpsClosures( epsClosureArcs ) ;
+            LogFile::printf( "nClosures=%d ... done\n" , nClosures ) ;
+        }
+
         if ( genTestSeqs )
         {
             network->generateSequences( 10 ) ;
@@ -982,6 +1301,12 @@ void setupNetworks(WFSTNetwork** network_, WFSTNetwork** clNetwork_, WFSTSortedI
         LogFile::printf(
             "Max number of transitions from a state in G = %d\n",
             gNetwork->getMaxOutTransitions() ) ;
+        if ( gLabelIndexArcs > 0 )
+        {
+            LogFile::printf(
+                "G states with a label index = %d\n",
+                gNetwork->buildLabelIndex( gLabelIndexArcs ) ) ;
+        }
         LogFile::printf(
             "C o L: nStates=%d nTrans=%d ... done\n" ,
             clNetwork->getNumStates() , clNetwork->getNumTransitions()
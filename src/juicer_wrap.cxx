@@ -5670,34 +5670,6 @@ SWIGEXPORT jint JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_WFSTTransiti
 }
 
 
-SWIGEXPORT void JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_WFSTTransition_1hook_1set(JNIEnv *jenv, jclass jcls, jlong jarg1, jobject jarg1_, jlong jarg2) {
-  Juicer::WFSTTransition *arg1 = (Juicer::WFSTTransition *) 0 ;
-  void *arg2 = (void *) 0 ;
-
-  (void)jenv;
-  (void)jcls;
-  (void)jarg1_;
-  arg1 = *(Juicer::WFSTTransition **)&jarg1;
-  arg2 = *(void **)&jarg2;
-  if (arg1) (arg1)->hook = arg2;
-}
-
-
-SWIGEXPORT jlong JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_WFSTTransition_1hook_1get(JNIEnv *jenv, jclass jcls, jlong jarg1, jobject jarg1_) {
-  jlong jresult = 0 ;
-  Juicer::WFSTTransition *arg1 = (Juicer::WFSTTransition *) 0 ;
-  void *result = 0 ;
-
-  (void)jenv;
-  (void)jcls;
-  (void)jarg1_;
-  arg1 = *(Juicer::WFSTTransition **)&jarg1;
-  result = (void *) ((arg1)->hook);
-  *(void **)&jresult = result;
-  printf(".%d.", result); return jresult;
-}
-
-
 SWIGEXPORT jlong JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_new_1WFSTTransition(JNIEnv *jenv, jclass jcls) {
   jlong jresult = 0 ;
   Juicer::WFSTTransition *result = 0 ;
@@ -5720,30 +5692,30 @@ SWIGEXPORT void JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_delete_1WFST
 }
 
 
-SWIGEXPORT void JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_WFSTState_1trans_1set(JNIEnv *jenv, jclass jcls, jlong jarg1, jobject jarg1_, jlong jarg2) {
+SWIGEXPORT void JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_WFSTState_1trans_1set(JNIEnv *jenv, jclass jcls, jlong jarg1, jobject jarg1_, jint jarg2) {
   Juicer::WFSTState *arg1 = (Juicer::WFSTState *) 0 ;
-  int *arg2 = (int *) 0 ;
+  int arg2 ;
 
   (void)jenv;
   (void)jcls;
   (void)jarg1_;
   arg1 = *(Juicer::WFSTState **)&jarg1;
-  arg2 = *(int **)&jarg2;
+  arg2 = (int)jarg2;
   if (arg1) (arg1)->trans = arg2;
 }
 
 
-SWIGEXPORT jlong JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_WFSTState_1trans_1get(JNIEnv *jenv, jclass jcls, jlong jarg1, jobject jarg1_) {
-  jlong jresult = 0 ;
+SWIGEXPORT jint JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_WFSTState_1trans_1get(JNIEnv *jenv, jclass jcls, jlong jarg1, jobject jarg1_) {
+  jint jresult = 0 ;
   Juicer::WFSTState *arg1 = (Juicer::WFSTState *) 0 ;
-  int *result = 0 ;
+  int result;
 
   (void)jenv;
   (void)jcls;
   (void)jarg1_;
   arg1 = *(Juicer::WFSTState **)&jarg1;
-  result = (int *) ((arg1)->trans);
-  *(int **)&jresult = result;
+  result = (int) ((arg1)->trans);
+  jresult = (jint)result;
   printf(".%d.", result); return jresult;
 }
 
@@ -6532,12 +6504,12 @@ SWIGEXPORT jfloat JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_WFSTNetwor
 }
 
 
-SWIGEXPORT jlong JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_WFSTNetwork_1getTransitions_1_1SWIG_12(JNIEnv *jenv, jclass jcls, jlong jarg1, jobject jarg1_, jlong jarg2, jobject jarg2_, jlong jarg3) {
-  jlong jresult = 0 ;
+SWIGEXPORT jint JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_WFSTNetwork_1getFirstTransition(JNIEnv *jenv, jclass jcls, jlong jarg1, jobject jarg1_, jlong jarg2, jobject jarg2_, jlong jarg3) {
+  jint jresult = 0 ;
   Juicer::WFSTNetwork *arg1 = (Juicer::WFSTNetwork *) 0 ;
   Juicer::WFSTTransition *arg2 = (Juicer::WFSTTransition *) 0 ;
   int *arg3 = (int *) 0 ;
-  int *result = 0 ;
+  int result;
 
   (void)jenv;
   (void)jcls;
@@ -6546,8 +6518,8 @@ SWIGEXPORT jlong JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_WFSTNetwork
   arg1 = *(Juicer::WFSTNetwork **)&jarg1;
   arg2 = *(Juicer::WFSTTransition **)&jarg2;
   arg3 = *(int **)&jarg3;
-  result = (int *)(arg1)->getTransitions((Juicer::WFSTTransition const *)arg2,arg3);
-  *(int **)&jresult = result;
+  result = (int)((Juicer::WFSTNetwork const *)arg1)->getFirstTransition((Juicer::WFSTTransition const *)arg2,arg3);
+  jresult = (jint)result;
   printf(".%d.", result); return jresult;
 }
 
@@ -6873,17 +6845,6 @@ SWIGEXPORT jint JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_WFSTNetwork_
 }
 
 
-SWIGEXPORT void JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_WFSTNetwork_1resetTransitionHooks(JNIEnv *jenv, jclass jcls, jlong jarg1, jobject jarg1_) {
-  Juicer::WFSTNetwork *arg1 = (Juicer::WFSTNetwork *) 0 ;
-
-  (void)jenv;
-  (void)jcls;
-  (void)jarg1_;
-  arg1 = *(Juicer::WFSTNetwork **)&jarg1;
-  (arg1)->resetTransitionHooks();
-}
-
-
 SWIGEXPORT jlong JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_new_1WFSTLabelPushingNetwork_1_1SWIG_10(JNIEnv *jenv, jclass jcls) {
   jlong jresult = 0 ;
   Juicer::WFSTLabelPushingNetwork *result = 0 ;
@@ -12833,36 +12794,35 @@ SWIGEXPORT void JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_delete_1Toke
 }
 
 
-SWIGEXPORT void JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_NetInst_1next_1set(JNIEnv *jenv, jclass jcls, jlong jarg1, jobject jarg1_, jlong jarg2, jobject jarg2_) {
+SWIGEXPORT void JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_NetInst_1hmmIndex_1set(JNIEnv *jenv, jclass jcls, jlong jarg1, jobject jarg1_, jint jarg2) {
   Juicer::NetInst *arg1 = (Juicer::NetInst *) 0 ;
-  Juicer::NetInst_ *arg2 = (Juicer::NetInst_ *) 0 ;
+  int arg2 ;
 
   (void)jenv;
   (void)jcls;
   (void)jarg1_;
-  (void)jarg2_;
   arg1 = *(Juicer::NetInst **)&jarg1;
-  arg2 = *(Juicer::NetInst_ **)&jarg2;
-  if (arg1) (arg1)->next = arg2;
+  arg2 = (int)jarg2;
+  if (arg1) (arg1)->hmmIndex = arg2;
 }
 
 
-SWIGEXPORT jlong JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_NetInst_1next_1get(JNIEnv *jenv, jclass jcls, jlong jarg1, jobject jarg1_) {
-  jlong jresult = 0 ;
+SWIGEXPORT jint JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_NetInst_1hmmIndex_1get(JNIEnv *jenv, jclass jcls, jlong jarg1, jobject jarg1_) {
+  jint jresult = 0 ;
   Juicer::NetInst *arg1 = (Juicer::NetInst *) 0 ;
-  Juicer::NetInst_ *result = 0 ;
+  int result;
 
   (void)jenv;
   (void)jcls;
   (void)jarg1_;
   arg1 = *(Juicer::NetInst **)&jarg1;
-  result = (Juicer::NetInst_ *) ((arg1)->next);
-  *(Juicer::NetInst_ **)&jresult = result;
+  result = (int) ((arg1)->hmmIndex);
+  jresult = (jint)result;
   printf(".%d.", result); return jresult;
 }
 
 
-SWIGEXPORT void JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_NetInst_1hmmIndex_1set(JNIEnv *jenv, jclass jcls, jlong jarg1, jobject jarg1_, jint jarg2) {
+SWIGEXPORT void JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_NetInst_1nStates_1set(JNIEnv *jenv, jclass jcls, jlong jarg1, jobject jarg1_, jint jarg2) {
   Juicer::NetInst *arg1 = (Juicer::NetInst *) 0 ;
   int arg2 ;
 
@@ -12871,11 +12831,11 @@ SWIGEXPORT void JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_NetInst_1hmm
   (void)jarg1_;
   arg1 = *(Juicer::NetInst **)&jarg1;
   arg2 = (int)jarg2;
-  if (arg1) (arg1)->hmmIndex = arg2;
+  if (arg1) (arg1)->nStates = arg2;
 }
 
 
-SWIGEXPORT jint JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_NetInst_1hmmIndex_1get(JNIEnv *jenv, jclass jcls, jlong jarg1, jobject jarg1_) {
+SWIGEXPORT jint JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_NetInst_1nStates_1get(JNIEnv *jenv, jclass jcls, jlong jarg1, jobject jarg1_) {
   jint jresult = 0 ;
   Juicer::NetInst *arg1 = (Juicer::NetInst *) 0 ;
   int result;
@@ -12884,13 +12844,13 @@ SWIGEXPORT jint JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_NetInst_1hmm
   (void)jcls;
   (void)jarg1_;
   arg1 = *(Juicer::NetInst **)&jarg1;
-  result = (int) ((arg1)->hmmIndex);
+  result = (int) ((arg1)->nStates);
   jresult = (jint)result;
   printf(".%d.", result); return jresult;
 }
 
 
-SWIGEXPORT void JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_NetInst_1nStates_1set(JNIEnv *jenv, jclass jcls, jlong jarg1, jobject jarg1_, jint jarg2) {
+SWIGEXPORT void JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_NetInst_1nActiveHyps_1set(JNIEnv *jenv, jclass jcls, jlong jarg1, jobject jarg1_, jint jarg2) {
   Juicer::NetInst *arg1 = (Juicer::NetInst *) 0 ;
   int arg2 ;
 
@@ -12899,11 +12859,11 @@ SWIGEXPORT void JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_NetInst_1nSt
   (void)jarg1_;
   arg1 = *(Juicer::NetInst **)&jarg1;
   arg2 = (int)jarg2;
-  if (arg1) (arg1)->nStates = arg2;
+  if (arg1) (arg1)->nActiveHyps = arg2;
 }
 
 
-SWIGEXPORT jint JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_NetInst_1nStates_1get(JNIEnv *jenv, jclass jcls, jlong jarg1, jobject jarg1_) {
+SWIGEXPORT jint JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_NetInst_1nActiveHyps_1get(JNIEnv *jenv, jclass jcls, jlong jarg1, jobject jarg1_) {
   jint jresult = 0 ;
   Juicer::NetInst *arg1 = (Juicer::NetInst *) 0 ;
   int result;
@@ -12912,13 +12872,13 @@ SWIGEXPORT jint JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_NetInst_1nSt
   (void)jcls;
   (void)jarg1_;
   arg1 = *(Juicer::NetInst **)&jarg1;
-  result = (int) ((arg1)->nStates);
+  result = (int) ((arg1)->nActiveHyps);
   jresult = (jint)result;
   printf(".%d.", result); return jresult;
 }
 
 
-SWIGEXPORT void JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_NetInst_1nActiveHyps_1set(JNIEnv *jenv, jclass jcls, jlong jarg1, jobject jarg1_, jint jarg2) {
+SWIGEXPORT void JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_NetInst_1tokens_1set(JNIEnv *jenv, jclass jcls, jlong jarg1, jobject jarg1_, jint jarg2) {
   Juicer::NetInst *arg1 = (Juicer::NetInst *) 0 ;
   int arg2 ;
 
@@ -12927,11 +12887,11 @@ SWIGEXPORT void JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_NetInst_1nAc
   (void)jarg1_;
   arg1 = *(Juicer::NetInst **)&jarg1;
   arg2 = (int)jarg2;
-  if (arg1) (arg1)->nActiveHyps = arg2;
+  if (arg1) (arg1)->tokens = arg2;
 }
 
 
-SWIGEXPORT jint JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_NetInst_1nActiveHyps_1get(JNIEnv *jenv, jclass jcls, jlong jarg1, jobject jarg1_) {
+SWIGEXPORT jint JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_NetInst_1tokens_1get(JNIEnv *jenv, jclass jcls, jlong jarg1, jobject jarg1_) {
   jint jresult = 0 ;
   Juicer::NetInst *arg1 = (Juicer::NetInst *) 0 ;
   int result;
@@ -12940,7 +12900,7 @@ SWIGEXPORT jint JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_NetInst_1nAc
   (void)jcls;
   (void)jarg1_;
   arg1 = *(Juicer::NetInst **)&jarg1;
-  result = (int) ((arg1)->nActiveHyps);
+  result = (int) ((arg1)->tokens);
   jresult = (jint)result;
   printf(".%d.", result); return jresult;
 }
@@ -12956,7 +12916,7 @@ SWIGEXPORT void JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_NetInst_1tra
   (void)jarg2_;
   arg1 = *(Juicer::NetInst **)&jarg1;
   arg2 = *(Juicer::WFSTTransition **)&jarg2;
-  if (arg1) (arg1)->trans = arg2;
+  if (arg1) (arg1)->trans = *arg2;
 }
 
 
@@ -12969,7 +12929,7 @@ SWIGEXPORT jlong JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_NetInst_1tr
   (void)jcls;
   (void)jarg1_;
   arg1 = *(Juicer::NetInst **)&jarg1;
-  result = (Juicer::WFSTTransition *) ((arg1)->trans);
+  result = (Juicer::WFSTTransition *)& ((arg1)->trans);
   *(Juicer::WFSTTransition **)&jresult = result;
   printf(".%d.", result); return jresult;
 }
@@ -13003,21 +12963,6 @@ SWIGEXPORT jfloat JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_NetInst_1t
 }
 
 
-SWIGEXPORT jlong JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_NetInst_1states_1get(JNIEnv *jenv, jclass jcls, jlong jarg1, jobject jarg1_) {
-  jlong jresult = 0 ;
-  Juicer::NetInst *arg1 = (Juicer::NetInst *) 0 ;
-  Juicer::Token *result = 0 ;
-
-  (void)jenv;
-  (void)jcls;
-  (void)jarg1_;
-  arg1 = *(Juicer::NetInst **)&jarg1;
-  result = (Juicer::Token *)(Juicer::Token *) ((arg1)->states);
-  *(Juicer::Token **)&jresult = result;
-  printf(".%d.", result); return jresult;
-}
-
-
 SWIGEXPORT jlong JNICALL Java_ch_idiap_producers_Projuicer_juicerJNI_new_1NetInst(JNIEnv *jenv, jclass jcls) {
   jlong jresult = 0 ;
   Juicer::NetInst *result = 0 ;
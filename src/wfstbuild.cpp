@@ -0,0 +1,198 @@
+/*
+ * Copyright 2009 by Idiap Research Institute
+ *                   http://www.idiap.ch
+ *
+ * See the file COPYING for the licence associated with this software.
+ */
+
+#include <string>
+#include <vector>
+
+#include "general.h"
+#include "CmdLine.h"
+#include "LogFile.h"
+#include "WFSTNetwork.h"
+#include "WFSTBuilder.h"
+
+/*
+ * wfstbuild - build the final.fsm decoding network from the grammar,
+ * lexicon and CD phone FSMs of gramgen, lexgen and cdgen, as
+ * bin/build-wfst-openfst does, but without the OpenFst tools.  The symbol
+ * files are found from the FSM names as for the script: grammar.fsm comes
+ * with grammar.insyms and grammar.outsyms.
+ *
+ * final.fsm, final.insyms and final.outsyms are written to -outDir.  With
+ * -outBinFName the binary network that juicer -inputFormat bin reads is
+ * written instead, straight from the built transducer, and final.fsm only
+ * if -textFSM is also given.
+ *
+ * The network is not the same as the OpenFst one (see WFSTBuildFSM), but
+ * it should stand for the same relation.  wfstbuildcheck checks that
+ * against the plain composition of the inputs, and bin/wfstbuild-compare
+ * compares the scores with those of the OpenFst build.
+ */
+
+using namespace Juicer ;
+using namespace Torch ;
+
+char           *gramFSMFName=NULL ;
+char           *lexFSMFName=NULL ;
+char           *cdFSMFName=NULL ;
+char           *outDir=NULL ;
+bool           optFinal=false ;
+int            maxDetStates=0 ;
+
+char           *outBinFName=NULL ;
+bool           textFSM=false ;
+real           lmScaleFactor=0.0 ;
+real           insPenalty=0.0 ;
+
+char           *logFName=NULL ;
+
+
+void processCmdLine( CmdLine *cmd , int argc , char *argv[] )
+{
+	cmd->addText("\nInput Options:") ;
+	cmd->addSCmdOption( "-gramFSM" , &gramFSMFName , "" ,
+			"the grammar FSM filename" ) ;
+	cmd->addSCmdOption( "-lexFSM" , &lexFSMFName , "" ,
+			"the lexicon FSM filename" ) ;
+	cmd->addSCmdOption( "-cdFSM" , &cdFSMFName , "" ,
+			"the CD phone FSM filename" ) ;
+
+	cmd->addText("\nBuild Options:") ;
+	cmd->addBCmdOption( "-optFinal" , &optFinal , false ,
+			"optimise the final transducer (build-wfst -of)" ) ;
+	cmd->addICmdOption( "-maxDetStates" , &maxDetStates , 0 ,
+			"give up determinizing after this many states (0 for no limit)" ) ;
+
+	cmd->addText("\nOutput Options:") ;
+	cmd->addSCmdOption( "-outDir" , &outDir , "" ,
+			"the directory of final.fsm (default that of the grammar)" ) ;
+	cmd->addSCmdOption( "-outBinFName" , &outBinFName , "" ,
+			"write the network in binary format instead of final.fsm" ) ;
+	cmd->addBCmdOption( "-textFSM" , &textFSM , false ,
+			"write final.fsm as well with -outBinFName" ) ;
+	cmd->addRCmdOption( "-lmScaleFactor" , &lmScaleFactor , 1.0 ,
+			"the juicer -lmScaleFactor, applied to the binary network" ) ;
+	cmd->addRCmdOption( "-insPenalty" , &insPenalty , 0.0 ,
+			"the juicer -insPenalty, applied to the binary network" ) ;
+	cmd->addSCmdOption( "-logFName" , &logFName , "stdout" ,
+			"the name of the log file" ) ;
+
+	cmd->read( argc , argv ) ;
+
+	if ( strcmp( gramFSMFName , "" ) == 0 )
+		error("wfstbuild: gramFSM undefined") ;
+	if ( strcmp( lexFSMFName , "" ) == 0 )
+		error("wfstbuild: lexFSM undefined") ;
+	if ( strcmp( cdFSMFName , "" ) == 0 )
+		error("wfstbuild: cdFSM undefined") ;
+}
+
+
+// foo.fsm -> foo.ext
+string symsFName( const char *fsmFName , const char *ext )
+{
+   string name( fsmFName ) ;
+   if ( (name.size() > 4) && (name.compare( name.size()-4 , 4 , ".fsm" ) == 0) )
+      name.erase( name.size()-4 ) ;
+   return name + "." + ext ;
+}
+
+
+void copyFile( const char *fromFName , const char *toFName )
+{
+   FILE *from , *to ;
+   if ( (from = fopen( fromFName , "rb" )) == NULL )
+      error("wfstbuild: error opening %s" , fromFName ) ;
+   if ( (to = fopen( toFName , "wb" )) == NULL )
+      error("wfstbuild: error opening %s" , toFName ) ;
+
+   char buf[4096] ;
+   size_t n ;
+   while ( (n = fread( buf , 1 , sizeof(buf) , from )) > 0 )
+   {
+      if ( fwrite( buf , 1 , n , to ) != n )
+         error("wfstbuild: error writing %s" , toFName ) ;
+   }
+   fclose( from ) ;
+   fclose( to ) ;
+}
+
+
+// The auxiliary symbols (#...) of a symbols file, as aux2eps.pl
+void readAuxLabels( const char *symsFName , vector<bool> *isAux )
+{
+   FILE *fd ;
+   if ( (fd = fopen( symsFName , "r" )) == NULL )
+      error("wfstbuild: error opening %s" , symsFName ) ;
+
+   char line[1000] , label[1000] ;
+   int index ;
+   while ( fgets( line , 1000 , fd ) != NULL )
+   {
+      if ( (sscanf( line , "%s %d" , label , &index ) != 2) || (index < 0) )
+         continue ;
+      if ( index >= (int)isAux->size() )
+         isAux->resize( index+1 , false ) ;
+      (*isAux)[index] = (label[0] == '#') ;
+   }
+   fclose( fd ) ;
+}
+
+
+int main( int argc , char *argv[] )
+{
+   CmdLine cmd ;
+
+   processCmdLine( &cmd , argc , argv ) ;
+   LogFile::open( logFName ) ;
+
+   string dir( outDir ) ;
+   if ( dir.empty() )
+   {
+      dir = gramFSMFName ;
+      size_t slash = dir.rfind( '/' ) ;
+      dir = (slash == string::npos) ? "." : dir.substr( 0 , slash ) ;
+   }
+   string finalFSMFName = dir + "/final.fsm" ;
+   string finalInSymsFName = dir + "/final.insyms" ;
+   string finalOutSymsFName = dir + "/final.outsyms" ;
+
+   vector<bool> lexAux ;
+   readAuxLabels( symsFName( lexFSMFName , "insyms" ).c_str() , &lexAux ) ;
+
+   WFSTBuildFSM gram , lex , cd , clg ;
+   gram.readFSM( gramFSMFName ) ;
+   lex.readFSM( lexFSMFName ) ;
+   cd.readFSM( cdFSMFName ) ;
+
+   WFSTBuilder builder( lexAux , optFinal , maxDetStates ) ;
+   builder.build( &gram , &lex , &cd , &clg ) ;
+   LogFile::printf( "%s: nStates=%d nArcs=%d\n" , finalFSMFName.c_str() ,
+                    clg.getNumStates() , clg.getNumArcs() ) ;
+
+   string inSymsFName = symsFName( cdFSMFName , "insyms" ) ;
+   string outSymsFName = symsFName( gramFSMFName , "outsyms" ) ;
+   bool binary = ( strcmp( outBinFName , "" ) != 0 ) ;
+   if ( !binary || textFSM )
+   {
+      clg.writeFSM( finalFSMFName.c_str() ) ;
+      copyFile( inSymsFName.c_str() , finalInSymsFName.c_str() ) ;
+      copyFile( outSymsFName.c_str() , finalOutSymsFName.c_str() ) ;
+   }
+
+   if ( binary )
+   {
+      // As juicer would load final.fsm
+      WFSTNetwork *net = new WFSTNetwork(
+         &clg , inSymsFName.c_str() , outSymsFName.c_str() ,
+         lmScaleFactor , insPenalty , REMOVEBOTH ) ;
+      net->writeBinary( outBinFName ) ;
+      delete net ;
+   }
+
+   LogFile::close() ;
+   return 0 ;
+}
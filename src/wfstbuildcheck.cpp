@@ -0,0 +1,437 @@
+/*
+ * Copyright 2009 by Idiap Research Institute
+ *                   http://www.idiap.ch
+ *
+ * See the file COPYING for the licence associated with this software.
+ */
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <math.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "general.h"
+#include "CmdLine.h"
+#include "LogFile.h"
+#include "WFSTBuilder.h"
+
+/*
+ * wfstbuildcheck - check the transducer operations of WFSTBuildFSM and
+ * WFSTBuilder by brute force.  A transducer is enumerated path by path into
+ * the relation it stands for, each pair of input and output label
+ * sequences with the log semiring sum of the costs of its paths.
+ * Operations that should not change the relation are checked by comparing
+ * the relations before and after.
+ *
+ * Without -gramFSM, -nTrials small random acyclic transducers go through
+ * compose, determinize, pushWeights, minimize, invert, connect and
+ * writeFSM/readFSM.  Composition is checked against the composition of
+ * the relations.
+ *
+ * With -gramFSM, -lexFSM and -cdFSM, the network that wfstbuild would
+ * build is checked against the plain composition C o (L* o G), without
+ * determinization, minimization or pushing.  Real networks have cycles,
+ * so only the pairs of at most -maxInLabels input and -maxOutLabels output
+ * labels are compared; all of their paths are enumerated, as long as no
+ * cycle has only epsilons.
+ */
+
+using namespace Juicer ;
+using namespace Torch ;
+
+typedef pair< vector<int> , vector<int> > LabelSeqs ;
+typedef map< LabelSeqs , double > Relation ;
+
+// Network options
+char           *gramFSMFName=NULL ;
+char           *lexFSMFName=NULL ;
+char           *cdFSMFName=NULL ;
+bool           optFinal=false ;
+int            maxInLabels=0 ;
+int            maxOutLabels=0 ;
+
+// Random trial options
+int            nTrials=0 ;
+int            seed=0 ;
+
+real           tolerance=0.0 ;
+char           *logFName=NULL ;
+
+
+void processCmdLine( CmdLine *cmd , int argc , char *argv[] )
+{
+	cmd->addText("\nNetwork Options:") ;
+	cmd->addSCmdOption( "-gramFSM" , &gramFSMFName , "" ,
+			"the grammar FSM filename" ) ;
+	cmd->addSCmdOption( "-lexFSM" , &lexFSMFName , "" ,
+			"the lexicon FSM filename" ) ;
+	cmd->addSCmdOption( "-cdFSM" , &cdFSMFName , "" ,
+			"the CD phone FSM filename" ) ;
+	cmd->addBCmdOption( "-optFinal" , &optFinal , false ,
+			"optimise the final transducer (wfstbuild -optFinal)" ) ;
+	cmd->addICmdOption( "-maxInLabels" , &maxInLabels , 12 ,
+			"the longest input label sequence compared" ) ;
+	cmd->addICmdOption( "-maxOutLabels" , &maxOutLabels , 3 ,
+			"the longest output label sequence compared" ) ;
+
+	cmd->addText("\nRandom Trial Options:") ;
+	cmd->addICmdOption( "-nTrials" , &nTrials , 300 ,
+			"number of random transducers without -gramFSM" ) ;
+	cmd->addICmdOption( "-seed" , &seed , 1 ,
+			"random seed of the first trial" ) ;
+
+	cmd->addText("\nGeneral Options:") ;
+	cmd->addRCmdOption( "-tolerance" , &tolerance , 1e-3 ,
+			"the largest difference of costs taken as equal" ) ;
+	cmd->addSCmdOption( "-logFName" , &logFName , "stdout" ,
+			"the name of the log file" ) ;
+
+	cmd->read( argc , argv ) ;
+
+	if ( (strcmp( gramFSMFName , "" ) != 0) &&
+	     ((strcmp( lexFSMFName , "" ) == 0) || (strcmp( cdFSMFName , "" ) == 0)) )
+		error("wfstbuildcheck: lexFSM and cdFSM must be defined with gramFSM") ;
+	if ( (maxInLabels < 0) || (maxOutLabels < 0) )
+		error("wfstbuildcheck: maxInLabels and maxOutLabels must be >= 0") ;
+}
+
+
+// Adds the pairs of the paths from state that keep within the label
+// limits.  depth only guards against cycles of epsilons.
+void enumeratePaths(
+      const WFSTBuildFSM *fsm , int state , double cost ,
+      vector<int> *in , vector<int> *out , int depth , Relation *rel )
+{
+   if ( depth > 4 * (maxInLabels + maxOutLabels) + 100 )
+      error("wfstbuildcheck: path too long, is there a cycle of epsilons?") ;
+
+   if ( fsm->isFinal( state ) )
+   {
+      LabelSeqs seqs( *in , *out ) ;
+      double total = cost + fsm->getFinalWeight( state ) ;
+      Relation::iterator r = rel->find( seqs ) ;
+      if ( r == rel->end() )
+         (*rel)[seqs] = total ;
+      else
+         r->second = WFSTBuildFSM::plus( r->second , total ) ;
+   }
+
+   const vector<WFSTBuildFSM::Arc> &arcs = fsm->getArcs( state ) ;
+   for ( unsigned i=0 ; i<arcs.size() ; i++ )
+   {
+      const WFSTBuildFSM::Arc &arc = arcs[i] ;
+      if ( (arc.in != 0) && ((int)in->size() == maxInLabels) )
+         continue ;
+      if ( (arc.out != 0) && ((int)out->size() == maxOutLabels) )
+         continue ;
+
+      if ( arc.in != 0 )
+         in->push_back( arc.in ) ;
+      if ( arc.out != 0 )
+         out->push_back( arc.out ) ;
+      enumeratePaths( fsm , arc.to , cost + arc.weight , in , out , depth+1 , rel ) ;
+      if ( arc.in != 0 )
+         in->pop_back() ;
+      if ( arc.out != 0 )
+         out->pop_back() ;
+   }
+}
+
+
+void getRelation( const WFSTBuildFSM *fsm , Relation *rel )
+{
+   rel->clear() ;
+   if ( fsm->getInitState() < 0 )
+      return ;
+   vector<int> in , out ;
+   enumeratePaths( fsm , fsm->getInitState() , 0.0 , &in , &out , 0 , rel ) ;
+}
+
+
+// The pairs of a o b from the pairs of a and b
+void composeRelations( const Relation &a , const Relation &b , Relation *c )
+{
+   c->clear() ;
+   for ( Relation::const_iterator i=a.begin() ; i!=a.end() ; ++i )
+   {
+      for ( Relation::const_iterator j=b.begin() ; j!=b.end() ; ++j )
+      {
+         if ( i->first.second != j->first.first )
+            continue ;
+         LabelSeqs seqs( i->first.first , j->first.second ) ;
+         double cost = i->second + j->second ;
+         Relation::iterator r = c->find( seqs ) ;
+         if ( r == c->end() )
+            (*c)[seqs] = cost ;
+         else
+            r->second = WFSTBuildFSM::plus( r->second , cost ) ;
+      }
+   }
+}
+
+
+// Returns the number of pairs that are in one relation only or whose costs
+// differ, and logs the first few
+int compareRelations( const Relation &a , const Relation &b , const char *what )
+{
+   int nDiffs = 0 ;
+   for ( Relation::const_iterator i=a.begin() ; i!=a.end() ; ++i )
+   {
+      Relation::const_iterator j = b.find( i->first ) ;
+      if ( (j != b.end()) && (fabs( j->second - i->second ) <= tolerance) )
+         continue ;
+      if ( nDiffs++ < 5 )
+      {
+         LogFile::printf( "%s: pair of %d:%d labels costs %f before, %f after\n" ,
+                          what , (int)i->first.first.size() , (int)i->first.second.size() ,
+                          i->second , (j == b.end()) ? WFSTBuildFSM::WFST_BUILD_ZERO : j->second ) ;
+      }
+   }
+   for ( Relation::const_iterator j=b.begin() ; j!=b.end() ; ++j )
+   {
+      if ( a.find( j->first ) != a.end() )
+         continue ;
+      if ( nDiffs++ < 5 )
+      {
+         LogFile::printf( "%s: pair of %d:%d labels not there before\n" ,
+                          what , (int)j->first.first.size() , (int)j->first.second.size() ) ;
+      }
+   }
+   if ( nDiffs > 0 )
+      LogFile::printf( "%s: %d pairs differ out of %d and %d\n" ,
+                       what , nDiffs , (int)a.size() , (int)b.size() ) ;
+   return nDiffs ;
+}
+
+
+bool isDeterministic( const WFSTBuildFSM *fsm )
+{
+   for ( int s=0 ; s<fsm->getNumStates() ; s++ )
+   {
+      set<int> labels ;
+      const vector<WFSTBuildFSM::Arc> &arcs = fsm->getArcs( s ) ;
+      for ( unsigned i=0 ; i<arcs.size() ; i++ )
+      {
+         if ( ! labels.insert( arcs[i].in ).second )
+            return false ;
+      }
+   }
+   return true ;
+}
+
+
+// An acyclic transducer of nStates states, state 0 initial, labels 1 to
+// nLabels.  If functional, each input label has one output label, or
+// epsilon, so that it can be determinized.
+void randomFSM( int nStates , int nArcs , int nLabels , bool functional ,
+                bool inputEpsilons , WFSTBuildFSM *fsm )
+{
+   for ( int s=0 ; s<nStates ; s++ )
+      fsm->addState() ;
+   fsm->setInitState( 0 ) ;
+   for ( int k=0 ; k<nArcs ; k++ )
+   {
+      int from = rand() % (nStates-1) ;
+      int to = from + 1 + rand() % (nStates-1-from) ;
+      int in = rand() % (nLabels+1) ;
+      if ( (in == 0) && !inputEpsilons )
+         in = 1 ;
+      int out ;
+      if ( functional )
+         out = (in % 3 == 0) ? 0 : in ;
+      else
+         out = rand() % (nLabels+1) ;
+      fsm->addArc( from , to , in , out , (rand() % 100) / 20.0 ) ;
+   }
+   fsm->setFinal( nStates-1 , (rand() % 10) / 10.0 ) ;
+   if ( rand() % 2 )
+      fsm->setFinal( nStates/2 , 0.5 ) ;
+}
+
+
+int checkTrial( int trial )
+{
+   int nDiffs = 0 ;
+   srand( seed + trial ) ;
+
+   WFSTBuildFSM a , b , ab ;
+   Relation relA , relB , relAB , rel ;
+   randomFSM( 6 , 10 , 3 , false , true , &a ) ;
+   randomFSM( 6 , 10 , 3 , false , true , &b ) ;
+   WFSTBuildFSM::compose( &a , &b , &ab ) ;
+   getRelation( &a , &relA ) ;
+   getRelation( &b , &relB ) ;
+   composeRelations( relA , relB , &relAB ) ;
+   getRelation( &ab , &rel ) ;
+   nDiffs += compareRelations( relAB , rel , "compose" ) ;
+
+   WFSTBuildFSM fsm ;
+   Relation relFSM ;
+   randomFSM( 7 , 14 , 3 , true , (trial % 2) == 1 , &fsm ) ;
+   getRelation( &fsm , &relFSM ) ;
+
+   WFSTBuildFSM det( fsm ) ;
+   det.determinize() ;
+   getRelation( &det , &rel ) ;
+   nDiffs += compareRelations( relFSM , rel , "determinize" ) ;
+   if ( ! isDeterministic( &det ) )
+   {
+      LogFile::printf( "determinize: not deterministic\n" ) ;
+      nDiffs++ ;
+   }
+
+   WFSTBuildFSM pushed( det ) ;
+   pushed.pushWeights() ;
+   getRelation( &pushed , &rel ) ;
+   nDiffs += compareRelations( relFSM , rel , "pushWeights" ) ;
+
+   WFSTBuildFSM min( det ) ;
+   min.minimize() ;
+   getRelation( &min , &rel ) ;
+   nDiffs += compareRelations( relFSM , rel , "minimize" ) ;
+   if ( min.getNumStates() > det.getNumStates() )
+   {
+      LogFile::printf( "minimize: %d states from %d\n" ,
+                       min.getNumStates() , det.getNumStates() ) ;
+      nDiffs++ ;
+   }
+   WFSTBuildFSM min2( min ) ;
+   min2.minimize() ;
+   if ( min2.getNumStates() != min.getNumStates() )
+   {
+      LogFile::printf( "minimize: %d states again from %d\n" ,
+                       min2.getNumStates() , min.getNumStates() ) ;
+      nDiffs++ ;
+   }
+
+   WFSTBuildFSM inv( fsm ) ;
+   inv.invert() ;
+   inv.invert() ;
+   getRelation( &inv , &rel ) ;
+   nDiffs += compareRelations( relFSM , rel , "invert" ) ;
+
+   WFSTBuildFSM conn( fsm ) ;
+   conn.connect() ;
+   getRelation( &conn , &rel ) ;
+   nDiffs += compareRelations( relFSM , rel , "connect" ) ;
+
+   // The text format needs the first arc to leave the initial state
+   if ( (conn.getInitState() >= 0) && !conn.getArcs( conn.getInitState() ).empty() )
+   {
+      char fName[] = "/tmp/wfstbuildcheckXXXXXX" ;
+      int fd = mkstemp( fName ) ;
+      if ( fd < 0 )
+         error("wfstbuildcheck: mkstemp failed") ;
+      close( fd ) ;
+      conn.writeFSM( fName ) ;
+      WFSTBuildFSM read ;
+      read.readFSM( fName ) ;
+      unlink( fName ) ;
+      getRelation( &read , &rel ) ;
+      nDiffs += compareRelations( relFSM , rel , "writeFSM/readFSM" ) ;
+   }
+
+   if ( nDiffs > 0 )
+      LogFile::printf( "trial %d: %d differences\n" , trial , nDiffs ) ;
+   return nDiffs ;
+}
+
+
+// The auxiliary symbols (#...) of a symbols file, as wfstbuild
+void readAuxLabels( const char *symsFName , vector<bool> *isAux )
+{
+   FILE *fd ;
+   if ( (fd = fopen( symsFName , "r" )) == NULL )
+      error("wfstbuildcheck: error opening %s" , symsFName ) ;
+
+   char line[1000] , label[1000] ;
+   int index ;
+   while ( fgets( line , 1000 , fd ) != NULL )
+   {
+      if ( (sscanf( line , "%s %d" , label , &index ) != 2) || (index < 0) )
+         continue ;
+      if ( index >= (int)isAux->size() )
+         isAux->resize( index+1 , false ) ;
+      (*isAux)[index] = (label[0] == '#') ;
+   }
+   fclose( fd ) ;
+}
+
+
+int checkNetwork()
+{
+   string lexInSyms( lexFSMFName ) ;
+   if ( (lexInSyms.size() > 4) &&
+        (lexInSyms.compare( lexInSyms.size()-4 , 4 , ".fsm" ) == 0) )
+   {
+      lexInSyms.erase( lexInSyms.size()-4 ) ;
+   }
+   lexInSyms += ".insyms" ;
+   vector<bool> lexAux ;
+   readAuxLabels( lexInSyms.c_str() , &lexAux ) ;
+
+   WFSTBuildFSM gram , lex , cd , clg ;
+   gram.readFSM( gramFSMFName ) ;
+   lex.readFSM( lexFSMFName ) ;
+   cd.readFSM( cdFSMFName ) ;
+
+   // C o (L* o G) as it is, with the auxiliary symbols removed as
+   // wfstbuild does unless optFinal
+   WFSTBuildFSM plainLex( lex ) , plainLG , plainCLG ;
+   plainLex.closure() ;
+   if ( ! optFinal )
+      plainLex.epsilonInputs( lexAux ) ;
+   plainLex.arcSort() ;
+   WFSTBuildFSM::compose( &plainLex , &gram , &plainLG ) ;
+   plainLG.arcSort() ;
+   WFSTBuildFSM::compose( &cd , &plainLG , &plainCLG ) ;
+   LogFile::printf( "C o L* o G: nStates=%d nArcs=%d\n" ,
+                    plainCLG.getNumStates() , plainCLG.getNumArcs() ) ;
+
+   WFSTBuilder builder( lexAux , optFinal ) ;
+   builder.build( &gram , &lex , &cd , &clg ) ;
+   LogFile::printf( "built: nStates=%d nArcs=%d\n" ,
+                    clg.getNumStates() , clg.getNumArcs() ) ;
+
+   Relation plainRel , builtRel ;
+   getRelation( &plainCLG , &plainRel ) ;
+   getRelation( &clg , &builtRel ) ;
+   LogFile::printf( "%d pairs of at most %d input and %d output labels\n" ,
+                    (int)plainRel.size() , maxInLabels , maxOutLabels ) ;
+   return compareRelations( plainRel , builtRel , "network" ) ;
+}
+
+
+int main( int argc , char *argv[] )
+{
+   CmdLine cmd ;
+
+   processCmdLine( &cmd , argc , argv ) ;
+   LogFile::open( logFName ) ;
+
+   int nDiffs = 0 ;
+   if ( strcmp( gramFSMFName , "" ) != 0 )
+      nDiffs = checkNetwork() ;
+   else
+   {
+      // The random transducers are acyclic, their relations are whole
+      maxInLabels = 100 ;
+      maxOutLabels = 100 ;
+      int nFailed = 0 ;
+      for ( int t=0 ; t<nTrials ; t++ )
+      {
+         int n = checkTrial( t ) ;
+         nDiffs += n ;
+         if ( n > 0 )
+            nFailed++ ;
+      }
+      LogFile::printf( "%d random trials, %d failed\n" , nTrials , nFailed ) ;
+   }
+
+   LogFile::printf( nDiffs ? "wfstbuildcheck: FAILED\n" : "wfstbuildcheck: OK\n" ) ;
+   LogFile::close() ;
+   return nDiffs ? 1 : 0 ;
+}
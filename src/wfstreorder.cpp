@@ -0,0 +1,312 @@
+/*
+ * Copyright 2009 by Idiap Research Institute
+ *                   http://www.idiap.ch
+ *
+ * See the file COPYING for the licence associated with this software.
+ */
+
+#include <vector>
+#include <algorithm>
+#include <functional>
+
+#include "general.h"
+#include "log_add.h"
+#include "CmdLine.h"
+#include "LogFile.h"
+#include "WFSTNetwork.h"
+
+/*
+ * wfstreorder - renumber the states of a decoding network so that states
+ * expanded together during decoding are close together in memory, and
+ * write it as a binary network for juicer.  The transitions are stored in
+ * state order, so they move with their states.
+ *
+ * -order bfs     breadth first from the initial state
+ * -order counts  by visit frequency read from -countsFName, lines of
+ *                "state count" from whatever statistics are at hand
+ *
+ * States that are never visited follow in breadth first order.  -measure
+ * replays the same beam-limited expansion on the network before and after
+ * renumbering and reports the cache lines touched per frame and the time.
+ * The lines are counted, not measured, so they are only a guide to what
+ * the reordering does to the decoder's cache misses.
+ */
+
+using namespace Juicer ;
+using namespace Torch ;
+
+// Input network, either an FSM with symbols or a binary network
+char           *fsmFName=NULL ;
+char           *inSymsFName=NULL ;
+char           *outSymsFName=NULL ;
+char           *inBinFName=NULL ;
+char           *outBinFName=NULL ;
+real           lmScaleFactor=0.0 ;
+real           insPenalty=0.0 ;
+
+// Ordering parameters
+char           *order=NULL ;
+char           *countsFName=NULL ;
+
+// Measurement parameters
+bool           measure=false ;
+int            nFrames=0 ;
+int            maxActive=0 ;
+
+char           *logFName=NULL ;
+
+
+void processCmdLine( CmdLine *cmd , int argc , char *argv[] )
+{
+	cmd->addText("\nTransducer Options:") ;
+	cmd->addSCmdOption( "-fsmFName" , &fsmFName , "" ,
+			"the FSM filename" ) ;
+	cmd->addSCmdOption( "-inSymsFName" , &inSymsFName , "" ,
+			"the input symbols filename" ) ;
+	cmd->addSCmdOption( "-outSymsFName" , &outSymsFName , "" ,
+			"the output symbols filename" ) ;
+	cmd->addSCmdOption( "-inBinFName" , &inBinFName , "" ,
+			"a binary network to read instead of the FSM" ) ;
+	cmd->addSCmdOption( "-outBinFName" , &outBinFName , "" ,
+			"the reordered binary network output filename" ) ;
+	cmd->addRCmdOption( "-lmScaleFactor" , &lmScaleFactor , 1.0 ,
+			"the juicer -lmScaleFactor, applied to the weights written" ) ;
+	cmd->addRCmdOption( "-insPenalty" , &insPenalty , 0.0 ,
+			"the juicer -insPenalty, applied to the weights written" ) ;
+
+	cmd->addText("\nOrdering Options:") ;
+	cmd->addSCmdOption( "-order" , &order , "bfs" ,
+			"state order: bfs or counts" ) ;
+	cmd->addSCmdOption( "-countsFName" , &countsFName , "" ,
+			"state visit counts for -order counts" ) ;
+
+	cmd->addText("\nMeasurement Options:") ;
+	cmd->addBCmdOption( "-measure" , &measure , false ,
+			"compare the memory access of the network before and after" ) ;
+	cmd->addICmdOption( "-nFrames" , &nFrames , 500 ,
+			"number of frames of expansion to measure" ) ;
+	cmd->addICmdOption( "-maxActive" , &maxActive , 5000 ,
+			"maximum number of active states per frame when measuring" ) ;
+	cmd->addSCmdOption( "-logFName" , &logFName , "stdout" ,
+			"the name of the log file" ) ;
+
+	cmd->read( argc , argv ) ;
+
+	if ( (strcmp( fsmFName , "" ) == 0) && (strcmp( inBinFName , "" ) == 0) )
+		error("wfstreorder: fsmFName or inBinFName must be defined") ;
+	if ( (strcmp( fsmFName , "" ) != 0) &&
+	     ((strcmp( inSymsFName , "" ) == 0) || (strcmp( outSymsFName , "" ) == 0)) )
+		error("wfstreorder: inSymsFName and outSymsFName must be defined with fsmFName") ;
+	if ( strcmp( outBinFName , "" ) == 0 )
+		error("wfstreorder: outBinFName undefined") ;
+	if ( (strcmp( order , "counts" ) == 0) && (strcmp( countsFName , "" ) == 0) )
+		error("wfstreorder: -order counts needs countsFName") ;
+}
+
+
+// Breadth first order from the initial state, then any unreachable states
+void bfsOrder( WFSTNetwork *net , int *stateOrder )
+{
+   int nStates = net->getNumStates() ;
+   vector<bool> seen( nStates , false ) ;
+   int head=0 , tail=0 ;
+
+   stateOrder[tail++] = net->getInitState() ;
+   seen[net->getInitState()] = true ;
+   while ( head < tail )
+   {
+      int state = stateOrder[head++] ;
+      int nTrans = net->getNumTransitionsOfOneState( state ) ;
+      for ( int i=0 ; i<nTrans ; i++ )
+      {
+         int to = net->getOneTransition( net->getTransID( state , i ) )->toState ;
+         if ( !seen[to] )
+         {
+            seen[to] = true ;
+            stateOrder[tail++] = to ;
+         }
+      }
+   }
+
+   for ( int i=0 ; i<nStates ; i++ )
+   {
+      if ( !seen[i] )
+         stateOrder[tail++] = i ;
+   }
+}
+
+
+void readCounts( WFSTNetwork *net , double *counts )
+{
+   FILE *fd ;
+   if ( (fd = fopen( countsFName , "r" )) == NULL )
+      error("wfstreorder: error opening %s" , countsFName ) ;
+
+   int state ;
+   double count ;
+   char line[1000] ;
+   while ( fgets( line , 1000 , fd ) != NULL )
+   {
+      if ( sscanf( line , "%d %lf" , &state , &count ) != 2 )
+         continue ;
+      if ( (state < 0) || (state >= net->getNumStates()) )
+         error("wfstreorder: state %d in %s out of range" , state , countsFName ) ;
+      counts[state] += count ;
+   }
+   fclose( fd ) ;
+}
+
+
+// Most visited states first, ties and unvisited states in bfs order
+void frequencyOrder( WFSTNetwork *net , const double *counts , int *stateOrder )
+{
+   int nStates = net->getNumStates() ;
+   bfsOrder( net , stateOrder ) ;
+
+   vector< pair<double,int> > keyed( nStates ) ;
+   for ( int i=0 ; i<nStates ; i++ )
+      keyed[i] = make_pair( -counts[stateOrder[i]] , i ) ;
+   sort( keyed.begin() , keyed.end() ) ;
+
+   vector<int> bfs( stateOrder , stateOrder+nStates ) ;
+   for ( int i=0 ; i<nStates ; i++ )
+      stateOrder[i] = bfs[keyed[i].second] ;
+}
+
+
+// A beam-limited expansion standing in for decoding: every frame expands
+// all transitions of the active states and keeps the maxActive best.  The
+// cache lines of the state and transition records read are counted once
+// per frame.  Scores only depend on the weights, so the same states are
+// expanded before and after renumbering, up to ties.
+void measureExpansion( WFSTNetwork *net , const char *name )
+{
+   int nStates = net->getNumStates() ;
+   int nTrans = net->getNumTransitions() ;
+   const char *arcBase = (const char *)net->getOneTransition( 0 ) ;
+
+   long nStateLines = (long)nStates * sizeof(WFSTState) / 64 + 1 ;
+   long nArcLines = (long)nTrans * sizeof(WFSTTransition) / 64 + 1 ;
+   vector<int> stateLineFrame( nStateLines , -1 ) ;
+   vector<int> arcLineFrame( nArcLines , -1 ) ;
+   vector<real> best( nStates , LOG_ZERO ) ;
+   vector< pair<real,int> > active , next ;
+   vector<int> touched ;
+
+   active.push_back( make_pair( (real)0.0 , net->getInitState() ) ) ;
+   long nLines=0 , nExpanded=0 ;
+   clock_t start = clock() ;
+
+   for ( int f=0 ; f<nFrames && !active.empty() ; f++ )
+   {
+      touched.clear() ;
+      for ( unsigned a=0 ; a<active.size() ; a++ )
+      {
+         int state = active[a].second ;
+         long line = (long)state * sizeof(WFSTState) / 64 ;
+         if ( stateLineFrame[line] != f )
+         {
+            stateLineFrame[line] = f ;
+            nLines++ ;
+         }
+
+         int n = net->getNumTransitionsOfOneState( state ) ;
+         int first = net->getTransID( state , 0 ) ;
+         for ( int i=0 ; i<n ; i++ )
+         {
+            const WFSTTransition *trans = net->getOneTransition( first+i ) ;
+            line = ((const char *)trans - arcBase) / 64 ;
+            if ( arcLineFrame[line] != f )
+            {
+               arcLineFrame[line] = f ;
+               nLines++ ;
+            }
+
+            real score = active[a].first + trans->weight ;
+            if ( best[trans->toState] <= LOG_ZERO )
+               touched.push_back( trans->toState ) ;
+            if ( score > best[trans->toState] )
+               best[trans->toState] = score ;
+            nExpanded++ ;
+         }
+      }
+
+      next.clear() ;
+      for ( unsigned t=0 ; t<touched.size() ; t++ )
+      {
+         next.push_back( make_pair( best[touched[t]] , touched[t] ) ) ;
+         best[touched[t]] = LOG_ZERO ;
+      }
+      if ( (int)next.size() > maxActive )
+      {
+         nth_element( next.begin() , next.begin()+maxActive , next.end() ,
+                      greater< pair<real,int> >() ) ;
+         next.resize( maxActive ) ;
+      }
+      active.swap( next ) ;
+   }
+
+   double secs = (double)(clock() - start) / CLOCKS_PER_SEC ;
+   LogFile::printf(
+      "%s: %.1f cache lines per frame, %ld transitions expanded, %.3f s\n" ,
+      name , (double)nLines / nFrames , nExpanded , secs
+   ) ;
+}
+
+
+int main( int argc , char *argv[] )
+{
+   CmdLine cmd ;
+
+   processCmdLine( &cmd , argc , argv ) ;
+   LogFile::open( logFName ) ;
+
+   WFSTNetwork *net ;
+   if ( strcmp( inBinFName , "" ) != 0 )
+   {
+      net = new WFSTNetwork( lmScaleFactor , insPenalty ) ;
+      net->readBinary( inBinFName ) ;
+   }
+   else
+   {
+      // As juicer loads a static network
+      net = new WFSTNetwork( fsmFName , inSymsFName , outSymsFName ,
+                             lmScaleFactor , insPenalty , REMOVEBOTH ) ;
+   }
+   LogFile::printf( "nStates=%d nTrans=%d\n" ,
+                    net->getNumStates() , net->getNumTransitions() ) ;
+
+   if ( net->getNumTransitions() == 0 )
+      error("wfstreorder: network has no transitions") ;
+
+   if ( measure )
+      measureExpansion( net , "before" ) ;
+
+   int nStates = net->getNumStates() ;
+   int *stateOrder = new int[nStates] ;
+   if ( strcmp( order , "bfs" ) == 0 )
+      bfsOrder( net , stateOrder ) ;
+   else if ( strcmp( order , "counts" ) == 0 )
+   {
+      double *counts = new double[nStates] ;
+      for ( int i=0 ; i<nStates ; i++ )
+         counts[i] = 0.0 ;
+      readCounts( net , counts ) ;
+      frequencyOrder( net , counts , stateOrder ) ;
+      delete [] counts ;
+   }
+   else
+      error("wfstreorder: unknown order %s" , order ) ;
+
+   net->renumberStates( stateOrder ) ;
+   delete [] stateOrder ;
+
+   if ( measure )
+      measureExpansion( net , "after" ) ;
+
+   net->writeBinary( outBinFName ) ;
+   delete net ;
+
+   LogFile::close() ;
+   return 0 ;
+}